@@ -21,11 +21,15 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 
 #include "BoidGameController.h"
+#include "../Rs2Projector/Profiler.h"
 
 #include <string>
 //#include <direct.h>
 
 CBoidGameController::CBoidGameController()
+:fishMetric(MetricsRegistry::get().gauge("magicsand_boids_fish", "Fish in the boid game")),
+rabbitsMetric(MetricsRegistry::get().gauge("magicsand_boids_rabbits", "Rabbits in the boid game")),
+sharksMetric(MetricsRegistry::get().gauge("magicsand_boids_sharks", "Sharks in the boid game"))
 {
 	DataBaseDir = "boidGame/";
 	setDebug(true);
@@ -76,6 +80,7 @@ void CBoidGameController::setup(std::shared_ptr<Rs2Projector> const& k)
 
 void CBoidGameController::updateBOIDS()
 {
+	PROFILE_ZONE("CBoidGameController::updateBOIDS");
 	// Set static varible that indicate if all BOIDS should be drawn flipped
 	Vehicle::setDrawFlipped(doFlippedDrawing);
 
@@ -96,6 +101,9 @@ void CBoidGameController::updateBOIDS()
 		}
 		drawVehicles();
 	}
+	fishMetric.set(fish.size());
+	rabbitsMetric.set(rabbits.size());
+	sharksMetric.set(sharks.size());
 }
 
 
@@ -685,8 +693,11 @@ bool CBoidGameController::setRandomVehicleLocation(ofRectangle area, bool liveIn
 		count++;
 		float x = ofRandom(area.getLeft(), area.getRight());
 		float y = ofRandom(area.getTop(), area.getBottom());
-		bool insideWater = rs2Projector->elevationAtrs2Coord(x, y) < 0;
-		if ((insideWater && liveInWater) || (!insideWater && !liveInWater)) {
+		// Coarse cell around the point: spawn well inside the water or the land, not on the shore
+		ElevationCell cell = rs2Projector->elevationCellAtrs2Coord(x, y, 4);
+		bool insideWater = cell.maximum < 0;
+		bool onLand = cell.minimum >= 0;
+		if ((insideWater && liveInWater) || (onLand && !liveInWater)) {
 			location = ofVec2f(x, y);
 			okwater = true;
 		}
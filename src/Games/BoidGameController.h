@@ -167,6 +167,11 @@ class CBoidGameController
 
 		// GUI
 		ofxDatGui* gui;
+
+		// Number of animals, as runtime metrics
+		MetricGauge& fishMetric;
+		MetricGauge& rabbitsMetric;
+		MetricGauge& sharksMetric;
 };
 
 #endif
@@ -21,11 +21,13 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 
 #include "MapGameController.h"
+#include "../Rs2Projector/Profiler.h"
 
 #include <string>
 //#include <direct.h>
 
 CMapGameController::CMapGameController()
+:matchDurationMetric(MetricsRegistry::get().histogram("magicsand_map_match_seconds", "Duration of the map matching", { 0.1, 0.25, 0.5, 1, 2, 5, 10, 30 }))
 {
 	DataBaseDir = "mapGame/";
 	setDebug(true);
@@ -1332,6 +1334,8 @@ void CMapGameController::CompareImages(cv::Mat& I, cv::Mat& T, int Xi, int Yi, c
 
 bool CMapGameController::MatchMap()
 {
+	PROFILE_ZONE("CMapGameController::MatchMap");
+	MetricTimer matchTimer(matchDurationMetric);
 	int actRef = referenceMapHandler.GetActualRef();
 	std::string RefMap = referenceMapHandler.ReferenceMaps[actRef];
 
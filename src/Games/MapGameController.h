@@ -213,6 +213,8 @@ class CMapGameController
 
 		bool debugOn;
 		std::string debugBaseDir;
+
+		MetricHistogram& matchDurationMetric; // Duration of MatchMap()
 };
 
 #endif
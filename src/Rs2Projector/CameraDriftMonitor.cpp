@@ -0,0 +1,522 @@
+/***********************************************************************
+CameraDriftMonitor - Background check that the camera did not move since
+the calibration, by aligning stable depth frames with a reference frame
+of the calibrated sandbox.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "CameraDriftMonitor.h"
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+static const char referenceMagic[8] = { 'M', 'S', 'A', 'N', 'D', 'R', 'E', 'F' };
+static const uint32_t referenceVersion = 1;
+
+namespace
+{
+	const float inlierDistance = 8; // World units at the finest level, doubled at each coarser one
+	const float minInlierRatio = 0.5f; // Below that, too much sand moved since the reference to trust the alignment
+	const int levelIterations[3] = { 12, 8, 5 };
+
+	struct ReferenceFileHeader
+	{
+		char magic[8];
+		uint32_t version;
+		int32_t width, height;
+		float roi[4];
+		float worldMatrix[16];
+		float basePlaneEq[4];
+	};
+
+	// Solve the 6x6 system a x = b by Gaussian elimination with partial pivoting
+	bool solve6(double a[6][6], double b[6], double x[6])
+	{
+		for (int c = 0; c < 6; c++)
+		{
+			int pivot = c;
+			for (int r = c + 1; r < 6; r++)
+				if (fabs(a[r][c]) > fabs(a[pivot][c]))
+					pivot = r;
+			if (a[pivot][c] == 0)
+				return false;
+			if (pivot != c)
+			{
+				for (int k = 0; k < 6; k++)
+					std::swap(a[c][k], a[pivot][k]);
+				std::swap(b[c], b[pivot]);
+			}
+			for (int r = c + 1; r < 6; r++)
+			{
+				double f = a[r][c] / a[c][c];
+				for (int k = c; k < 6; k++)
+					a[r][k] -= f * a[c][k];
+				b[r] -= f * b[c];
+			}
+		}
+		for (int r = 5; r >= 0; r--)
+		{
+			double s = b[r];
+			for (int k = r + 1; k < 6; k++)
+				s -= a[r][k] * x[k];
+			x[r] = s / a[r][r];
+		}
+		return true;
+	}
+
+	// Rotation of angle |w| around w
+	void rotationFromVector(const double w[3], double r[3][3])
+	{
+		double theta = sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]);
+		if (theta < 1e-12)
+		{
+			double small[3][3] = { { 1, -w[2], w[1] }, { w[2], 1, -w[0] }, { -w[1], w[0], 1 } };
+			memcpy(r, small, sizeof(small));
+			return;
+		}
+		double k[3] = { w[0] / theta, w[1] / theta, w[2] / theta };
+		double c = cos(theta), s = sin(theta), v = 1 - c;
+		r[0][0] = c + k[0] * k[0] * v;
+		r[0][1] = k[0] * k[1] * v - k[2] * s;
+		r[0][2] = k[0] * k[2] * v + k[1] * s;
+		r[1][0] = k[1] * k[0] * v + k[2] * s;
+		r[1][1] = c + k[1] * k[1] * v;
+		r[1][2] = k[1] * k[2] * v - k[0] * s;
+		r[2][0] = k[2] * k[0] * v - k[1] * s;
+		r[2][1] = k[2] * k[1] * v + k[0] * s;
+		r[2][2] = c + k[2] * k[2] * v;
+	}
+}
+
+//--------------------------------------------------------------
+void CameraDriftMonitor::Motion::setIdentity()
+{
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+			r[i][j] = i == j ? 1 : 0;
+		t[i] = 0;
+	}
+}
+
+ofVec3f CameraDriftMonitor::Motion::apply(const ofVec3f& p) const
+{
+	return ofVec3f(static_cast<float>(r[0][0] * p.x + r[0][1] * p.y + r[0][2] * p.z + t[0]),
+		static_cast<float>(r[1][0] * p.x + r[1][1] * p.y + r[1][2] * p.z + t[1]),
+		static_cast<float>(r[2][0] * p.x + r[2][1] * p.y + r[2][2] * p.z + t[2]));
+}
+
+//--------------------------------------------------------------
+CameraDriftMonitor::CameraDriftMonitor()
+:stopping(false),
+pending(false),
+busy(false),
+hasResult(false),
+result(),
+frameSequence(0)
+{
+	worker = std::thread(&CameraDriftMonitor::threadFunction, this);
+}
+
+CameraDriftMonitor::~CameraDriftMonitor()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	worker.join();
+}
+
+void CameraDriftMonitor::setReference(const float* depth, int width, int height, const ofRectangle& roi,
+	const ofMatrix4x4& worldMatrix, const ofVec4f& basePlaneEq)
+{
+	std::shared_ptr<Reference> ref = std::make_shared<Reference>();
+	ref->width = width;
+	ref->height = height;
+	ref->roi = roi;
+	ref->worldMatrix = worldMatrix;
+	ref->basePlaneEq = basePlaneEq;
+	ref->depth.assign(depth, depth + width * height);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	reference = ref;
+	hasResult = false;
+}
+
+void CameraDriftMonitor::clearReference()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	reference.reset();
+	hasResult = false;
+}
+
+bool CameraDriftMonitor::hasReference()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return reference != nullptr;
+}
+
+bool CameraDriftMonitor::saveReference(const std::string& path)
+{
+	std::shared_ptr<const Reference> ref;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ref = reference;
+	}
+	if (!ref)
+		return false;
+
+	ReferenceFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, referenceMagic, sizeof(header.magic));
+	header.version = referenceVersion;
+	header.width = ref->width;
+	header.height = ref->height;
+	header.roi[0] = ref->roi.x;
+	header.roi[1] = ref->roi.y;
+	header.roi[2] = ref->roi.width;
+	header.roi[3] = ref->roi.height;
+	memcpy(header.worldMatrix, ref->worldMatrix.getPtr(), sizeof(header.worldMatrix));
+	header.basePlaneEq[0] = ref->basePlaneEq.x;
+	header.basePlaneEq[1] = ref->basePlaneEq.y;
+	header.basePlaneEq[2] = ref->basePlaneEq.z;
+	header.basePlaneEq[3] = ref->basePlaneEq.w;
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		ofLogError("CameraDriftMonitor") << "saveReference(): Could not create " << path;
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(ref->depth.data(), sizeof(float), ref->depth.size(), file) == ref->depth.size();
+	ok = fclose(file) == 0 && ok;
+	return ok;
+}
+
+bool CameraDriftMonitor::loadReference(const std::string& path, const ofMatrix4x4& worldMatrix, int width, int height)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	ReferenceFileHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(header.magic, referenceMagic, sizeof(header.magic)) == 0
+		&& header.version == referenceVersion;
+	if (ok && (header.width != width || header.height != height || memcmp(header.worldMatrix, worldMatrix.getPtr(), sizeof(header.worldMatrix)) != 0))
+	{
+		ofLogNotice("CameraDriftMonitor") << "loadReference(): " << path << " was taken with another camera";
+		ok = false;
+	}
+	std::vector<float> depth;
+	if (ok)
+	{
+		depth.resize(static_cast<size_t>(width) * height);
+		ok = fread(depth.data(), sizeof(float), depth.size(), file) == depth.size();
+	}
+	fclose(file);
+	if (!ok)
+		return false;
+
+	setReference(depth.data(), width, height, ofRectangle(header.roi[0], header.roi[1], header.roi[2], header.roi[3]), worldMatrix,
+		ofVec4f(header.basePlaneEq[0], header.basePlaneEq[1], header.basePlaneEq[2], header.basePlaneEq[3]));
+	return true;
+}
+
+bool CameraDriftMonitor::submit(const float* depth, uint64_t sequence)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!reference || pending || busy || stopping)
+			return false;
+		frame.assign(depth, depth + reference->width * reference->height);
+		frameSequence = sequence;
+		pending = true;
+	}
+	wake.notify_one();
+	return true;
+}
+
+bool CameraDriftMonitor::getDrift(CameraDrift& drift)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!hasResult)
+		return false;
+	drift = result;
+	hasResult = false;
+	return true;
+}
+
+//--------------------------------------------------------------
+void CameraDriftMonitor::threadFunction()
+{
+	// The drift shows over minutes, the frame loop and the filter threads come first
+#ifdef _WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+	setpriority(PRIO_PROCESS, 0, 10); // Applies to the calling thread on Linux
+#endif
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		wake.wait(lock, [this] { return stopping || pending; });
+		if (stopping)
+			break;
+		std::swap(frame, alignedFrame);
+		uint64_t sequence = frameSequence;
+		std::shared_ptr<const Reference> ref = reference;
+		pending = false;
+		busy = true;
+		lock.unlock();
+
+		if (ref != alignedReference)
+		{
+			table.setup(ref->worldMatrix, ref->width, ref->height);
+			buildLevels(ref->depth.data(), referenceLevels, true);
+			alignedReference = ref;
+		}
+		CameraDrift drift = align(sequence);
+
+		lock.lock();
+		// A result for a reference replaced in the meantime is dropped
+		if (ref == reference)
+		{
+			result = drift;
+			hasResult = true;
+		}
+		busy = false;
+	}
+}
+
+// Cells of 8x8, 4x4 and 2x2 pixels. A cell has a point when at least half of its pixels have a depth and they do not
+// straddle an edge of the sand.
+void CameraDriftMonitor::buildLevels(const float* depth, Level* levels, bool withNormals)
+{
+	int width = table.getWidth();
+	int height = table.getHeight();
+	for (int l = 0; l < NUM_LEVELS; l++)
+	{
+		Level& level = levels[l];
+		int s = 8 >> l;
+		level.reduction = s;
+		level.width = width / s;
+		level.height = height / s;
+		level.points.assign(level.width * level.height, ofVec3f(0, 0, 0));
+		for (int cy = 0; cy < level.height; cy++)
+		{
+			for (int cx = 0; cx < level.width; cx++)
+			{
+				float sum = 0, minimum = 0, maximum = 0;
+				int count = 0;
+				for (int y = cy * s; y < (cy + 1) * s; y++)
+				{
+					const float* row = depth + y * width;
+					for (int x = cx * s; x < (cx + 1) * s; x++)
+					{
+						float d = row[x];
+						if (d <= 0)
+							continue;
+						if (count == 0 || d < minimum)
+							minimum = d;
+						if (count == 0 || d > maximum)
+							maximum = d;
+						sum += d;
+						count++;
+					}
+				}
+				if (2 * count < s * s)
+					continue;
+				float mean = sum / count;
+				if (maximum - minimum > 0.05f * mean)
+					continue;
+				level.points[cy * level.width + cx] = table.deproject((cx + 0.5f) * s - 0.5f, (cy + 0.5f) * s - 0.5f, mean);
+			}
+		}
+
+		if (!withNormals)
+			continue;
+		level.normals.assign(level.points.size(), ofVec3f(0, 0, 0));
+		for (int cy = 1; cy < level.height - 1; cy++)
+		{
+			for (int cx = 1; cx < level.width - 1; cx++)
+			{
+				int i = cy * level.width + cx;
+				const ofVec3f& left = level.points[i - 1];
+				const ofVec3f& right = level.points[i + 1];
+				const ofVec3f& up = level.points[i - level.width];
+				const ofVec3f& down = level.points[i + level.width];
+				if (level.points[i].z <= 0 || left.z <= 0 || right.z <= 0 || up.z <= 0 || down.z <= 0)
+					continue;
+				ofVec3f normal = (right - left).cross(down - up);
+				float length = normal.length();
+				if (length == 0)
+					continue;
+				normal /= length;
+				// Towards the camera
+				if (normal.dot(level.points[i]) > 0)
+					normal = -normal;
+				level.normals[i] = normal;
+			}
+		}
+	}
+}
+
+// Gauss-Newton iterations of the point to plane distance. Each point of the frame is moved by the motion and projected
+// in the reference cells, it is compared with the tangent plane of the cell it falls in.
+bool CameraDriftMonitor::alignLevel(int l, Motion& motion, int numIterations, int& numPoints, int& numInliers, double& residual2)
+{
+	const Level& ref = referenceLevels[l];
+	const Level& cur = frameLevels[l];
+	const ofMatrix4x4& m = alignedReference->worldMatrix;
+	float s = static_cast<float>(ref.reduction);
+	double c = inlierDistance * ref.reduction / 2;
+	double c2 = c * c;
+
+	for (int it = 0; it < numIterations; it++)
+	{
+		double a[6][6] = {};
+		double b[6] = {};
+		numPoints = numInliers = 0;
+		residual2 = 0;
+		for (size_t i = 0; i < cur.points.size(); i++)
+		{
+			if (cur.points[i].z <= 0)
+				continue;
+			ofVec3f q = motion.apply(cur.points[i]);
+			if (q.z <= 0)
+				continue;
+			// Same projection as Rs2Projector::worldCoordTors2Coord(), then the cell holding the pixel
+			float x = (q.x / q.z - m(0, 3)) / m(0, 0);
+			float y = (q.y / q.z - m(1, 3)) / m(1, 1);
+			int cx = static_cast<int>(floor((x + 0.5f) / s));
+			int cy = static_cast<int>(floor((y + 0.5f) / s));
+			if (cx < 0 || cx >= ref.width || cy < 0 || cy >= ref.height)
+				continue;
+			int j = cy * ref.width + cx;
+			const ofVec3f& n = ref.normals[j];
+			if (n.x == 0 && n.y == 0 && n.z == 0)
+				continue;
+			numPoints++;
+			double r = n.dot(q - ref.points[j]);
+			if (r * r >= c2)
+				continue;
+			numInliers++;
+			residual2 += r * r;
+			double u = 1 - r * r / c2;
+			double w = u * u;
+			ofVec3f qn = q.cross(n);
+			double jac[6] = { qn.x, qn.y, qn.z, n.x, n.y, n.z };
+			for (int p = 0; p < 6; p++)
+			{
+				for (int k = p; k < 6; k++)
+					a[p][k] += w * jac[p] * jac[k];
+				b[p] -= w * jac[p] * r;
+			}
+		}
+		if (numInliers < 50)
+			return false;
+
+		// The damping keeps the motions the surface does not constrain (sliding over a flat sand) close to zero
+		double trace = 0;
+		for (int p = 0; p < 6; p++)
+			trace += a[p][p];
+		for (int p = 0; p < 6; p++)
+		{
+			for (int k = 0; k < p; k++)
+				a[p][k] = a[k][p];
+			a[p][p] += 1e-4 * a[p][p] + 1e-9 * trace;
+		}
+		double delta[6];
+		if (!solve6(a, b, delta))
+			return false;
+
+		double dr[3][3];
+		rotationFromVector(delta, dr);
+		Motion updated;
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+				updated.r[i][j] = dr[i][0] * motion.r[0][j] + dr[i][1] * motion.r[1][j] + dr[i][2] * motion.r[2][j];
+			updated.t[i] = dr[i][0] * motion.t[0] + dr[i][1] * motion.t[1] + dr[i][2] * motion.t[2] + delta[3 + i];
+		}
+		motion = updated;
+
+		double rotationStep = delta[0] * delta[0] + delta[1] * delta[1] + delta[2] * delta[2];
+		double translationStep = delta[3] * delta[3] + delta[4] * delta[4] + delta[5] * delta[5];
+		if (rotationStep < 1e-12 && translationStep < 1e-6)
+			break;
+	}
+	return true;
+}
+
+CameraDrift CameraDriftMonitor::align(uint64_t sequence)
+{
+	uint64_t start = ofGetElapsedTimeMicros();
+	CameraDrift drift = CameraDrift();
+	drift.sequence = sequence;
+
+	buildLevels(alignedFrame.data(), frameLevels, false);
+	Motion motion;
+	motion.setIdentity();
+	int numPoints = 0, numInliers = 0;
+	double residual2 = 0;
+	bool aligned = true;
+	for (int l = 0; l < NUM_LEVELS && aligned; l++)
+		aligned = alignLevel(l, motion, levelIterations[l], numPoints, numInliers, residual2);
+
+	drift.inlierRatio = numPoints > 0 ? static_cast<float>(numInliers) / numPoints : 0;
+	drift.rmsResidual = numInliers > 0 ? static_cast<float>(sqrt(residual2 / numInliers)) : 0;
+	drift.valid = aligned && drift.inlierRatio >= minInlierRatio;
+	double cosine = (motion.r[0][0] + motion.r[1][1] + motion.r[2][2] - 1) / 2;
+	drift.rotation = static_cast<float>(acos(ofClamp(cosine, -1, 1)) * 180 / PI);
+	drift.translation = ofVec3f(static_cast<float>(motion.t[0]), static_cast<float>(motion.t[1]), static_cast<float>(motion.t[2]));
+
+	// The plane n.p + w = 0 of the reference camera is (R^T n).p' + (n.t + w) = 0 for the points p' of the current one
+	const ofVec4f& eq = alignedReference->basePlaneEq;
+	double n[3];
+	for (int i = 0; i < 3; i++)
+		n[i] = motion.r[0][i] * eq.x + motion.r[1][i] * eq.y + motion.r[2][i] * eq.z;
+	double w = eq.x * motion.t[0] + eq.y * motion.t[1] + eq.z * motion.t[2] + eq.w;
+	drift.basePlaneEq = ofVec4f(static_cast<float>(n[0]), static_cast<float>(n[1]), static_cast<float>(n[2]), static_cast<float>(w));
+	drift.referencePlaneEq = eq;
+
+	// Elevation the uncorrected base plane gives to the sand bottom at the corners of the ROI. The point of a ray at
+	// depth d is d times its point at depth 1 for the pinhole cameras of the frame sources.
+	const ofRectangle& roi = alignedReference->roi;
+	float corners[4][2] = { { roi.getMinX(), roi.getMinY() }, { roi.getMaxX() - 1, roi.getMinY() },
+		{ roi.getMinX(), roi.getMaxY() - 1 }, { roi.getMaxX() - 1, roi.getMaxY() - 1 } };
+	for (int i = 0; i < 4; i++)
+	{
+		ofVec3f ray = table.deproject(corners[i][0], corners[i][1], 1);
+		double along = n[0] * ray.x + n[1] * ray.y + n[2] * ray.z;
+		if (fabs(along) < 1e-9)
+			continue;
+		ofVec3f bottom = ray * static_cast<float>(-w / along);
+		float elevation = -(eq.x * bottom.x + eq.y * bottom.y + eq.z * bottom.z + eq.w);
+		drift.elevationShift = max(drift.elevationShift, fabs(elevation));
+	}
+
+	drift.alignTime = (ofGetElapsedTimeMicros() - start) / 1000.0f;
+	return drift;
+}
@@ -0,0 +1,128 @@
+/***********************************************************************
+CameraDriftMonitor - Background check that the camera did not move since
+the calibration, by aligning stable depth frames with a reference frame
+of the calibrated sandbox.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ofMain.h"
+#include "DeprojectionTable.h"
+
+// Motion of the camera between the reference frame and a later frame
+struct CameraDrift
+{
+	bool valid; // Enough of the frame matched the reference for the motion to be trusted
+	uint64_t sequence; // Frame the drift was measured on
+	float rotation; // Degrees
+	ofVec3f translation; // Position of the camera in the reference camera coordinates, world units
+	ofVec4f basePlaneEq; // Reference base plane seen from the current camera
+	ofVec4f referencePlaneEq; // Reference base plane seen from the reference camera
+	float elevationShift; // Largest elevation change of the base plane over the ROI corners, world units
+	float inlierRatio; // Share of the frame points matching the reference surface
+	float rmsResidual; // Distance of the matching points to the reference surface, world units
+	float alignTime; // Milliseconds
+};
+
+// The frames are aligned on a low priority thread of their own with a coarse to fine point to plane ICP: the frame
+// and the reference are reduced to 8x8, 4x4 and 2x2 pixel cells and each level starts from the motion of the coarser
+// one. Robust weights leave out the sand moved since the reference. The main thread only copies a frame now and then
+// and polls for the result.
+class CameraDriftMonitor
+{
+public:
+	CameraDriftMonitor();
+	~CameraDriftMonitor();
+
+	// Depth frame of the sandbox with the calibrated base plane. The drifts are measured from it.
+	void setReference(const float* depth, int width, int height, const ofRectangle& roi, const ofMatrix4x4& worldMatrix,
+		const ofVec4f& basePlaneEq);
+	void clearReference();
+	bool hasReference();
+	// The reference is kept with the settings, it is only loaded back for the same camera and frame size
+	bool saveReference(const std::string& path);
+	bool loadReference(const std::string& path, const ofMatrix4x4& worldMatrix, int width, int height);
+
+	// Copy a frame for the monitor thread. Returns false (and copies nothing) while the previous frame is aligned or
+	// without reference.
+	bool submit(const float* depth, uint64_t sequence);
+
+	// Drift of the last frame aligned. Returns true once per new result.
+	bool getDrift(CameraDrift& drift);
+
+private:
+	static const int NUM_LEVELS = 3;
+
+	// Frame reduced to cells of reduction x reduction pixels: world points, and for the reference the surface normals
+	struct Level
+	{
+		int reduction;
+		int width, height;
+		std::vector<ofVec3f> points; // z = 0 for the cells without depth
+		std::vector<ofVec3f> normals; // Zero where the normal is unknown
+	};
+
+	struct Reference
+	{
+		int width, height;
+		ofRectangle roi;
+		ofMatrix4x4 worldMatrix;
+		ofVec4f basePlaneEq;
+		std::vector<float> depth;
+	};
+
+	// Rotation and translation taking points of the current camera to the reference camera
+	struct Motion
+	{
+		double r[3][3];
+		double t[3];
+
+		void setIdentity();
+		ofVec3f apply(const ofVec3f& p) const;
+	};
+
+	void threadFunction();
+	void buildLevels(const float* depth, Level* levels, bool withNormals);
+	bool alignLevel(int level, Motion& motion, int numIterations, int& numPoints, int& numInliers, double& residual2);
+	CameraDrift align(uint64_t sequence);
+
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping;
+	bool pending; // A frame is waiting in frame
+	bool busy; // The worker is aligning a frame
+	bool hasResult;
+	CameraDrift result;
+	std::shared_ptr<const Reference> reference;
+	std::vector<float> frame;
+	uint64_t frameSequence;
+
+	// Worker thread only
+	std::shared_ptr<const Reference> alignedReference; // Reference the levels below were built from
+	std::vector<float> alignedFrame;
+	DeprojectionTable table;
+	Level referenceLevels[NUM_LEVELS];
+	Level frameLevels[NUM_LEVELS];
+};
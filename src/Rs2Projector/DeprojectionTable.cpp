@@ -0,0 +1,171 @@
+/***********************************************************************
+DeprojectionTable - Per pixel rays of the rs2 world matrix, turning
+depth frames and lists of rs2 pixels into world points in batches.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DeprojectionTable.h"
+
+// SSE2 is part of the x86-64 baseline, no runtime dispatch needed
+#if defined(__x86_64__) || defined(_M_X64)
+#define DEPROJECTIONTABLE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+DeprojectionTable::DeprojectionTable()
+:width(0),
+height(0)
+{
+	for (int i = 0; i < 3; i++)
+		depthTerm[i] = offset[i] = 0;
+}
+
+void DeprojectionTable::setup(const ofMatrix4x4& sworldMatrix, int swidth, int sheight)
+{
+	if (isAllocated() && swidth == width && sheight == height && sworldMatrix == worldMatrix)
+		return;
+	worldMatrix = sworldMatrix;
+	width = max(swidth, 0);
+	height = max(sheight, 0);
+	size_t plane = static_cast<size_t>(width) * height;
+	rays.resize(3 * plane);
+	for (int i = 0; i < 3; i++)
+	{
+		float mx = worldMatrix(i, 0);
+		float my = worldMatrix(i, 1);
+		float* ray = rays.data() + i * plane;
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+				*ray++ = mx * x + my * y;
+		depthTerm[i] = worldMatrix(i, 2);
+		offset[i] = worldMatrix(i, 3);
+	}
+	ofLogVerbose("DeprojectionTable") << "setup(): Built the rays of a " << width << " x " << height << " frame";
+}
+
+ofVec3f DeprojectionTable::deproject(float x, float y, float depth) const
+{
+	int xi = static_cast<int>(x);
+	int yi = static_cast<int>(y);
+	float r[3];
+	if (xi == x && yi == y && xi >= 0 && yi >= 0 && xi < width && yi < height)
+	{
+		size_t plane = static_cast<size_t>(width) * height;
+		size_t idx = static_cast<size_t>(yi) * width + xi;
+		for (int i = 0; i < 3; i++)
+			r[i] = rays[i * plane + idx];
+	}
+	else
+	{
+		for (int i = 0; i < 3; i++)
+			r[i] = worldMatrix(i, 0) * x + worldMatrix(i, 1) * y;
+	}
+	return ofVec3f(((r[0] + depthTerm[0] * depth) + offset[0]) * depth,
+		((r[1] + depthTerm[1] * depth) + offset[1]) * depth,
+		((r[2] + depthTerm[2] * depth) + offset[2]) * depth);
+}
+
+void DeprojectionTable::deprojectRow(const float* depth, int y, int minX, int maxX, ofVec3f* points) const
+{
+	size_t plane = static_cast<size_t>(width) * height;
+	size_t rowOffset = static_cast<size_t>(y) * width;
+	const float* d = depth + rowOffset;
+	const float* rx = rays.data() + rowOffset;
+	const float* ry = rx + plane;
+	const float* rz = ry + plane;
+	int x = minX;
+#ifdef DEPROJECTIONTABLE_SSE2
+	const __m128 dtx = _mm_set1_ps(depthTerm[0]), dty = _mm_set1_ps(depthTerm[1]), dtz = _mm_set1_ps(depthTerm[2]);
+	const __m128 ox = _mm_set1_ps(offset[0]), oy = _mm_set1_ps(offset[1]), oz = _mm_set1_ps(offset[2]);
+	for (; x + 4 <= maxX; x += 4, points += 4)
+	{
+		__m128 z = _mm_loadu_ps(d + x);
+		float wx[4], wy[4], wz[4];
+		_mm_storeu_ps(wx, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_loadu_ps(rx + x), _mm_mul_ps(dtx, z)), ox), z));
+		_mm_storeu_ps(wy, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_loadu_ps(ry + x), _mm_mul_ps(dty, z)), oy), z));
+		_mm_storeu_ps(wz, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_loadu_ps(rz + x), _mm_mul_ps(dtz, z)), oz), z));
+		for (int j = 0; j < 4; j++)
+			points[j] = ofVec3f(wx[j], wy[j], wz[j]);
+	}
+#endif
+	for (; x < maxX; x++, points++)
+	{
+		float z = d[x];
+		*points = ofVec3f(((rx[x] + depthTerm[0] * z) + offset[0]) * z,
+			((ry[x] + depthTerm[1] * z) + offset[1]) * z,
+			((rz[x] + depthTerm[2] * z) + offset[2]) * z);
+	}
+}
+
+void DeprojectionTable::elevationRow(const float* depth, int y, int minX, int maxX, const ofVec4f& basePlaneEq, float* elevation) const
+{
+	size_t plane = static_cast<size_t>(width) * height;
+	size_t rowOffset = static_cast<size_t>(y) * width;
+	const float* d = depth + rowOffset;
+	const float* rx = rays.data() + rowOffset;
+	const float* ry = rx + plane;
+	const float* rz = ry + plane;
+	float* e = elevation + rowOffset;
+	int x = minX;
+#ifdef DEPROJECTIONTABLE_SSE2
+	const __m128 dtx = _mm_set1_ps(depthTerm[0]), dty = _mm_set1_ps(depthTerm[1]), dtz = _mm_set1_ps(depthTerm[2]);
+	const __m128 ox = _mm_set1_ps(offset[0]), oy = _mm_set1_ps(offset[1]), oz = _mm_set1_ps(offset[2]);
+	const __m128 px = _mm_set1_ps(basePlaneEq.x), py = _mm_set1_ps(basePlaneEq.y), pz = _mm_set1_ps(basePlaneEq.z), pw = _mm_set1_ps(basePlaneEq.w);
+	const __m128 zero = _mm_setzero_ps();
+	for (; x + 4 <= maxX; x += 4)
+	{
+		__m128 z = _mm_loadu_ps(d + x);
+		__m128 wx = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_loadu_ps(rx + x), _mm_mul_ps(dtx, z)), ox), z);
+		__m128 wy = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_loadu_ps(ry + x), _mm_mul_ps(dty, z)), oy), z);
+		__m128 wz = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_loadu_ps(rz + x), _mm_mul_ps(dtz, z)), oz), z);
+		__m128 dot = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, wx), _mm_mul_ps(py, wy)), _mm_mul_ps(pz, wz)), pw);
+		_mm_storeu_ps(e + x, _mm_sub_ps(zero, dot));
+	}
+#endif
+	for (; x < maxX; x++)
+	{
+		float z = d[x];
+		float wx = ((rx[x] + depthTerm[0] * z) + offset[0]) * z;
+		float wy = ((ry[x] + depthTerm[1] * z) + offset[1]) * z;
+		float wz = ((rz[x] + depthTerm[2] * z) + offset[2]) * z;
+		e[x] = -(basePlaneEq.x * wx + basePlaneEq.y * wy + basePlaneEq.z * wz + basePlaneEq.w);
+	}
+}
+
+void DeprojectionTable::deprojectFrame(const float* depth, int minX, int minY, int maxX, int maxY, ofVec3f* points) const
+{
+	minX = max(minX, 0);
+	minY = max(minY, 0);
+	maxX = min(maxX, width);
+	maxY = min(maxY, height);
+	for (int y = minY; y < maxY; y++, points += maxX - minX)
+		deprojectRow(depth, y, minX, maxX, points);
+}
+
+void DeprojectionTable::deprojectPoints(const float* depth, const ofVec2f* coords, int count, ofVec3f* points) const
+{
+	if (!isAllocated())
+		return;
+	for (int i = 0; i < count; i++)
+	{
+		float x = coords[i].x < 0 ? 0 : (coords[i].x >= width ? width - 1 : coords[i].x);
+		float y = coords[i].y < 0 ? 0 : (coords[i].y >= height ? height - 1 : coords[i].y);
+		float z = depth[static_cast<int>(y) * width + static_cast<int>(x)];
+		points[i] = deproject(x, y, z);
+	}
+}
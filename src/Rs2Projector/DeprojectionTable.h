@@ -0,0 +1,77 @@
+/***********************************************************************
+DeprojectionTable - Per pixel rays of the rs2 world matrix, turning
+depth frames and lists of rs2 pixels into world points in batches.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <vector>
+#include "ofMain.h"
+
+// The world point of rs2 pixel (x, y) with depth d is worldMatrix * (x, y, d, 1) * d. The table keeps the x and y
+// part of the product for each pixel, the depth part is added per point. The operations are done in the same order
+// as the matrix product so the points are identical to the ones of Rs2Projector::rs2CoordToWorldCoord().
+class DeprojectionTable
+{
+public:
+	DeprojectionTable();
+
+	// Build the rays of a width x height frame. Does nothing when the matrix and the size did not change.
+	void setup(const ofMatrix4x4& worldMatrix, int width, int height);
+
+	bool isAllocated() const{
+		return width > 0 && height > 0;
+	}
+
+	int getWidth() const{
+		return width;
+	}
+
+	int getHeight() const{
+		return height;
+	}
+
+	const ofMatrix4x4& getWorldMatrix() const{
+		return worldMatrix;
+	}
+
+	// World point of rs2 coordinates with a depth. Pixel coordinates inside the frame use the table, others the matrix.
+	ofVec3f deproject(float x, float y, float depth) const;
+
+	// Pixels [minX, maxX) of row y of a full frame depth image into points[0, maxX-minX)
+	void deprojectRow(const float* depth, int y, int minX, int maxX, ofVec3f* points) const;
+
+	// Pixels of [minX, maxX) x [minY, maxY) of a full frame depth image into points, (maxX-minX) points per row
+	void deprojectFrame(const float* depth, int minX, int minY, int maxX, int maxY, ofVec3f* points) const;
+
+	// Elevation above the base plane of the pixels [minX, maxX) of row y, -(basePlaneEq . (world point, 1)) as in
+	// Rs2Projector::elevationAtrs2Coord(). depth and elevation are full frame images.
+	void elevationRow(const float* depth, int y, int minX, int maxX, const ofVec4f& basePlaneEq, float* elevation) const;
+
+	// World points of a list of rs2 coordinates: the coordinates are clamped to the frame and the depth is read at
+	// the pixel holding them, as Rs2Projector::rs2CoordToWorldCoord() does
+	void deprojectPoints(const float* depth, const ofVec2f* coords, int count, ofVec3f* points) const;
+
+private:
+	ofMatrix4x4 worldMatrix;
+	int width, height;
+	std::vector<float> rays; // 3 planes of width x height values: worldMatrix(i, 0) * x + worldMatrix(i, 1) * y
+	float depthTerm[3]; // worldMatrix(i, 2)
+	float offset[3]; // worldMatrix(i, 3)
+};
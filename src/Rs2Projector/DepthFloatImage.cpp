@@ -0,0 +1,98 @@
+/***********************************************************************
+DepthFloatImage - ofxCvFloatImage holding the filtered depth frame whose
+texture can be updated one set of dirty tiles at a time instead of
+re-uploading the whole frame.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DepthFloatImage.h"
+
+DepthFloatImage::DepthFloatImage()
+:fullUploadNeeded(true),
+lastUploadBytes(0)
+{
+}
+
+void DepthFloatImage::setNativeScale(float scaleMin, float scaleMax)
+{
+	// The texture holds scaled values, every pixel changes with the scale
+	if (scaleMin != getNativeScaleMin() || scaleMax != getNativeScaleMax())
+		fullUploadNeeded = true;
+	ofxCvFloatImage::setNativeScale(scaleMin, scaleMax);
+}
+
+void DepthFloatImage::updateFullTexture()
+{
+	bTextureDirty = true;
+	updateTexture();
+	fullUploadNeeded = false;
+	lastUploadBytes = 0;
+	if (tex.isAllocated())
+		lastUploadBytes = static_cast<size_t>(width) * height * (ofGetGLTypeFromInternal(tex.getTextureData().glInternalFormat) == GL_FLOAT ? sizeof(float) : sizeof(unsigned char));
+}
+
+void DepthFloatImage::updateTextureTiles(const DirtyTiles& tiles)
+{
+	lastUploadBytes = 0;
+	if (!bUseTexture)
+		return;
+	if (fullUploadNeeded || !tex.isAllocated() || tex.getWidth() != width || tex.getHeight() != height
+		|| !tiles.isAllocated() || tiles.getNumDirty() == tiles.getCols() * tiles.getRows())
+	{
+		updateFullTexture();
+		return;
+	}
+
+	// Nothing moved: the texture already holds these values
+	bTextureDirty = false;
+	if (!tiles.any())
+		return;
+
+	// Upload from the same buffer ofxCvFloatImage would upload, in the texture's own format
+	const ofTextureData& texData = tex.getTextureData();
+	GLenum glType = ofGetGLTypeFromInternal(texData.glInternalFormat);
+	GLenum glFormat = ofGetGLFormatFromInternal(texData.glInternalFormat);
+	const unsigned char* source;
+	size_t bytesPerPixel;
+	if (glType == GL_FLOAT)
+	{
+		source = reinterpret_cast<const unsigned char*>(getFloatPixelsRef().getData());
+		bytesPerPixel = sizeof(float);
+	}
+	else
+	{
+		source = getPixels().getData();
+		bytesPerPixel = sizeof(unsigned char);
+	}
+
+	glBindTexture(texData.textureTarget, texData.textureID);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (const ofRectangle& run : tiles.getDirtyRuns())
+	{
+		int x = static_cast<int>(run.x);
+		int y = static_cast<int>(run.y);
+		int w = static_cast<int>(run.width);
+		int h = static_cast<int>(run.height);
+		glTexSubImage2D(texData.textureTarget, 0, x, y, w, h, glFormat, glType, source + (static_cast<size_t>(y) * width + x) * bytesPerPixel);
+		lastUploadBytes += static_cast<size_t>(w) * h * bytesPerPixel;
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(texData.textureTarget, 0);
+}
@@ -0,0 +1,55 @@
+/***********************************************************************
+DepthFloatImage - ofxCvFloatImage holding the filtered depth frame whose
+texture can be updated one set of dirty tiles at a time instead of
+re-uploading the whole frame.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "ofxOpenCv.h"
+#include "DirtyTiles.h"
+
+class DepthFloatImage : public ofxCvFloatImage
+{
+public:
+	DepthFloatImage();
+
+	// Upload only the dirty tiles of the image to the texture. Falls back to a full upload when the texture
+	// is not allocated yet or after a change of native scale, and does nothing when no tile is dirty.
+	void updateTextureTiles(const DirtyTiles& tiles);
+
+	// Force the next update to upload the whole image
+	void invalidateTexture(){
+		fullUploadNeeded = true;
+	}
+
+	void setNativeScale(float scaleMin, float scaleMax);
+
+	// Bytes sent to the texture by the last update
+	size_t getLastUploadBytes() const{
+		return lastUploadBytes;
+	}
+
+private:
+	void updateFullTexture();
+
+	bool fullUploadNeeded;
+	size_t lastUploadBytes;
+};
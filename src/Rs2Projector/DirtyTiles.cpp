@@ -0,0 +1,117 @@
+/***********************************************************************
+DirtyTiles - Set of 16x16 pixel tiles of the depth frame whose filtered
+depth changed, used to limit work and texture uploads to the parts of
+the sand that actually moved.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DirtyTiles.h"
+
+const int DirtyTiles::TILE_SIZE;
+
+DirtyTiles::DirtyTiles()
+:width(0),
+height(0),
+cols(0),
+rows(0)
+{
+}
+
+void DirtyTiles::setup(int swidth, int sheight)
+{
+	width = swidth;
+	height = sheight;
+	cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+	rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+	flags.assign(cols * rows, 0);
+}
+
+void DirtyTiles::clear()
+{
+	std::fill(flags.begin(), flags.end(), 0);
+}
+
+void DirtyTiles::markAll()
+{
+	std::fill(flags.begin(), flags.end(), 1);
+}
+
+bool DirtyTiles::isRegionDirty(int minX, int minY, int maxX, int maxY) const
+{
+	int tx0 = max(0, minX / TILE_SIZE);
+	int ty0 = max(0, minY / TILE_SIZE);
+	int tx1 = min(cols - 1, (maxX - 1) / TILE_SIZE);
+	int ty1 = min(rows - 1, (maxY - 1) / TILE_SIZE);
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+			if (flags[ty * cols + tx])
+				return true;
+	return false;
+}
+
+void DirtyTiles::merge(const DirtyTiles& other)
+{
+	if (other.flags.size() != flags.size())
+	{
+		// Frame size changed: everything has to be redone
+		setup(other.width, other.height);
+		markAll();
+		return;
+	}
+	for (size_t i = 0; i < flags.size(); i++)
+		flags[i] |= other.flags[i];
+}
+
+int DirtyTiles::getNumDirty() const
+{
+	int n = 0;
+	for (auto flag : flags)
+		n += flag;
+	return n;
+}
+
+ofRectangle DirtyTiles::getTileRect(int tx, int ty) const
+{
+	int x = tx * TILE_SIZE;
+	int y = ty * TILE_SIZE;
+	return ofRectangle(x, y, min(TILE_SIZE, width - x), min(TILE_SIZE, height - y));
+}
+
+std::vector<ofRectangle> DirtyTiles::getDirtyRuns() const
+{
+	std::vector<ofRectangle> runs;
+	for (int ty = 0; ty < rows; ty++)
+	{
+		int tx = 0;
+		while (tx < cols)
+		{
+			if (!flags[ty * cols + tx])
+			{
+				tx++;
+				continue;
+			}
+			int first = tx;
+			while (tx < cols && flags[ty * cols + tx])
+				tx++;
+			ofRectangle firstRect = getTileRect(first, ty);
+			ofRectangle lastRect = getTileRect(tx - 1, ty);
+			runs.push_back(ofRectangle(firstRect.x, firstRect.y, lastRect.getMaxX() - firstRect.x, firstRect.height));
+		}
+	}
+	return runs;
+}
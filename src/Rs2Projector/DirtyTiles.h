@@ -0,0 +1,81 @@
+/***********************************************************************
+DirtyTiles - Set of 16x16 pixel tiles of the depth frame whose filtered
+depth changed, used to limit work and texture uploads to the parts of
+the sand that actually moved.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+
+class DirtyTiles
+{
+public:
+	static const int TILE_SIZE = 16;
+
+	DirtyTiles();
+
+	// Tiles covering a width x height frame, all clean
+	void setup(int width, int height);
+	void clear();
+	void markAll();
+
+	void markTile(int tx, int ty){
+		flags[ty * cols + tx] = 1;
+	}
+
+	bool isTileDirty(int tx, int ty) const{
+		return flags[ty * cols + tx] != 0;
+	}
+
+	// Is any tile overlapping the pixel region [minX, maxX) x [minY, maxY) dirty
+	bool isRegionDirty(int minX, int minY, int maxX, int maxY) const;
+
+	// Add the dirty tiles of another set of the same size
+	void merge(const DirtyTiles& other);
+
+	bool isAllocated() const{
+		return !flags.empty();
+	}
+
+	bool any() const{
+		return getNumDirty() > 0;
+	}
+
+	int getNumDirty() const;
+
+	int getCols() const{
+		return cols;
+	}
+
+	int getRows() const{
+		return rows;
+	}
+
+	// Pixel rectangle of a tile, clipped to the frame
+	ofRectangle getTileRect(int tx, int ty) const;
+
+	// Horizontal runs of consecutive dirty tiles in each tile row, as pixel rectangles clipped to the frame
+	std::vector<ofRectangle> getDirtyRuns() const;
+
+private:
+	int width, height;
+	int cols, rows;
+	std::vector<uint8_t> flags;
+};
@@ -0,0 +1,282 @@
+/***********************************************************************
+ElevationPyramid - Minimum, maximum and mean elevation of the sand over
+cells of 2x2, 4x4 and 8x8 rs2 pixels, reduced from the elevation map of
+each frame for the consumers that only need the coarse terrain.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "ElevationPyramid.h"
+#include <limits>
+
+// SSE2 is part of the x86-64 baseline, no runtime dispatch needed
+#if defined(__x86_64__) || defined(_M_X64)
+#define ELEVATIONPYRAMID_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static const float emptyMinimum = std::numeric_limits<float>::max();
+static const float emptyMaximum = -std::numeric_limits<float>::max();
+
+ElevationPyramid::ElevationPyramid()
+:width(0),
+height(0),
+minX(0),
+minY(0),
+maxX(0),
+maxY(0)
+{
+	for (int l = 0; l < NUM_LEVELS; l++)
+		levels[l].width = levels[l].height = 0;
+}
+
+int ElevationPyramid::getLevelForReduction(int reduction)
+{
+	for (int l = 0; l < NUM_LEVELS; l++)
+		if (getReduction(l) >= reduction)
+			return l;
+	return NUM_LEVELS - 1;
+}
+
+void ElevationPyramid::allocate(int swidth, int sheight)
+{
+	width = swidth;
+	height = sheight;
+	for (int l = 0; l < NUM_LEVELS; l++)
+	{
+		int f = getReduction(l);
+		Level& level = levels[l];
+		level.width = (width + f - 1) / f;
+		level.height = (height + f - 1) / f;
+		size_t size = static_cast<size_t>(level.width) * level.height;
+		level.minimum.assign(size, 0.0f);
+		level.maximum.assign(size, 0.0f);
+		level.sum.assign(size, 0.0f);
+		level.mean.assign(size, 0.0f);
+		level.count.assign(size, 0.0f);
+	}
+	// The accumulators are read two columns at a time up to the next multiple of 8
+	scratch.assign(FrameFilterWorkerPool::MAX_THREADS * 4 * static_cast<size_t>(width + 8), 0.0f);
+	minX = minY = maxX = maxY = 0;
+}
+
+void ElevationPyramid::clear()
+{
+	for (int l = 0; l < NUM_LEVELS; l++)
+	{
+		Level& level = levels[l];
+		std::fill(level.minimum.begin(), level.minimum.end(), 0.0f);
+		std::fill(level.maximum.begin(), level.maximum.end(), 0.0f);
+		std::fill(level.sum.begin(), level.sum.end(), 0.0f);
+		std::fill(level.mean.begin(), level.mean.end(), 0.0f);
+		std::fill(level.count.begin(), level.count.end(), 0.0f);
+	}
+}
+
+// Accumulator of a band with the columns [first, last) empty
+ElevationPyramid::RowAccumulator ElevationPyramid::getAccumulator(int band, int first, int last)
+{
+	size_t stride = width + 8;
+	float* base = scratch.data() + band * 4 * stride;
+	RowAccumulator acc = { base, base + stride, base + 2 * stride, base + 3 * stride };
+	std::fill(acc.minimum + first, acc.minimum + last, emptyMinimum);
+	std::fill(acc.maximum + first, acc.maximum + last, emptyMaximum);
+	std::fill(acc.sum + first, acc.sum + last, 0.0f);
+	std::fill(acc.count + first, acc.count + last, 0.0f);
+	return acc;
+}
+
+// Add the pixels [first, last) of an elevation map row. Pixels without depth are skipped.
+void ElevationPyramid::accumulateMapRow(RowAccumulator& acc, const float* depth, const float* elevation, int y, int first, int last) const
+{
+	const float* row = depth + static_cast<size_t>(y) * width;
+	const float* elevationRow = elevation + static_cast<size_t>(y) * width;
+	int x = first;
+#ifdef ELEVATIONPYRAMID_SSE2
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 emptyMin = _mm_set1_ps(emptyMinimum);
+	const __m128 emptyMax = _mm_set1_ps(emptyMaximum);
+	for (; x + 4 <= last; x += 4)
+	{
+		__m128 valid = _mm_cmpgt_ps(_mm_loadu_ps(row + x), zero);
+		__m128 e = _mm_loadu_ps(elevationRow + x);
+		__m128 eMin = _mm_or_ps(_mm_and_ps(valid, e), _mm_andnot_ps(valid, emptyMin));
+		__m128 eMax = _mm_or_ps(_mm_and_ps(valid, e), _mm_andnot_ps(valid, emptyMax));
+		_mm_storeu_ps(acc.minimum + x, _mm_min_ps(_mm_loadu_ps(acc.minimum + x), eMin));
+		_mm_storeu_ps(acc.maximum + x, _mm_max_ps(_mm_loadu_ps(acc.maximum + x), eMax));
+		_mm_storeu_ps(acc.sum + x, _mm_add_ps(_mm_loadu_ps(acc.sum + x), _mm_and_ps(valid, e)));
+		_mm_storeu_ps(acc.count + x, _mm_add_ps(_mm_loadu_ps(acc.count + x), _mm_and_ps(valid, one)));
+	}
+#endif
+	for (; x < last; x++)
+	{
+		if (row[x] <= 0)
+			continue;
+		float e = elevationRow[x];
+		acc.minimum[x] = std::min(acc.minimum[x], e);
+		acc.maximum[x] = std::max(acc.maximum[x], e);
+		acc.sum[x] += e;
+		acc.count[x] += 1.0f;
+	}
+}
+
+// Add the cells [first, last) of a row of a level. Empty cells are skipped.
+void ElevationPyramid::accumulateLevelRow(RowAccumulator& acc, const Level& level, int y, int first, int last) const
+{
+	size_t offset = static_cast<size_t>(y) * level.width;
+	const float* minimum = level.minimum.data() + offset;
+	const float* maximum = level.maximum.data() + offset;
+	const float* sum = level.sum.data() + offset;
+	const float* count = level.count.data() + offset;
+	int x = first;
+#ifdef ELEVATIONPYRAMID_SSE2
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 emptyMin = _mm_set1_ps(emptyMinimum);
+	const __m128 emptyMax = _mm_set1_ps(emptyMaximum);
+	for (; x + 4 <= last; x += 4)
+	{
+		__m128 n = _mm_loadu_ps(count + x);
+		__m128 valid = _mm_cmpgt_ps(n, zero);
+		__m128 eMin = _mm_or_ps(_mm_and_ps(valid, _mm_loadu_ps(minimum + x)), _mm_andnot_ps(valid, emptyMin));
+		__m128 eMax = _mm_or_ps(_mm_and_ps(valid, _mm_loadu_ps(maximum + x)), _mm_andnot_ps(valid, emptyMax));
+		_mm_storeu_ps(acc.minimum + x, _mm_min_ps(_mm_loadu_ps(acc.minimum + x), eMin));
+		_mm_storeu_ps(acc.maximum + x, _mm_max_ps(_mm_loadu_ps(acc.maximum + x), eMax));
+		_mm_storeu_ps(acc.sum + x, _mm_add_ps(_mm_loadu_ps(acc.sum + x), _mm_loadu_ps(sum + x)));
+		_mm_storeu_ps(acc.count + x, _mm_add_ps(_mm_loadu_ps(acc.count + x), n));
+	}
+#endif
+	for (; x < last; x++)
+	{
+		if (count[x] <= 0)
+			continue;
+		acc.minimum[x] = std::min(acc.minimum[x], minimum[x]);
+		acc.maximum[x] = std::max(acc.maximum[x], maximum[x]);
+		acc.sum[x] += sum[x];
+		acc.count[x] += count[x];
+	}
+}
+
+// Combine the columns 2c and 2c+1 of the accumulator into the cells c of [firstCell, lastCell) of a level row
+void ElevationPyramid::reduceRow(const RowAccumulator& acc, Level& level, int y, int firstCell, int lastCell) const
+{
+	size_t offset = static_cast<size_t>(y) * level.width;
+	float* minimum = level.minimum.data() + offset;
+	float* maximum = level.maximum.data() + offset;
+	float* sum = level.sum.data() + offset;
+	float* mean = level.mean.data() + offset;
+	float* count = level.count.data() + offset;
+	int cell = firstCell;
+#ifdef ELEVATIONPYRAMID_SSE2
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	for (; cell + 4 <= lastCell; cell += 4)
+	{
+		int x = 2 * cell;
+		__m128 lo = _mm_loadu_ps(acc.minimum + x), hi = _mm_loadu_ps(acc.minimum + x + 4);
+		__m128 cellMin = _mm_min_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+		lo = _mm_loadu_ps(acc.maximum + x);
+		hi = _mm_loadu_ps(acc.maximum + x + 4);
+		__m128 cellMax = _mm_max_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+		lo = _mm_loadu_ps(acc.sum + x);
+		hi = _mm_loadu_ps(acc.sum + x + 4);
+		__m128 cellSum = _mm_add_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+		lo = _mm_loadu_ps(acc.count + x);
+		hi = _mm_loadu_ps(acc.count + x + 4);
+		__m128 cellCount = _mm_add_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+
+		__m128 valid = _mm_cmpgt_ps(cellCount, zero);
+		_mm_storeu_ps(minimum + cell, _mm_and_ps(valid, cellMin));
+		_mm_storeu_ps(maximum + cell, _mm_and_ps(valid, cellMax));
+		_mm_storeu_ps(sum + cell, cellSum);
+		_mm_storeu_ps(mean + cell, _mm_and_ps(valid, _mm_div_ps(cellSum, _mm_max_ps(cellCount, one))));
+		_mm_storeu_ps(count + cell, cellCount);
+	}
+#endif
+	for (; cell < lastCell; cell++)
+	{
+		int x = 2 * cell;
+		float n = acc.count[x] + acc.count[x + 1];
+		float s = acc.sum[x] + acc.sum[x + 1];
+		bool valid = n > 0;
+		minimum[cell] = valid ? std::min(acc.minimum[x], acc.minimum[x + 1]) : 0.0f;
+		maximum[cell] = valid ? std::max(acc.maximum[x], acc.maximum[x + 1]) : 0.0f;
+		sum[cell] = s;
+		mean[cell] = valid ? s / n : 0.0f;
+		count[cell] = n;
+	}
+}
+
+void ElevationPyramid::compute(const float* depth, const float* elevation, int swidth, int sheight, int sminX, int sminY,
+	int smaxX, int smaxY, FrameFilterWorkerPool& pool)
+{
+	if (swidth != width || sheight != height)
+		allocate(swidth, sheight);
+
+	// Cells that left the ROI go back to empty
+	if (sminX != minX || sminY != minY || smaxX != maxX || smaxY != maxY)
+		clear();
+	minX = sminX;
+	minY = sminY;
+	maxX = smaxX;
+	maxY = smaxY;
+	if (maxX <= minX || maxY <= minY)
+		return;
+
+	// Each level only reads the level below, its rows are split between the threads
+	for (int l = 0; l < NUM_LEVELS; l++)
+	{
+		int f = getReduction(l);
+		int firstCell = minX / f;
+		int lastCell = (maxX + f - 1) / f;
+		pool.run(minY / f, (maxY + f - 1) / f, [&](int firstRow, int lastRow, int band) {
+			int first = 2 * firstCell;
+			int last = 2 * lastCell;
+			for (int y = firstRow; y < lastRow; y++)
+			{
+				RowAccumulator acc = getAccumulator(band, first, last);
+				for (int i = 0; i < 2; i++)
+				{
+					int inputRow = 2 * y + i;
+					if (l == 0)
+					{
+						if (inputRow >= minY && inputRow < maxY)
+							accumulateMapRow(acc, depth, elevation, inputRow, minX, maxX);
+					}
+					else if (inputRow < levels[l - 1].height)
+						accumulateLevelRow(acc, levels[l - 1], inputRow, first, std::min(last, levels[l - 1].width));
+				}
+				reduceRow(acc, levels[l], y, firstCell, lastCell);
+			}
+		});
+	}
+}
+
+ElevationCell ElevationPyramid::getCell(int level, float x, float y) const
+{
+	ElevationCell cell = { 0, 0, 0, 0 };
+	if (!isAllocated() || level < 0 || level >= NUM_LEVELS || !(x >= 0 && y >= 0 && x < width && y < height))
+		return cell;
+	int f = getReduction(level);
+	const Level& l = levels[level];
+	size_t idx = static_cast<size_t>(static_cast<int>(y) / f) * l.width + static_cast<int>(x) / f;
+	cell.minimum = l.minimum[idx];
+	cell.maximum = l.maximum[idx];
+	cell.mean = l.mean[idx];
+	cell.count = static_cast<int>(l.count[idx]);
+	return cell;
+}
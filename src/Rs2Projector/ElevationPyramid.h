@@ -0,0 +1,118 @@
+/***********************************************************************
+ElevationPyramid - Minimum, maximum and mean elevation of the sand over
+cells of 2x2, 4x4 and 8x8 rs2 pixels, reduced from the elevation map of
+each frame for the consumers that only need the coarse terrain.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <vector>
+#include "ofMain.h"
+#include "FrameFilterWorkerPool.h"
+
+// Elevation of the rs2 pixels of one cell, same convention as Rs2Projector::elevationAtrs2Coord() (world units
+// above the base plane). A cell without any valid pixel has a count of 0 and reads as 0.
+struct ElevationCell
+{
+	float minimum;
+	float maximum;
+	float mean;
+	int count; // Number of valid rs2 pixels in the cell
+};
+
+class ElevationPyramid
+{
+public:
+	static const int NUM_LEVELS = 3; // Cells of 2, 4 and 8 rs2 pixels
+
+	ElevationPyramid();
+
+	// Build all the levels from the ROI [minX, maxX) x [minY, maxY) of an elevation map. A pixel is valid when it is
+	// inside the ROI and has a depth. Level 0 is reduced from the map and each next level from the previous one.
+	void compute(const float* depth, const float* elevation, int width, int height, int minX, int minY, int maxX, int maxY,
+		FrameFilterWorkerPool& pool);
+
+	bool isAllocated() const{
+		return width > 0 && height > 0;
+	}
+
+	// Side of the cells of a level in rs2 pixels
+	static int getReduction(int level){
+		return 2 << level;
+	}
+
+	// Finest level whose cells are at least reduction rs2 pixels wide
+	static int getLevelForReduction(int reduction);
+
+	int getLevelWidth(int level) const{
+		return levels[level].width;
+	}
+
+	int getLevelHeight(int level) const{
+		return levels[level].height;
+	}
+
+	// Planes of a level, getLevelWidth() x getLevelHeight() cells
+	const float* getMinimum(int level) const{
+		return levels[level].minimum.data();
+	}
+
+	const float* getMaximum(int level) const{
+		return levels[level].maximum.data();
+	}
+
+	const float* getMean(int level) const{
+		return levels[level].mean.data();
+	}
+
+	const float* getCount(int level) const{
+		return levels[level].count.data();
+	}
+
+	// Cell of a level holding the rs2 coordinates. Points outside the frame return an empty cell.
+	ElevationCell getCell(int level, float x, float y) const;
+
+private:
+	struct Level
+	{
+		int width, height;
+		std::vector<float> minimum, maximum, sum, mean, count;
+	};
+
+	// Two rows of the level below combined, one value per column
+	struct RowAccumulator
+	{
+		float* minimum;
+		float* maximum;
+		float* sum;
+		float* count;
+	};
+
+	void allocate(int width, int height);
+	void clear();
+	RowAccumulator getAccumulator(int band, int first, int last);
+	void accumulateMapRow(RowAccumulator& acc, const float* depth, const float* elevation, int y, int first, int last) const;
+	void accumulateLevelRow(RowAccumulator& acc, const Level& level, int y, int first, int last) const;
+	void reduceRow(const RowAccumulator& acc, Level& level, int y, int firstCell, int lastCell) const;
+
+	int width, height;
+	int minX, minY, maxX, maxY; // ROI of the last computation
+	Level levels[NUM_LEVELS];
+	std::vector<float> scratch; // One RowAccumulator per band
+};
@@ -0,0 +1,325 @@
+/***********************************************************************
+FilterBenchmark - Timings of the depth filter stages of the Rs2Grabber and
+of the color temporal filter on synthetic frames, without a camera.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "FilterBenchmark.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include "Rs2Grabber.h"
+#include "SandboxFrameSource.h"
+#include "TemporalFrameFilter.h"
+
+// Allocation counting (builds with MAGICSAND_COUNT_ALLOCATIONS only, the replacement of the global operators would
+// otherwise add a load to every allocation of the application): the operators count while a benchmarked call runs.
+#ifdef MAGICSAND_COUNT_ALLOCATIONS
+namespace
+{
+	std::atomic<bool> countAllocations(false);
+	std::atomic<uint64_t> numAllocations(0);
+	std::atomic<uint64_t> allocatedBytes(0);
+
+	void countAllocation(std::size_t size)
+	{
+		if (countAllocations.load(std::memory_order_relaxed))
+		{
+			numAllocations.fetch_add(1, std::memory_order_relaxed);
+			allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+		}
+	}
+
+	void* allocate(std::size_t size, std::size_t alignment = 0)
+	{
+		countAllocation(size);
+		if (!size)
+			size = 1;
+		void* ptr;
+#ifdef _WIN32
+		ptr = alignment ? _aligned_malloc(size, alignment) : std::malloc(size);
+#else
+		if (alignment)
+		{
+			if (posix_memalign(&ptr, std::max(alignment, sizeof(void*)), size) != 0)
+				ptr = nullptr;
+		}
+		else
+			ptr = std::malloc(size);
+#endif
+		return ptr;
+	}
+
+	void deallocate(void* ptr, bool aligned = false)
+	{
+#ifdef _WIN32
+		if (aligned)
+		{
+			_aligned_free(ptr);
+			return;
+		}
+#else
+		(void)aligned; // free() releases the posix_memalign() blocks too
+#endif
+		std::free(ptr);
+	}
+
+	void* allocateOrThrow(std::size_t size, std::size_t alignment = 0)
+	{
+		void* ptr = allocate(size, alignment);
+		if (!ptr)
+			throw std::bad_alloc();
+		return ptr;
+	}
+}
+
+void* operator new(std::size_t size) { return allocateOrThrow(size); }
+void* operator new[](std::size_t size) { return allocateOrThrow(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+void operator delete(void* ptr) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { deallocate(ptr); }
+
+void* operator new(std::size_t size, std::align_val_t al) { return allocateOrThrow(size, static_cast<std::size_t>(al)); }
+void* operator new[](std::size_t size, std::align_val_t al) { return allocateOrThrow(size, static_cast<std::size_t>(al)); }
+void* operator new(std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return allocate(size, static_cast<std::size_t>(al)); }
+void* operator new[](std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return allocate(size, static_cast<std::size_t>(al)); }
+void operator delete(void* ptr, std::align_val_t) noexcept { deallocate(ptr, true); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { deallocate(ptr, true); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { deallocate(ptr, true); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { deallocate(ptr, true); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { deallocate(ptr, true); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { deallocate(ptr, true); }
+#endif
+
+FilterBenchmark::FilterBenchmark()
+:resolutions({ ofVec2f(640, 480), ofVec2f(848, 480), ofVec2f(1280, 720) }),
+roiFractions({ 1.0f, 0.6f }),
+averagingSlots({ 15, 5, 30 }),
+temporalFrames({ 15, 50 }),
+numThreads(1),
+minIterations(10),
+minSeconds(0.2f),
+maxSeconds(2.0f)
+{
+}
+
+void FilterBenchmark::run()
+{
+	results.clear();
+	for (const auto& resolution : resolutions)
+	{
+		int width = static_cast<int>(resolution.x);
+		int height = static_cast<int>(resolution.y);
+		for (float roiFraction : roiFractions)
+		{
+			for (size_t i = 0; i < averagingSlots.size(); i++)
+				runGrabberStages(width, height, roiFraction, averagingSlots[i], i == 0);
+		}
+		for (int frames : temporalFrames)
+			runTemporalFilter(width, height, frames);
+	}
+}
+
+// The stages run on the frames of a sandbox simulation, after the averaging slots are full. Every call of a stage
+// starts from the same data: the stages working in place on the filtered frame get the raw frame back before each call.
+void FilterBenchmark::runGrabberStages(int width, int height, float roiFraction, int slots, bool allStages)
+{
+	Rs2Grabber grabber;
+	grabber.setup(std::make_shared<SandboxFrameSource>(width, height, 0));
+	int roiWidth = static_cast<int>(width * roiFraction);
+	int roiHeight = static_cast<int>(height * roiFraction);
+	ofRectangle roi((width - roiWidth) / 2, (height - roiHeight) / 2, roiWidth, roiHeight);
+	size_t pixels = static_cast<size_t>(roiWidth) * roiHeight;
+
+	auto runCase = [&](const std::string& stage, std::function<void()> prepare, std::function<void()> call) {
+		FilterBenchmarkResult result = measure(stage, pixels, prepare, call);
+		result.width = width;
+		result.height = height;
+		result.roiWidth = roiWidth;
+		result.roiHeight = roiHeight;
+		result.numAveragingSlots = slots;
+		results.push_back(result);
+	};
+
+	grabber.setupFramefilter(10, 570, roi, true, false, slots);
+	grabber.setNumFilterThreads(numThreads);
+	const FrameFilterMode filterModes[3] = { FRAMEFILTER_MODE_SLOTS, FRAMEFILTER_MODE_COMPACT, FRAMEFILTER_MODE_RECURSIVE };
+	for (auto mode : filterModes)
+	{
+		// Changing the mode resets the filter state, it is warmed up again
+		grabber.setFilterMode(mode);
+		for (int i = 0; i <= grabber.minInitFrame + slots; i++)
+			grabber.processNextFrame();
+		runCase(std::string("filter (") + getFrameFilterModeName(mode) + ")", nullptr, [&]() { grabber.filter(); });
+	}
+	if (!allStages)
+		return;
+
+	// Raw frame as the stages after the temporal filter see it
+	grabber.depth_filtering();
+	ofFloatPixels rawFrame = grabber.filteredframe;
+	auto restore = [&]() {
+		memcpy(grabber.filteredframe.getData(), rawFrame.getData(), rawFrame.size() * sizeof(float));
+	};
+
+	runCase("depth_filtering", nullptr, [&]() { grabber.depth_filtering(); });
+	runCase("applySimpleOutlierInpainting", restore, [&]() { grabber.applySimpleOutlierInpainting(); });
+	runCase("applyPushPullInpainting", restore, [&]() { grabber.applyPushPullInpainting(); });
+	grabber.setSpatialFilterMode(SPATIALFILTER_BINOMIAL);
+	runCase("applySpaceFilter (binomial)", restore, [&]() { grabber.applySpaceFilter(); });
+	grabber.setSpatialFilterMode(SPATIALFILTER_RECURSIVE_GAUSSIAN);
+	runCase("applySpaceFilter (recursive)", restore, [&]() { grabber.applySpaceFilter(); });
+	runCase("updateGradientField", [&]() { grabber.frameDirtyTiles.markAll(); }, [&]() { grabber.updateGradientField(); });
+}
+
+void FilterBenchmark::runTemporalFilter(int width, int height, int frames)
+{
+	SandboxFrameSource source(width, height, 0);
+	source.open();
+	CTemporalFrameFilter temporalFilter;
+	temporalFilter.Init(width, height, frames);
+	// Both buffers share the frame counter, they are filled one after the other
+	for (int i = 0; i < 2 * frames; i++)
+	{
+		source.poll();
+		unsigned char* color = const_cast<unsigned char*>(source.getColorPixels().getData());
+		if (i < frames)
+			temporalFilter.NewFrame(color, width, height, frames);
+		else
+			temporalFilter.NewColFrame(color, width, height, frames);
+	}
+
+	size_t pixels = static_cast<size_t>(width) * height;
+	auto runCase = [&](const std::string& stage, std::function<void()> call) {
+		FilterBenchmarkResult result = measure(stage, pixels, nullptr, call);
+		result.width = width;
+		result.height = height;
+		result.roiWidth = width;
+		result.roiHeight = height;
+		result.numAveragingSlots = frames;
+		result.numThreads = 1;
+		results.push_back(result);
+	};
+	runCase("CTemporalFrameFilter::ComputeMedianImage", [&]() { temporalFilter.getMedianFilteredImage(); });
+	runCase("CTemporalFrameFilter::ComputeAverageImageCol", [&]() { temporalFilter.getAverageFilteredColImage(); });
+}
+
+FilterBenchmarkResult FilterBenchmark::measure(const std::string& stage, size_t pixels, std::function<void()> prepare, std::function<void()> call)
+{
+	std::vector<double> times;
+	times.reserve(1024);
+#ifdef MAGICSAND_COUNT_ALLOCATIONS
+	uint64_t allocations = 0;
+	uint64_t bytes = 0;
+#endif
+	double elapsed = 0;
+	while (static_cast<int>(times.size()) < minIterations || elapsed < minSeconds)
+	{
+		if (elapsed >= maxSeconds && times.size() >= 3)
+			break;
+		if (prepare)
+			prepare();
+
+#ifdef MAGICSAND_COUNT_ALLOCATIONS
+		numAllocations = 0;
+		allocatedBytes = 0;
+		countAllocations = true;
+#endif
+		auto start = std::chrono::steady_clock::now();
+		call();
+		auto end = std::chrono::steady_clock::now();
+#ifdef MAGICSAND_COUNT_ALLOCATIONS
+		countAllocations = false;
+		allocations += numAllocations;
+		bytes += allocatedBytes;
+#endif
+		double ns = std::chrono::duration<double, std::nano>(end - start).count();
+		times.push_back(ns);
+		elapsed += ns * 1e-9;
+	}
+
+	std::sort(times.begin(), times.end());
+	FilterBenchmarkResult result;
+	result.stage = stage;
+	result.numThreads = numThreads;
+	result.iterations = static_cast<int>(times.size());
+	result.nsPerPixel = times[times.size() / 2] / pixels;
+	result.minNsPerPixel = times.front() / pixels;
+	result.megapixelsPerSecond = 1000.0 / result.nsPerPixel;
+#ifdef MAGICSAND_COUNT_ALLOCATIONS
+	result.allocationsPerCall = static_cast<double>(allocations) / times.size();
+	result.allocatedBytesPerCall = static_cast<double>(bytes) / times.size();
+#else
+	result.allocationsPerCall = result.allocatedBytesPerCall = -1;
+#endif
+	ofLogVerbose("FilterBenchmark") << "measure(): " << stage << ": " << result.iterations << " iterations";
+	return result;
+}
+
+void FilterBenchmark::logResults() const
+{
+	for (const auto& r : results)
+	{
+		ofLogNotice("FilterBenchmark") << r.stage << " " << r.width << "x" << r.height
+			<< " ROI " << r.roiWidth << "x" << r.roiHeight << " slots " << r.numAveragingSlots << " threads " << r.numThreads
+			<< ": " << ofToString(r.nsPerPixel, 2) << " ns/pixel (min " << ofToString(r.minNsPerPixel, 2) << "), "
+			<< ofToString(r.megapixelsPerSecond, 1) << " Mpixel/s, "
+			<< (r.allocationsPerCall < 0 ? std::string("allocations not counted") : ofToString(r.allocationsPerCall, 1) + " allocations ("
+			+ ofToString(r.allocatedBytesPerCall / 1024, 1) + " kB) per call");
+	}
+}
+
+bool FilterBenchmark::saveResults(const std::string& path) const
+{
+	std::ofstream file(path.c_str());
+	if (!file)
+	{
+		ofLogError("FilterBenchmark") << "saveResults(): Could not write " << path;
+		return false;
+	}
+	file << "stage,width,height,roiWidth,roiHeight,numAveragingSlots,numThreads,iterations,nsPerPixel,minNsPerPixel,megapixelsPerSecond,allocationsPerCall,allocatedBytesPerCall\n";
+	for (const auto& r : results)
+	{
+		file << r.stage << "," << r.width << "," << r.height << "," << r.roiWidth << "," << r.roiHeight << ","
+			<< r.numAveragingSlots << "," << r.numThreads << "," << r.iterations << "," << r.nsPerPixel << ","
+			<< r.minNsPerPixel << "," << r.megapixelsPerSecond << "," << r.allocationsPerCall << "," << r.allocatedBytesPerCall << "\n";
+	}
+	return true;
+}
+
+int runFilterBenchmarks()
+{
+	FilterBenchmark benchmark;
+	benchmark.run();
+	benchmark.logResults();
+
+	ofDirectory::createDirectory("benchmarks", true, true);
+	std::string path = ofToDataPath("benchmarks/filter-benchmark-" + ofGetTimestampString("%Y%m%d-%H%M%S") + ".csv", true);
+	if (!benchmark.saveResults(path))
+		return 1;
+	ofLogNotice("FilterBenchmark") << "Results saved to " << path;
+	return 0;
+}
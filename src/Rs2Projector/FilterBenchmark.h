@@ -0,0 +1,81 @@
+/***********************************************************************
+FilterBenchmark - Timings of the depth filter stages of the Rs2Grabber and
+of the color temporal filter on synthetic frames, without a camera.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <functional>
+#include "ofMain.h"
+
+class Rs2Grabber;
+
+struct FilterBenchmarkResult
+{
+	std::string stage;
+	int width, height; // Frame size
+	int roiWidth, roiHeight; // Pixels processed (the whole frame for the temporal filter)
+	int numAveragingSlots; // Averaging slots of the depth filter, frames of the temporal filter
+	int numThreads;
+	int iterations;
+	double nsPerPixel; // Median over the iterations
+	double minNsPerPixel;
+	double megapixelsPerSecond; // From the median
+	double allocationsPerCall; // operator new calls, on all threads. -1 without MAGICSAND_COUNT_ALLOCATIONS.
+	double allocatedBytesPerCall;
+};
+
+class FilterBenchmark
+{
+public:
+	FilterBenchmark();
+
+	// Run every stage over the sweep below
+	void run();
+
+	const std::vector<FilterBenchmarkResult>& getResults() const{
+		return results;
+	}
+
+	void logResults() const;
+	bool saveResults(const std::string& path) const; // CSV
+
+	// Sweep
+	std::vector<ofVec2f> resolutions;
+	std::vector<float> roiFractions; // ROI side relative to the frame, centered
+	std::vector<int> averagingSlots; // Swept for filter(), the other stages use the first value
+	std::vector<int> temporalFrames; // Buffer lengths of the temporal filter
+	int numThreads; // Filter threads of the grabber
+
+	// Each case runs at least minIterations times and minSeconds, and stops after maxSeconds
+	int minIterations;
+	float minSeconds;
+	float maxSeconds;
+
+private:
+	void runGrabberStages(int width, int height, float roiFraction, int slots, bool allStages);
+	void runTemporalFilter(int width, int height, int frames);
+	FilterBenchmarkResult measure(const std::string& stage, size_t pixels, std::function<void()> prepare, std::function<void()> call);
+
+	std::vector<FilterBenchmarkResult> results;
+};
+
+// Run the benchmarks, log them and save them in data/benchmarks (Magic-Sand --benchmark). The allocations are only
+// counted in a build with MAGICSAND_COUNT_ALLOCATIONS defined (Benchmark configuration, make BENCHMARK=1).
+int runFilterBenchmarks();
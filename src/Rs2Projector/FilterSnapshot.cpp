@@ -0,0 +1,314 @@
+/***********************************************************************
+FilterSnapshot - Binary snapshot of the temporal filter state, restored at
+startup so the sandbox does not have to stabilize again.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "FilterSnapshot.h"
+#include <cstdio>
+#include "FileUtils.h"
+#include "SessionRecording.h" // MappedFile
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+static const char snapshotMagic[8] = { 'M', 'S', 'A', 'N', 'D', 'S', 'N', 'P' };
+static const uint32_t snapshotVersion = 1;
+static const size_t snapshotHeaderBytes = 512;
+
+static_assert(sizeof(FilterSnapshotHeader) <= snapshotHeaderBytes, "Snapshot header does not fit");
+
+namespace
+{
+	// Rows of a plane inside the stored part of the frame
+	size_t planeRowBytes(const FilterSnapshotHeader& h, uint32_t pixelBytes)
+	{
+		return static_cast<size_t>(h.maxX - h.minX) * pixelBytes;
+	}
+
+	uint64_t computeStateBytes(const FilterSnapshotHeader& h)
+	{
+		uint64_t bytes = 0;
+		for (uint32_t p = 0; p < h.numPlanes; p++)
+			bytes += planeRowBytes(h, h.planePixelBytes[p]) * (h.maxY - h.minY);
+		return bytes;
+	}
+
+	// Catches snapshots cut short by a power loss, not meant as a cryptographic hash
+	uint64_t computeChecksum(const unsigned char* data, size_t size)
+	{
+		uint64_t sum = 0x9E3779B97F4A7C15ull;
+		size_t words = size / 8;
+		for (size_t i = 0; i < words; i++)
+		{
+			uint64_t w;
+			memcpy(&w, data + 8 * i, 8);
+			sum = (sum ^ w) * 0x100000001B3ull;
+			sum ^= sum >> 29;
+		}
+		for (size_t i = 8 * words; i < size; i++)
+			sum = (sum ^ data[i]) * 0x100000001B3ull;
+		return sum;
+	}
+
+	bool sameLayout(const FilterSnapshotHeader& a, const FilterSnapshotHeader& b)
+	{
+		if (a.numPlanes != b.numPlanes)
+			return false;
+		for (uint32_t p = 0; p < a.numPlanes; p++)
+			if (a.planePixelBytes[p] != b.planePixelBytes[p])
+				return false;
+		return a.width == b.width && a.height == b.height
+			&& a.minX == b.minX && a.minY == b.minY && a.maxX == b.maxX && a.maxY == b.maxY
+			&& a.filterMode == b.filterMode && a.numAveragingSlots == b.numAveragingSlots;
+	}
+
+	bool sameFloats(const float* a, const float* b, int n, float tolerance)
+	{
+		for (int i = 0; i < n; i++)
+			if (fabs(a[i] - b[i]) > tolerance)
+				return false;
+		return true;
+	}
+}
+
+//--------------------------------------------------------------
+FilterSnapshotCalibration::FilterSnapshotCalibration()
+{
+	memset(this, 0, sizeof(*this));
+}
+
+FilterSnapshotCalibration::FilterSnapshotCalibration(ofRectangle rs2ROI, ofVec3f sbasePlaneNormal, ofVec3f sbasePlaneOffset, float smaxOffset, const ofMatrix4x4& srs2ProjMatrix)
+{
+	roi[0] = rs2ROI.x;
+	roi[1] = rs2ROI.y;
+	roi[2] = rs2ROI.width;
+	roi[3] = rs2ROI.height;
+	basePlaneNormal[0] = sbasePlaneNormal.x;
+	basePlaneNormal[1] = sbasePlaneNormal.y;
+	basePlaneNormal[2] = sbasePlaneNormal.z;
+	basePlaneOffset[0] = sbasePlaneOffset.x;
+	basePlaneOffset[1] = sbasePlaneOffset.y;
+	basePlaneOffset[2] = sbasePlaneOffset.z;
+	maxOffset = smaxOffset;
+	memcpy(rs2ProjMatrix, srs2ProjMatrix.getPtr(), sizeof(rs2ProjMatrix));
+}
+
+// The values come back from the settings files, so they are compared with a small tolerance
+bool FilterSnapshotCalibration::matches(const FilterSnapshotCalibration& other) const
+{
+	return sameFloats(roi, other.roi, 4, 0.5f)
+		&& sameFloats(basePlaneNormal, other.basePlaneNormal, 3, 1e-4f)
+		&& sameFloats(basePlaneOffset, other.basePlaneOffset, 3, 0.1f)
+		&& fabs(maxOffset - other.maxOffset) <= 0.1f
+		&& sameFloats(rs2ProjMatrix, other.rs2ProjMatrix, 16, 1e-4f * (1 + fabs(rs2ProjMatrix[15])));
+}
+
+//--------------------------------------------------------------
+// Copy the ROI rows of each plane one after the other into out, computeStateBytes(header) bytes
+static void packStatePlanes(const FilterSnapshotHeader& header, const std::vector<FilterStatePlane>& planes, unsigned char* out)
+{
+	for (uint32_t p = 0; p < header.numPlanes; p++)
+	{
+		size_t rowBytes = planeRowBytes(header, planes[p].pixelBytes);
+		for (int y = 0; y < header.maxY - header.minY; y++, out += rowBytes)
+			memcpy(out, planes[p].data + y * planes[p].rowStride, rowBytes);
+	}
+}
+
+// Write the snapshot file, the plane data is copied from state if given, packed from the planes otherwise
+static bool writeFilterSnapshot(const std::string& path, const FilterSnapshotHeader& header,
+	const std::vector<FilterStatePlane>* planes, const unsigned char* state)
+{
+	std::string tmpPath = path + ".tmp";
+	uint64_t stateBytes = computeStateBytes(header);
+	MappedFile file;
+	if (!file.create(tmpPath, snapshotHeaderBytes + stateBytes))
+	{
+		ofLogError("FilterSnapshot") << "saveFilterSnapshot(): Could not create " << tmpPath;
+		return false;
+	}
+
+	if (state)
+		memcpy(file.data() + snapshotHeaderBytes, state, stateBytes);
+	else
+		packStatePlanes(header, *planes, file.data() + snapshotHeaderBytes);
+
+	memset(file.data(), 0, snapshotHeaderBytes);
+	FilterSnapshotHeader* h = reinterpret_cast<FilterSnapshotHeader*>(file.data());
+	*h = header;
+	memcpy(h->magic, snapshotMagic, sizeof(snapshotMagic));
+	h->version = snapshotVersion;
+	h->stateBytes = stateBytes;
+	h->checksum = computeChecksum(file.data() + snapshotHeaderBytes, stateBytes);
+	h->savedTime = ofGetUnixTime();
+	// The new snapshot is on the disk before it takes the place of the previous one
+	bool flushed = file.flush();
+	file.close();
+	if (!flushed)
+	{
+		ofLogError("FilterSnapshot") << "saveFilterSnapshot(): Could not flush " << tmpPath;
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+
+	if (!replaceFile(tmpPath, path))
+	{
+		ofLogError("FilterSnapshot") << "saveFilterSnapshot(): Could not rename " << tmpPath << " to " << path;
+		return false;
+	}
+	return true;
+}
+
+bool saveFilterSnapshot(const std::string& path, const FilterSnapshotHeader& header, const std::vector<FilterStatePlane>& planes)
+{
+	if (planes.size() != header.numPlanes || header.numPlanes > FilterSnapshotHeader::MAX_PLANES)
+		return false;
+	return writeFilterSnapshot(path, header, &planes, nullptr);
+}
+
+//--------------------------------------------------------------
+FilterSnapshotWriter::FilterSnapshotWriter()
+:stopping(false),
+pending(false),
+busy(false)
+{
+	worker = std::thread(&FilterSnapshotWriter::threadFunction, this);
+}
+
+FilterSnapshotWriter::~FilterSnapshotWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	worker.join();
+}
+
+bool FilterSnapshotWriter::submit(const std::string& path, const FilterSnapshotHeader& header, const std::vector<FilterStatePlane>& planes)
+{
+	if (planes.size() != header.numPlanes || header.numPlanes > FilterSnapshotHeader::MAX_PLANES)
+		return false;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (pending || busy)
+		return false;
+	// The buffer keeps its size between the saves, only the first one allocates
+	state.resize(computeStateBytes(header));
+	packStatePlanes(header, planes, state.data());
+	this->path = path;
+	this->header = header;
+	pending = true;
+	wake.notify_one();
+	return true;
+}
+
+void FilterSnapshotWriter::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return !pending && !busy; });
+}
+
+void FilterSnapshotWriter::threadFunction()
+{
+	// Writing and flushing tens of MB can take a while, the frame loop and the filter threads come first
+#ifdef _WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+	setpriority(PRIO_PROCESS, 0, 10); // Applies to the calling thread on Linux
+#endif
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		wake.wait(lock, [this] { return stopping || pending; });
+		if (pending)
+		{
+			// The state buffer is not touched by submit() while busy
+			pending = false;
+			busy = true;
+			lock.unlock();
+			uint64_t start = ofGetElapsedTimeMicros();
+			if (writeFilterSnapshot(path, header, nullptr, state.data()))
+				ofLogVerbose("FilterSnapshotWriter") << "threadFunction(): Saved " << path << " in " << (ofGetElapsedTimeMicros() - start) / 1000 << " ms";
+			lock.lock();
+			busy = false;
+			done.notify_all();
+		}
+		if (stopping)
+			break;
+	}
+}
+
+bool loadFilterSnapshot(const std::string& path, FilterSnapshotHeader& expected, const std::vector<FilterStatePlane>& planes, std::string& reason)
+{
+	MappedFile file;
+	if (!ofFile::doesFileExist(path, false) || !file.openRead(path))
+	{
+		reason = "no snapshot";
+		return false;
+	}
+
+	const FilterSnapshotHeader* h = reinterpret_cast<const FilterSnapshotHeader*>(file.data());
+	if (file.size() < snapshotHeaderBytes
+		|| memcmp(h->magic, snapshotMagic, sizeof(snapshotMagic)) != 0
+		|| h->version != snapshotVersion
+		|| h->numPlanes > FilterSnapshotHeader::MAX_PLANES
+		|| h->stateBytes != computeStateBytes(*h)
+		|| file.size() < snapshotHeaderBytes + h->stateBytes)
+	{
+		reason = "not a valid snapshot";
+		return false;
+	}
+	if (!sameLayout(*h, expected) || planes.size() != h->numPlanes)
+	{
+		reason = "taken with another ROI or filter setup";
+		return false;
+	}
+	if (!sameFloats(h->worldMatrix, expected.worldMatrix, 16, 1e-4f))
+	{
+		reason = "taken with another camera";
+		return false;
+	}
+	if (!h->calibration.matches(expected.calibration))
+	{
+		reason = "taken with another calibration";
+		return false;
+	}
+	if (h->averagingSlotIndex >= h->numAveragingSlots
+		|| computeChecksum(file.data() + snapshotHeaderBytes, h->stateBytes) != h->checksum)
+	{
+		reason = "corrupted";
+		return false;
+	}
+
+	const unsigned char* in = file.data() + snapshotHeaderBytes;
+	for (uint32_t p = 0; p < h->numPlanes; p++)
+	{
+		size_t rowBytes = planeRowBytes(*h, planes[p].pixelBytes);
+		for (int y = 0; y < h->maxY - h->minY; y++, in += rowBytes)
+			memcpy(planes[p].data + y * planes[p].rowStride, in, rowBytes);
+	}
+	expected.averagingSlotIndex = h->averagingSlotIndex;
+	expected.savedTime = h->savedTime;
+	return true;
+}
@@ -0,0 +1,122 @@
+/***********************************************************************
+FilterSnapshot - Binary snapshot of the temporal filter state, restored at
+startup so the sandbox does not have to stabilize again.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ofMain.h"
+
+// ROI, base plane and projector calibration the filter state was built with. A snapshot is only restored
+// with the calibration it was taken with.
+struct FilterSnapshotCalibration
+{
+	FilterSnapshotCalibration();
+	FilterSnapshotCalibration(ofRectangle rs2ROI, ofVec3f basePlaneNormal, ofVec3f basePlaneOffset, float maxOffset, const ofMatrix4x4& rs2ProjMatrix);
+
+	bool matches(const FilterSnapshotCalibration& other) const;
+
+	float roi[4]; // x, y, width, height
+	float basePlaneNormal[3];
+	float basePlaneOffset[3];
+	float maxOffset;
+	float rs2ProjMatrix[16];
+};
+
+enum WarmStartState
+{
+	WARMSTART_NONE, // Cold start, the state is built from the live frames
+	WARMSTART_VALIDATING, // A snapshot was restored and is being checked against the live frames
+	WARMSTART_RESTORED, // The snapshot matched the live frames
+	WARMSTART_REJECTED // The sand moved since the snapshot was taken, cold start
+};
+
+// One plane of the filter state covering the stored part of the frame: rows of pixelBytes bytes per pixel,
+// rowStride bytes apart
+struct FilterStatePlane
+{
+	unsigned char* data; // Pixel (minX, minY)
+	uint32_t pixelBytes;
+	size_t rowStride;
+};
+
+// Snapshot file layout: a 512 byte header, then the ROI rows of each state plane one after the other
+struct FilterSnapshotHeader
+{
+	static const int MAX_PLANES = 48;
+
+	char magic[8]; // "MSANDSNP"
+	uint32_t version;
+	uint32_t width; // Rs2 frame size
+	uint32_t height;
+	int32_t minX, minY, maxX, maxY; // Part of the frame stored
+	uint32_t filterMode; // FrameFilterMode of the state
+	uint32_t numAveragingSlots;
+	uint32_t averagingSlotIndex;
+	uint32_t numPlanes;
+	uint32_t planePixelBytes[MAX_PLANES];
+	uint64_t stateBytes; // Size of the plane data after the header
+	uint64_t checksum; // Of the plane data
+	uint64_t savedTime; // Unix time
+	float worldMatrix[16]; // Rs2Grabber::getWorldMatrix() of the camera
+	FilterSnapshotCalibration calibration;
+};
+
+// Write the ROI of the planes to path. The file is written next to path and renamed over it once complete,
+// so a crash during a save leaves the previous snapshot.
+bool saveFilterSnapshot(const std::string& path, const FilterSnapshotHeader& header, const std::vector<FilterStatePlane>& planes);
+
+// Saves the snapshots on a low priority thread: submit() only copies the planes into a buffer kept between the
+// saves, the file is written, flushed and renamed in the background. A snapshot submitted before the writer is
+// destroyed is still written.
+class FilterSnapshotWriter
+{
+public:
+	FilterSnapshotWriter();
+	~FilterSnapshotWriter();
+
+	// Copy the planes and queue the save. Returns false, copying nothing, while the previous one is written.
+	bool submit(const std::string& path, const FilterSnapshotHeader& header, const std::vector<FilterStatePlane>& planes);
+	// Wait until the queued snapshot is on the disk
+	void wait();
+
+private:
+	void threadFunction();
+
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	bool stopping;
+	bool pending; // Submitted, not picked up by the thread yet
+	bool busy; // Being written
+	std::string path;
+	FilterSnapshotHeader header;
+	std::vector<unsigned char> state;
+};
+
+// Map the snapshot at path and copy it into the planes if its header matches expected (frame size, ROI, filter
+// state layout, camera and calibration). averagingSlotIndex and savedTime are read back into expected.
+// On failure reason tells why and the planes are untouched.
+bool loadFilterSnapshot(const std::string& path, FilterSnapshotHeader& expected, const std::vector<FilterStatePlane>& planes, std::string& reason);
@@ -0,0 +1,515 @@
+/***********************************************************************
+FrameFilterKernels - Row kernels for the temporal depth filter of the
+Rs2Grabber: a scalar reference kernel and SSE4.1/AVX2 versions selected
+at runtime.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "FrameFilterKernels.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define FRAMEFILTER_X86_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and clang need the instruction set enabled per function since the project is built for baseline x86-64.
+// FMA is deliberately not enabled: contracting a*b+c would break bit-identity with the scalar kernel.
+#if defined(FRAMEFILTER_X86_SIMD) && (defined(__GNUC__) || defined(__clang__))
+#define FRAMEFILTER_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define FRAMEFILTER_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define FRAMEFILTER_TARGET_SSE41
+#define FRAMEFILTER_TARGET_AVX2
+#endif
+
+FrameFilterRowStats filterRowScalar(const FrameFilterParams& p, const FrameFilterRow& row)
+{
+	FrameFilterRowStats stats = { 0, 0 };
+	const unsigned short* inputFramePtr = row.input;
+	float* averagingBufferPtr = row.averagingSlot;
+	float* count = row.sampleCount;
+	float* sum = row.sampleSum;
+	float* sumSq = row.sampleSumSq;
+	float* validBufferPtr = row.valid;
+	float* filteredFramePtr = row.filtered;
+
+	for (int i = 0; i < row.count; ++i)
+	{
+		float newVal = static_cast<float>(inputFramePtr[i]);
+		float oldVal = averagingBufferPtr[i];
+
+		if (newVal > p.maxOffset)//we are under the ceiling plane
+		{
+			averagingBufferPtr[i] = newVal; // Store the value
+			if (p.followBigChange && count[i] > 0) { // Follow big changes
+				float oldFiltered = sum[i] / count[i]; // Compare newVal with average
+				if (oldFiltered - newVal >= p.bigChange || newVal - oldFiltered >= p.bigChange)
+				{
+					for (int s = 0; s < p.numAveragingSlots; s++) // update all averaging slots
+						row.averagingBase[s*p.slotStride + i] = newVal;
+					count[i] = p.numAveragingSlots; //Update statistics
+					sum[i] = newVal*p.numAveragingSlots;
+					sumSq[i] = newVal*newVal*p.numAveragingSlots;
+					stats.numResets++;
+				}
+			}
+			// Update the pixel's statistics:
+			++count[i]; // Number of valid samples
+			sum[i] += newVal; // Sum of valid samples
+			sumSq[i] += newVal*newVal; // Sum of squares of valid samples
+
+			// Check if the previous value in the averaging buffer was not initiated
+			if (oldVal != p.initialValue)
+			{
+				--count[i]; // Number of valid samples
+				sum[i] -= oldVal; // Sum of valid samples
+				sumSq[i] -= oldVal * oldVal; // Sum of squares of valid samples
+			}
+		}
+		// Check if the pixel is "stable":
+		if (count[i] >= p.minNumSamples &&
+			sumSq[i] * count[i] <= p.maxVariance*count[i] * count[i] + sum[i] * sum[i])
+		{
+			// Check if the new running mean is outside the previous value's envelope:
+			float newFiltered = sum[i] / count[i];
+			if (std::abs(newFiltered - validBufferPtr[i]) >= p.hysteresis)
+			{
+				// Set the output pixel value to the depth-corrected running mean:
+				validBufferPtr[i] = newFiltered;
+			}
+		}
+		else
+			stats.numUnstable++;
+		filteredFramePtr[i] = validBufferPtr[i];
+	}
+	return stats;
+}
+
+#ifdef FRAMEFILTER_X86_SIMD
+
+// Lanes flagged in resetMask followed a big change: all their averaging slots take the new value
+static void resetAveragingSlots(const FrameFilterParams& p, const FrameFilterRow& row, int i, int resetMask)
+{
+	while (resetMask)
+	{
+		int lane = 0;
+		while (!(resetMask & (1 << lane)))
+			lane++;
+		resetMask &= ~(1 << lane);
+		float newVal = static_cast<float>(row.input[i + lane]);
+		for (int s = 0; s < p.numAveragingSlots; s++)
+			row.averagingBase[s*p.slotStride + i + lane] = newVal;
+	}
+}
+
+static inline int countLanes(int mask)
+{
+	int n = 0;
+	for (; mask; mask &= mask - 1)
+		n++;
+	return n;
+}
+
+FRAMEFILTER_TARGET_SSE41
+static inline void filterStepSSE41(const FrameFilterParams& p, const FrameFilterRow& row, int i, FrameFilterRowStats& stats)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	const __m128 numSlots = _mm_set1_ps(static_cast<float>(p.numAveragingSlots));
+
+	__m128 newVal = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row.input + i))));
+	__m128 oldVal = _mm_loadu_ps(row.averagingSlot + i);
+	__m128 count = _mm_loadu_ps(row.sampleCount + i);
+	__m128 sum = _mm_loadu_ps(row.sampleSum + i);
+	__m128 sumSq = _mm_loadu_ps(row.sampleSumSq + i);
+	__m128 valid = _mm_loadu_ps(row.valid + i);
+
+	// Pixels under the ceiling plane receive the new sample
+	__m128 under = _mm_cmpgt_ps(newVal, _mm_set1_ps(p.maxOffset));
+	_mm_storeu_ps(row.averagingSlot + i, _mm_blendv_ps(oldVal, newVal, under));
+
+	if (p.followBigChange)
+	{
+		__m128 oldFiltered = _mm_div_ps(sum, count);
+		__m128 bigChange = _mm_set1_ps(p.bigChange);
+		__m128 big = _mm_or_ps(_mm_cmpge_ps(_mm_sub_ps(oldFiltered, newVal), bigChange),
+			_mm_cmpge_ps(_mm_sub_ps(newVal, oldFiltered), bigChange));
+		__m128 reset = _mm_and_ps(_mm_and_ps(under, _mm_cmpgt_ps(count, _mm_setzero_ps())), big);
+		int resetMask = _mm_movemask_ps(reset);
+		if (resetMask)
+		{
+			resetAveragingSlots(p, row, i, resetMask);
+			stats.numResets += countLanes(resetMask);
+			count = _mm_blendv_ps(count, numSlots, reset);
+			sum = _mm_blendv_ps(sum, _mm_mul_ps(newVal, numSlots), reset);
+			sumSq = _mm_blendv_ps(sumSq, _mm_mul_ps(_mm_mul_ps(newVal, newVal), numSlots), reset);
+		}
+	}
+
+	// Add the new sample and remove the one it replaces if that slot had been initiated
+	__m128 newCount = _mm_add_ps(count, one);
+	__m128 newSum = _mm_add_ps(sum, newVal);
+	__m128 newSumSq = _mm_add_ps(sumSq, _mm_mul_ps(newVal, newVal));
+	__m128 initiated = _mm_cmpneq_ps(oldVal, _mm_set1_ps(p.initialValue));
+	newCount = _mm_blendv_ps(newCount, _mm_sub_ps(newCount, one), initiated);
+	newSum = _mm_blendv_ps(newSum, _mm_sub_ps(newSum, oldVal), initiated);
+	newSumSq = _mm_blendv_ps(newSumSq, _mm_sub_ps(newSumSq, _mm_mul_ps(oldVal, oldVal)), initiated);
+	count = _mm_blendv_ps(count, newCount, under);
+	sum = _mm_blendv_ps(sum, newSum, under);
+	sumSq = _mm_blendv_ps(sumSq, newSumSq, under);
+	_mm_storeu_ps(row.sampleCount + i, count);
+	_mm_storeu_ps(row.sampleSum + i, sum);
+	_mm_storeu_ps(row.sampleSumSq + i, sumSq);
+
+	// Stable pixels outside the hysteresis envelope take the running mean
+	__m128 stable = _mm_and_ps(_mm_cmpge_ps(count, _mm_set1_ps(static_cast<float>(p.minNumSamples))),
+		_mm_cmple_ps(_mm_mul_ps(sumSq, count),
+			_mm_add_ps(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(p.maxVariance), count), count), _mm_mul_ps(sum, sum))));
+	stats.numUnstable += countLanes(~_mm_movemask_ps(stable) & 0xf);
+	__m128 newFiltered = _mm_div_ps(sum, count);
+	__m128 deviation = _mm_andnot_ps(signMask, _mm_sub_ps(newFiltered, valid));
+	__m128 update = _mm_and_ps(stable, _mm_cmpge_ps(deviation, _mm_set1_ps(p.hysteresis)));
+	valid = _mm_blendv_ps(valid, newFiltered, update);
+	_mm_storeu_ps(row.valid + i, valid);
+	_mm_storeu_ps(row.filtered + i, valid);
+}
+
+FRAMEFILTER_TARGET_SSE41
+static FrameFilterRowStats filterRowSSE41(const FrameFilterParams& p, const FrameFilterRow& row)
+{
+	FrameFilterRowStats stats = { 0, 0 };
+	int i = 0;
+	for (; i + 8 <= row.count; i += 8)
+	{
+		filterStepSSE41(p, row, i, stats);
+		filterStepSSE41(p, row, i + 4, stats);
+	}
+	for (; i + 4 <= row.count; i += 4)
+		filterStepSSE41(p, row, i, stats);
+
+	FrameFilterRow tail = row;
+	tail.input += i;
+	tail.averagingSlot += i;
+	tail.averagingBase += i;
+	tail.sampleCount += i;
+	tail.sampleSum += i;
+	tail.sampleSumSq += i;
+	tail.valid += i;
+	tail.filtered += i;
+	tail.count = row.count - i;
+	FrameFilterRowStats tailStats = filterRowScalar(p, tail);
+	stats.numResets += tailStats.numResets;
+	stats.numUnstable += tailStats.numUnstable;
+	return stats;
+}
+
+FRAMEFILTER_TARGET_AVX2
+static inline void filterStepAVX2(const FrameFilterParams& p, const FrameFilterRow& row, int i, FrameFilterRowStats& stats)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	const __m256 numSlots = _mm256_set1_ps(static_cast<float>(p.numAveragingSlots));
+
+	__m256 newVal = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row.input + i))));
+	__m256 oldVal = _mm256_loadu_ps(row.averagingSlot + i);
+	__m256 count = _mm256_loadu_ps(row.sampleCount + i);
+	__m256 sum = _mm256_loadu_ps(row.sampleSum + i);
+	__m256 sumSq = _mm256_loadu_ps(row.sampleSumSq + i);
+	__m256 valid = _mm256_loadu_ps(row.valid + i);
+
+	// Pixels under the ceiling plane receive the new sample
+	__m256 under = _mm256_cmp_ps(newVal, _mm256_set1_ps(p.maxOffset), _CMP_GT_OQ);
+	_mm256_storeu_ps(row.averagingSlot + i, _mm256_blendv_ps(oldVal, newVal, under));
+
+	if (p.followBigChange)
+	{
+		__m256 oldFiltered = _mm256_div_ps(sum, count);
+		__m256 bigChange = _mm256_set1_ps(p.bigChange);
+		__m256 big = _mm256_or_ps(_mm256_cmp_ps(_mm256_sub_ps(oldFiltered, newVal), bigChange, _CMP_GE_OQ),
+			_mm256_cmp_ps(_mm256_sub_ps(newVal, oldFiltered), bigChange, _CMP_GE_OQ));
+		__m256 reset = _mm256_and_ps(_mm256_and_ps(under, _mm256_cmp_ps(count, _mm256_setzero_ps(), _CMP_GT_OQ)), big);
+		int resetMask = _mm256_movemask_ps(reset);
+		if (resetMask)
+		{
+			resetAveragingSlots(p, row, i, resetMask);
+			stats.numResets += countLanes(resetMask);
+			count = _mm256_blendv_ps(count, numSlots, reset);
+			sum = _mm256_blendv_ps(sum, _mm256_mul_ps(newVal, numSlots), reset);
+			sumSq = _mm256_blendv_ps(sumSq, _mm256_mul_ps(_mm256_mul_ps(newVal, newVal), numSlots), reset);
+		}
+	}
+
+	// Add the new sample and remove the one it replaces if that slot had been initiated
+	__m256 newCount = _mm256_add_ps(count, one);
+	__m256 newSum = _mm256_add_ps(sum, newVal);
+	__m256 newSumSq = _mm256_add_ps(sumSq, _mm256_mul_ps(newVal, newVal));
+	__m256 initiated = _mm256_cmp_ps(oldVal, _mm256_set1_ps(p.initialValue), _CMP_NEQ_UQ);
+	newCount = _mm256_blendv_ps(newCount, _mm256_sub_ps(newCount, one), initiated);
+	newSum = _mm256_blendv_ps(newSum, _mm256_sub_ps(newSum, oldVal), initiated);
+	newSumSq = _mm256_blendv_ps(newSumSq, _mm256_sub_ps(newSumSq, _mm256_mul_ps(oldVal, oldVal)), initiated);
+	count = _mm256_blendv_ps(count, newCount, under);
+	sum = _mm256_blendv_ps(sum, newSum, under);
+	sumSq = _mm256_blendv_ps(sumSq, newSumSq, under);
+	_mm256_storeu_ps(row.sampleCount + i, count);
+	_mm256_storeu_ps(row.sampleSum + i, sum);
+	_mm256_storeu_ps(row.sampleSumSq + i, sumSq);
+
+	// Stable pixels outside the hysteresis envelope take the running mean
+	__m256 stable = _mm256_and_ps(_mm256_cmp_ps(count, _mm256_set1_ps(static_cast<float>(p.minNumSamples)), _CMP_GE_OQ),
+		_mm256_cmp_ps(_mm256_mul_ps(sumSq, count),
+			_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(p.maxVariance), count), count), _mm256_mul_ps(sum, sum)), _CMP_LE_OQ));
+	stats.numUnstable += countLanes(~_mm256_movemask_ps(stable) & 0xff);
+	__m256 newFiltered = _mm256_div_ps(sum, count);
+	__m256 deviation = _mm256_andnot_ps(signMask, _mm256_sub_ps(newFiltered, valid));
+	__m256 update = _mm256_and_ps(stable, _mm256_cmp_ps(deviation, _mm256_set1_ps(p.hysteresis), _CMP_GE_OQ));
+	valid = _mm256_blendv_ps(valid, newFiltered, update);
+	_mm256_storeu_ps(row.valid + i, valid);
+	_mm256_storeu_ps(row.filtered + i, valid);
+}
+
+FRAMEFILTER_TARGET_AVX2
+static FrameFilterRowStats filterRowAVX2(const FrameFilterParams& p, const FrameFilterRow& row)
+{
+	FrameFilterRowStats stats = { 0, 0 };
+	int i = 0;
+	for (; i + 16 <= row.count; i += 16)
+	{
+		filterStepAVX2(p, row, i, stats);
+		filterStepAVX2(p, row, i + 8, stats);
+	}
+	for (; i + 8 <= row.count; i += 8)
+		filterStepAVX2(p, row, i, stats);
+
+	FrameFilterRow tail = row;
+	tail.input += i;
+	tail.averagingSlot += i;
+	tail.averagingBase += i;
+	tail.sampleCount += i;
+	tail.sampleSum += i;
+	tail.sampleSumSq += i;
+	tail.valid += i;
+	tail.filtered += i;
+	tail.count = row.count - i;
+	FrameFilterRowStats tailStats = filterRowScalar(p, tail);
+	stats.numResets += tailStats.numResets;
+	stats.numUnstable += tailStats.numUnstable;
+	return stats;
+}
+
+#endif // FRAMEFILTER_X86_SIMD
+
+FrameFilterKernelType detectFrameFilterKernel()
+{
+#if defined(FRAMEFILTER_X86_SIMD) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	bool avx2 = false;
+	if (osxsave && avx && (_xgetbv(0) & 6) == 6) // The OS saves the YMM registers
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+	if (avx2)
+		return FRAMEFILTER_KERNEL_AVX2;
+	if (sse41)
+		return FRAMEFILTER_KERNEL_SSE41;
+#elif defined(FRAMEFILTER_X86_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return FRAMEFILTER_KERNEL_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return FRAMEFILTER_KERNEL_SSE41;
+#endif
+	return FRAMEFILTER_KERNEL_SCALAR;
+}
+
+FrameFilterRowKernel getFrameFilterRowKernel(FrameFilterKernelType type)
+{
+#ifdef FRAMEFILTER_X86_SIMD
+	if (type == FRAMEFILTER_KERNEL_AVX2)
+		return filterRowAVX2;
+	if (type == FRAMEFILTER_KERNEL_SSE41)
+		return filterRowSSE41;
+#endif
+	return filterRowScalar;
+}
+
+const char* getFrameFilterKernelName(FrameFilterKernelType type)
+{
+	switch (type)
+	{
+	case FRAMEFILTER_KERNEL_AVX2:
+		return "AVX2";
+	case FRAMEFILTER_KERNEL_SSE41:
+		return "SSE4.1";
+	default:
+		return "scalar";
+	}
+}
+
+size_t getCompactRingStride(int numAveragingSlots)
+{
+	size_t stride = 1;
+	while (stride < static_cast<size_t>(numAveragingSlots))
+		stride *= 2;
+	return stride;
+}
+
+// Same stability and hysteresis rules as filterRowScalar, evaluated on exact integer statistics
+FrameFilterRowStats filterCompactRow(const FrameFilterParams& p, const FrameFilterCompactRow& row)
+{
+	FrameFilterRowStats stats = { 0, 0 };
+	const uint64_t numSlots = static_cast<uint64_t>(p.numAveragingSlots);
+	uint16_t* ring = row.ring;
+
+	for (int i = 0; i < row.count; ++i, ring += row.ringStride)
+	{
+		uint8_t& count = row.sampleCount[i];
+		uint32_t& sum = row.sampleSum[i];
+		uint64_t& sumSq = row.sampleSumSq[i];
+		uint64_t newVal = row.input[i];
+		uint64_t oldVal = ring[row.slot];
+
+		if (newVal > p.maxOffset)//we are under the ceiling plane
+		{
+			bool bigChange = false;
+			if (p.followBigChange && count > 0) { // Follow big changes
+				// |sum/count - newVal| >= bigChange without dividing
+				double diff = static_cast<double>(sum) - static_cast<double>(newVal) * count;
+				bigChange = std::abs(diff) >= static_cast<double>(p.bigChange) * count;
+			}
+			if (bigChange)
+			{
+				// The whole ring takes the new value and the statistics are recomputed from it
+				for (int s = 0; s < p.numAveragingSlots; s++)
+					ring[s] = static_cast<uint16_t>(newVal);
+				count = static_cast<uint8_t>(numSlots);
+				sum = static_cast<uint32_t>(newVal * numSlots);
+				sumSq = newVal * newVal * numSlots;
+				stats.numResets++;
+			}
+			else
+			{
+				ring[row.slot] = static_cast<uint16_t>(newVal); // Store the value
+				++count;
+				sum += static_cast<uint32_t>(newVal);
+				sumSq += newVal * newVal;
+				if (oldVal != 0) // The slot held a sample
+				{
+					--count;
+					sum -= static_cast<uint32_t>(oldVal);
+					sumSq -= oldVal * oldVal;
+				}
+			}
+		}
+		// Check if the pixel is "stable": count^2 * variance = count * sumSq - sum^2 (exact in 64 bit)
+		if (count >= p.minNumSamples &&
+			static_cast<double>(count * sumSq - static_cast<uint64_t>(sum) * sum) <= static_cast<double>(p.maxVariance) * count * count)
+		{
+			// Check if the new running mean is outside the previous value's envelope:
+			float newFiltered = static_cast<float>(static_cast<double>(sum) / count);
+			if (std::abs(newFiltered - row.valid[i]) >= p.hysteresis)
+			{
+				// Set the output pixel value to the depth-corrected running mean:
+				row.valid[i] = newFiltered;
+			}
+		}
+		else
+			stats.numUnstable++;
+		row.filtered[i] = row.valid[i];
+	}
+	return stats;
+}
+
+FrameFilterRowStats filterRecursiveRow(const FrameFilterParams& p, const FrameFilterRecursiveRow& row)
+{
+	FrameFilterRowStats stats = { 0, 0 };
+	// An exponential average with this gain has the same mean age of its samples as a ring of numAveragingSlots
+	const float gain = 2.0f / (p.numAveragingSlots + 1);
+
+	for (int i = 0; i < row.count; ++i)
+	{
+		float& mean = row.mean[i];
+		float& variance = row.variance[i];
+		uint16_t& count = row.sampleCount[i];
+		float newVal = static_cast<float>(row.input[i]);
+
+		if (newVal > p.maxOffset)//we are under the ceiling plane
+		{
+			float diff = newVal - mean;
+			if (count == 0)
+			{
+				mean = newVal;
+				variance = 0;
+				count = 1;
+			}
+			else if (p.followBigChange && std::abs(diff) >= p.bigChange)
+			{
+				// As the slot modes do, restart the estimate as if all slots held the new value
+				mean = newVal;
+				variance = 0;
+				count = static_cast<uint16_t>(p.numAveragingSlots);
+				stats.numResets++;
+			}
+			else
+			{
+				// Plain running average over the first samples so the estimate does not lean towards the first one
+				float a = std::max(gain, 1.0f / (count + 1));
+				mean += a * diff;
+				variance = (1 - a) * (variance + a * diff * diff);
+				if (count < UINT16_MAX)
+					++count;
+			}
+		}
+		// Check if the pixel is "stable":
+		if (count >= p.minNumSamples && variance <= p.maxVariance)
+		{
+			// Check if the new running mean is outside the previous value's envelope:
+			if (std::abs(mean - row.valid[i]) >= p.hysteresis)
+			{
+				// Set the output pixel value to the depth-corrected running mean:
+				row.valid[i] = mean;
+			}
+		}
+		else
+			stats.numUnstable++;
+		row.filtered[i] = row.valid[i];
+	}
+	return stats;
+}
+
+const char* getFrameFilterModeName(FrameFilterMode mode)
+{
+	switch (mode)
+	{
+	case FRAMEFILTER_MODE_COMPACT:
+		return "compact ring";
+	case FRAMEFILTER_MODE_RECURSIVE:
+		return "recursive estimate";
+	default:
+		return "float slots";
+	}
+}
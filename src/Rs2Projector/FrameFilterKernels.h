@@ -0,0 +1,125 @@
+/***********************************************************************
+FrameFilterKernels - Row kernels for the temporal depth filter of the
+Rs2Grabber: a scalar reference kernel and SSE4.1/AVX2 versions selected
+at runtime.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Layout of the temporal filter state
+enum FrameFilterMode
+{
+	FRAMEFILTER_MODE_SLOTS, // Slot-major float averaging buffer with float statistics
+	FRAMEFILTER_MODE_COMPACT, // Pixel-major ring of raw depth values with exact integer statistics
+	FRAMEFILTER_MODE_RECURSIVE // Exponentially weighted running mean and variance, numAveragingSlots only sets the time constant
+};
+
+const char* getFrameFilterModeName(FrameFilterMode mode);
+
+// Frame filter parameters shared by all pixels of a frame
+struct FrameFilterParams
+{
+	int numAveragingSlots; // Number of slots in each pixel's averaging buffer
+	size_t slotStride; // Distance (in floats) between two averaging slots of the same pixel
+	unsigned int minNumSamples; // Minimum number of valid samples needed to consider a pixel stable
+	float maxVariance; // Maximum variance to consider a pixel stable
+	float hysteresis; // Amount by which a new filtered value has to differ from the current value to update the display
+	float bigChange; // Amount of change over which the averaging slots are reset to the new value
+	float maxOffset; // Depth values below maxOffset are above the ceiling plane and ignored
+	float initialValue; // Value of an averaging slot that has not received a sample yet
+	bool followBigChange;
+};
+
+// Pointers to the first pixel of a run of consecutive pixels in one row
+struct FrameFilterRow
+{
+	const unsigned short* input; // Raw depth values
+	float* averagingSlot; // Averaging slot receiving the new depth values
+	float* averagingBase; // Averaging slot 0 of the same pixels
+	float* sampleCount; // Statistics planes: number of valid samples,
+	float* sampleSum; // sum of valid samples
+	float* sampleSumSq; // and sum of squares of valid samples
+	float* valid; // Most recent stable depth values
+	float* filtered; // Output depth values
+	int count; // Number of pixels in the run
+};
+
+// Compact state: each pixel owns ringStride consecutive raw depth values (0 = no sample yet)
+// and integer statistics that always equal the sums over its ring
+struct FrameFilterCompactRow
+{
+	const unsigned short* input; // Raw depth values
+	uint16_t* ring; // Ring of the first pixel of the run
+	size_t ringStride; // Distance (in values) between the rings of two neighbouring pixels
+	int slot; // Ring slot receiving the new depth values
+	uint8_t* sampleCount; // Number of valid samples,
+	uint32_t* sampleSum; // sum of valid samples
+	uint64_t* sampleSumSq; // and sum of squares of valid samples
+	float* valid; // Most recent stable depth values
+	float* filtered; // Output depth values
+	int count; // Number of pixels in the run
+};
+
+// Recursive state: constant size per pixel whatever the number of averaging slots
+struct FrameFilterRecursiveRow
+{
+	const unsigned short* input; // Raw depth values
+	float* mean; // Exponentially weighted mean
+	float* variance; // and variance of the valid samples
+	uint16_t* sampleCount; // Number of valid samples since the last reset (saturates)
+	float* valid; // Most recent stable depth values
+	float* filtered; // Output depth values
+	int count; // Number of pixels in the run
+};
+
+// Pixel counts of a run, summed into the frame statistics
+struct FrameFilterRowStats
+{
+	int numResets; // Pixels whose averaging slots followed a big change
+	int numUnstable; // Pixels failing the stability test (too few samples or too much variance)
+};
+
+typedef FrameFilterRowStats (*FrameFilterRowKernel)(const FrameFilterParams& params, const FrameFilterRow& row);
+
+enum FrameFilterKernelType
+{
+	FRAMEFILTER_KERNEL_SCALAR,
+	FRAMEFILTER_KERNEL_SSE41, // 4 pixels per vector, 8 per iteration
+	FRAMEFILTER_KERNEL_AVX2 // 8 pixels per vector, 16 per iteration
+};
+
+// The vectorized kernels produce bit-identical output to the scalar kernel
+FrameFilterRowStats filterRowScalar(const FrameFilterParams& params, const FrameFilterRow& row);
+
+// Best kernel supported by the CPU we are running on
+FrameFilterKernelType detectFrameFilterKernel();
+FrameFilterRowKernel getFrameFilterRowKernel(FrameFilterKernelType type);
+const char* getFrameFilterKernelName(FrameFilterKernelType type);
+
+FrameFilterRowStats filterCompactRow(const FrameFilterParams& params, const FrameFilterCompactRow& row);
+
+// Same stability test and hysteresis as the slot kernels on a recursive estimate with the time constant of an
+// average over numAveragingSlots frames
+FrameFilterRowStats filterRecursiveRow(const FrameFilterParams& params, const FrameFilterRecursiveRow& row);
+
+// Smallest power of two holding numAveragingSlots values, so a ring of up to 32 slots never straddles a 64 byte cache line
+size_t getCompactRingStride(int numAveragingSlots);
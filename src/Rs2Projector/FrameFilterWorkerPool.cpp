@@ -0,0 +1,143 @@
+/***********************************************************************
+FrameFilterWorkerPool - A small pool of worker threads used by the
+Rs2Grabber to run the stages of the depth filter chain on bands of rows
+(or columns) in parallel.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "FrameFilterWorkerPool.h"
+#include "Profiler.h"
+#include <algorithm>
+
+const int FrameFilterWorkerPool::MAX_THREADS;
+
+FrameFilterWorkerPool::FrameFilterWorkerPool()
+:numThreads(1),
+jobBand(nullptr),
+jobBegin(0),
+jobEnd(0),
+jobGeneration(0),
+jobPending(0),
+stopping(false)
+{
+}
+
+FrameFilterWorkerPool::~FrameFilterWorkerPool()
+{
+	stopWorkers();
+}
+
+int FrameFilterWorkerPool::getMaxThreads()
+{
+	int n = static_cast<int>(std::thread::hardware_concurrency());
+	return std::max(1, std::min(n, MAX_THREADS));
+}
+
+void FrameFilterWorkerPool::setNumThreads(int n)
+{
+	n = std::max(1, std::min(n, MAX_THREADS));
+	if (n == numThreads)
+		return;
+
+	stopWorkers();
+	numThreads = n;
+	stopping = false;
+	// Band 0 is always processed by the calling thread
+	for (int i = 1; i < numThreads; i++)
+		workers.push_back(std::thread(&FrameFilterWorkerPool::workerFunction, this, i, jobGeneration));
+}
+
+void FrameFilterWorkerPool::stopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		stopping = true;
+	}
+	jobStart.notify_all();
+	for (auto & worker : workers)
+		worker.join();
+	workers.clear();
+}
+
+void FrameFilterWorkerPool::run(int begin, int end, const BandFunction& band)
+{
+	if (end <= begin)
+		return;
+
+	if (numThreads == 1)
+	{
+		band(begin, end, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		jobBand = &band;
+		jobBegin = begin;
+		jobEnd = end;
+		jobPending = numThreads - 1;
+		jobGeneration++;
+	}
+	jobStart.notify_all();
+
+	int bandEnd = begin + (end - begin) / numThreads;
+	if (bandEnd > begin)
+		band(begin, bandEnd, 0);
+
+	std::unique_lock<std::mutex> lock(jobMutex);
+	jobDone.wait(lock, [this] { return jobPending == 0; });
+	jobBand = nullptr;
+}
+
+// startGeneration is the job generation when the worker was created, so a job started
+// before the worker thread gets scheduled is not missed
+void FrameFilterWorkerPool::workerFunction(int bandIndex, unsigned int startGeneration)
+{
+	unsigned int lastGeneration = startGeneration;
+	Profiler::setThreadName("Filter worker " + std::to_string(bandIndex));
+	while (true)
+	{
+		const BandFunction* band;
+		int bandBegin, bandEnd;
+		{
+			std::unique_lock<std::mutex> lock(jobMutex);
+			jobStart.wait(lock, [this, lastGeneration] { return stopping || jobGeneration != lastGeneration; });
+			if (stopping)
+				return;
+			lastGeneration = jobGeneration;
+			band = jobBand;
+			int n = jobEnd - jobBegin;
+			bandBegin = jobBegin + (n * bandIndex) / numThreads;
+			bandEnd = jobBegin + (n * (bandIndex + 1)) / numThreads;
+		}
+
+		if (bandEnd > bandBegin)
+		{
+			PROFILE_ZONE("Filter band");
+			(*band)(bandBegin, bandEnd, bandIndex);
+		}
+
+		bool last;
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			last = (--jobPending == 0);
+		}
+		if (last)
+			jobDone.notify_one();
+	}
+}
@@ -0,0 +1,72 @@
+/***********************************************************************
+FrameFilterWorkerPool - A small pool of worker threads used by the
+Rs2Grabber to run the stages of the depth filter chain on bands of rows
+(or columns) in parallel.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class FrameFilterWorkerPool
+{
+public:
+	// Largest number of threads (including the calling thread) a pool can use
+	static const int MAX_THREADS = 16;
+
+	// Work on one band: first index, one past the last index and band number
+	typedef std::function<void(int, int, int)> BandFunction;
+
+	FrameFilterWorkerPool();
+	~FrameFilterWorkerPool();
+
+	// Number of threads used by run(), including the calling thread. 1 means everything runs on the caller.
+	void setNumThreads(int n);
+	int getNumThreads() const
+	{
+		return numThreads;
+	}
+
+	// Number of threads the hardware can run concurrently (clamped to MAX_THREADS)
+	static int getMaxThreads();
+
+	// Split [begin, end) into getNumThreads() consecutive bands and call band() once per non empty band.
+	// The calling thread processes band 0 and the call returns when all bands are done.
+	void run(int begin, int end, const BandFunction& band);
+
+private:
+	void workerFunction(int bandIndex, unsigned int startGeneration);
+	void stopWorkers();
+
+	int numThreads;
+	std::vector<std::thread> workers;
+
+	std::mutex jobMutex;
+	std::condition_variable jobStart;
+	std::condition_variable jobDone;
+	const BandFunction* jobBand; // Job currently being executed
+	int jobBegin, jobEnd;
+	unsigned int jobGeneration; // Incremented for each new job, tells the workers there is work to do
+	int jobPending; // Number of workers that have not finished the current job
+	bool stopping;
+};
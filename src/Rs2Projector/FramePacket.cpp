@@ -0,0 +1,95 @@
+/***********************************************************************
+FramePacket - Everything the grabber produces for one depth frame, and
+the lock-free triple buffer handing the latest packet from the grabber
+thread to the main thread.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "FramePacket.h"
+
+const uint8_t FramePacketBuffer::FRESH;
+
+FramePacket::FramePacket()
+:sequence(0),
+timestamp(0),
+stabilized(false),
+gradientCols(0),
+gradientRows(0),
+gradientResolution(0),
+hasDerivatives(false),
+hasElevation(false),
+hasOccluders(false)
+{
+}
+
+void FramePacket::allocate(int width, int height, int sgradientCols, int sgradientRows)
+{
+	if (depth.getWidth() != width || depth.getHeight() != height)
+	{
+		depth.allocate(width, height, 1);
+		depth.set(0);
+		elevation.allocate(width, height, 1);
+		elevation.set(0);
+		color.allocate(width, height, 3);
+		color.set(0);
+		occluders.allocate(width, height, 1);
+		occluders.set(0);
+		dirtyTiles.setup(width, height);
+		dirtyTiles.markAll();
+	}
+	if (gradientCols != sgradientCols || gradientRows != sgradientRows)
+	{
+		gradientCols = sgradientCols;
+		gradientRows = sgradientRows;
+		gradient.assign(gradientCols * gradientRows, ofVec2f(0));
+	}
+}
+
+FramePacketBuffer::FramePacketBuffer()
+:middle(1),
+writeIndex(0),
+readIndex(2),
+numDropped(0)
+{
+}
+
+void FramePacketBuffer::allocate(int width, int height, int gradientCols, int gradientRows)
+{
+	for (int i = 0; i < 3; i++)
+		packets[i].allocate(width, height, gradientCols, gradientRows);
+}
+
+bool FramePacketBuffer::publish()
+{
+	// Release the write packet to the reader and take back the one in the middle
+	uint8_t previous = middle.exchange(writeIndex | FRESH, std::memory_order_acq_rel);
+	writeIndex = previous & 3;
+	bool dropped = (previous & FRESH) != 0;
+	if (dropped)
+		numDropped.fetch_add(1, std::memory_order_relaxed);
+	return dropped;
+}
+
+bool FramePacketBuffer::acquireLatest()
+{
+	if ((middle.load(std::memory_order_relaxed) & FRESH) == 0)
+		return false;
+	uint8_t previous = middle.exchange(readIndex, std::memory_order_acq_rel);
+	readIndex = previous & 3;
+	return true;
+}
@@ -0,0 +1,111 @@
+/***********************************************************************
+FramePacket - Everything the grabber produces for one depth frame, and
+the lock-free triple buffer handing the latest packet from the grabber
+thread to the main thread.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include "ofMain.h"
+#include "TerrainDerivatives.h"
+#include "ElevationPyramid.h"
+#include "DirtyTiles.h"
+#include "LatencyTracer.h"
+
+struct FramePacket
+{
+	FramePacket();
+
+	// Allocate the buffers. Does nothing when they already have these sizes, so it can be called for every frame.
+	void allocate(int width, int height, int gradientCols, int gradientRows);
+
+	uint64_t sequence; // Number of the depth frame, starting at 1
+	uint64_t timestamp; // Capture time in microseconds (ofGetElapsedTimeMicros)
+	bool stabilized; // The temporal filter had enough frames to be trusted
+
+	ofFloatPixels depth; // Filtered depth frame
+	ofPixels color; // Registered color frame
+
+	std::vector<ofVec2f> gradient; // Gradient field, gradientCols x gradientRows cells of gradientResolution pixels
+	int gradientCols, gradientRows, gradientResolution;
+
+	TerrainDerivatives derivatives; // Only valid when hasDerivatives is set
+	bool hasDerivatives;
+
+	// Elevation of each pixel above the base plane (Rs2Projector::elevationAtrs2Coord()) and its coarse levels,
+	// measured with elevationWorldMatrix and elevationBasePlaneEq. Only valid when hasElevation is set
+	ofFloatPixels elevation;
+	ElevationPyramid elevationPyramid;
+	ofMatrix4x4 elevationWorldMatrix;
+	ofVec4f elevationBasePlaneEq;
+	bool hasElevation;
+
+	ofPixels occluders; // Hands and objects above the sand (255), the depth keeps the sand under them. Only valid when hasOccluders is set
+	bool hasOccluders;
+
+	// Tiles changed since the last packet the reader got (includes the changes of the packets it never saw)
+	DirtyTiles dirtyTiles;
+
+	// Times the frame went through the checkpoints of the grabber, the main thread adds its own
+	LatencyStamps latency;
+};
+
+// Single producer, single consumer triple buffer with latest-wins semantics. The writer fills its packet and
+// publishes it, the reader takes the most recently published packet. Neither side ever waits, the three packets
+// are allocated once and each packet belongs to exactly one side at a time so there are no torn reads.
+class FramePacketBuffer
+{
+public:
+	FramePacketBuffer();
+
+	// Allocate the three packets before the threads start
+	void allocate(int width, int height, int gradientCols, int gradientRows);
+
+	// Writer side: packet to fill, owned by the writer until publish()
+	FramePacket& getWritePacket(){
+		return packets[writeIndex];
+	}
+
+	// Make the write packet the latest one. Returns true if the previous packet was replaced before the reader got it,
+	// false if the reader has taken it.
+	bool publish();
+
+	// Reader side: take the latest packet if one was published since the last call
+	bool acquireLatest();
+
+	// Packet owned by the reader, stays valid until the next acquireLatest()
+	const FramePacket& getReadPacket() const{
+		return packets[readIndex];
+	}
+
+	// Number of packets replaced before the reader got them
+	uint64_t getNumDropped() const{
+		return numDropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	static const uint8_t FRESH = 4; // Set in middle when it holds a packet the reader has not taken yet
+
+	FramePacket packets[3];
+	std::atomic<uint8_t> middle; // Index of the packet between the two sides, plus the FRESH flag
+	uint8_t writeIndex;
+	uint8_t readIndex;
+	std::atomic<uint64_t> numDropped;
+};
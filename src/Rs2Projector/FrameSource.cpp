@@ -0,0 +1,295 @@
+/***********************************************************************
+FrameSource - Interface of the depth and color frame providers of the
+Rs2Grabber (RealSense, Kinect, recorded session or synthetic frames).
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "FrameSource.h"
+#include "SandboxFrameSource.h"
+
+// Matrix of a pinhole camera: the world direction of pixel (x, y) is ((x - cx) / fx, (y - cy) / fy, 1).
+// Built from two unprojected points, the same way for all the cameras.
+static ofMatrix4x4 worldMatrixFromPoints(const ofVec3f& a, const ofVec3f& b)
+{
+	return ofMatrix4x4(b.x - a.x, 0, 0, a.x,
+		0, b.y - a.y, 0, a.y,
+		0, 0, 0, 1,
+		0, 0, 0, 1);
+}
+
+//--------------------------------------------------------------
+RealSenseFrameSource::RealSenseFrameSource()
+:opened(false),
+timestamp(0)
+{
+	rs2.init();
+	rs2.setRegistration(true); // To have correspondance between RGB and depth images
+	rs2.setUseTexture(false);
+	width = rs2.getWidth();
+	height = rs2.getHeight();
+	depth.allocate(width, height, 1);
+	depth.set(0);
+	color.allocate(width, height, 3);
+	color.set(0);
+}
+
+bool RealSenseFrameSource::open()
+{
+	opened = rs2.open();
+	return opened;
+}
+
+void RealSenseFrameSource::close()
+{
+	rs2.close();
+	opened = false;
+}
+
+bool RealSenseFrameSource::poll()
+{
+	rs2.update();
+	if (!rs2.isFrameNew())
+		return false;
+	timestamp = ofGetElapsedTimeMicros();
+	depth = rs2.getRawDepthPixels();
+	color = rs2.getPixels();
+	return true;
+}
+
+ofMatrix4x4 RealSenseFrameSource::getWorldMatrix()
+{
+	if (!opened)
+		return ofMatrix4x4();
+	ofVec3f a = rs2.getWorldCoordinateAt(0, 0, 1);// Trick to access rs2 internal parameters without having to modify ofxRealSense2
+	ofVec3f b = rs2.getWorldCoordinateAt(1, 1, 1);
+	ofLogVerbose("RealSenseFrameSource") << "getWorldMatrix(): Computing rs2 world matrix";
+	return worldMatrixFromPoints(a, b);
+}
+
+//--------------------------------------------------------------
+KinectFrameSource::KinectFrameSource()
+:opened(false),
+timestamp(0)
+{
+	kinect.init();
+	kinect.setRegistration(true); // To have correspondance between RGB and depth images
+	kinect.setUseTexture(false);
+	width = kinect.getWidth();
+	height = kinect.getHeight();
+	depth.allocate(width, height, 1);
+	depth.set(0);
+	color.allocate(width, height, 3);
+	color.set(0);
+}
+
+bool KinectFrameSource::open()
+{
+	opened = kinect.open();
+	return opened;
+}
+
+void KinectFrameSource::close()
+{
+	kinect.close();
+	opened = false;
+}
+
+bool KinectFrameSource::poll()
+{
+	kinect.update();
+	if (!kinect.isFrameNew())
+		return false;
+	timestamp = ofGetElapsedTimeMicros();
+	depth = kinect.getRawDepthPixels();
+	color = kinect.getPixels();
+	return true;
+}
+
+ofMatrix4x4 KinectFrameSource::getWorldMatrix()
+{
+	if (!opened)
+		return ofMatrix4x4();
+	ofVec3f a = kinect.getWorldCoordinateAt(0, 0, 1);// Trick to access kinect internal parameters without having to modify ofxKinect
+	ofVec3f b = kinect.getWorldCoordinateAt(1, 1, 1);
+	ofLogVerbose("KinectFrameSource") << "getWorldMatrix(): Computing kinect world matrix";
+	return worldMatrixFromPoints(a, b);
+}
+
+//--------------------------------------------------------------
+ReplayFrameSource::ReplayFrameSource(std::shared_ptr<SessionPlayer> splayer)
+:player(splayer),
+timestamp(0),
+recordedTimestamp(0)
+{
+}
+
+bool ReplayFrameSource::open()
+{
+	return isOpen();
+}
+
+void ReplayFrameSource::close()
+{
+	player.reset();
+}
+
+bool ReplayFrameSource::poll()
+{
+	if (!isOpen() || !player->update(depth, color, recordedTimestamp))
+		return false;
+	timestamp = ofGetElapsedTimeMicros();
+	return true;
+}
+
+ofMatrix4x4 ReplayFrameSource::getWorldMatrix()
+{
+	return isOpen() ? player->getWorldMatrix() : ofMatrix4x4();
+}
+
+int ReplayFrameSource::getWidth() const
+{
+	return isOpen() ? player->getWidth() : 0;
+}
+
+int ReplayFrameSource::getHeight() const
+{
+	return isOpen() ? player->getHeight() : 0;
+}
+
+//--------------------------------------------------------------
+SyntheticFrameSource::SyntheticFrameSource(int swidth, int sheight, float sfps)
+:width(swidth),
+height(sheight),
+fps(sfps),
+horizontalFov(87), // RealSense D4xx depth field of view
+timestamp(0),
+frameNumber(0),
+opened(false),
+nextFrameTime(0)
+{
+	depth.allocate(width, height, 1);
+	depth.set(0);
+	color.allocate(width, height, 3);
+	color.set(0);
+}
+
+bool SyntheticFrameSource::open()
+{
+	opened = true;
+	frameNumber = 0;
+	nextFrameTime = ofGetElapsedTimeMicros();
+	return true;
+}
+
+void SyntheticFrameSource::close()
+{
+	opened = false;
+}
+
+bool SyntheticFrameSource::poll()
+{
+	if (!opened)
+		return false;
+	uint64_t now = ofGetElapsedTimeMicros();
+	if (fps > 0)
+	{
+		if (now < nextFrameTime)
+			return false;
+		// Keep the pace without trying to catch up on missed frames
+		uint64_t period = static_cast<uint64_t>(1000000.0f / fps);
+		nextFrameTime += period;
+		if (nextFrameTime < now)
+			nextFrameTime = now + period;
+	}
+	timestamp = now;
+	generateFrame();
+	frameNumber++;
+	return true;
+}
+
+ofMatrix4x4 SyntheticFrameSource::getWorldMatrix()
+{
+	float f = 0.5f * width / tanf(ofDegToRad(0.5f * horizontalFov));
+	ofVec3f a(-0.5f * width / f, -0.5f * height / f, 1);
+	ofVec3f b((1 - 0.5f * width) / f, (1 - 0.5f * height) / f, 1);
+	return worldMatrixFromPoints(a, b);
+}
+
+// A plane 1 m away tilted by 2 degrees, with three hills rising slowly so the frames are not all identical
+void SyntheticFrameSource::generateFrame()
+{
+	const float distance = 1000;
+	const float tilt = tanf(ofDegToRad(2.0f));
+	const float hillX[3] = { 0.3f, 0.65f, 0.5f };
+	const float hillY[3] = { 0.35f, 0.6f, 0.25f };
+	const float hillRadius[3] = { 0.12f, 0.18f, 0.08f };
+	float growth = 0.5f + 0.5f * sinf(frameNumber * 0.01f);
+
+	uint16_t* depthPtr = depth.getData();
+	unsigned char* colorPtr = color.getData();
+	for (int y = 0; y < height; y++)
+	{
+		float v = static_cast<float>(y) / height;
+		for (int x = 0; x < width; x++)
+		{
+			float u = static_cast<float>(x) / width;
+			float elevation = 0;
+			for (int i = 0; i < 3; i++)
+			{
+				float du = (u - hillX[i]) / hillRadius[i];
+				float dv = (v - hillY[i]) / hillRadius[i];
+				elevation += 80.0f * growth * expf(-0.5f * (du * du + dv * dv));
+			}
+			float z = distance + tilt * (x - 0.5f * width) - elevation;
+			*depthPtr++ = static_cast<uint16_t>(z + 0.5f);
+			unsigned char shade = static_cast<unsigned char>(ofClamp(120 + elevation, 0, 255));
+			*colorPtr++ = shade;
+			*colorPtr++ = shade;
+			*colorPtr++ = shade;
+		}
+	}
+}
+
+//--------------------------------------------------------------
+std::shared_ptr<FrameSource> createFrameSource(FrameSourceType type)
+{
+	switch (type)
+	{
+	case FRAMESOURCE_KINECT:
+		return std::make_shared<KinectFrameSource>();
+	case FRAMESOURCE_SYNTHETIC:
+		return std::make_shared<SandboxFrameSource>();
+	case FRAMESOURCE_REALSENSE:
+	default:
+		return std::make_shared<RealSenseFrameSource>();
+	}
+}
+
+std::string getFrameSourceTypeName(FrameSourceType type)
+{
+	switch (type)
+	{
+	case FRAMESOURCE_KINECT:
+		return "Kinect";
+	case FRAMESOURCE_SYNTHETIC:
+		return "Synthetic";
+	case FRAMESOURCE_REALSENSE:
+	default:
+		return "RealSense";
+	}
+}
@@ -0,0 +1,252 @@
+/***********************************************************************
+FrameSource - Interface of the depth and color frame providers of the
+Rs2Grabber (RealSense, Kinect, recorded session or synthetic frames).
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "ofxKinect.h"
+#include "ofxRealSense2.h"
+#include "SessionRecording.h"
+
+enum FrameSourceType
+{
+	FRAMESOURCE_REALSENSE,
+	FRAMESOURCE_KINECT,
+	FRAMESOURCE_SYNTHETIC
+};
+
+class FrameSource
+{
+public:
+	virtual ~FrameSource() {}
+
+	virtual bool open() = 0;
+	virtual void close() = 0;
+	virtual bool isOpen() const = 0;
+
+	// Check for a new frame. When it returns true the depth, color and timestamp are those of the new frame.
+	virtual bool poll() = 0;
+
+	// Raw depth in mm (0 = no measure) and RGB color registered to the depth, width x height.
+	// Owned by the source, valid until the next poll().
+	virtual const ofShortPixels& getDepthPixels() const = 0;
+	virtual const ofPixels& getColorPixels() const = 0;
+
+	// Capture time of the last frame in microseconds, on the ofGetElapsedTimeMicros() clock
+	virtual uint64_t getTimestamp() const = 0;
+
+	// Intrinsics as the matrix mapping (x, y, 1, 1) to the world direction of the pixel (see Rs2Projector::rs2CoordToWorldCoord)
+	virtual ofMatrix4x4 getWorldMatrix() = 0;
+
+	virtual int getWidth() const = 0;
+	virtual int getHeight() const = 0;
+	virtual std::string getName() const = 0;
+
+	// Cameras are polled continuously, the grabber sleeps between the polls of the other sources
+	virtual bool isLive() const{
+		return false;
+	}
+};
+
+// Intel RealSense through ofxRealSense2
+class RealSenseFrameSource : public FrameSource
+{
+public:
+	RealSenseFrameSource();
+
+	bool open() override;
+	void close() override;
+	bool isOpen() const override{
+		return opened;
+	}
+	bool poll() override;
+	const ofShortPixels& getDepthPixels() const override{
+		return depth;
+	}
+	const ofPixels& getColorPixels() const override{
+		return color;
+	}
+	uint64_t getTimestamp() const override{
+		return timestamp;
+	}
+	ofMatrix4x4 getWorldMatrix() override;
+	int getWidth() const override{
+		return width;
+	}
+	int getHeight() const override{
+		return height;
+	}
+	std::string getName() const override{
+		return "RealSense";
+	}
+	bool isLive() const override{
+		return true;
+	}
+
+private:
+	ofxRealSense2 rs2;
+	bool opened;
+	int width, height;
+	ofShortPixels depth;
+	ofPixels color;
+	uint64_t timestamp;
+};
+
+// Microsoft Kinect (v1) through ofxKinect
+class KinectFrameSource : public FrameSource
+{
+public:
+	KinectFrameSource();
+
+	bool open() override;
+	void close() override;
+	bool isOpen() const override{
+		return opened;
+	}
+	bool poll() override;
+	const ofShortPixels& getDepthPixels() const override{
+		return depth;
+	}
+	const ofPixels& getColorPixels() const override{
+		return color;
+	}
+	uint64_t getTimestamp() const override{
+		return timestamp;
+	}
+	ofMatrix4x4 getWorldMatrix() override;
+	int getWidth() const override{
+		return width;
+	}
+	int getHeight() const override{
+		return height;
+	}
+	std::string getName() const override{
+		return "Kinect";
+	}
+	bool isLive() const override{
+		return true;
+	}
+
+private:
+	ofxKinect kinect;
+	bool opened;
+	int width, height;
+	ofShortPixels depth;
+	ofPixels color;
+	uint64_t timestamp;
+};
+
+// Frames of a recorded session (see SessionRecording.h)
+class ReplayFrameSource : public FrameSource
+{
+public:
+	ReplayFrameSource(std::shared_ptr<SessionPlayer> player);
+
+	bool open() override;
+	void close() override;
+	bool isOpen() const override{
+		return player && player->isOpen();
+	}
+	bool poll() override;
+	const ofShortPixels& getDepthPixels() const override{
+		return depth;
+	}
+	const ofPixels& getColorPixels() const override{
+		return color;
+	}
+	uint64_t getTimestamp() const override{
+		return timestamp;
+	}
+	ofMatrix4x4 getWorldMatrix() override;
+	int getWidth() const override;
+	int getHeight() const override;
+	std::string getName() const override{
+		return "Replay";
+	}
+
+	// Timestamp the frame was recorded with
+	uint64_t getRecordedTimestamp() const{
+		return recordedTimestamp;
+	}
+
+private:
+	std::shared_ptr<SessionPlayer> player;
+	ofShortPixels depth;
+	ofPixels color;
+	uint64_t timestamp;
+	uint64_t recordedTimestamp;
+};
+
+// Computed frames of a tilted plane with a few hills, at any size and frame rate (0 = a frame at every poll)
+class SyntheticFrameSource : public FrameSource
+{
+public:
+	SyntheticFrameSource(int width = 640, int height = 480, float fps = 30);
+
+	bool open() override;
+	void close() override;
+	bool isOpen() const override{
+		return opened;
+	}
+	bool poll() override;
+	const ofShortPixels& getDepthPixels() const override{
+		return depth;
+	}
+	const ofPixels& getColorPixels() const override{
+		return color;
+	}
+	uint64_t getTimestamp() const override{
+		return timestamp;
+	}
+	ofMatrix4x4 getWorldMatrix() override;
+	int getWidth() const override{
+		return width;
+	}
+	int getHeight() const override{
+		return height;
+	}
+	std::string getName() const override{
+		return "Synthetic";
+	}
+
+	uint64_t getFrameNumber() const{
+		return frameNumber;
+	}
+
+protected:
+	// Fill depth and color for the current frame number
+	virtual void generateFrame();
+
+	int width, height;
+	float fps;
+	float horizontalFov; // Degrees, used for the intrinsics
+	ofShortPixels depth;
+	ofPixels color;
+	uint64_t timestamp;
+	uint64_t frameNumber;
+
+private:
+	bool opened;
+	uint64_t nextFrameTime;
+};
+
+std::shared_ptr<FrameSource> createFrameSource(FrameSourceType type);
+std::string getFrameSourceTypeName(FrameSourceType type);
@@ -0,0 +1,185 @@
+/***********************************************************************
+LatencyTracer - Time stamps of a depth frame from its acquisition to the
+projector window, with rolling percentiles of each stage.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "LatencyTracer.h"
+
+const int LatencyTracer::NUM_STAGES;
+
+void LatencyStamps::clear()
+{
+	sequence = 0;
+	for (int i = 0; i < LATENCY_NUM_CHECKPOINTS; i++)
+		time[i] = 0;
+}
+
+LatencyTracer::LatencyTracer()
+:windowSize(0),
+refreshInterval(1),
+lastRefresh(0),
+logInterval(10),
+lastLog(0)
+{
+	for (int s = 0; s < NUM_STAGES; s++)
+	{
+		numSamples[s] = 0;
+		nextSample[s] = 0;
+		percentiles[s] = { 0, 0, 0, 0 };
+	}
+}
+
+LatencyTracer::~LatencyTracer()
+{
+	if (logFile.is_open())
+		logFile.close();
+}
+
+void LatencyTracer::setup(int swindowSize, float srefreshInterval)
+{
+	windowSize = std::max(1, swindowSize);
+	refreshInterval = srefreshInterval;
+	for (int s = 0; s < NUM_STAGES; s++)
+	{
+		samples[s].assign(windowSize, 0);
+		numSamples[s] = 0;
+		nextSample[s] = 0;
+		percentiles[s] = { 0, 0, 0, 0 };
+	}
+	sortScratch.resize(windowSize);
+}
+
+bool LatencyTracer::setLogFile(const std::string& path, float slogInterval)
+{
+	if (logFile.is_open())
+		logFile.close();
+	logInterval = slogInterval;
+	if (path.empty())
+		return true;
+
+	logFile.open(path.c_str(), std::ios::out | std::ios::app);
+	if (!logFile.is_open())
+	{
+		ofLogError("LatencyTracer") << "setLogFile(): Could not open " << path;
+		return false;
+	}
+	// One line per interval: time, then p50, p95 and p99 (ms) of each stage
+	logFile << "time";
+	for (int s = 0; s < NUM_STAGES; s++)
+		logFile << "," << getStageName(s) << "_p50," << getStageName(s) << "_p95," << getStageName(s) << "_p99";
+	logFile << std::endl;
+	lastLog = ofGetElapsedTimef();
+	ofLogVerbose("LatencyTracer") << "setLogFile(): Logging latencies to " << path;
+	return true;
+}
+
+void LatencyTracer::record(const LatencyStamps& stamps)
+{
+	if (windowSize == 0)
+		return;
+
+	// A stage is measured from the last checkpoint the frame reached before it
+	int previous = -1;
+	for (int c = 0; c < LATENCY_NUM_CHECKPOINTS; c++)
+	{
+		if (stamps.time[c] == 0)
+			continue;
+		if (previous >= 0 && stamps.time[c] >= stamps.time[previous])
+		{
+			samples[c][nextSample[c]] = (stamps.time[c] - stamps.time[previous]) / 1000.0f;
+			nextSample[c] = (nextSample[c] + 1) % windowSize;
+			numSamples[c] = std::min(numSamples[c] + 1, windowSize);
+		}
+		previous = c;
+	}
+
+	if (stamps.has(LATENCY_CAPTURED) && stamps.has(LATENCY_PROJECTED) && stamps.time[LATENCY_PROJECTED] >= stamps.time[LATENCY_CAPTURED])
+	{
+		samples[0][nextSample[0]] = (stamps.time[LATENCY_PROJECTED] - stamps.time[LATENCY_CAPTURED]) / 1000.0f;
+		nextSample[0] = (nextSample[0] + 1) % windowSize;
+		numSamples[0] = std::min(numSamples[0] + 1, windowSize);
+	}
+}
+
+void LatencyTracer::update()
+{
+	float now = ofGetElapsedTimef();
+	if (now - lastRefresh >= refreshInterval)
+	{
+		lastRefresh = now;
+		computePercentiles();
+	}
+	if (logFile.is_open() && now - lastLog >= logInterval)
+	{
+		lastLog = now;
+		computePercentiles();
+		writeLog();
+	}
+}
+
+void LatencyTracer::computePercentiles()
+{
+	for (int s = 0; s < NUM_STAGES; s++)
+	{
+		int n = numSamples[s];
+		percentiles[s].count = n;
+		if (n == 0)
+		{
+			percentiles[s].p50 = percentiles[s].p95 = percentiles[s].p99 = 0;
+			continue;
+		}
+		std::copy(samples[s].begin(), samples[s].begin() + n, sortScratch.begin());
+		auto begin = sortScratch.begin();
+		auto end = sortScratch.begin() + n;
+		// Increasing ranks, each nth_element only reorders the part after the previous one
+		int i50 = (n - 1) * 50 / 100;
+		int i95 = (n - 1) * 95 / 100;
+		int i99 = (n - 1) * 99 / 100;
+		std::nth_element(begin, begin + i50, end);
+		percentiles[s].p50 = sortScratch[i50];
+		std::nth_element(begin + i50, begin + i95, end);
+		percentiles[s].p95 = sortScratch[i95];
+		std::nth_element(begin + i95, begin + i99, end);
+		percentiles[s].p99 = sortScratch[i99];
+	}
+}
+
+void LatencyTracer::writeLog()
+{
+	logFile << ofToString(ofGetElapsedTimef(), 1);
+	for (int s = 0; s < NUM_STAGES; s++)
+		logFile << "," << percentiles[s].p50 << "," << percentiles[s].p95 << "," << percentiles[s].p99;
+	logFile << std::endl;
+}
+
+std::string LatencyTracer::getStageName(int stage)
+{
+	switch (stage)
+	{
+	case 0: return "total";
+	case LATENCY_FILTERED: return "filter";
+	case LATENCY_PROCESSED: return "derivatives";
+	case LATENCY_PUBLISHED: return "publish";
+	case LATENCY_RECEIVED: return "queue";
+	case LATENCY_UPLOADED: return "upload";
+	case LATENCY_RENDERED: return "render";
+	case LATENCY_PROJECTED: return "projector";
+	default: return "";
+	}
+}
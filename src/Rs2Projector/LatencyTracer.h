@@ -0,0 +1,115 @@
+/***********************************************************************
+LatencyTracer - Time stamps of a depth frame from its acquisition to the
+projector window, with rolling percentiles of each stage.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <fstream>
+#include "ofMain.h"
+
+// Points a frame goes through, in order
+enum LatencyCheckpoint
+{
+	LATENCY_CAPTURED, // Frame got from the camera (grabber thread)
+	LATENCY_FILTERED, // Temporal and spatial filters done
+	LATENCY_PROCESSED, // Dirty tiles, gradient field and derivatives done
+	LATENCY_PUBLISHED, // Frame packet handed to the main thread
+	LATENCY_RECEIVED, // Packet taken by Rs2Projector::update()
+	LATENCY_UPLOADED, // Depth texture updated
+	LATENCY_RENDERED, // SandSurfaceRenderer::drawSandbox() done
+	LATENCY_PROJECTED, // Projector window drawn (before the buffer swap)
+	LATENCY_NUM_CHECKPOINTS
+};
+
+// Times (ofGetElapsedTimeMicros) a frame reached each checkpoint, 0 if it did not
+struct LatencyStamps
+{
+	uint64_t sequence;
+	uint64_t time[LATENCY_NUM_CHECKPOINTS];
+
+	LatencyStamps(){
+		clear();
+	}
+
+	void clear();
+
+	void mark(LatencyCheckpoint checkpoint){
+		time[checkpoint] = ofGetElapsedTimeMicros();
+	}
+
+	bool has(LatencyCheckpoint checkpoint) const{
+		return time[checkpoint] != 0;
+	}
+};
+
+struct LatencyPercentiles
+{
+	float p50, p95, p99; // ms
+	int count; // Samples in the window
+};
+
+class LatencyTracer
+{
+public:
+	// Stage 0 is the whole latency (captured to projected), stage i > 0 the time from the previous reached checkpoint to checkpoint i
+	static const int NUM_STAGES = LATENCY_NUM_CHECKPOINTS;
+
+	LatencyTracer();
+	~LatencyTracer();
+
+	// Percentiles over the last windowSize frames, refreshed every refreshInterval seconds
+	void setup(int windowSize, float refreshInterval);
+
+	// Append the percentiles to a log file every logInterval seconds (an empty path stops the log)
+	bool setLogFile(const std::string& path, float logInterval);
+
+	bool isLogging() const{
+		return logFile.is_open();
+	}
+
+	// Add the stage durations of a projected frame
+	void record(const LatencyStamps& stamps);
+
+	// Refresh the percentiles and write the log when due, called once per frame
+	void update();
+
+	const LatencyPercentiles& getPercentiles(int stage) const{
+		return percentiles[stage];
+	}
+
+	static std::string getStageName(int stage);
+
+private:
+	void computePercentiles();
+	void writeLog();
+
+	int windowSize;
+	std::vector<float> samples[NUM_STAGES]; // Rolling windows of durations (ms)
+	int numSamples[NUM_STAGES];
+	int nextSample[NUM_STAGES];
+	std::vector<float> sortScratch;
+	LatencyPercentiles percentiles[NUM_STAGES];
+	float refreshInterval;
+	float lastRefresh;
+
+	std::ofstream logFile;
+	float logInterval;
+	float lastLog;
+};
@@ -0,0 +1,271 @@
+/***********************************************************************
+Metrics - Registry of counters, gauges and histograms written periodically
+as Prometheus text and CSV files.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "Metrics.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "ofMain.h"
+#include "FileUtils.h"
+
+// The CSV history is rolled over to <name>.1.csv past this size, so at most twice as much is kept
+static const std::streamoff maxCsvBytes = 16 << 20;
+
+namespace
+{
+	std::string formatValue(double v)
+	{
+		std::ostringstream s;
+		s.precision(12);
+		s << v;
+		return s.str();
+	}
+
+	std::string formatBound(const std::vector<double>& bounds, size_t i)
+	{
+		return i < bounds.size() ? formatValue(bounds[i]) : std::string("+Inf");
+	}
+}
+
+MetricHistogram::MetricHistogram(const std::vector<double>& sbounds)
+:bounds(sbounds),
+bucketCounts(sbounds.size() + 1, 0),
+count(0),
+sum(0)
+{
+	std::sort(bounds.begin(), bounds.end());
+}
+
+void MetricHistogram::observe(double v)
+{
+	size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), v) - bounds.begin();
+	std::lock_guard<std::mutex> guard(lock);
+	bucketCounts[bucket]++;
+	count++;
+	sum += v;
+}
+
+void MetricHistogram::getSnapshot(std::vector<uint64_t>& cumulativeCounts, uint64_t& scount, double& ssum) const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	cumulativeCounts.resize(bucketCounts.size());
+	uint64_t total = 0;
+	for (size_t i = 0; i < bucketCounts.size(); i++)
+	{
+		total += bucketCounts[i];
+		cumulativeCounts[i] = total;
+	}
+	scount = count;
+	ssum = sum;
+}
+
+MetricTimer::MetricTimer(MetricHistogram& shistogram)
+:histogram(shistogram),
+start(ofGetElapsedTimeMicros())
+{
+}
+
+MetricTimer::~MetricTimer()
+{
+	histogram.observe((ofGetElapsedTimeMicros() - start) / 1e6);
+}
+
+MetricsRegistry& MetricsRegistry::get()
+{
+	static MetricsRegistry registry;
+	return registry;
+}
+
+MetricsRegistry::MetricsRegistry()
+:outputInterval(0),
+lastOutput(0)
+{
+}
+
+MetricsRegistry::Metric* MetricsRegistry::getOrCreate(const std::string& name, const std::string& help, MetricType type)
+{
+	for (auto& metric : metrics)
+	{
+		if (metric->name != name)
+			continue;
+		if (metric->type == type)
+			return metric.get();
+		// Two metrics of different types cannot share a name in the scrape file
+		ofLogError("MetricsRegistry") << "getOrCreate(): " << name << " is already registered with another type";
+		return getOrCreate(name + "_" + ofToString(static_cast<int>(type)), help, type);
+	}
+	metrics.push_back(std::unique_ptr<Metric>(new Metric()));
+	Metric* metric = metrics.back().get();
+	metric->name = name;
+	metric->help = help;
+	metric->type = type;
+	return metric;
+}
+
+MetricCounter& MetricsRegistry::counter(const std::string& name, const std::string& help)
+{
+	std::lock_guard<std::mutex> lock(metricsMutex);
+	Metric* metric = getOrCreate(name, help, METRIC_COUNTER);
+	if (!metric->counter)
+		metric->counter.reset(new MetricCounter());
+	return *metric->counter;
+}
+
+MetricGauge& MetricsRegistry::gauge(const std::string& name, const std::string& help)
+{
+	std::lock_guard<std::mutex> lock(metricsMutex);
+	Metric* metric = getOrCreate(name, help, METRIC_GAUGE);
+	if (!metric->gauge)
+		metric->gauge.reset(new MetricGauge());
+	return *metric->gauge;
+}
+
+MetricHistogram& MetricsRegistry::histogram(const std::string& name, const std::string& help, const std::vector<double>& bounds)
+{
+	std::lock_guard<std::mutex> lock(metricsMutex);
+	Metric* metric = getOrCreate(name, help, METRIC_HISTOGRAM);
+	if (!metric->histogram)
+		metric->histogram.reset(new MetricHistogram(bounds));
+	return *metric->histogram;
+}
+
+void MetricsRegistry::setOutput(const std::string& directory, float interval)
+{
+	outputDirectory = directory;
+	outputInterval = interval;
+	lastOutput = ofGetElapsedTimef();
+	if (!directory.empty() && interval > 0)
+		ofLogVerbose("MetricsRegistry") << "setOutput(): Writing metrics to " << directory << " every " << interval << " s";
+}
+
+void MetricsRegistry::update()
+{
+	if (outputDirectory.empty() || outputInterval <= 0)
+		return;
+	float now = ofGetElapsedTimef();
+	if (now - lastOutput < outputInterval)
+		return;
+	lastOutput = now;
+
+	// The scrape file is replaced as a whole so a reader never sees half of it
+	std::string promPath = ofFilePath::join(outputDirectory, "magicsand.prom");
+	std::string tmpPath = promPath + ".tmp";
+	if (writePrometheus(tmpPath) && !replaceFile(tmpPath, promPath))
+		ofLogError("MetricsRegistry") << "update(): Could not replace " << promPath;
+	appendCsv(ofFilePath::join(outputDirectory, "magicsand-metrics.csv"));
+}
+
+bool MetricsRegistry::writePrometheus(const std::string& path) const
+{
+	std::ofstream file(path.c_str());
+	if (!file)
+	{
+		ofLogError("MetricsRegistry") << "writePrometheus(): Could not write " << path;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(metricsMutex);
+	for (const auto& metric : metrics)
+	{
+		file << "# HELP " << metric->name << " " << metric->help << "\n";
+		switch (metric->type)
+		{
+		case METRIC_COUNTER:
+			file << "# TYPE " << metric->name << " counter\n";
+			file << metric->name << " " << metric->counter->get() << "\n";
+			break;
+		case METRIC_GAUGE:
+			file << "# TYPE " << metric->name << " gauge\n";
+			file << metric->name << " " << formatValue(metric->gauge->get()) << "\n";
+			break;
+		case METRIC_HISTOGRAM:
+		{
+			std::vector<uint64_t> buckets;
+			uint64_t count;
+			double sum;
+			metric->histogram->getSnapshot(buckets, count, sum);
+			file << "# TYPE " << metric->name << " histogram\n";
+			for (size_t i = 0; i < buckets.size(); i++)
+				file << metric->name << "_bucket{le=\"" << formatBound(metric->histogram->getBounds(), i) << "\"} " << buckets[i] << "\n";
+			file << metric->name << "_sum " << formatValue(sum) << "\n";
+			file << metric->name << "_count " << count << "\n";
+			break;
+		}
+		}
+	}
+	return true;
+}
+
+// One line per metric value: unix time, metric, value
+bool MetricsRegistry::appendCsv(const std::string& path) const
+{
+	std::streamoff size;
+	{
+		std::ifstream current(path.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+		size = current ? static_cast<std::streamoff>(current.tellg()) : -1;
+	}
+	if (size >= maxCsvBytes)
+	{
+		std::string previous = path.substr(0, path.size() - std::min<size_t>(path.size(), 4)) + ".1.csv";
+		if (!replaceFile(path, previous))
+			ofLogError("MetricsRegistry") << "appendCsv(): Could not roll " << path << " over to " << previous;
+		else
+			size = -1;
+	}
+	bool newFile = size < 0;
+	std::ofstream file(path.c_str(), std::ios::out | std::ios::app);
+	if (!file)
+	{
+		ofLogError("MetricsRegistry") << "appendCsv(): Could not write " << path;
+		return false;
+	}
+	if (newFile)
+		file << "time,metric,value\n";
+
+	uint64_t time = ofGetUnixTime();
+	std::lock_guard<std::mutex> lock(metricsMutex);
+	for (const auto& metric : metrics)
+	{
+		switch (metric->type)
+		{
+		case METRIC_COUNTER:
+			file << time << "," << metric->name << "," << metric->counter->get() << "\n";
+			break;
+		case METRIC_GAUGE:
+			file << time << "," << metric->name << "," << formatValue(metric->gauge->get()) << "\n";
+			break;
+		case METRIC_HISTOGRAM:
+		{
+			std::vector<uint64_t> buckets;
+			uint64_t count;
+			double sum;
+			metric->histogram->getSnapshot(buckets, count, sum);
+			for (size_t i = 0; i < buckets.size(); i++)
+				file << time << "," << metric->name << "_bucket_le_" << formatBound(metric->histogram->getBounds(), i) << "," << buckets[i] << "\n";
+			file << time << "," << metric->name << "_sum," << formatValue(sum) << "\n";
+			file << time << "," << metric->name << "_count," << count << "\n";
+			break;
+		}
+		}
+	}
+	return true;
+}
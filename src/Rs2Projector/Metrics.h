@@ -0,0 +1,152 @@
+/***********************************************************************
+Metrics - Registry of counters, gauges and histograms written periodically
+as Prometheus text and CSV files.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Metrics can be updated from any thread. Counters and gauges are single atomics,
+// histograms take a short lock per observation.
+class MetricCounter
+{
+public:
+	MetricCounter() : value(0) {}
+
+	void add(uint64_t n = 1){
+		value.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	uint64_t get() const{
+		return value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> value;
+};
+
+class MetricGauge
+{
+public:
+	MetricGauge() : value(0) {}
+
+	void set(double v){
+		value.store(v, std::memory_order_relaxed);
+	}
+
+	double get() const{
+		return value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<double> value;
+};
+
+class MetricHistogram
+{
+public:
+	// Upper bounds of the buckets in increasing order, a +Inf bucket is added
+	explicit MetricHistogram(const std::vector<double>& bounds);
+
+	void observe(double v);
+
+	// Cumulative bucket counts (the last one is +Inf), total count and sum
+	void getSnapshot(std::vector<uint64_t>& cumulativeCounts, uint64_t& count, double& sum) const;
+
+	const std::vector<double>& getBounds() const{
+		return bounds;
+	}
+
+private:
+	std::vector<double> bounds;
+	std::vector<uint64_t> bucketCounts;
+	uint64_t count;
+	double sum;
+	mutable std::mutex lock;
+};
+
+// Observes the lifetime of the scope (in seconds) in a histogram
+class MetricTimer
+{
+public:
+	explicit MetricTimer(MetricHistogram& shistogram);
+	~MetricTimer();
+
+	MetricTimer(const MetricTimer&) = delete;
+	MetricTimer& operator=(const MetricTimer&) = delete;
+
+private:
+	MetricHistogram& histogram;
+	uint64_t start;
+};
+
+class MetricsRegistry
+{
+public:
+	static MetricsRegistry& get();
+
+	// A metric is created on the first call with its name, later calls return the same one
+	MetricCounter& counter(const std::string& name, const std::string& help);
+	MetricGauge& gauge(const std::string& name, const std::string& help);
+	MetricHistogram& histogram(const std::string& name, const std::string& help, const std::vector<double>& bounds);
+
+	// Write <directory>/magicsand.prom and append to <directory>/magicsand-metrics.csv every interval
+	// seconds (0 stops writing). Past 16 MB the CSV replaces magicsand-metrics.1.csv and a new one is started.
+	void setOutput(const std::string& directory, float interval);
+
+	// Write the files when due, called once per frame
+	void update();
+
+	bool writePrometheus(const std::string& path) const;
+	bool appendCsv(const std::string& path) const;
+
+private:
+	MetricsRegistry();
+
+	enum MetricType
+	{
+		METRIC_COUNTER,
+		METRIC_GAUGE,
+		METRIC_HISTOGRAM
+	};
+
+	struct Metric
+	{
+		std::string name;
+		std::string help;
+		MetricType type;
+		std::unique_ptr<MetricCounter> counter;
+		std::unique_ptr<MetricGauge> gauge;
+		std::unique_ptr<MetricHistogram> histogram;
+	};
+
+	Metric* getOrCreate(const std::string& name, const std::string& help, MetricType type);
+
+	std::vector<std::unique_ptr<Metric>> metrics;
+	mutable std::mutex metricsMutex;
+
+	std::string outputDirectory;
+	float outputInterval;
+	float lastOutput;
+};
@@ -0,0 +1,285 @@
+/***********************************************************************
+OccluderDetector - Segmentation of hands and other objects held above the
+sand, so the temporal filter keeps the sand under them.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "OccluderDetector.h"
+
+static const float stillAdaptation = 0.2f; // Weight of a new sample in the running mean and variance
+
+OccluderDetector::OccluderDetector()
+:minHeight(30),
+margin(4),
+sandAdaptation(0.25f),
+stableTolerance(4),
+stableFrames(15),
+stableRatio(0.9f),
+maxFrames(150),
+width(0),
+height(0),
+numOccluders(0)
+{
+}
+
+void OccluderDetector::reset()
+{
+	std::fill(sand.begin(), sand.end(), 0.0f);
+	std::fill(age.begin(), age.end(), 0);
+	std::fill(stillMean.begin(), stillMean.end(), 0.0f);
+	std::fill(stillFrames.begin(), stillFrames.end(), 0);
+	if (mask.isAllocated())
+		mask.set(0);
+	numOccluders = 0;
+}
+
+int OccluderDetector::detect(unsigned short* depth, int swidth, int sheight, int minX, int minY, int maxX, int maxY,
+	float maxOffset, FrameFilterWorkerPool& pool)
+{
+	if (swidth != width || sheight != height)
+	{
+		width = swidth;
+		height = sheight;
+		size_t size = static_cast<size_t>(width) * height;
+		sand.assign(size, 0.0f);
+		age.assign(size, 0);
+		stillMean.assign(size, 0.0f);
+		stillVariance.assign(size, 0.0f);
+		stillFrames.assign(size, 0);
+		blobs.assign(size, BLOB_NONE);
+		seeds.assign(size, 0);
+		rowDilated.assign(size, 0);
+		columnDistance.assign(width, 0);
+		mask.allocate(width, height, 1);
+		mask.set(0);
+	}
+
+	// Seeds: valid samples well above the sand estimate. The stillness of the pixels is followed as well, the samples
+	// without measure neither break nor extend it.
+	const float stableVariance = stableTolerance * stableTolerance;
+	pool.run(minY, maxY, [&](int firstRow, int lastRow, int) {
+		for (int y = firstRow; y < lastRow; y++)
+		{
+			size_t offset = static_cast<size_t>(y) * width;
+			for (int x = minX; x < maxX; x++)
+			{
+				size_t i = offset + x;
+				float raw = depth[i];
+				float estimate = sand[i];
+				seeds[i] = (raw > maxOffset && estimate > 0 && estimate - raw >= minHeight) ? 1 : 0;
+				blobs[i] = BLOB_NONE;
+				if (raw > maxOffset)
+				{
+					float delta = raw - stillMean[i];
+					if (stillMean[i] > 0)
+					{
+						stillMean[i] += stillAdaptation * delta;
+						stillVariance[i] = (1 - stillAdaptation) * (stillVariance[i] + stillAdaptation * delta * delta);
+					}
+					else
+					{
+						stillMean[i] = raw;
+						stillVariance[i] = 0;
+					}
+					stillFrames[i] = stillVariance[i] <= stableVariance ? std::min<int>(stillFrames[i] + 1, stableFrames) : 0;
+				}
+			}
+		}
+	});
+
+	dilate(minX, minY, maxX, maxY, pool);
+	classifyBlobs(minX, minY, maxX, maxY);
+
+	// Freeze the occluded pixels, let the sand estimate follow the others
+	int bandOccluders[FrameFilterWorkerPool::MAX_THREADS] = { 0 };
+	unsigned char* maskPtr = mask.getData();
+	pool.run(minY, maxY, [&](int firstRow, int lastRow, int band) {
+		for (int y = firstRow; y < lastRow; y++)
+		{
+			size_t offset = static_cast<size_t>(y) * width;
+			for (int x = minX; x < maxX; x++)
+			{
+				size_t i = offset + x;
+				float raw = depth[i];
+				if (maskPtr[i])
+				{
+					if (++age[i] <= maxFrames && blobs[i] != BLOB_SAND)
+					{
+						depth[i] = 0;
+						bandOccluders[band]++;
+						continue;
+					}
+					// Sand piled up by the hands, or held still for too long: this is sand rather than a hand
+					maskPtr[i] = 0;
+					if (raw > maxOffset)
+						sand[i] = raw;
+				}
+				age[i] = 0;
+				if (raw > maxOffset)
+					sand[i] = (sand[i] > 0) ? sand[i] + sandAdaptation * (raw - sand[i]) : raw;
+			}
+		}
+	});
+
+	numOccluders = 0;
+	for (int i = 0; i < FrameFilterWorkerPool::MAX_THREADS; i++)
+		numOccluders += bandOccluders[i];
+	return numOccluders;
+}
+
+// Connected blobs (4-connected) of the occluder mask. The blobs touching the ROI border are hands and arms reaching
+// in and are kept. The others are sand piled up (or the rim of a hole) once most of their pixels hold still: judging
+// the whole blob lets the noisy pixels on its slopes go with it.
+void OccluderDetector::classifyBlobs(int minX, int minY, int maxX, int maxY)
+{
+	const unsigned char* maskPtr = mask.getData();
+	blobPixels.clear();
+	for (int x = minX; x < maxX; x++)
+	{
+		for (int y : { minY, maxY - 1 })
+		{
+			size_t i = static_cast<size_t>(y) * width + x;
+			if (maskPtr[i] && blobs[i] == BLOB_NONE)
+			{
+				blobs[i] = BLOB_HAND;
+				blobPixels.push_back(static_cast<int>(i));
+			}
+		}
+	}
+	for (int y = minY; y < maxY; y++)
+	{
+		for (int x : { minX, maxX - 1 })
+		{
+			size_t i = static_cast<size_t>(y) * width + x;
+			if (maskPtr[i] && blobs[i] == BLOB_NONE)
+			{
+				blobs[i] = BLOB_HAND;
+				blobPixels.push_back(static_cast<int>(i));
+			}
+		}
+	}
+	floodBlob(0, BLOB_HAND, minX, minY, maxX, maxY);
+
+	for (int y = minY; y < maxY; y++)
+	{
+		size_t offset = static_cast<size_t>(y) * width;
+		for (int x = minX; x < maxX; x++)
+		{
+			size_t i = offset + x;
+			if (!maskPtr[i] || blobs[i] != BLOB_NONE)
+				continue;
+			blobPixels.clear();
+			blobs[i] = BLOB_HELD;
+			blobPixels.push_back(static_cast<int>(i));
+			floodBlob(0, BLOB_HELD, minX, minY, maxX, maxY);
+			size_t numStill = 0;
+			for (int p : blobPixels)
+				numStill += stillFrames[p] >= stableFrames ? 1 : 0;
+			if (numStill >= stableRatio * blobPixels.size())
+			{
+				for (int p : blobPixels)
+					blobs[p] = BLOB_SAND;
+			}
+		}
+	}
+}
+
+// Grow the blob of the pixels blobPixels[first...] to the occluder pixels it touches, labelling them type. The pixels
+// reached are appended to blobPixels.
+void OccluderDetector::floodBlob(size_t first, uint8_t type, int minX, int minY, int maxX, int maxY)
+{
+	const unsigned char* maskPtr = mask.getData();
+	auto reach = [&](size_t i) {
+		if (maskPtr[i] && blobs[i] == BLOB_NONE)
+		{
+			blobs[i] = type;
+			blobPixels.push_back(static_cast<int>(i));
+		}
+	};
+	for (size_t k = first; k < blobPixels.size(); k++)
+	{
+		size_t i = blobPixels[k];
+		int x = static_cast<int>(i % width);
+		int y = static_cast<int>(i / width);
+		if (x > minX)
+			reach(i - 1);
+		if (x < maxX - 1)
+			reach(i + 1);
+		if (y > minY)
+			reach(i - width);
+		if (y < maxY - 1)
+			reach(i + width);
+	}
+}
+
+// Square dilation of the seeds by margin pixels, restricted to the ROI: a horizontal pass on each row then a vertical
+// pass carrying the distance to the last seed down and up the columns
+void OccluderDetector::dilate(int minX, int minY, int maxX, int maxY, FrameFilterWorkerPool& pool)
+{
+	const int far = margin + 1;
+	pool.run(minY, maxY, [&](int firstRow, int lastRow, int) {
+		for (int y = firstRow; y < lastRow; y++)
+		{
+			const uint8_t* in = seeds.data() + static_cast<size_t>(y) * width;
+			uint8_t* out = rowDilated.data() + static_cast<size_t>(y) * width;
+			int distance = far;
+			for (int x = minX; x < maxX; x++)
+			{
+				distance = in[x] ? 0 : std::min(distance + 1, far);
+				out[x] = distance <= margin;
+			}
+			distance = far;
+			for (int x = maxX - 1; x >= minX; x--)
+			{
+				distance = in[x] ? 0 : std::min(distance + 1, far);
+				out[x] |= distance <= margin;
+			}
+		}
+	});
+
+	unsigned char* maskPtr = mask.getData();
+	pool.run(minX, maxX, [&](int firstCol, int lastCol, int) {
+		// Each band owns the columns [firstCol, lastCol) of the distance row
+		int* distance = columnDistance.data();
+		std::fill(distance + firstCol, distance + lastCol, far);
+		for (int y = minY; y < maxY; y++)
+		{
+			const uint8_t* in = rowDilated.data() + static_cast<size_t>(y) * width;
+			unsigned char* out = maskPtr + static_cast<size_t>(y) * width;
+			for (int x = firstCol; x < lastCol; x++)
+			{
+				int& d = distance[x];
+				d = in[x] ? 0 : std::min(d + 1, far);
+				out[x] = (d <= margin) ? 255 : 0;
+			}
+		}
+		std::fill(distance + firstCol, distance + lastCol, far);
+		for (int y = maxY - 1; y >= minY; y--)
+		{
+			const uint8_t* in = rowDilated.data() + static_cast<size_t>(y) * width;
+			unsigned char* out = maskPtr + static_cast<size_t>(y) * width;
+			for (int x = firstCol; x < lastCol; x++)
+			{
+				int& d = distance[x];
+				d = in[x] ? 0 : std::min(d + 1, far);
+				if (d <= margin)
+					out[x] = 255;
+			}
+		}
+	});
+}
@@ -0,0 +1,93 @@
+/***********************************************************************
+OccluderDetector - Segmentation of hands and other objects held above the
+sand, so the temporal filter keeps the sand under them.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <vector>
+#include "ofMain.h"
+#include "FrameFilterWorkerPool.h"
+
+// A pixel is an occluder when its raw depth is at least minHeight closer to the camera than a fast running
+// estimate of the sand. The estimate only follows pixels that are not occluded. The occluder mask is dilated
+// by margin pixels to catch the mixed depths at the edges of a hand. Hands and arms reach in from the edge of
+// the box: an occluder blob apart from the ROI border that holds still is sand piled up and is released.
+class OccluderDetector
+{
+public:
+	OccluderDetector();
+
+	// Forget the sand estimate (new ROI or filter state)
+	void reset();
+
+	// Classify the pixels of the ROI [minX, maxX) x [minY, maxY) and clear the raw samples of the occluders
+	// (a 0 sample is ignored by the temporal filter, which keeps its state). Returns the number of occluder pixels.
+	int detect(unsigned short* depth, int width, int height, int minX, int minY, int maxX, int maxY,
+		float maxOffset, FrameFilterWorkerPool& pool);
+
+	// Occluders of the last frame: 255 for an occluder, 0 elsewhere (full frame)
+	const ofPixels& getMask() const{
+		return mask;
+	}
+
+	int getNumOccluders() const{
+		return numOccluders;
+	}
+
+	// Fast sand estimate (full frame), frozen under the occluders
+	const float* getSandEstimate() const{
+		return sand.data();
+	}
+
+	float minHeight; // Height above the sand estimate (depth units) of an occluder
+	int margin; // Dilation of the occluder mask in pixels
+	float sandAdaptation; // Weight of a new sample in the sand estimate
+	float stableTolerance; // Standard deviation of the raw depth (depth units) under which a pixel holds still
+	int stableFrames; // Frames a pixel has to stay under stableTolerance to hold still
+	float stableRatio; // Share of still pixels from which an occluder blob apart from the ROI border is sand
+	int maxFrames; // Fallback: an occluder still there after maxFrames frames is taken as sand
+
+private:
+	enum BlobType
+	{
+		BLOB_NONE, // Not an occluder, or not reached yet
+		BLOB_HAND, // Connected to the ROI border
+		BLOB_HELD, // Apart from the border, still moving
+		BLOB_SAND // Apart from the border and still: released
+	};
+
+	void dilate(int minX, int minY, int maxX, int maxY, FrameFilterWorkerPool& pool);
+	void classifyBlobs(int minX, int minY, int maxX, int maxY);
+	void floodBlob(size_t first, uint8_t type, int minX, int minY, int maxX, int maxY);
+
+	int width, height;
+	std::vector<float> sand; // Fast sand estimate, 0 until the pixel got a sample
+	std::vector<uint16_t> age; // Number of frames the pixel has been an occluder
+	std::vector<float> stillMean; // Running mean and variance of the raw depth, 0 until the pixel got a sample
+	std::vector<float> stillVariance;
+	std::vector<uint16_t> stillFrames; // Frames the variance has stayed under stableTolerance^2
+	std::vector<uint8_t> blobs; // BlobType of the pixels
+	std::vector<int> blobPixels; // Pixels of the blobs being flooded
+	std::vector<uint8_t> seeds; // Occluder pixels before the dilation
+	std::vector<uint8_t> rowDilated; // Horizontal pass of the dilation
+	std::vector<int> columnDistance; // Vertical pass: distance to the last seed of each column
+	ofPixels mask;
+	int numOccluders;
+};
@@ -0,0 +1,112 @@
+/***********************************************************************
+OccluderDetectorTest - Checks of the occluder detector on a simulated
+sandbox: hands reaching in, a pile and a hole left behind.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "OccluderDetectorTest.h"
+#include "OccluderDetector.h"
+#include "SandboxFrameSource.h"
+
+namespace
+{
+	SandboxEvent handEvent(float start, float duration, ofVec2f from, ofVec2f to)
+	{
+		SandboxEvent event;
+		event.type = SANDBOX_EVENT_HAND_SWEEP;
+		event.start = start;
+		event.duration = duration;
+		event.from = from;
+		event.to = to;
+		event.radius = 0.05f;
+		event.amount = 0;
+		return event;
+	}
+
+	// A hand reaches in from the bottom edge, stays while it digs (negative amount: piles sand) and leaves
+	void addDig(SandboxFrameSource& source, float start, ofVec2f position, float amount)
+	{
+		source.addEvent(handEvent(start, 1, ofVec2f(position.x, 1.1f), position));
+		source.addEvent(handEvent(start + 1, 1, position, position));
+		SandboxEvent dig;
+		dig.type = SANDBOX_EVENT_DIG;
+		dig.start = start + 1;
+		dig.duration = 1;
+		dig.from = position;
+		dig.to = position;
+		dig.radius = 0.06f;
+		dig.amount = amount;
+		source.addEvent(dig);
+		source.addEvent(handEvent(start + 2, 1, position, ofVec2f(position.x, 1.1f)));
+	}
+}
+
+int runOccluderDetectorTest()
+{
+	const int width = 320;
+	const int height = 240;
+	const int minX = 10, minY = 10, maxX = width - 10, maxY = height - 10;
+	const float maxOffset = 500; // Closer than this is outside the box
+	const int maxNoiseOccluders = (maxX - minX) * (maxY - minY) / 1000;
+
+	// Events at 30 simulated frames per second
+	SandboxSimulationSettings settings;
+	settings.scriptedEvents = false;
+	SandboxFrameSource source(width, height, 0, settings);
+	addDig(source, 1, ofVec2f(0.5f, 0.5f), -60); // Pile
+	addDig(source, 5, ofVec2f(0.3f, 0.4f), 100); // Hole, its rim is high enough to be taken for an occluder
+	source.addEvent(handEvent(9, 1, ofVec2f(0.7f, 1.1f), ofVec2f(0.7f, 0.6f)));
+	source.addEvent(handEvent(10, 3, ofVec2f(0.7f, 0.6f), ofVec2f(0.7f, 0.6f))); // Hand held still
+	source.open();
+
+	OccluderDetector detector;
+	FrameFilterWorkerPool pool;
+	ofShortPixels depth;
+	int failures = 0;
+	auto check = [&](bool passed, const std::string& what) {
+		if (passed)
+			ofLogNotice("OccluderDetectorTest") << "passed: " << what;
+		else
+			ofLogError("OccluderDetectorTest") << "FAILED: " << what;
+		failures += passed ? 0 : 1;
+	};
+
+	int heldStillFrames = 0;
+	for (int frame = 0; frame < 13 * 30; frame++)
+	{
+		source.poll();
+		depth = source.getDepthPixels();
+		float time = source.getSimulationTime();
+		int numOccluders = detector.detect(depth.getData(), width, height, minX, minY, maxX, maxY, maxOffset, pool);
+		if (frame == 75)
+			check(numOccluders > maxNoiseOccluders, "hand over the pile, " + ofToString(numOccluders) + " occluder pixels");
+		// About a second after the hands left, well before maxFrames
+		if (frame == 4 * 30 + 30)
+			check(numOccluders <= maxNoiseOccluders, "pile released, " + ofToString(numOccluders) + " occluder pixels");
+		if (frame == 8 * 30 + 30)
+			check(numOccluders <= maxNoiseOccluders, "rim of the hole released, " + ofToString(numOccluders) + " occluder pixels");
+		// The hand is connected to the border, it stays an occluder (shorter than the maxFrames fallback)
+		if (time >= 10.5f && time < 13 && numOccluders > maxNoiseOccluders)
+			heldStillFrames++;
+	}
+	check(heldStillFrames >= 2 * 30, "hand held still kept for " + ofToString(heldStillFrames) + " frames");
+
+	if (failures > 0)
+		ofLogError("OccluderDetectorTest") << failures << " check(s) failed";
+	return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,309 @@
+/***********************************************************************
+PlaneEstimator - Robust fit of the base plane of the sandbox from a depth
+frame, insensitive to objects left on the sand.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "PlaneEstimator.h"
+
+namespace
+{
+	// Eigenvector of the smallest eigenvalue of a symmetric 3x3 matrix (cyclic Jacobi rotations)
+	void smallestEigenvector(double a[3][3], double v[3])
+	{
+		double e[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+		for (int sweep = 0; sweep < 32; sweep++)
+		{
+			double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+			double diag = a[0][0] * a[0][0] + a[1][1] * a[1][1] + a[2][2] * a[2][2];
+			if (off <= 1e-24 * diag)
+				break;
+			for (int p = 0; p < 2; p++)
+			{
+				for (int q = p + 1; q < 3; q++)
+				{
+					if (a[p][q] == 0)
+						continue;
+					double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+					double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1));
+					double c = 1 / sqrt(t * t + 1);
+					double s = t * c;
+					for (int k = 0; k < 3; k++)
+					{
+						double akp = a[k][p], akq = a[k][q];
+						a[k][p] = c * akp - s * akq;
+						a[k][q] = s * akp + c * akq;
+					}
+					for (int k = 0; k < 3; k++)
+					{
+						double apk = a[p][k], aqk = a[q][k];
+						a[p][k] = c * apk - s * aqk;
+						a[q][k] = s * apk + c * aqk;
+					}
+					for (int k = 0; k < 3; k++)
+					{
+						double ekp = e[k][p], ekq = e[k][q];
+						e[k][p] = c * ekp - s * ekq;
+						e[k][q] = s * ekp + c * ekq;
+					}
+				}
+			}
+		}
+		int smallest = 0;
+		for (int i = 1; i < 3; i++)
+			if (a[i][i] < a[smallest][smallest])
+				smallest = i;
+		for (int k = 0; k < 3; k++)
+			v[k] = e[k][smallest];
+	}
+
+	// Same orientation as plane_from_points(): the largest component of the normal is positive
+	ofVec4f orientedPlane(double nx, double ny, double nz, const ofVec3f& point)
+	{
+		double largest = nx;
+		if (fabs(ny) > fabs(largest))
+			largest = ny;
+		if (fabs(nz) > fabs(largest))
+			largest = nz;
+		if (largest < 0)
+		{
+			nx = -nx;
+			ny = -ny;
+			nz = -nz;
+		}
+		double w = -(nx * point.x + ny * point.y + nz * point.z);
+		return ofVec4f(static_cast<float>(nx), static_cast<float>(ny), static_cast<float>(nz), static_cast<float>(w));
+	}
+}
+
+void PlaneEstimator::Moments::clear()
+{
+	w = x = y = z = xx = xy = xz = yy = yz = zz = residual2 = 0;
+	numPoints = numInliers = 0;
+}
+
+void PlaneEstimator::Moments::add(const Moments& o)
+{
+	w += o.w;
+	x += o.x;
+	y += o.y;
+	z += o.z;
+	xx += o.xx;
+	xy += o.xy;
+	xz += o.xz;
+	yy += o.yy;
+	yz += o.yz;
+	zz += o.zz;
+	residual2 += o.residual2;
+	numPoints += o.numPoints;
+	numInliers += o.numInliers;
+}
+
+PlaneEstimator::PlaneEstimator()
+:inlierDistance(10),
+numHypotheses(64),
+numScoringPoints(4096),
+numRefinements(3),
+random(5489u)
+{
+}
+
+// Plane through the weighted centroid, normal along the direction of least spread
+bool PlaneEstimator::solve(const Moments& m, const ofVec3f& origin, ofVec4f& plane) const
+{
+	if (m.w <= 0 || m.numInliers < 3)
+		return false;
+	double cx = m.x / m.w, cy = m.y / m.w, cz = m.z / m.w;
+	double cov[3][3];
+	cov[0][0] = m.xx / m.w - cx * cx;
+	cov[0][1] = cov[1][0] = m.xy / m.w - cx * cy;
+	cov[0][2] = cov[2][0] = m.xz / m.w - cx * cz;
+	cov[1][1] = m.yy / m.w - cy * cy;
+	cov[1][2] = cov[2][1] = m.yz / m.w - cy * cz;
+	cov[2][2] = m.zz / m.w - cz * cz;
+	double trace = cov[0][0] + cov[1][1] + cov[2][2];
+	if (!(trace > 0))
+		return false;
+
+	double n[3];
+	smallestEigenvector(cov, n);
+	double length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+	if (length == 0)
+		return false;
+	ofVec3f centroid(static_cast<float>(origin.x + cx), static_cast<float>(origin.y + cy), static_cast<float>(origin.z + cz));
+	plane = orientedPlane(n[0] / length, n[1] / length, n[2] / length, centroid);
+	return true;
+}
+
+// Planes through 3 random points of a sparse grid of the ROI, scored on the grid. Returns the plane with the most
+// supporting points.
+bool PlaneEstimator::ransac(const float* depth, const DeprojectionTable& table, int minX, int minY, int maxX, int maxY,
+	ofVec4f& plane)
+{
+	int width = table.getWidth();
+	int roiWidth = maxX - minX;
+	int roiHeight = maxY - minY;
+	int step = max(1, static_cast<int>(sqrt(static_cast<double>(roiWidth) * roiHeight / max(numScoringPoints, 1))));
+	gridPoints.clear();
+	for (int y = minY + step / 2; y < maxY; y += step)
+	{
+		const float* row = depth + y * width;
+		for (int x = minX + step / 2; x < maxX; x += step)
+			if (row[x] > 0)
+				gridPoints.push_back(table.deproject(static_cast<float>(x), static_cast<float>(y), row[x]));
+	}
+	int numGridPoints = static_cast<int>(gridPoints.size());
+	if (numGridPoints < 3)
+		return false;
+	std::uniform_int_distribution<int> pick(0, numGridPoints - 1);
+
+	int bestScore = 0;
+	for (int h = 0; h < numHypotheses; h++)
+	{
+		ofVec3f p[3] = { gridPoints[pick(random)], gridPoints[pick(random)], gridPoints[pick(random)] };
+		ofVec3f u = p[1] - p[0];
+		ofVec3f v = p[2] - p[0];
+		ofVec3f normal = u.cross(v);
+		float length = normal.length();
+		// Nearly aligned points give a normal dominated by the depth noise
+		if (length == 0 || length < 0.1f * u.length() * v.length())
+			continue;
+		normal /= length;
+		float offset = -normal.dot(p[0]);
+
+		int score = 0;
+		for (int i = 0; i < numGridPoints; i++)
+			if (fabs(normal.dot(gridPoints[i]) + offset) < inlierDistance)
+				score++;
+		if (score > bestScore)
+		{
+			bestScore = score;
+			plane = orientedPlane(normal.x, normal.y, normal.z, p[0]);
+		}
+	}
+	return bestScore >= 3;
+}
+
+// Moments of the ROI points. Weighted: Tukey biweight of the distance to the plane, zero beyond inlierDistance.
+void PlaneEstimator::accumulate(const float* depth, const DeprojectionTable& table, int minX, int minY, int maxX, int maxY,
+	const ofVec4f& plane, bool weighted, const ofVec3f& origin, FrameFilterWorkerPool& pool, Moments& total)
+{
+	int width = table.getWidth();
+	double nx = plane.x, ny = plane.y, nz = plane.z, nw = plane.w;
+	double c2 = static_cast<double>(inlierDistance) * inlierDistance;
+	for (int b = 0; b < FrameFilterWorkerPool::MAX_THREADS; b++)
+		bandMoments[b].clear();
+
+	pool.run(minY, maxY, [&](int firstRow, int lastRow, int band) {
+		Moments& m = bandMoments[band];
+		const int chunkSize = 64;
+		ofVec3f points[chunkSize];
+		for (int y = firstRow; y < lastRow; y++)
+		{
+			const float* row = depth + y * width;
+			for (int x0 = minX; x0 < maxX; x0 += chunkSize)
+			{
+				int n = min(chunkSize, maxX - x0);
+				table.deprojectRow(depth, y, x0, x0 + n, points);
+				for (int i = 0; i < n; i++)
+				{
+					if (row[x0 + i] <= 0)
+						continue;
+					const ofVec3f& p = points[i];
+					double r = nx * p.x + ny * p.y + nz * p.z + nw;
+					double r2 = r * r;
+					m.numPoints++;
+					double w = 1;
+					if (r2 < c2)
+					{
+						m.numInliers++;
+						m.residual2 += r2;
+						if (weighted)
+						{
+							double u = 1 - r2 / c2;
+							w = u * u;
+						}
+					}
+					else if (weighted)
+						continue;
+					double qx = p.x - origin.x, qy = p.y - origin.y, qz = p.z - origin.z;
+					m.w += w;
+					m.x += w * qx;
+					m.y += w * qy;
+					m.z += w * qz;
+					m.xx += w * qx * qx;
+					m.xy += w * qx * qy;
+					m.xz += w * qx * qz;
+					m.yy += w * qy * qy;
+					m.yz += w * qy * qz;
+					m.zz += w * qz * qz;
+				}
+			}
+		}
+	});
+
+	total.clear();
+	for (int b = 0; b < FrameFilterWorkerPool::MAX_THREADS; b++)
+		total.add(bandMoments[b]);
+}
+
+PlaneFit PlaneEstimator::fit(const float* depth, const DeprojectionTable& table, int minX, int minY, int maxX, int maxY,
+	FrameFilterWorkerPool& pool)
+{
+	PlaneFit result;
+	result.valid = false;
+	result.plane = ofVec4f(0, 0, 0, 0);
+	result.numPoints = result.numInliers = 0;
+	result.rmsResidual = 0;
+
+	minX = max(minX, 0);
+	minY = max(minY, 0);
+	maxX = min(maxX, table.getWidth());
+	maxY = min(maxY, table.getHeight());
+	if (!table.isAllocated() || maxX - minX < 2 || maxY - minY < 2)
+		return result;
+
+	// Start from the RANSAC plane, or from the least squares plane of every point if no hypothesis held
+	ofVec4f plane;
+	Moments moments;
+	bool robust = ransac(depth, table, minX, minY, maxX, maxY, plane);
+	ofVec3f origin = robust ? ofVec3f(plane) * -plane.w : table.deproject((minX + maxX) / 2, (minY + maxY) / 2, 1.0f);
+	if (!robust)
+	{
+		accumulate(depth, table, minX, minY, maxX, maxY, ofVec4f(0, 0, 0, 0), false, origin, pool, moments);
+		moments.numInliers = moments.numPoints;
+		if (!solve(moments, origin, plane))
+			return result;
+	}
+
+	for (int i = 0; i < numRefinements; i++)
+	{
+		accumulate(depth, table, minX, minY, maxX, maxY, plane, true, origin, pool, moments);
+		if (!solve(moments, origin, plane))
+			return result;
+	}
+
+	// Support of the final plane
+	accumulate(depth, table, minX, minY, maxX, maxY, plane, true, origin, pool, moments);
+	result.valid = moments.numInliers >= 3;
+	result.plane = plane;
+	result.numPoints = moments.numPoints;
+	result.numInliers = moments.numInliers;
+	result.rmsResidual = moments.numInliers > 0 ? sqrt(moments.residual2 / moments.numInliers) : 0;
+	return result;
+}
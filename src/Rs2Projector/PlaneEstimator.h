@@ -0,0 +1,78 @@
+/***********************************************************************
+PlaneEstimator - Robust fit of the base plane of the sandbox from a depth
+frame, insensitive to objects left on the sand.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <random>
+#include <vector>
+#include "ofMain.h"
+#include "DeprojectionTable.h"
+#include "FrameFilterWorkerPool.h"
+
+struct PlaneFit
+{
+	bool valid;
+	ofVec4f plane; // Unit normal and offset, oriented as plane_from_points() orients its planes
+	int numPoints; // Pixels with a depth in the ROI
+	int numInliers; // Pixels closer to the plane than the inlier distance
+	double rmsResidual; // Of the inliers, world units
+};
+
+// RANSAC on a sparse grid of the ROI gives a first plane, then a few iteratively reweighted least squares passes
+// refine it on every pixel. Each pass streams the pixels through the deprojection table and accumulates the
+// weighted moments in double precision, the bands of rows being split between the threads of the pool. Nothing is
+// allocated during a fit once the grid of the first one is stored.
+class PlaneEstimator
+{
+public:
+	PlaneEstimator();
+
+	// Fit the plane of the pixels [minX, maxX) x [minY, maxY) of a full frame depth image
+	PlaneFit fit(const float* depth, const DeprojectionTable& table, int minX, int minY, int maxX, int maxY,
+		FrameFilterWorkerPool& pool);
+
+	float inlierDistance; // World units between a point and the plane for the point to support it
+	int numHypotheses; // RANSAC planes tried
+	int numScoringPoints; // Size of the grid the hypotheses are scored on
+	int numRefinements; // Reweighted least squares passes
+
+private:
+	// Weighted moments of a set of points, relative to an origin to keep the precision
+	struct Moments
+	{
+		double w, x, y, z, xx, xy, xz, yy, yz, zz;
+		double residual2; // Squared distance of the inliers to the plane the moments were taken with
+		int numPoints, numInliers;
+
+		void clear();
+		void add(const Moments& other);
+	};
+
+	bool solve(const Moments& m, const ofVec3f& origin, ofVec4f& plane) const;
+	bool ransac(const float* depth, const DeprojectionTable& table, int minX, int minY, int maxX, int maxY,
+		ofVec4f& plane);
+	void accumulate(const float* depth, const DeprojectionTable& table, int minX, int minY, int maxX, int maxY,
+		const ofVec4f& plane, bool weighted, const ofVec3f& origin, FrameFilterWorkerPool& pool, Moments& total);
+
+	std::mt19937 random;
+	std::vector<ofVec3f> gridPoints; // World points of the RANSAC grid, kept between the fits
+	Moments bandMoments[FrameFilterWorkerPool::MAX_THREADS];
+};
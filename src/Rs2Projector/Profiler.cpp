@@ -0,0 +1,197 @@
+/***********************************************************************
+Profiler - Scoped timing zones, thread names and frame markers written as
+Chrome trace_event JSON (chrome://tracing, Perfetto).
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "Profiler.h"
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "ofMain.h"
+
+const size_t Profiler::MAX_EVENTS_PER_THREAD;
+std::atomic<bool> Profiler::capturing(false);
+std::atomic<int> Profiler::framesLeft(0);
+
+namespace
+{
+	struct ProfileEvent
+	{
+		const char* name;
+		uint64_t start;
+		uint64_t duration;
+		bool instant;
+	};
+
+	// Events of one thread. The lock is only taken by its thread and by the capture start and
+	// the trace writer, so it is never contended during a capture.
+	struct ThreadTrack
+	{
+		std::mutex lock;
+		int id;
+		std::string name;
+		std::vector<ProfileEvent> events;
+		size_t dropped;
+	};
+
+	// Tracks live until the application exits, a thread that ended keeps its events
+	std::mutex tracksMutex;
+	std::vector<std::unique_ptr<ThreadTrack>> tracks;
+	thread_local ThreadTrack* currentTrack = nullptr;
+
+	ThreadTrack* getTrack()
+	{
+		if (currentTrack)
+			return currentTrack;
+		std::lock_guard<std::mutex> lock(tracksMutex);
+		tracks.push_back(std::unique_ptr<ThreadTrack>(new ThreadTrack()));
+		currentTrack = tracks.back().get();
+		currentTrack->id = static_cast<int>(tracks.size());
+		currentTrack->name = "Thread " + ofToString(currentTrack->id);
+		currentTrack->dropped = 0;
+		return currentTrack;
+	}
+
+	void addEvent(const ProfileEvent& event)
+	{
+		ThreadTrack* track = getTrack();
+		std::lock_guard<std::mutex> lock(track->lock);
+		if (track->events.capacity() < Profiler::MAX_EVENTS_PER_THREAD)
+			track->events.reserve(Profiler::MAX_EVENTS_PER_THREAD);
+		if (track->events.size() < Profiler::MAX_EVENTS_PER_THREAD)
+			track->events.push_back(event);
+		else
+			track->dropped++;
+	}
+
+	std::string escapeJson(const std::string& s)
+	{
+		std::string out;
+		for (char c : s)
+		{
+			if (c == '"' || c == '\\')
+				out += '\\';
+			out += c;
+		}
+		return out;
+	}
+}
+
+uint64_t Profiler::now()
+{
+	return ofGetElapsedTimeMicros();
+}
+
+void Profiler::startCapture(int numFrames)
+{
+	{
+		std::lock_guard<std::mutex> lock(tracksMutex);
+		for (auto& track : tracks)
+		{
+			std::lock_guard<std::mutex> trackLock(track->lock);
+			track->events.clear();
+			track->dropped = 0;
+		}
+	}
+	framesLeft = numFrames;
+	capturing = true;
+	if (numFrames > 0)
+		ofLogNotice("Profiler") << "startCapture(): Capturing " << numFrames << " frames";
+	else
+		ofLogNotice("Profiler") << "startCapture(): Capturing until stopped";
+}
+
+void Profiler::stopCapture()
+{
+	if (!capturing.exchange(false))
+		return;
+	ofDirectory::createDirectory("profiles", true, true);
+	std::string path = ofToDataPath("profiles/trace-" + ofGetTimestampString("%Y%m%d-%H%M%S") + ".json", true);
+	if (writeTrace(path))
+		ofLogNotice("Profiler") << "stopCapture(): Trace saved to " << path;
+}
+
+void Profiler::toggleCapture()
+{
+	if (isCapturing())
+		stopCapture();
+	else
+		startCapture();
+}
+
+void Profiler::setThreadName(const std::string& name)
+{
+	ThreadTrack* track = getTrack();
+	std::lock_guard<std::mutex> lock(track->lock);
+	track->name = name;
+}
+
+void Profiler::frameMark(const char* name)
+{
+	uint64_t t = now();
+	addEvent({ name, t, 0, true });
+}
+
+void Profiler::newFrame()
+{
+	if (!isCapturing())
+		return;
+	frameMark("Frame");
+	if (framesLeft > 0 && framesLeft.fetch_sub(1) == 1)
+		stopCapture();
+}
+
+void Profiler::addZone(const char* name, uint64_t start, uint64_t end)
+{
+	addEvent({ name, start, end - start, false });
+}
+
+bool Profiler::writeTrace(const std::string& path)
+{
+	std::ofstream file(path.c_str());
+	if (!file)
+	{
+		ofLogError("Profiler") << "writeTrace(): Could not write " << path;
+		return false;
+	}
+
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+	std::lock_guard<std::mutex> lock(tracksMutex);
+	for (auto& track : tracks)
+	{
+		std::lock_guard<std::mutex> trackLock(track->lock);
+		file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track->id
+			<< ",\"args\":{\"name\":\"" << escapeJson(track->name) << "\"}}";
+		first = false;
+		for (const auto& event : track->events)
+		{
+			file << ",\n{\"name\":\"" << escapeJson(event.name) << "\",\"pid\":1,\"tid\":" << track->id << ",\"ts\":" << event.start;
+			if (event.instant)
+				file << ",\"ph\":\"i\",\"s\":\"t\"}";
+			else
+				file << ",\"ph\":\"X\",\"dur\":" << event.duration << "}";
+		}
+		if (track->dropped > 0)
+			ofLogWarning("Profiler") << "writeTrace(): " << track->dropped << " events dropped on " << track->name;
+	}
+	file << "\n]}\n";
+	return true;
+}
@@ -0,0 +1,98 @@
+/***********************************************************************
+Profiler - Scoped timing zones, thread names and frame markers written as
+Chrome trace_event JSON (chrome://tracing, Perfetto).
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+// Events are only recorded while a capture runs. Outside of a capture a zone costs one relaxed
+// atomic load, so the zones stay in release builds. Define MAGICSAND_NO_PROFILER to compile them out.
+class Profiler
+{
+public:
+	// Record events until stopCapture(), or for numFrames calls of newFrame() if numFrames > 0.
+	// The trace is then written to data/profiles/trace-<time>.json
+	static void startCapture(int numFrames = 0);
+	static void stopCapture();
+	static void toggleCapture(); // Hotkey
+
+	static bool isCapturing(){
+		return capturing.load(std::memory_order_relaxed);
+	}
+
+	// Name of the calling thread in the trace
+	static void setThreadName(const std::string& name);
+
+	// Instant event on the calling thread's track
+	static void frameMark(const char* name);
+
+	// Frame marker of the main thread, counts the frames of a limited capture. Called once per ofApp::update()
+	static void newFrame();
+
+	// Called by ProfileZone, name must be a string literal (it is stored as a pointer)
+	static void addZone(const char* name, uint64_t start, uint64_t end);
+
+	static uint64_t now();
+
+	// Events kept per thread and capture, the later ones are dropped
+	static const size_t MAX_EVENTS_PER_THREAD = 1 << 17;
+
+private:
+	static bool writeTrace(const std::string& path);
+
+	static std::atomic<bool> capturing;
+	static std::atomic<int> framesLeft;
+};
+
+class ProfileZone
+{
+public:
+	explicit ProfileZone(const char* sname)
+	:name(Profiler::isCapturing() ? sname : nullptr),
+	start(name ? Profiler::now() : 0)
+	{
+	}
+
+	~ProfileZone(){
+		if (name)
+			Profiler::addZone(name, start, Profiler::now());
+	}
+
+	ProfileZone(const ProfileZone&) = delete;
+	ProfileZone& operator=(const ProfileZone&) = delete;
+
+private:
+	const char* name;
+	uint64_t start;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+
+#ifndef MAGICSAND_NO_PROFILER
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_FRAME_MARK(name) do { if (Profiler::isCapturing()) Profiler::frameMark(name); } while (0)
+#else
+#define PROFILE_ZONE(name) do {} while (0)
+#define PROFILE_FRAME_MARK(name) do {} while (0)
+#endif
@@ -0,0 +1,209 @@
+/***********************************************************************
+PushPullInpainter - Fills the holes of the filtered depth frame with a
+push-pull image pyramid. Every hole is filled whatever its size, in time
+proportional to the number of pixels.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "PushPullInpainter.h"
+#include <algorithm>
+
+PushPullInpainter::PushPullInpainter()
+:numHoles(0),
+numFilled(0),
+holeLevel(0)
+{
+}
+
+// The pyramid is only reallocated when the size of the fill rectangle changes
+void PushPullInpainter::allocateLevels(int width, int height)
+{
+	if (!levels.empty() && levels[0].width == width && levels[0].height == height)
+		return;
+
+	levels.clear();
+	while (true)
+	{
+		Level level;
+		level.width = width;
+		level.height = height;
+		level.value.resize(width * height);
+		level.weight.resize(width * height);
+		levels.push_back(level);
+		if (width == 1 && height == 1)
+			break;
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+}
+
+// Each coarse pixel is the weighted average of its (up to) 2x2 children
+void PushPullInpainter::push(const Level& fine, Level& coarse, int firstRow, int lastRow)
+{
+	for (int y = firstRow; y < lastRow; y++)
+	{
+		int fy0 = 2 * y;
+		int fy1 = std::min(2 * y + 1, fine.height - 1);
+		for (int x = 0; x < coarse.width; x++)
+		{
+			int fx0 = 2 * x;
+			int fx1 = std::min(2 * x + 1, fine.width - 1);
+			float sumW = 0;
+			float sumWV = 0;
+			for (int fy = fy0; fy <= fy1; fy++)
+			{
+				for (int fx = fx0; fx <= fx1; fx++)
+				{
+					int idx = fy * fine.width + fx;
+					sumW += fine.weight[idx];
+					sumWV += fine.weight[idx] * fine.value[idx];
+				}
+			}
+			int idx = y * coarse.width + x;
+			coarse.value[idx] = sumW > 0 ? sumWV / sumW : 0;
+			coarse.weight[idx] = std::min(1.0f, sumW);
+		}
+	}
+}
+
+// Pixels that are not fully covered are blended with the bilinear interpolation of the coarse level
+void PushPullInpainter::pull(Level& fine, const Level& coarse, int firstRow, int lastRow)
+{
+	for (int y = firstRow; y < lastRow; y++)
+	{
+		float cy = std::min(std::max(0.5f * y - 0.25f, 0.0f), static_cast<float>(coarse.height - 1));
+		int cy0 = static_cast<int>(cy);
+		int cy1 = std::min(cy0 + 1, coarse.height - 1);
+		float ty = cy - cy0;
+		for (int x = 0; x < fine.width; x++)
+		{
+			int idx = y * fine.width + x;
+			float w = fine.weight[idx];
+			if (w >= 1)
+				continue;
+
+			float cx = std::min(std::max(0.5f * x - 0.25f, 0.0f), static_cast<float>(coarse.width - 1));
+			int cx0 = static_cast<int>(cx);
+			int cx1 = std::min(cx0 + 1, coarse.width - 1);
+			float tx = cx - cx0;
+			const float* row0 = coarse.value.data() + cy0 * coarse.width;
+			const float* row1 = coarse.value.data() + cy1 * coarse.width;
+			float top = row0[cx0] + tx * (row0[cx1] - row0[cx0]);
+			float bottom = row1[cx0] + tx * (row1[cx1] - row1[cx0]);
+			float interpolated = top + ty * (bottom - top);
+
+			fine.value[idx] = w * fine.value[idx] + (1 - w) * interpolated;
+			fine.weight[idx] = 1;
+		}
+	}
+}
+
+int PushPullInpainter::fill(float* data, int stride,
+	int fillMinX, int fillMinY, int fillMaxX, int fillMaxY,
+	int sampleMinX, int sampleMinY, int sampleMaxX, int sampleMaxY,
+	float invalidValue, FrameFilterWorkerPool& pool)
+{
+	numHoles = 0;
+	numFilled = 0;
+	holeLevel = 0;
+	int fillWidth = fillMaxX - fillMinX;
+	int fillHeight = fillMaxY - fillMinY;
+	if (fillWidth <= 0 || fillHeight <= 0)
+		return 0;
+
+	allocateLevels(fillWidth, fillHeight);
+	Level& base = levels[0];
+
+	// Level 0: samples get weight 1, holes and pixels outside the sample rectangle weight 0
+	int bandHoles[FrameFilterWorkerPool::MAX_THREADS] = { 0 };
+	pool.run(0, fillHeight, [&](int firstRow, int lastRow, int band) {
+		for (int y = firstRow; y < lastRow; y++)
+		{
+			int fy = fillMinY + y;
+			const float* src = data + fy * stride + fillMinX;
+			float* value = base.value.data() + y * fillWidth;
+			float* weight = base.weight.data() + y * fillWidth;
+			for (int x = 0; x < fillWidth; x++)
+			{
+				int fx = fillMinX + x;
+				float val = src[x];
+				bool hole = (val == 0 || val == invalidValue);
+				bool inside = (fx >= sampleMinX && fx < sampleMaxX && fy >= sampleMinY && fy < sampleMaxY);
+				value[x] = val;
+				weight[x] = (!hole && inside) ? 1.0f : 0.0f;
+				if (hole)
+					bandHoles[band]++;
+			}
+		}
+	});
+	for (int i = 0; i < FrameFilterWorkerPool::MAX_THREADS; i++)
+		numHoles += bandHoles[i];
+	if (numHoles == 0 || levels.size() < 2)
+		return 0;
+
+	// Push: build the pyramid of weighted averages. The first reduction is the expensive one and is split between the threads
+	int numLevels = static_cast<int>(levels.size());
+	for (int k = 1; k < numLevels; k++)
+	{
+		if (k == 1)
+			pool.run(0, levels[1].height, [&](int firstRow, int lastRow, int) {
+				push(levels[0], levels[1], firstRow, lastRow);
+			});
+		else
+			push(levels[k - 1], levels[k], 0, levels[k].height);
+
+		const std::vector<float>& weight = levels[k].weight;
+		if (std::find_if(weight.begin(), weight.end(), [](float w) { return w < 1; }) == weight.end())
+		{
+			// Fully covered, coarser levels are not needed
+			numLevels = k + 1;
+			break;
+		}
+		holeLevel = k;
+	}
+
+	// No sample at all: nothing to interpolate from
+	if (levels[numLevels - 1].weight[0] == 0)
+		return 0;
+
+	// Pull: fill the partially covered pixels from the coarser level, coarse to fine
+	for (int k = numLevels - 2; k >= 1; k--)
+		pull(levels[k], levels[k + 1], 0, levels[k].height);
+
+	// Write back the holes of the frame
+	int bandFilled[FrameFilterWorkerPool::MAX_THREADS] = { 0 };
+	pool.run(0, fillHeight, [&](int firstRow, int lastRow, int band) {
+		pull(base, levels[1], firstRow, lastRow);
+		for (int y = firstRow; y < lastRow; y++)
+		{
+			float* dst = data + (fillMinY + y) * stride + fillMinX;
+			const float* value = base.value.data() + y * fillWidth;
+			for (int x = 0; x < fillWidth; x++)
+			{
+				if (dst[x] == 0 || dst[x] == invalidValue)
+				{
+					dst[x] = value[x];
+					bandFilled[band]++;
+				}
+			}
+		}
+	});
+	for (int i = 0; i < FrameFilterWorkerPool::MAX_THREADS; i++)
+		numFilled += bandFilled[i];
+	return numFilled;
+}
@@ -0,0 +1,77 @@
+/***********************************************************************
+PushPullInpainter - Fills the holes of the filtered depth frame with a
+push-pull image pyramid. Every hole is filled whatever its size, in time
+proportional to the number of pixels.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <vector>
+#include "FrameFilterWorkerPool.h"
+
+enum InpaintMode
+{
+	INPAINT_LOCAL_AVERAGE, // Average of the valid pixels in an 11x11 window, ROI average if there are none
+	INPAINT_PUSH_PULL // Push-pull pyramid interpolation
+};
+
+class PushPullInpainter
+{
+public:
+	PushPullInpainter();
+
+	// Fill the pixels of the fill rectangle equal to 0 or invalidValue. Only the pixels of the sample rectangle
+	// that are not holes are used as samples. Rectangles are [minX, maxX) x [minY, maxY) and the sample
+	// rectangle must lie inside the fill rectangle. Returns the number of filled pixels.
+	int fill(float* data, int stride,
+		int fillMinX, int fillMinY, int fillMaxX, int fillMaxY,
+		int sampleMinX, int sampleMinY, int sampleMaxX, int sampleMaxY,
+		float invalidValue, FrameFilterWorkerPool& pool);
+
+	// Statistics of the last call to fill()
+	int getNumHoles(){
+		return numHoles;
+	}
+
+	int getNumFilled(){
+		return numFilled;
+	}
+
+	// Coarsest pyramid level that still had holes (level k covers 2^k x 2^k pixels): an indication of the size of the largest hole
+	int getHoleLevel(){
+		return holeLevel;
+	}
+
+private:
+	struct Level
+	{
+		int width, height;
+		std::vector<float> value; // Weighted average of the samples covered by the pixel
+		std::vector<float> weight; // 1 for a pixel covered by samples, less for a partially covered pixel, 0 for a hole
+	};
+
+	void allocateLevels(int width, int height);
+	void push(const Level& fine, Level& coarse, int firstRow, int lastRow);
+	void pull(Level& fine, const Level& coarse, int firstRow, int lastRow);
+
+	std::vector<Level> levels;
+	int numHoles;
+	int numFilled;
+	int holeLevel;
+};
@@ -21,17 +21,40 @@ General Public License for more details.
 
 #include "Rs2Grabber.h"
 #include "ofConstants.h"
+#include "Profiler.h"
+
+// A restored filter state is trusted once this many live frames agreed with it
+static const int warmStartCheckFrames = 5;
+static const float warmStartTolerance = 30; // Depth units between a measure and the restored sand to agree
+static const float warmStartMinAgreement = 0.9f; // Share of the measured ROI pixels that have to agree
 
 Rs2Grabber::Rs2Grabber()
 :newFrame(true),
 bufferInitiated(false),
-rs2Opened(false)
+rs2Opened(false),
+warmStartState(WARMSTART_NONE),
+warmStartFrames(0),
+detectOccluders(true),
+numOccluderPixels(0),
+numUnstablePixels(0),
+numBigChangeResets(0),
+framesProcessedMetric(MetricsRegistry::get().counter("magicsand_frames_processed_total", "Depth frames filtered by the grabber")),
+bigChangeResetsMetric(MetricsRegistry::get().counter("magicsand_filter_big_change_resets_total", "Pixels whose averaging slots were reset by a big change (quick reaction)")),
+unstablePixelsMetric(MetricsRegistry::get().gauge("magicsand_unstable_pixels", "ROI pixels failing the stability test in the last frame")),
+inpaintedPixelsMetric(MetricsRegistry::get().gauge("magicsand_inpainted_pixels", "Pixels filled by inpainting in the last frame")),
+inpaintedLocalMetric(MetricsRegistry::get().counter("magicsand_inpainted_local_pixels_total", "Pixels filled from their neighbourhood (setToLocalAvg)")),
+inpaintedGlobalMetric(MetricsRegistry::get().counter("magicsand_inpainted_global_pixels_total", "Pixels filled with the ROI average (setToGlobalAvg)")),
+processTimeMetric(MetricsRegistry::get().histogram("magicsand_grabber_frame_seconds", "Filter chain duration per depth frame", { 0.002, 0.005, 0.01, 0.02, 0.033, 0.05, 0.1 })),
+occluderPixelsMetric(MetricsRegistry::get().gauge("magicsand_occluder_pixels", "Pixels covered by hands or objects above the sand in the last frame")),
+recording(false),
+numRecordedFrames(0)
 {
 }
 
 Rs2Grabber::~Rs2Grabber(){
     //    stop();
     waitForThread(true);
+    releaseBuffers(); // A grabber whose thread never ran (benchmarks) still holds them
 }
 
 /// Start the thread.
@@ -46,30 +69,65 @@ void Rs2Grabber::stop(){
     stopThread();
 }
 
-bool Rs2Grabber::setup(){
+bool Rs2Grabber::setup(FrameSourceType sourceType){
+	ofLogVerbose("Rs2Grabber") << "setup(): Frame source: " << getFrameSourceTypeName(sourceType);
+	return setup(createFrameSource(sourceType));
+}
+
+bool Rs2Grabber::setup(std::shared_ptr<FrameSource> source){
 	// settings and defaults
-	storedframes = 0;
+	frameSequence = 0;
+	gradFieldcols = 0;
+	gradFieldrows = 0;
+	gradFieldresolution = 0;
 	ROIAverageValue = 0;
 	setToGlobalAvg = 0;
 	setToLocalAvg = 0;
 	doInPaint = 0;
 	doFullFrameFiltering = false;
+	vectorizedFilter = true;
+	filterMode = FRAMEFILTER_MODE_SLOTS;
+	inpaintMode = INPAINT_PUSH_PULL;
+	computeDerivatives = true;
+	elevationBasePlaneEq = ofVec4f(0, 0, 0, 0);
+	spatialFilterMode = SPATIALFILTER_RECURSIVE_GAUSSIAN;
+	setSpatialSigma(SPATIALFILTER_BINOMIAL_SIGMA);
+	filterKernelType = detectFrameFilterKernel();
+	filterRowKernel = getFrameFilterRowKernel(filterKernelType);
+	ofLogVerbose("Rs2Grabber") << "setup(): Temporal filter kernel: " << getFrameFilterKernelName(filterKernelType);
+	numFilterThreads = min(4, FrameFilterWorkerPool::getMaxThreads());
+	workerPool.setNumThreads(numFilterThreads);
+	filterTime = 0;
+	for (int i = 0; i <= FrameFilterWorkerPool::MAX_THREADS; i++)
+	{
+		filterTimeByThreads[i] = 0;
+		speedupResults[i] = 0;
+	}
+	speedupThreads = 0;
+	ofLogVerbose("Rs2Grabber") << "setup(): Filter threads: " << numFilterThreads << " of " << FrameFilterWorkerPool::getMaxThreads();
 
-	rs2.init();
-	rs2.setRegistration(true); // To have correspondance between RGB and depth images
-	rs2.setUseTexture(false);
-	width = rs2.getWidth();
-	height = rs2.getHeight();
+	cameraSource = source;
+	replaySource.reset();
+	width = cameraSource->getWidth();
+	height = cameraSource->getHeight();
 
 	rs2DepthImage.allocate(width, height, 1);
     filteredframe.allocate(width, height, 1);
+    referenceFrame.resize(width*height);
+    frameDirtyTiles.setup(width, height);
+    pendingDirtyTiles.setup(width, height);
+    allTilesDirty = true;
+    numDirtyTiles = 0;
+    inpaintSource.resize(width*height);
+    spatialScratch.resize(width*height);
     rs2ColorImage.allocate(width, height);
     rs2ColorImage.setUseTexture(false);
+    framePackets.allocate(width, height, 0, 0);
 	return openRs2();
 }
 
 bool Rs2Grabber::openRs2() {
-	rs2Opened = rs2.open();
+	rs2Opened = cameraSource->open();
 	return rs2Opened;
 }
 void Rs2Grabber::setupFramefilter(int sgradFieldresolution, float newMaxOffset, ofRectangle ROI, bool sspatialFilter, bool sfollowBigChange, int snumAveragingSlots) {
@@ -102,31 +160,69 @@ void Rs2Grabber::setupFramefilter(int sgradFieldresolution, float newMaxOffset,
 }
 
 void Rs2Grabber::initiateBuffers(void){
+    releaseBuffers(); // setupFramefilter() initiates the buffers twice
 	filteredframe.set(0);
 
-    averagingBuffer=new float[numAveragingSlots*height*width];
-    float* averagingBufferPtr=averagingBuffer;
-    for(int i=0;i<numAveragingSlots;++i)
-        for(unsigned int y=0;y<height;++y)
-            for(unsigned int x=0;x<width;++x,++averagingBufferPtr)
-                *averagingBufferPtr=initialValue;
-    
+    averagingBuffer = nullptr;
+    statBuffer = nullptr;
+    compactRing = nullptr;
+    compactCount = nullptr;
+    compactSum = nullptr;
+    compactSumSq = nullptr;
+    recursiveMean = nullptr;
+    recursiveVariance = nullptr;
+    recursiveCount = nullptr;
     averagingSlotIndex=0;
-    
-    /* Initialize the statistics buffer: */
-    statBuffer=new float[height*width*3];
-    float* sbPtr=statBuffer;
-    for(unsigned int y=0;y<height;++y)
-        for(unsigned int x=0;x<width;++x)
-            for(int i=0;i<3;++i,++sbPtr)
-                *sbPtr=0.0;
-    
-    /* Initialize the valid buffer: */
-    validBuffer=new float[height*width];
-    float* vbPtr=validBuffer;
-    for(unsigned int y=0;y<height;++y)
-        for(unsigned int x=0;x<width;++x,++vbPtr)
-            *vbPtr=initialValue;
+
+    /* The state planes only cover the ROI, rows padded to 16 pixels so float rows start on a cache line: */
+    stateStride = (max(maxX-minX, 0)+15) & ~static_cast<size_t>(15);
+    statePlaneSize = stateStride*max(maxY-minY, 0);
+    if (filterMode == FRAMEFILTER_MODE_COMPACT)
+        compactRingStride = getCompactRingStride(numAveragingSlots);
+
+    /* Carve all the planes from one block, each plane starting on a cache line: */
+    size_t stateBytes = 0;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        unsigned char* base = pass == 0 ? nullptr : stateStorage + ((64 - (reinterpret_cast<uintptr_t>(stateStorage) & 63)) & 63);
+        size_t planeOffset = 0;
+        auto plane = [&](size_t pixelBytes) {
+            unsigned char* p = base ? base + planeOffset : nullptr;
+            planeOffset += (statePlaneSize*pixelBytes + 63) & ~static_cast<size_t>(63);
+            return p;
+        };
+        if (filterMode == FRAMEFILTER_MODE_COMPACT)
+        {
+            compactRing = reinterpret_cast<uint16_t*>(plane(compactRingStride*sizeof(uint16_t)));
+            compactCount = plane(sizeof(uint8_t));
+            compactSum = reinterpret_cast<uint32_t*>(plane(sizeof(uint32_t)));
+            compactSumSq = reinterpret_cast<uint64_t*>(plane(sizeof(uint64_t)));
+        }
+        else if (filterMode == FRAMEFILTER_MODE_RECURSIVE)
+        {
+            recursiveMean = reinterpret_cast<float*>(plane(sizeof(float)));
+            recursiveVariance = reinterpret_cast<float*>(plane(sizeof(float)));
+            recursiveCount = reinterpret_cast<uint16_t*>(plane(sizeof(uint16_t)));
+        }
+        else
+        {
+            averagingBuffer = reinterpret_cast<float*>(plane(numAveragingSlots*sizeof(float)));
+            statBuffer = reinterpret_cast<float*>(plane(3*sizeof(float)));
+        }
+        validBuffer = reinterpret_cast<float*>(plane(sizeof(float)));
+        if (pass == 0)
+        {
+            stateBytes = planeOffset;
+            stateStorage = new unsigned char[stateBytes + 63];
+        }
+    }
+    ofLogVerbose("Rs2Grabber") << "initiateBuffers(): Temporal filter state: " << stateBytes / 1024 << " kB for a " << maxX-minX << " x " << maxY-minY << " ROI";
+
+    /* Ring, integer statistics and estimates start at 0 (no sample), slots and valid values at the initial value: */
+    memset(stateStorage, 0, stateBytes + 63);
+    if (averagingBuffer)
+        std::fill(averagingBuffer, averagingBuffer+numAveragingSlots*statePlaneSize, initialValue);
+    std::fill(validBuffer, validBuffer+statePlaneSize, initialValue);
     
     /* Initialize the gradient field buffer: */
     gradField = new ofVec2f[gradFieldcols*gradFieldrows];
@@ -135,55 +231,166 @@ void Rs2Grabber::initiateBuffers(void){
         for(unsigned int x=0;x<gradFieldcols;++x,++gfPtr)
             *gfPtr=ofVec2f(0);
     
+    occluderDetector.reset();
     bufferInitiated = true;
+    allTilesDirty = true;
     currentInitFrame = 0;
     firstImageReady = false;
+    warmStartFrames = 0;
+    if (warmStartState == WARMSTART_VALIDATING)
+        warmStartState = WARMSTART_NONE;
 }
 
-void Rs2Grabber::resetBuffers(void){
+void Rs2Grabber::releaseBuffers(void){
     if (bufferInitiated){
         bufferInitiated = false;
-        delete[] averagingBuffer;
-        delete[] statBuffer;
-        delete[] validBuffer;
+        delete[] stateStorage;
         delete[] gradField;
     }
+}
+
+void Rs2Grabber::resetBuffers(void){
+    releaseBuffers();
     initiateBuffers();
 }
 
 void Rs2Grabber::threadedFunction() {
+    Profiler::setThreadName("Rs2Grabber");
 	while(isThreadRunning()) {
-        this->actionsLock.lock(); // Update the grabber state if needed
-        for(auto & action : this->actions) {
-            action(*this);
-        }
-        this->actions.clear();
-        this->actionsLock.unlock();
-        
-        rs2.update();
-        if(rs2.isFrameNew()){
-            rs2DepthImage = rs2.getRawDepthPixels();
-            filter();
-            filteredframe.setImageType(OF_IMAGE_GRAYSCALE);
-            updateGradientField();
-			rs2ColorImage.setFromPixels(rs2.getPixels());
-        }
-        if (storedframes == 0)
         {
-            filtered.send(std::move(filteredframe));
-			gradient.send(std::move(gradField));
-            colored.send(std::move(rs2ColorImage.getPixels()));
-            lock();
-            storedframes += 1;
-            unlock();
+            PROFILE_ZONE("Rs2Grabber actions");
+            runActions(); // Update the grabber state if needed
         }
         
+        if (!processNextFrame() && !getFrameSource()->isLive())
+            ofSleepMillis(1); // Not due yet (synthetic frames, real-time or stepped playback)
     }
-    rs2.close();
-    delete[] averagingBuffer;
-    delete[] statBuffer;
-    delete[] validBuffer;
-    delete[] gradField;
+    // Actions queued right before the stop (e.g. the snapshot saved on exit) still see the buffers and the camera
+    runActions();
+    cameraSource->close();
+    recorder.close();
+    recording = false;
+    releaseBuffers();
+}
+
+bool Rs2Grabber::processNextFrame()
+{
+    uint64_t captureTime;
+    {
+        PROFILE_ZONE("grabFrame");
+        if (!grabFrame(captureTime))
+            return false;
+    }
+    PROFILE_FRAME_MARK("Depth frame");
+    PROFILE_ZONE("Rs2Grabber frame");
+
+    if (recorder.isOpen())
+    {
+        PROFILE_ZONE("Record frame");
+        if (!recorder.addFrame(rs2DepthImage.getData(), rs2ColorImage.getPixels().getData(), captureTime))
+            recording = false; // The recorder closed the file
+        numRecordedFrames = recorder.getNumFrames();
+    }
+
+    // The derivatives are computed straight into the packet, the rest is copied when it is published
+    FramePacket& packet = framePackets.getWritePacket();
+    packet.allocate(width, height, gradFieldcols, gradFieldrows);
+    packet.latency.clear();
+    packet.latency.time[LATENCY_CAPTURED] = captureTime;
+
+    uint64_t filterStart = ofGetElapsedTimeMicros();
+    {
+        PROFILE_ZONE("filter");
+        filter();
+    }
+    packet.latency.mark(LATENCY_FILTERED);
+    filteredframe.setImageType(OF_IMAGE_GRAYSCALE);
+    {
+        PROFILE_ZONE("updateDirtyTiles");
+        updateDirtyTiles();
+    }
+    {
+        PROFILE_ZONE("updateGradientField");
+        updateGradientField();
+    }
+    packet.hasDerivatives = computeDerivatives;
+    if (computeDerivatives)
+    {
+        PROFILE_ZONE("TerrainDerivatives::compute");
+        packet.derivatives.compute(filteredframe.getData(), width, height, minX, minY, maxX, maxY, workerPool);
+    }
+    packet.hasElevation = ofVec3f(elevationBasePlaneEq).lengthSquared() > 0;
+    if (packet.hasElevation)
+    {
+        PROFILE_ZONE("updateElevation");
+        updateElevation(packet);
+    }
+    packet.latency.mark(LATENCY_PROCESSED);
+    uint64_t processMicros = ofGetElapsedTimeMicros() - filterStart;
+    updateFilterTiming(processMicros);
+    updateMetrics(processMicros);
+    {
+        PROFILE_ZONE("publishFrame");
+        publishFrame(packet, captureTime);
+    }
+    return true;
+}
+
+// Get the next depth and color frames from the camera or the session being replayed
+bool Rs2Grabber::grabFrame(uint64_t& captureTime)
+{
+    std::shared_ptr<FrameSource> source = getFrameSource();
+    if (!source->poll())
+        return false;
+    captureTime = source->getTimestamp();
+    rs2DepthImage = source->getDepthPixels();
+    rs2ColorImage.setFromPixels(source->getColorPixels());
+    return true;
+}
+
+void Rs2Grabber::startRecording(const std::string& path)
+{
+    recording = true;
+    numRecordedFrames = 0;
+    performInThread([path](Rs2Grabber & kg) {
+        if (!kg.recorder.open(path, kg.width, kg.height, kg.getWorldMatrix()))
+            kg.recording = false;
+    });
+}
+
+void Rs2Grabber::stopRecording()
+{
+    recording = false;
+    performInThread([](Rs2Grabber & kg) {
+        kg.recorder.close();
+    });
+}
+
+void Rs2Grabber::setReplay(std::shared_ptr<SessionPlayer> player)
+{
+    if (player && (player->getWidth() != (int)width || player->getHeight() != (int)height))
+    {
+        ofLogError("Rs2Grabber") << "setReplay(): Recording is " << player->getWidth() << " x " << player->getHeight()
+            << ", the grabber expects " << width << " x " << height;
+        return;
+    }
+    if (player)
+        replaySource = std::make_shared<ReplayFrameSource>(player);
+    else
+        replaySource.reset();
+    ofLogVerbose("Rs2Grabber") << "setReplay(): " << (replaySource ? "Replaying a recorded session" : "Back to the " + cameraSource->getName());
+
+    // The temporal filter restarts on the new stream
+    resetBuffers();
+}
+
+void Rs2Grabber::runActions() {
+    this->actionsLock.lock();
+    for(auto & action : this->actions) {
+        action(*this);
+    }
+    this->actions.clear();
+    this->actionsLock.unlock();
 }
 
 void Rs2Grabber::performInThread(std::function<void(Rs2Grabber&)> action) {
@@ -193,107 +400,177 @@ void Rs2Grabber::performInThread(std::function<void(Rs2Grabber&)> action) {
 }
 
 void Rs2Grabber::depth_filtering(){
+    // Occluded pixels lost their raw sample, they show the sand seen before the occluder came
+    const unsigned char* occluders = (detectOccluders && numOccluderPixels > 0) ? occluderDetector.getMask().getData() : nullptr;
+    const float* sandEstimate = occluderDetector.getSandEstimate();
+
+    // We only scan rs2 ROI, one band of rows per thread
+    workerPool.run(minY, maxY, [this, occluders, sandEstimate](int firstRow, int lastRow, int) {
+        const RawDepth* inputFramePtr = static_cast<const RawDepth*>(rs2DepthImage.getData());
+        float* filteredFramePtr = filteredframe.getData();
+        inputFramePtr += firstRow*width;
+        filteredFramePtr += firstRow*width;
+
+        for (int y = firstRow; y < lastRow; ++y)
+        {
+            inputFramePtr += minX;
+            filteredFramePtr += minX;
+
+            for (int x = minX; x < maxX; ++x, ++inputFramePtr, ++filteredFramePtr)
+            {
+                float newVal = static_cast<float>(*inputFramePtr);
+                *filteredFramePtr = newVal;
+            }
+            inputFramePtr += width - maxX;
+            filteredFramePtr += width - maxX;
+
+            if (occluders)
+            {
+                size_t offset = y*width;
+                for (int x = minX; x < maxX; ++x)
+                    if (occluders[offset+x])
+                        filteredframe.getData()[offset+x] = sandEstimate[offset+x];
+            }
+        }
+    });
+}
+
+FrameFilterParams Rs2Grabber::getFrameFilterParams(){
+    FrameFilterParams params;
+    params.numAveragingSlots = numAveragingSlots;
+    params.slotStride = statePlaneSize;
+    params.minNumSamples = minNumSamples;
+    params.maxVariance = maxVariance;
+    params.hysteresis = hysteresis;
+    params.bigChange = bigChange;
+    params.maxOffset = maxOffset;
+    params.initialValue = initialValue;
+    params.followBigChange = followBigChange;
+    return params;
+}
+
+// Temporal filter on the slot-major float averaging buffer
+void Rs2Grabber::filterSlots(){
+    const FrameFilterParams params = getFrameFilterParams();
+    FrameFilterRowKernel kernel = vectorizedFilter ? filterRowKernel : filterRowScalar;
     const RawDepth* inputFramePtr = static_cast<const RawDepth*>(rs2DepthImage.getData());
     float* filteredFramePtr = filteredframe.getData();
-    inputFramePtr += minY*width;  // We only scan rs2 ROI
-    filteredFramePtr += minY*width;
-    
-    for (unsigned int y = minY; y < maxY; ++y)
-    {
-        inputFramePtr += minX;
-        filteredFramePtr += minX;
-        
-        for (unsigned int x = minX; x < maxX; ++x, ++inputFramePtr, ++filteredFramePtr)
+    float* averagingBufferPtr = averagingBuffer+averagingSlotIndex*statePlaneSize;
+    FrameFilterRowStats bandStats[FrameFilterWorkerPool::MAX_THREADS] = {};
+
+    // We only scan rs2 ROI, one row at a time. Pixels are independent so each thread takes a band of rows
+    workerPool.run(minY, maxY, [&](int firstRow, int lastRow, int band) {
+        FrameFilterRow row;
+        row.count = maxX-minX;
+        for(int y=firstRow ; y<lastRow ; ++y)
+        {
+            size_t offset = y*width+minX;
+            size_t stateOffset = (y-minY)*stateStride;
+            row.input = inputFramePtr+offset;
+            row.averagingSlot = averagingBufferPtr+stateOffset;
+            row.averagingBase = averagingBuffer+stateOffset;
+            row.sampleCount = statBuffer+stateOffset;
+            row.sampleSum = statBuffer+statePlaneSize+stateOffset;
+            row.sampleSumSq = statBuffer+2*statePlaneSize+stateOffset;
+            row.valid = validBuffer+stateOffset;
+            row.filtered = filteredFramePtr+offset;
+            FrameFilterRowStats stats = kernel(params, row);
+            bandStats[band].numResets += stats.numResets;
+            bandStats[band].numUnstable += stats.numUnstable;
+        }
+    });
+    sumFilterStats(bandStats);
+}
+
+// Temporal filter on the pixel-major integer ring
+void Rs2Grabber::filterCompact(){
+    const FrameFilterParams params = getFrameFilterParams();
+    const RawDepth* inputFramePtr = static_cast<const RawDepth*>(rs2DepthImage.getData());
+    float* filteredFramePtr = filteredframe.getData();
+    FrameFilterRowStats bandStats[FrameFilterWorkerPool::MAX_THREADS] = {};
+
+    workerPool.run(minY, maxY, [&](int firstRow, int lastRow, int band) {
+        FrameFilterCompactRow row;
+        row.count = maxX-minX;
+        row.ringStride = compactRingStride;
+        row.slot = averagingSlotIndex;
+        for(int y=firstRow ; y<lastRow ; ++y)
         {
-            float newVal = static_cast<float>(*inputFramePtr);
-            *filteredFramePtr = newVal;
+            size_t offset = y*width+minX;
+            size_t stateOffset = (y-minY)*stateStride;
+            row.input = inputFramePtr+offset;
+            row.ring = compactRing+stateOffset*compactRingStride;
+            row.sampleCount = compactCount+stateOffset;
+            row.sampleSum = compactSum+stateOffset;
+            row.sampleSumSq = compactSumSq+stateOffset;
+            row.valid = validBuffer+stateOffset;
+            row.filtered = filteredFramePtr+offset;
+            FrameFilterRowStats stats = filterCompactRow(params, row);
+            bandStats[band].numResets += stats.numResets;
+            bandStats[band].numUnstable += stats.numUnstable;
         }
-        inputFramePtr += width - maxX;
-        filteredFramePtr += width - maxX;
+    });
+    sumFilterStats(bandStats);
+}
+
+// Temporal filter on the recursive per pixel estimates
+void Rs2Grabber::filterRecursive(){
+    const FrameFilterParams params = getFrameFilterParams();
+    const RawDepth* inputFramePtr = static_cast<const RawDepth*>(rs2DepthImage.getData());
+    float* filteredFramePtr = filteredframe.getData();
+    FrameFilterRowStats bandStats[FrameFilterWorkerPool::MAX_THREADS] = {};
+
+    workerPool.run(minY, maxY, [&](int firstRow, int lastRow, int band) {
+        FrameFilterRecursiveRow row;
+        row.count = maxX-minX;
+        for(int y=firstRow ; y<lastRow ; ++y)
+        {
+            size_t offset = y*width+minX;
+            size_t stateOffset = (y-minY)*stateStride;
+            row.input = inputFramePtr+offset;
+            row.mean = recursiveMean+stateOffset;
+            row.variance = recursiveVariance+stateOffset;
+            row.sampleCount = recursiveCount+stateOffset;
+            row.valid = validBuffer+stateOffset;
+            row.filtered = filteredFramePtr+offset;
+            FrameFilterRowStats stats = filterRecursiveRow(params, row);
+            bandStats[band].numResets += stats.numResets;
+            bandStats[band].numUnstable += stats.numUnstable;
+        }
+    });
+    sumFilterStats(bandStats);
+}
+
+void Rs2Grabber::sumFilterStats(const FrameFilterRowStats* bandStats){
+    numBigChangeResets = 0;
+    numUnstablePixels = 0;
+    for (int i = 0; i < FrameFilterWorkerPool::MAX_THREADS; i++)
+    {
+        numBigChangeResets += bandStats[i].numResets;
+        numUnstablePixels += bandStats[i].numUnstable;
     }
 }
 
 void Rs2Grabber::filter(){
 	if (bufferInitiated)
     {
-        const RawDepth* inputFramePtr = static_cast<const RawDepth*>(rs2DepthImage.getData());
-        float* filteredFramePtr = filteredframe.getData();
-        float* averagingBufferPtr = averagingBuffer+averagingSlotIndex*height*width;
-        float* statBufferPtr = statBuffer;
-        float* validBufferPtr = validBuffer;
-        inputFramePtr += minY*width;  // We only scan rs2 ROI
-        averagingBufferPtr += minY*width;
-        statBufferPtr += minY*width*3;
-        validBufferPtr += minY*width;
-        filteredFramePtr += minY*width;
-
-		for(unsigned int y=minY ; y<maxY ; ++y)
-        {
-            inputFramePtr += minX;
-            averagingBufferPtr += minX;
-            statBufferPtr += minX*3;
-            validBufferPtr += minX;
-            filteredFramePtr += minX;
-            for(unsigned int x=minX ; x<maxX ; ++x,++inputFramePtr,++averagingBufferPtr,statBufferPtr+=3,++validBufferPtr,++filteredFramePtr)
-            {
-                float newVal = static_cast<float>(*inputFramePtr);
-                float oldVal = *averagingBufferPtr;
-                
-				if(newVal > maxOffset)//we are under the ceiling plane
-                {
-                    *averagingBufferPtr = newVal; // Store the value
-                    if (followBigChange && statBufferPtr[0] > 0){ // Follow big changes
-                        float oldFiltered = statBufferPtr[1]/statBufferPtr[0]; // Compare newVal with average
-                        if(oldFiltered-newVal >= bigChange || newVal-oldFiltered >= bigChange)
-                        {
-                            float* aaveragingBufferPtr;
-                            for (int i = 0; i < numAveragingSlots; i++){ // update all averaging slots
-                                aaveragingBufferPtr = averagingBuffer + i*height*width + y*width +x;
-                                *aaveragingBufferPtr = newVal;
-                            }
-                            statBufferPtr[0] = numAveragingSlots; //Update statistics
-                            statBufferPtr[1] = newVal*numAveragingSlots;
-                            statBufferPtr[2] = newVal*newVal*numAveragingSlots;
-                        }
-                    }
-                    // Update the pixel's statistics:
-                    ++statBufferPtr[0]; // Number of valid samples
-                    statBufferPtr[1] += newVal; // Sum of valid samples
-                    statBufferPtr[2] += newVal*newVal; // Sum of squares of valid samples
-                    
-                    // Check if the previous value in the averaging buffer was not initiated
-                    if(oldVal != initialValue)
-                    {
-                        --statBufferPtr[0]; // Number of valid samples
-                        statBufferPtr[1] -= oldVal; // Sum of valid samples
-                        statBufferPtr[2] -= oldVal * oldVal; // Sum of squares of valid samples
-                    }
-                }
-                // Check if the pixel is "stable":
-                if(statBufferPtr[0] >= minNumSamples &&
-                   statBufferPtr[2]*statBufferPtr[0] <= maxVariance*statBufferPtr[0]*statBufferPtr[0] + statBufferPtr[1]*statBufferPtr[1])
-                {
-                    // Check if the new running mean is outside the previous value's envelope:
-                    float newFiltered = statBufferPtr[1]/statBufferPtr[0];
-                    if(abs(newFiltered-*validBufferPtr) >= hysteresis)
-                    {
-                        // Set the output pixel value to the depth-corrected running mean:
-                        *filteredFramePtr = *validBufferPtr = newFiltered;
-                    } else {
-                        // Leave the pixel at its previous value:
-                        *filteredFramePtr = *validBufferPtr;
-                    }
-                }
-                *filteredFramePtr = *validBufferPtr;
-			}
-            inputFramePtr += width-maxX;
-            averagingBufferPtr += width-maxX;
-            statBufferPtr += (width-maxX)*3;
-            validBufferPtr += width-maxX;
-            filteredFramePtr += width-maxX;
-        }
-        // Go to the next averaging slot:
-        if(++averagingSlotIndex==numAveragingSlots)
+        // Occluded pixels get no sample, so the temporal filter keeps the sand it had under them
+        numOccluderPixels = 0;
+        if (detectOccluders)
+            numOccluderPixels = occluderDetector.detect(rs2DepthImage.getData(), width, height, minX, minY, maxX, maxY, maxOffset, workerPool);
+
+        if (warmStartFrames > 0)
+            validateWarmStart();
+
+        if (filterMode == FRAMEFILTER_MODE_COMPACT)
+            filterCompact();
+        else if (filterMode == FRAMEFILTER_MODE_RECURSIVE)
+            filterRecursive();
+        else
+            filterSlots();
+
+        // Go to the next averaging slot (the recursive estimates can change their number of slots on the fly):
+        if(++averagingSlotIndex>=numAveragingSlots)
             averagingSlotIndex=0;
         
         if (!firstImageReady){
@@ -306,7 +583,10 @@ void Rs2Grabber::filter(){
         depth_filtering();
 		if (doInPaint)
 		{
-			applySimpleOutlierInpainting();
+			if (inpaintMode == INPAINT_PUSH_PULL)
+				applyPushPullInpainting();
+			else
+				applySimpleOutlierInpainting();
 		}
 
         // Apply a spatial filter if requested:
@@ -317,6 +597,245 @@ void Rs2Grabber::filter(){
 	}
 }
 
+void Rs2Grabber::setVectorizedFilter(bool vf)
+{
+	vectorizedFilter = vf;
+	ofLogVerbose("Rs2Grabber") << "setVectorizedFilter(): Temporal filter kernel: " << getFrameFilterKernelName(vectorizedFilter ? filterKernelType : FRAMEFILTER_KERNEL_SCALAR);
+}
+
+void Rs2Grabber::setFilterMode(FrameFilterMode mode)
+{
+	releaseBuffers();
+	filterMode = mode;
+	ofLogVerbose("Rs2Grabber") << "setFilterMode(): Temporal filter state: " << getFrameFilterModeName(filterMode);
+	initiateBuffers();
+}
+
+void Rs2Grabber::setNumFilterThreads(int n)
+{
+	numFilterThreads = max(1, min(n, FrameFilterWorkerPool::getMaxThreads()));
+	if (speedupThreads == 0)
+		workerPool.setNumThreads(numFilterThreads);
+	ofLogVerbose("Rs2Grabber") << "setNumFilterThreads(): Filter threads: " << numFilterThreads;
+}
+
+float Rs2Grabber::getFilterSpeedup()
+{
+	int n = workerPool.getNumThreads();
+	if (filterTimeByThreads[1] == 0 || filterTimeByThreads[n] == 0)
+		return 0;
+	return filterTimeByThreads[1] / filterTimeByThreads[n];
+}
+
+void Rs2Grabber::startSpeedupMeasurement()
+{
+	ofLogNotice("Rs2Grabber") << "startSpeedupMeasurement(): Timing the filter chain with 1 to " << FrameFilterWorkerPool::getMaxThreads() << " threads";
+	speedupThreads = 1;
+	speedupFrames = 0;
+	speedupMicros = 0;
+	workerPool.setNumThreads(speedupThreads);
+}
+
+// Pixel-major planes of the temporal filter state, in the order they are stored in a snapshot
+std::vector<FilterStatePlane> Rs2Grabber::getFilterStatePlanes(){
+    std::vector<FilterStatePlane> planes;
+    auto addPlane = [&](void* data, size_t pixelBytes) {
+        planes.push_back({ static_cast<unsigned char*>(data), static_cast<uint32_t>(pixelBytes), stateStride*pixelBytes });
+    };
+    if (filterMode == FRAMEFILTER_MODE_COMPACT)
+    {
+        addPlane(compactRing, compactRingStride*sizeof(uint16_t));
+        addPlane(compactCount, sizeof(uint8_t));
+        addPlane(compactSum, sizeof(uint32_t));
+        addPlane(compactSumSq, sizeof(uint64_t));
+    }
+    else if (filterMode == FRAMEFILTER_MODE_RECURSIVE)
+    {
+        addPlane(recursiveMean, sizeof(float));
+        addPlane(recursiveVariance, sizeof(float));
+        addPlane(recursiveCount, sizeof(uint16_t));
+    }
+    else
+    {
+        for (int i = 0; i < numAveragingSlots; i++)
+            addPlane(averagingBuffer + i*statePlaneSize, sizeof(float));
+        for (int i = 0; i < 3; i++)
+            addPlane(statBuffer + i*statePlaneSize, sizeof(float));
+    }
+    addPlane(validBuffer, sizeof(float));
+    return planes;
+}
+
+FilterSnapshotHeader Rs2Grabber::getSnapshotHeader(const FilterSnapshotCalibration& calibration){
+    FilterSnapshotHeader header = FilterSnapshotHeader();
+    header.width = width;
+    header.height = height;
+    header.minX = minX;
+    header.minY = minY;
+    header.maxX = maxX;
+    header.maxY = maxY;
+    header.filterMode = filterMode;
+    header.numAveragingSlots = numAveragingSlots;
+    header.averagingSlotIndex = averagingSlotIndex;
+    std::vector<FilterStatePlane> planes = getFilterStatePlanes();
+    header.numPlanes = planes.size();
+    for (size_t i = 0; i < planes.size() && i < FilterSnapshotHeader::MAX_PLANES; i++)
+        header.planePixelBytes[i] = planes[i].pixelBytes;
+    memcpy(header.worldMatrix, getWorldMatrix().getPtr(), sizeof(header.worldMatrix));
+    header.calibration = calibration;
+    return header;
+}
+
+bool Rs2Grabber::saveSnapshot(const std::string& path, const FilterSnapshotCalibration& calibration){
+    // A state still stabilizing (or not checked yet) would be restored as if it was stable
+    if (!bufferInitiated || !firstImageReady || warmStartFrames > 0)
+        return false;
+    // A background save of the same file is finished first, both write next to path
+    snapshotWriter.wait();
+    uint64_t start = ofGetElapsedTimeMicros();
+    if (!::saveFilterSnapshot(path, getSnapshotHeader(calibration), getFilterStatePlanes()))
+        return false;
+    ofLogVerbose("Rs2Grabber") << "saveSnapshot(): Filter state saved to " << path << " in " << (ofGetElapsedTimeMicros() - start) / 1000 << " ms";
+    return true;
+}
+
+bool Rs2Grabber::saveSnapshotInBackground(const std::string& path, const FilterSnapshotCalibration& calibration){
+    if (!bufferInitiated || !firstImageReady || warmStartFrames > 0)
+        return false;
+    uint64_t start = ofGetElapsedTimeMicros();
+    if (!snapshotWriter.submit(path, getSnapshotHeader(calibration), getFilterStatePlanes()))
+        return false;
+    ofLogVerbose("Rs2Grabber") << "saveSnapshotInBackground(): Filter state copied in " << (ofGetElapsedTimeMicros() - start) / 1000 << " ms";
+    return true;
+}
+
+bool Rs2Grabber::loadSnapshot(const std::string& path, const FilterSnapshotCalibration& calibration){
+    if (!bufferInitiated)
+        return false;
+    FilterSnapshotHeader header = getSnapshotHeader(calibration);
+    std::string reason;
+    if (!::loadFilterSnapshot(path, header, getFilterStatePlanes(), reason))
+    {
+        ofLogNotice("Rs2Grabber") << "loadSnapshot(): Filter snapshot not restored: " << reason;
+        warmStartState = WARMSTART_NONE;
+        return false;
+    }
+    averagingSlotIndex = header.averagingSlotIndex;
+    allTilesDirty = true;
+    currentInitFrame = 0;
+    firstImageReady = false;
+    warmStartState = WARMSTART_VALIDATING;
+    warmStartFrames = warmStartCheckFrames;
+    ofLogNotice("Rs2Grabber") << "loadSnapshot(): Filter state restored from " << path << " (saved " << ofGetUnixTime() - header.savedTime << " s ago), checking it against the live frames";
+    return true;
+}
+
+// Compare the next live frames to the restored sand before the state is used. Pixels without a measure, above the
+// ceiling, under an occluder or never stable in the snapshot have no say.
+void Rs2Grabber::validateWarmStart(){
+    int bandMeasured[FrameFilterWorkerPool::MAX_THREADS] = { 0 };
+    int bandAgreeing[FrameFilterWorkerPool::MAX_THREADS] = { 0 };
+    const RawDepth* inputFramePtr = static_cast<const RawDepth*>(rs2DepthImage.getData());
+    workerPool.run(minY, maxY, [&](int firstRow, int lastRow, int band) {
+        for (int y = firstRow; y < lastRow; ++y)
+        {
+            const RawDepth* input = inputFramePtr + y*width + minX;
+            const float* valid = validBuffer + (y-minY)*stateStride;
+            for (int x = 0; x < maxX-minX; ++x)
+            {
+                float newVal = static_cast<float>(input[x]);
+                float restored = valid[x];
+                if (newVal <= maxOffset || restored == initialValue)
+                    continue;
+                bandMeasured[band]++;
+                if (fabs(newVal - restored) <= warmStartTolerance)
+                    bandAgreeing[band]++;
+            }
+        }
+    });
+    int measured = 0, agreeing = 0;
+    for (int i = 0; i < FrameFilterWorkerPool::MAX_THREADS; i++)
+    {
+        measured += bandMeasured[i];
+        agreeing += bandAgreeing[i];
+    }
+
+    if (measured == 0 || agreeing < warmStartMinAgreement * measured)
+    {
+        ofLogNotice("Rs2Grabber") << "validateWarmStart(): Only " << agreeing << " of " << measured << " pixels match the restored sand, starting from scratch";
+        resetBuffers();
+        warmStartState = WARMSTART_REJECTED;
+        return;
+    }
+    if (--warmStartFrames == 0)
+    {
+        firstImageReady = true;
+        warmStartState = WARMSTART_RESTORED;
+        ofLogNotice("Rs2Grabber") << "validateWarmStart(): Restored filter state matches the live frames";
+    }
+}
+
+void Rs2Grabber::setDetectOccluders(bool doc)
+{
+	detectOccluders = doc;
+	numOccluderPixels = 0;
+	occluderDetector.reset();
+}
+
+void Rs2Grabber::updateMetrics(uint64_t processMicros)
+{
+	framesProcessedMetric.add();
+	bigChangeResetsMetric.add(numBigChangeResets);
+	unstablePixelsMetric.set(numUnstablePixels);
+	inpaintedPixelsMetric.set(doInPaint ? getNumInpaintedPixels() : 0);
+	if (doInPaint)
+	{
+		inpaintedLocalMetric.add(setToLocalAvg);
+		inpaintedGlobalMetric.add(setToGlobalAvg);
+	}
+	processTimeMetric.observe(processMicros / 1e6);
+	occluderPixelsMetric.set(numOccluderPixels);
+}
+
+void Rs2Grabber::updateFilterTiming(uint64_t filterMicros)
+{
+	const int speedupMeasurementFrames = 60;
+
+	// Running average of the filter chain duration for the number of threads in use
+	int n = workerPool.getNumThreads();
+	float ms = filterMicros / 1000.0f;
+	if (filterTimeByThreads[n] == 0)
+		filterTimeByThreads[n] = ms;
+	else
+		filterTimeByThreads[n] = 0.95f * filterTimeByThreads[n] + 0.05f * ms;
+	filterTime = filterTimeByThreads[n];
+
+	if (speedupThreads == 0)
+		return;
+
+	speedupMicros += filterMicros;
+	if (++speedupFrames < speedupMeasurementFrames)
+		return;
+
+	speedupResults[speedupThreads] = speedupMicros / 1000.0f / speedupFrames;
+	if (speedupThreads < FrameFilterWorkerPool::getMaxThreads())
+	{
+		speedupThreads++;
+		speedupFrames = 0;
+		speedupMicros = 0;
+		workerPool.setNumThreads(speedupThreads);
+		return;
+	}
+
+	ofLogNotice("Rs2Grabber") << "Filter chain speedup (ROI " << maxX - minX << " x " << maxY - minY << ", " << speedupMeasurementFrames << " frames per thread count):";
+	for (int i = 1; i <= FrameFilterWorkerPool::getMaxThreads(); i++)
+	{
+		ofLogNotice("Rs2Grabber") << "  " << i << " threads: " << speedupResults[i] << " ms/frame, speedup " << speedupResults[1] / speedupResults[i];
+	}
+	speedupThreads = 0;
+	workerPool.setNumThreads(numFilterThreads);
+}
+
 void Rs2Grabber::setFullFrameFiltering(bool ff, ofRectangle ROI)
 {
 	doFullFrameFiltering = ff;
@@ -345,63 +864,224 @@ void Rs2Grabber::setFullFrameFiltering(bool ff, ofRectangle ROI)
 	}
 }
 
+void Rs2Grabber::setSpatialSigma(float sigma)
+{
+	spatialSigma = sigma;
+	spatialCoefficients = computeRecursiveGaussian(spatialSigma);
+}
+
 void Rs2Grabber::applySpaceFilter()
 {
-    for(int filterPass=0;filterPass< 20;++filterPass)
-    {
-		// Pointer to first pixel of ROI
-		float *ptrOffset = filteredframe.getData() + minY * width + minX;
+	if (spatialFilterMode == SPATIALFILTER_RECURSIVE_GAUSSIAN)
+	{
+		applyRecursiveSpaceFilter();
+		return;
+	}
 
-        // Low-pass filter the values in the ROI
-		// First a horisontal pass
-        for(unsigned int x = 0; x < width; x++)
-        {
+	float* data = filteredframe.getData();
+
+	// Each pass only couples pixels along one direction, so the columns are split between the threads
+	// for the column pass and the rows for the row pass. Only the ROI is filtered.
+	FrameFilterWorkerPool::BandFunction columnPass = [this, data](int firstCol, int lastCol, int) {
+		for(int x = firstCol; x < lastCol; x++)
+		{
 			// Pointer to current pixel
-            float* colPtr = ptrOffset + x;
+			float* colPtr = data + minY * width + x;
 			float lastVal = *colPtr;
 
-            // Top border pixels 
-            *colPtr = (colPtr[0]*2.0f + colPtr[width]) / 3.0f;
-            colPtr += width;
-            
-            // Filter the interior pixels in the column
-            for(unsigned int y = minY+1; y < maxY-1; ++y, colPtr += width)
-            {
+			// Top border pixels
+			*colPtr = (colPtr[0]*2.0f + colPtr[width]) / 3.0f;
+			colPtr += width;
+
+			// Filter the interior pixels in the column
+			for(int y = minY+1; y < maxY-1; ++y, colPtr += width)
+			{
 				float nextLastVal = *colPtr;
-                *colPtr=(lastVal + colPtr[0]*2.0f + colPtr[width])*0.25f;
+				*colPtr=(lastVal + colPtr[0]*2.0f + colPtr[width])*0.25f;
 				lastVal = nextLastVal; // To avoid using already updated pixels
-            }
-            
-            // Filter the last pixel in the column: 
-            *colPtr=(lastVal + colPtr[0] * 2.0f)/3.0f;
-        }
+			}
 
-		// then a vertical pass
-        for(unsigned int y = 0; y < height; y++)
-        {
+			// Filter the last pixel in the column:
+			*colPtr=(lastVal + colPtr[0] * 2.0f)/3.0f;
+		}
+	};
+
+	FrameFilterWorkerPool::BandFunction rowPass = [this, data](int firstRow, int lastRow, int) {
+		for(int y = firstRow; y < lastRow; y++)
+		{
 			// Pointer to current pixel
-			float* rowPtr = ptrOffset + y * width;
-			
-			// Filter the first pixel in the row: 
-            float lastVal=*rowPtr;
-            *rowPtr=(rowPtr[0]*2.0f + rowPtr[1]) / 3.0f;
-            rowPtr++;
-       
-            // Filter the interior pixels in the row: 
-            for(unsigned int x = minX+1; x < maxX-1; ++x,++rowPtr)
+			float* rowPtr = data + y * width + minX;
+
+			// Filter the first pixel in the row:
+			float lastVal=*rowPtr;
+			*rowPtr=(rowPtr[0]*2.0f + rowPtr[1]) / 3.0f;
+			rowPtr++;
+
+			// Filter the interior pixels in the row:
+			for(int x = minX+1; x < maxX-1; ++x,++rowPtr)
+			{
+				float nextLastVal=*rowPtr;
+				*rowPtr=(lastVal+rowPtr[0]*2.0f+rowPtr[1])*0.25f;
+				lastVal=nextLastVal;
+			}
+
+			// Filter the last pixel in the row:
+			*rowPtr=(lastVal+rowPtr[0]*2.0f)/3.0f;
+		}
+	};
+
+    for(int filterPass=0;filterPass< 20;++filterPass)
+    {
+        // Low-pass filter the values in the ROI
+		// First along the columns, then along the rows
+		workerPool.run(minX, maxX, columnPass);
+		workerPool.run(minY, maxY, rowPass);
+    }
+}
+
+// Separable recursive Gaussian on the ROI. Each pass runs down columns so a row of values is updated
+// at once, the horizontal pass works on a transposed copy of the ROI
+void Rs2Grabber::applyRecursiveSpaceFilter()
+{
+	float* roi = filteredframe.getData() + minY * width + minX;
+	int roiWidth = maxX - minX;
+	int roiHeight = maxY - minY;
+	float* transposed = spatialScratch.data();
+
+	// Vertical pass on bands of columns
+	workerPool.run(0, roiWidth, [&](int firstCol, int lastCol, int) {
+		recursiveGaussianColumns(spatialCoefficients, roi + firstCol, width, roiHeight, lastCol - firstCol);
+	});
+
+	// Horizontal pass on bands of rows: the band becomes a band of columns of the transposed ROI
+	workerPool.run(0, roiHeight, [&](int firstRow, int lastRow, int) {
+		int numRows = lastRow - firstRow;
+		transposeBlock(roi + firstRow * width, width, transposed + firstRow, roiHeight, numRows, roiWidth);
+		recursiveGaussianColumns(spatialCoefficients, transposed + firstRow, roiHeight, roiWidth, numRows);
+		transposeBlock(transposed + firstRow, roiHeight, roi + firstRow * width, width, roiWidth, numRows);
+	});
+}
+
+// Compare the tiles around the ROI with the reference frame. Tiles are independent so each thread takes a band of tile rows.
+// The filtered frame is compared where it was written (ROI and the 2 pixel inpainting border), dirty tiles are copied
+// to the reference so slow drifts are caught once they add up to the hysteresis.
+void Rs2Grabber::updateDirtyTiles()
+{
+    if (!bufferInitiated)
+        return;
+
+    const float* frame = filteredframe.getData();
+    float* reference = referenceFrame.data();
+    if (allTilesDirty)
+    {
+        memcpy(reference, frame, width*height*sizeof(float));
+        frameDirtyTiles.markAll();
+        allTilesDirty = false;
+    }
+    else
+    {
+        frameDirtyTiles.clear();
+        const int tileSize = DirtyTiles::TILE_SIZE;
+        int tileMinX = max(0, minX-2) / tileSize;
+        int tileMaxX = (min((int)width, maxX+2) - 1) / tileSize + 1;
+        int tileMinY = max(0, minY-2) / tileSize;
+        int tileMaxY = (min((int)height, maxY+2) - 1) / tileSize + 1;
+        const float threshold = hysteresis;
+        workerPool.run(tileMinY, tileMaxY, [&](int firstTileRow, int lastTileRow, int) {
+            for (int ty = firstTileRow; ty < lastTileRow; ty++)
             {
-                float nextLastVal=*rowPtr;
-                *rowPtr=(lastVal+rowPtr[0]*2.0f+rowPtr[1])*0.25f;
-                lastVal=nextLastVal;
+                for (int tx = tileMinX; tx < tileMaxX; tx++)
+                {
+                    ofRectangle rect = frameDirtyTiles.getTileRect(tx, ty);
+                    int x0 = rect.x, y0 = rect.y;
+                    int x1 = rect.getMaxX(), y1 = rect.getMaxY();
+                    bool dirty = false;
+                    for (int y = y0; y < y1 && !dirty; y++)
+                    {
+                        const float* framePtr = frame + y*width;
+                        const float* referencePtr = reference + y*width;
+                        for (int x = x0; x < x1; x++)
+                        {
+                            if (fabs(framePtr[x] - referencePtr[x]) >= threshold)
+                            {
+                                dirty = true;
+                                break;
+                            }
+                        }
+                    }
+                    if (dirty)
+                    {
+                        frameDirtyTiles.markTile(tx, ty);
+                        for (int y = y0; y < y1; y++)
+                            memcpy(reference + y*width + x0, frame + y*width + x0, (x1 - x0)*sizeof(float));
+                    }
+                }
             }
-            
-            // Filter the last pixel in the row: 
-            *rowPtr=(lastVal+rowPtr[0]*2.0f)/3.0f;
-        }
+        });
     }
+    numDirtyTiles = frameDirtyTiles.getNumDirty();
+}
+
+// Copy the frame into the packet (its buffers are already allocated) and hand it to the main thread
+void Rs2Grabber::publishFrame(FramePacket& packet, uint64_t captureTime)
+{
+    packet.sequence = ++frameSequence;
+    packet.timestamp = captureTime;
+    packet.stabilized = firstImageReady;
+    memcpy(packet.depth.getData(), filteredframe.getData(), width*height*sizeof(float));
+
+    const ofPixels& colorPixels = rs2ColorImage.getPixels();
+    if (colorPixels.size() == packet.color.size())
+        memcpy(packet.color.getData(), colorPixels.getData(), colorPixels.size());
+    else
+        packet.color = colorPixels;
+
+    if (bufferInitiated)
+        memcpy(packet.gradient.data(), gradField, gradFieldcols*gradFieldrows*sizeof(ofVec2f));
+    packet.hasOccluders = detectOccluders && occluderDetector.getMask().size() == packet.occluders.size();
+    if (packet.hasOccluders)
+        memcpy(packet.occluders.getData(), occluderDetector.getMask().getData(), packet.occluders.size());
+    packet.gradientResolution = gradFieldresolution;
+
+    // The packet carries every tile changed since the last packet the main thread got. Once it is known that the main
+    // thread took the previous packet, only the tiles of this frame remain unseen.
+    pendingDirtyTiles.merge(frameDirtyTiles);
+    packet.dirtyTiles = pendingDirtyTiles;
+
+    packet.latency.sequence = packet.sequence;
+    packet.latency.mark(LATENCY_PUBLISHED);
+
+    if (!framePackets.publish())
+        pendingDirtyTiles = frameDirtyTiles;
+}
+
+// Elevation of every pixel through the rays of the camera, then its pyramid. The whole frame is measured so the map
+// answers the queries outside of the ROI as well.
+void Rs2Grabber::updateElevation(FramePacket& packet)
+{
+    deprojection.setup(elevationWorldMatrix, width, height);
+    const float* depth = filteredframe.getData();
+    float* elevation = packet.elevation.getData();
+    const ofVec4f planeEq = elevationBasePlaneEq;
+    workerPool.run(0, height, [&](int firstRow, int lastRow, int) {
+        for (int y = firstRow; y < lastRow; y++)
+            deprojection.elevationRow(depth, y, 0, width, planeEq, elevation);
+    });
+    packet.elevationPyramid.compute(depth, elevation, width, height, minX, minY, maxX, maxY, workerPool);
+    packet.elevationWorldMatrix = elevationWorldMatrix;
+    packet.elevationBasePlaneEq = elevationBasePlaneEq;
 }
 
 void Rs2Grabber::updateGradientField()
+{
+    // Each cell of the gradient field only reads the filtered frame, so the rows of cells are split between the threads.
+    // Only the cells overlapping a dirty tile are recomputed, the others keep their value.
+    workerPool.run(0, gradFieldrows, [this](int firstRow, int lastRow, int) {
+        updateGradientFieldRows(firstRow, lastRow);
+    });
+}
+
+void Rs2Grabber::updateGradientFieldRows(int firstRow, int lastRow)
 {
     int ind = 0;
     float gx;
@@ -409,8 +1089,10 @@ void Rs2Grabber::updateGradientField()
     int gvx, gvy;
     float lgth = 0;
     float* filteredFramePtr=filteredframe.getData();
-    for(unsigned int y=0;y<gradFieldrows;++y) {
+    for(int y=firstRow;y<lastRow;++y) {
         for(unsigned int x=0;x<gradFieldcols;++x) {
+            if (!frameDirtyTiles.isRegionDirty(x*gradFieldresolution, y*gradFieldresolution, (x+1)*gradFieldresolution, (y+1)*gradFieldresolution))
+                continue;
             if (isInsideROI(x*gradFieldresolution, y*gradFieldresolution) && isInsideROI((x+1)*gradFieldresolution, (y+1)*gradFieldresolution) ){
                 gx = 0;
                 gvx = 0;
@@ -456,7 +1138,7 @@ float Rs2Grabber::findInpaintValue(float *data, int x, int y)
 	double sumval = 0;
 	for (int y = tminy; y < tmaxy; y++)
 	{
-		for (int x = tminx; x < tmaxy; x++)
+		for (int x = tminx; x < tmaxx; x++)
 		{
 			int idx = y * width + x;
 			float val = data[idx];
@@ -477,56 +1159,94 @@ float Rs2Grabber::findInpaintValue(float *data, int x, int y)
 void Rs2Grabber::applySimpleOutlierInpainting()
 {
 	float *data = filteredframe.getData();
+	float *source = inpaintSource.data();
 
-	// Estimate overall average inside ROI
-	int samples = 0;
-	ROIAverageValue = 0;
-	for (unsigned int y = minY; y < maxY; y++)
-	{
-		for (unsigned int x = minX; x < maxX; x++)
+	// Per band partial results, combined in band order
+	int bandSamples[FrameFilterWorkerPool::MAX_THREADS] = { 0 };
+	double bandSums[FrameFilterWorkerPool::MAX_THREADS] = { 0 };
+	int bandLocal[FrameFilterWorkerPool::MAX_THREADS] = { 0 };
+	int bandGlobal[FrameFilterWorkerPool::MAX_THREADS] = { 0 };
+
+	// Copy the ROI rows to the inpainting source and estimate overall average inside ROI
+	workerPool.run(minY, maxY, [&](int firstRow, int lastRow, int band) {
+		for (int y = firstRow; y < lastRow; y++)
 		{
-			int idx = y * width + x;
-			float val = data[idx];
-			if (val != 0 && val != initialValue)
+			int rowIdx = y * width;
+			memcpy(source + rowIdx, data + rowIdx, width * sizeof(float));
+			for (int x = minX; x < maxX; x++)
 			{
-				samples++;
-				ROIAverageValue += val;
+				float val = data[rowIdx + x];
+				if (val != 0 && val != initialValue)
+				{
+					bandSamples[band]++;
+					bandSums[band] += val;
+				}
 			}
 		}
+	});
+
+	int samples = 0;
+	ROIAverageValue = 0;
+	for (int i = 0; i < FrameFilterWorkerPool::MAX_THREADS; i++)
+	{
+		samples += bandSamples[i];
+		ROIAverageValue += bandSums[i];
 	}
 	// No valid samples found in ROI - strange situation
 	if (samples == 0)
 		ROIAverageValue = initialValue;
-	
-	ROIAverageValue /= samples;
+	else
+		ROIAverageValue /= samples;
 
-	setToLocalAvg = 0;
-	setToGlobalAvg = 0;
-	// Filter ROI
-	for (unsigned int y = max(0, minY-2); y < min((int)height, maxY+2); y++)
-	{
-		for (unsigned int x = max(0, minX-2); x < min((int)width, maxX+2); x++)
+	// Filter ROI. The neighbourhood values are read from the source copy, which only holds measured values,
+	// so the result does not depend on the scan order or on how the rows are split between the threads
+	workerPool.run(max(0, minY-2), min((int)height, maxY+2), [&](int firstRow, int lastRow, int band) {
+		for (int y = firstRow; y < lastRow; y++)
 		{
-			int idx = y * width + x;
-			float val = data[idx];
-
-			if (val == 0 || val == initialValue)
+			for (int x = max(0, minX-2); x < min((int)width, maxX+2); x++)
 			{
-				float newval = findInpaintValue(data, x, y);
-				if (newval == 0)
-				{
-					newval = ROIAverageValue;
-					setToGlobalAvg++;
-				}
-				else
-				{
+				int idx = y * width + x;
+				float val = data[idx];
 
-					setToLocalAvg++;
+				if (val == 0 || val == initialValue)
+				{
+					float newval = findInpaintValue(source, x, y);
+					if (newval == 0)
+					{
+						newval = ROIAverageValue;
+						bandGlobal[band]++;
+					}
+					else
+					{
+						bandLocal[band]++;
+					}
+					data[idx] = newval;
 				}
-				data[idx] = newval;
 			}
 		}
+	});
+
+	setToLocalAvg = 0;
+	setToGlobalAvg = 0;
+	for (int i = 0; i < FrameFilterWorkerPool::MAX_THREADS; i++)
+	{
+		setToLocalAvg += bandLocal[i];
+		setToGlobalAvg += bandGlobal[i];
 	}
+	inpaintHoleLevel = 0;
+}
+
+// Holes of the ROI (and the 2 pixel border outside it) are interpolated from the measured values of the ROI
+void Rs2Grabber::applyPushPullInpainting()
+{
+	pushPullInpainter.fill(filteredframe.getData(), width,
+		max(0, minX-2), max(0, minY-2), min((int)width, maxX+2), min((int)height, maxY+2),
+		minX, minY, maxX, maxY,
+		initialValue, workerPool);
+
+	setToLocalAvg = pushPullInpainter.getNumFilled();
+	setToGlobalAvg = 0;
+	inpaintHoleLevel = pushPullInpainter.getHoleLevel();
 }
 
 bool Rs2Grabber::isInsideROI(int x, int y){
@@ -561,67 +1281,89 @@ void Rs2Grabber::setRs2ROI(ofRectangle ROI){
 }
 
 void Rs2Grabber::setAveragingSlotsNumber(int snumAveragingSlots){
-    if (bufferInitiated){
-            bufferInitiated = false;
-            delete[] averagingBuffer;
-            delete[] statBuffer;
-            delete[] validBuffer;
-            delete[] gradField;
-        }
+    if (filterMode == FRAMEFILTER_MODE_RECURSIVE && bufferInitiated)
+    {
+        // Only the time constant of the estimates changes, they are kept
+        numAveragingSlots = snumAveragingSlots;
+        minNumSamples=(numAveragingSlots+1)/2;
+        return;
+    }
+    releaseBuffers();
     numAveragingSlots = snumAveragingSlots;
     minNumSamples=(numAveragingSlots+1)/2;
     initiateBuffers();
 }
 
 void Rs2Grabber::setGradFieldResolution(int sgradFieldresolution){
-    if (bufferInitiated){
-        bufferInitiated = false;
-        delete[] averagingBuffer;
-        delete[] statBuffer;
-        delete[] validBuffer;
-        delete[] gradField;
-    }
+    releaseBuffers();
     gradFieldresolution = sgradFieldresolution;
+    gradFieldcols = width / gradFieldresolution;
+    gradFieldrows = height / gradFieldresolution;
     initiateBuffers();
 }
 
 void Rs2Grabber::setFollowBigChange(bool newfollowBigChange){
-    if (bufferInitiated){
-        bufferInitiated = false;
-        delete[] averagingBuffer;
-        delete[] statBuffer;
-        delete[] validBuffer;
-        delete[] gradField;
-    }
+    releaseBuffers();
     followBigChange = newfollowBigChange;
     initiateBuffers();
 }
 
+// The state only covers the ROI: pixels of the frame outside of it read as pixels without samples
+bool Rs2Grabber::getStateIndex(int x, int y, size_t& idx){
+    if (!bufferInitiated || x < minX || x >= maxX || y < minY || y >= maxY)
+        return false;
+    idx = (y-minY)*stateStride + (x-minX);
+    return true;
+}
+
 ofVec3f Rs2Grabber::getStatBuffer(int x, int y){
-    float* statBufferPtr = statBuffer+3*(x + y*width);
-    return ofVec3f(statBufferPtr[0], statBufferPtr[1], statBufferPtr[2]);
+    size_t idx;
+    if (!getStateIndex(x, y, idx))
+        return ofVec3f(0);
+    if (filterMode == FRAMEFILTER_MODE_COMPACT){
+        return ofVec3f(compactCount[idx], compactSum[idx], compactSumSq[idx]);
+    }
+    if (filterMode == FRAMEFILTER_MODE_RECURSIVE){
+        // Count, sum and sum of squares of samples having the estimated mean and variance
+        float count = recursiveCount[idx];
+        float mean = recursiveMean[idx];
+        return ofVec3f(count, count*mean, count*(recursiveVariance[idx] + mean*mean));
+    }
+    float* statBufferPtr = statBuffer+idx;
+    return ofVec3f(statBufferPtr[0], statBufferPtr[statePlaneSize], statBufferPtr[2*statePlaneSize]);
 }
 
 float Rs2Grabber::getAveragingBuffer(int x, int y, int slotNum){
-    float* averagingBufferPtr = averagingBuffer + slotNum*height*width + (x + y*width);
+    size_t idx;
+    if (!getStateIndex(x, y, idx))
+        return initialValue;
+    if (filterMode == FRAMEFILTER_MODE_COMPACT){
+        uint16_t val = compactRing[idx*compactRingStride + slotNum];
+        return val == 0 ? initialValue : val;
+    }
+    if (filterMode == FRAMEFILTER_MODE_RECURSIVE){
+        // No slots, every slot reads as the current estimate
+        return recursiveCount[idx] == 0 ? initialValue : recursiveMean[idx];
+    }
+    float* averagingBufferPtr = averagingBuffer + slotNum*statePlaneSize + idx;
     return *averagingBufferPtr;
 }
 
 float Rs2Grabber::getValidBuffer(int x, int y){
-    float* validBufferPtr = validBuffer + (x + y*width);
-    return *validBufferPtr;
+    size_t idx;
+    if (!getStateIndex(x, y, idx))
+        return initialValue;
+    return validBuffer[idx];
 }
 
 ofMatrix4x4 Rs2Grabber::getWorldMatrix() {
-	auto mat = ofMatrix4x4();
-	if (rs2Opened) {
-		ofVec3f a = rs2.getWorldCoordinateAt(0, 0, 1);// Trick to access rs2 internal parameters without having to modify ofxRealSense2
-		ofVec3f b = rs2.getWorldCoordinateAt(1, 1, 1);
-		ofLogVerbose("rs2Grabber") << "getWorldMatrix(): Computing rs2 world matrix";
-		mat = ofMatrix4x4(b.x - a.x, 0, 0, a.x,
-			0, b.y - a.y, 0, a.y,
-			0, 0, 0, 1,
-			0, 0, 0, 1);
-	}
-	return mat;
+	if (!rs2Opened && !replaySource)
+		return ofMatrix4x4();
+	return getFrameSource()->getWorldMatrix();
+}
+
+ofMatrix4x4 Rs2Grabber::getCameraWorldMatrix() {
+	if (!rs2Opened)
+		return ofMatrix4x4();
+	return cameraSource->getWorldMatrix();
 }
@@ -23,12 +23,24 @@ General Public License for more details.
 #include "ofMain.h"
 #include "ofxOpenCv.h"
 #include "ofxCv.h"
-#include "ofxKinect.h"
-#include "ofxRealSense2.h"
 
 #include "Utils.h"
+#include "FrameFilterKernels.h"
+#include "FrameFilterWorkerPool.h"
+#include "SpatialFilterKernels.h"
+#include "PushPullInpainter.h"
+#include "OccluderDetector.h"
+#include "FilterSnapshot.h"
+#include "TerrainDerivatives.h"
+#include "DeprojectionTable.h"
+#include "DirtyTiles.h"
+#include "FramePacket.h"
+#include "SessionRecording.h"
+#include "FrameSource.h"
+#include "Metrics.h"
 
 class Rs2Grabber: public ofThread {
+	friend class FilterBenchmark; // Times the private filter stages
 public:
 	typedef unsigned short RawDepth; // Data type for raw depth values
 	typedef float FilteredDepth; // Data type for filtered depth values
@@ -38,11 +50,13 @@ public:
     void start();
     void stop();
     void performInThread(std::function<void(Rs2Grabber&)> action);
-    bool setup();
+    bool setup(FrameSourceType sourceType = FRAMESOURCE_REALSENSE);
+    bool setup(std::shared_ptr<FrameSource> source); // Any source, e.g. a SyntheticFrameSource to run without a camera
 	bool openRs2();
 	void setupFramefilter(int gradFieldresolution, float newMaxOffset, ofRectangle ROI, bool spatialFilter, bool followBigChange, int numAveragingSlots);
     void initiateBuffers(void); // Reinitialise buffers
     void resetBuffers(void);
+    void releaseBuffers(void);
     
     ofVec3f getStatBuffer(int x, int y);
     float getAveragingBuffer(int x, int y, int slotNum);
@@ -53,10 +67,6 @@ public:
     void setAveragingSlotsNumber(int snumAveragingSlots);
     void setGradFieldResolution(int sgradFieldresolution);
     
-    void decStoredframes(){
-        storedframes -= 1;
-    }
-    
     bool isImageStabilized(){
         return firstImageReady;
     }
@@ -73,7 +83,14 @@ public:
         return rs2DepthImage.getData()[(int)(y*width+x)];
     }
     
+	// Matrix of the frames the grabber filters, the recording's during a replay. Grabber thread only.
 	ofMatrix4x4 getWorldMatrix();
+	// Matrix of the camera, whatever is replayed. Safe from the main thread.
+	ofMatrix4x4 getCameraWorldMatrix();
+
+	bool isRs2Opened(){
+		return rs2Opened;
+	}
     
     int getNumAveragingSlots(){
         return numAveragingSlots;
@@ -87,31 +104,190 @@ public:
         spatialFilter = newspatialFilter;
     }
     
+	void setSpatialFilterMode(SpatialFilterMode mode){
+		spatialFilterMode = mode;
+	}
+
+	// Standard deviation (in pixels) of the recursive Gaussian spatial filter
+	void setSpatialSigma(float sigma);
+
 	void setInPainting(bool inp)
 	{
 		doInPaint = inp;
 	}
 
+	void setInpaintMode(InpaintMode mode)
+	{
+		inpaintMode = mode;
+	}
+
+	// Fill statistics of the last frame
+	int getNumInpaintedPixels()
+	{
+		return setToLocalAvg + setToGlobalAvg;
+	}
+
+	int getNumInpaintedFromROIAverage()
+	{
+		return setToGlobalAvg;
+	}
+
+	int getInpaintHoleLevel()
+	{
+		return inpaintHoleLevel;
+	}
+
+	// Temporal filter statistics of the last frame
+	int getNumUnstablePixels()
+	{
+		return numUnstablePixels;
+	}
+
+	int getNumBigChangeResets()
+	{
+		return numBigChangeResets;
+	}
+
+	// Use the SSE4.1/AVX2 temporal filter kernel when the CPU supports it (output is identical to the scalar kernel)
+	void setVectorizedFilter(bool vf);
+
+	FrameFilterKernelType getFilterKernelType(){
+		return filterKernelType;
+	}
+
+	// Layout of the temporal filter state, the state is reset when it changes
+	void setFilterMode(FrameFilterMode mode);
+
+	FrameFilterMode getFilterMode(){
+		return filterMode;
+	}
+
+	// Number of threads running the filter chain on bands of the ROI (1 = grabber thread only)
+	void setNumFilterThreads(int n);
+
+	int getNumFilterThreads(){
+		return numFilterThreads;
+	}
+
+	// Average duration of the filter chain (temporal filter to gradient field) in ms for the current number of threads
+	float getFilterTime(){
+		return filterTime;
+	}
+
+	// Filter chain speedup of the current number of threads relative to a single thread (0 if not measured yet)
+	float getFilterSpeedup();
+
+	// Time the filter chain on live frames with 1, 2, ... getMaxThreads() threads and log the speedups
+	void startSpeedupMeasurement();
+
+	// Save the temporal filter state with the calibration it was built with (only once the image is stabilized)
+	bool saveSnapshot(const std::string& path, const FilterSnapshotCalibration& calibration);
+
+	// Same, the state is only copied here and written to the disk on a low priority thread. Returns false
+	// when the previous snapshot is still being written.
+	bool saveSnapshotInBackground(const std::string& path, const FilterSnapshotCalibration& calibration);
+
+	// Restore a snapshot taken with the same ROI, filter setup and calibration. The restored state is checked
+	// against the next live frames and dropped if the sand moved in the meantime.
+	bool loadSnapshot(const std::string& path, const FilterSnapshotCalibration& calibration);
+
+	WarmStartState getWarmStartState(){
+		return warmStartState;
+	}
+
+	// Keep the sand under hands and other occluders and send the occluder mask with each frame
+	void setDetectOccluders(bool doc);
+
+	int getNumOccluderPixels(){
+		return numOccluderPixels;
+	}
+
+	// Compute the full resolution terrain derivatives and send them with each frame
+	void setComputeDerivatives(bool cd){
+		computeDerivatives = cd;
+	}
+
+	// Camera and base plane the elevation is measured with. The elevation map and its pyramid are sent with each
+	// frame once the base plane is known.
+	void setElevationReference(const ofMatrix4x4& sworldMatrix, const ofVec4f& sbasePlaneEq){
+		elevationWorldMatrix = sworldMatrix;
+		elevationBasePlaneEq = sbasePlaneEq;
+	}
+
+	// Number of tiles of the last filtered frame that changed by more than the hysteresis
+	int getNumDirtyTiles(){
+		return numDirtyTiles;
+	}
+
+	// Record the raw depth and color frames to a session file. The file is opened and closed by the grabber thread.
+	void startRecording(const std::string& path);
+	void stopRecording();
+
+	// True from startRecording() until stopRecording(), or until the file could not be created or grown
+	bool isRecording(){
+		return recording;
+	}
+
+	uint64_t getNumRecordedFrames(){
+		return numRecordedFrames;
+	}
+
+	// Take the frames from an opened session player instead of the rs2 (nullptr goes back to the rs2)
+	void setReplay(std::shared_ptr<SessionPlayer> player);
+
+	// Source the frames come from: the session being replayed if any, else the camera
+	std::shared_ptr<FrameSource> getFrameSource(){
+		return replaySource ? replaySource : cameraSource;
+	}
+
+	// Grab a frame and run the whole filter chain on it, publishing the result in framePackets.
+	// Called by the grabber thread, or directly when the thread is not started (benchmarks, offline processing).
+	// Returns false if the source had no new frame.
+	bool processNextFrame();
+
 	// Should the entire frame be filtered and thereby ignoring the Rs2ROI
 	void setFullFrameFiltering(bool ff, ofRectangle ROI);
 
-	ofThreadChannel<ofFloatPixels> filtered;
-	ofThreadChannel<ofPixels> colored;
-	ofThreadChannel<ofVec2f*> gradient;
+	// Number of frame packets replaced before the main thread read them
+	uint64_t getNumDroppedFrames(){
+		return framePackets.getNumDropped();
+	}
+
+	// Latest filtered frame, color frame, gradient field and derivatives, written by the grabber thread
+	FramePacketBuffer framePackets;
     
 private:
 	void threadedFunction() override;
     void filter();
+    void filterSlots();
+    void filterCompact();
+    FrameFilterParams getFrameFilterParams();
+    void filterRecursive();
+    bool getStateIndex(int x, int y, size_t& idx);
+    void sumFilterStats(const FrameFilterRowStats* bandStats);
+    std::vector<FilterStatePlane> getFilterStatePlanes();
+    FilterSnapshotHeader getSnapshotHeader(const FilterSnapshotCalibration& calibration);
+    void validateWarmStart();
     void depth_filtering();
     bool isInsideROI(int x, int y); // test is x, y is inside ROI
     void applySpaceFilter();
+    void applyRecursiveSpaceFilter();
     void updateGradientField();
+    void updateElevation(FramePacket& packet);
+    void updateGradientFieldRows(int firstRow, int lastRow);
+    void updateDirtyTiles();
+    void publishFrame(FramePacket& packet, uint64_t captureTime);
+    bool grabFrame(uint64_t& captureTime);
+    void runActions();
+    void updateFilterTiming(uint64_t filterMicros);
+    void updateMetrics(uint64_t processMicros);
     
 	// A simple inpainting algorithm to remove outliers in the depth
 	// Since the shader has no way of filtering outliers (0 and 4000 values mainly) it creates visual artifacts if they are not 
 	// removed prior to the shader pass
 	void applySimpleOutlierInpainting();
 	float findInpaintValue(float *data, int x, int y);
+	void applyPushPullInpainting();
 	double ROIAverageValue = 0;
 	int setToLocalAvg = 0;
     int setToGlobalAvg = 0;
@@ -120,7 +296,7 @@ private:
 	bool newFrame;
     bool bufferInitiated;
     bool firstImageReady;
-    int storedframes;
+    uint64_t frameSequence;
     
     // Thread lambda functions (actions)
 	vector<std::function<void(Rs2Grabber&)> > actions;
@@ -128,7 +304,7 @@ private:
     
     // Rs2 parameters
 	bool rs2Opened;
-	ofxRealSense2				rs2;
+	std::shared_ptr<FrameSource> cameraSource;
     unsigned int width, height; // Width and height of rs2 frames
 	int minX, maxX; // , ROIwidth; // ROI definition
 	int minY, maxY; //, ROIheight;
@@ -138,11 +314,41 @@ private:
     ofShortPixels     rs2DepthImage;
     ofFloatPixels filteredframe;
     ofVec2f* gradField;
+    bool computeDerivatives;
+    ofMatrix4x4 elevationWorldMatrix;
+    ofVec4f elevationBasePlaneEq; // Null until the main thread sends the base plane
+    DeprojectionTable deprojection; // Rays of elevationWorldMatrix
+
+    // Change tracking: a tile is dirty when one of its pixels moved by more than the hysteresis
+    // from the value it had the last time the tile was dirty
+    std::vector<float> referenceFrame;
+    DirtyTiles frameDirtyTiles; // Tiles changed by the current frame
+    DirtyTiles pendingDirtyTiles; // Tiles changed since the last frame packet the main thread got
+    bool allTilesDirty; // The whole frame has to be resent (buffers or ROI changed)
+    int numDirtyTiles;
     
-    // Filtering buffers
+    // Filtering buffers. The temporal state only covers the ROI: its planes are carved from stateStorage, with rows
+    // of stateStride pixels (the ROI width padded to 16) and each plane starting on a cache line. Pixel (x, y) of the
+    // frame is at (y-minY)*stateStride + x-minX of a plane, see getStateIndex().
+    unsigned char* stateStorage;
+    size_t stateStride;
+    size_t statePlaneSize; // stateStride * ROI height
 	float* averagingBuffer; // Buffer to calculate running averages of each pixel's depth value
-	float* statBuffer; // Buffer retaining the running means and variances of each pixel's depth value
+	float* statBuffer; // Buffer retaining the running means and variances of each pixel's depth value: planes of sample counts, sums and sums of squares
 	float* validBuffer; // Buffer holding the most recent stable depth value for each pixel
+
+    // Compact filtering buffers (FRAMEFILTER_MODE_COMPACT)
+    FrameFilterMode filterMode;
+    uint16_t* compactRing; // Pixel-major ring of raw depth values, each pixel's ring starts on a multiple of compactRingStride
+    size_t compactRingStride;
+    uint8_t* compactCount; // Exact per pixel statistics of the ring: number of valid samples,
+    uint32_t* compactSum; // sum of valid samples
+    uint64_t* compactSumSq; // and sum of squares of valid samples
+
+    // Recursive filtering buffers (FRAMEFILTER_MODE_RECURSIVE)
+    float* recursiveMean; // Exponentially weighted mean of each pixel's depth value
+    float* recursiveVariance; // and its variance
+    uint16_t* recursiveCount; // Number of valid samples since the estimate was reset
     
     // Gradient computation variables
     int gradFieldcols, gradFieldrows;
@@ -161,14 +367,65 @@ private:
     float bigChange; // Amount of change over which the averaging slot is reset to new value
 //	float instableValue; // Value to assign to instable pixels if retainValids is false
 	bool spatialFilter; // Flag whether to apply a spatial filter to time-averaged depth values
+	SpatialFilterMode spatialFilterMode;
+	float spatialSigma;
+	RecursiveGaussianCoefficients spatialCoefficients;
+	std::vector<float> spatialScratch; // Transposed ROI for the horizontal recursive pass
     float maxOffset;
     
     int minInitFrame; // Minimal number of frame to consider the rs2 initialized
     int currentInitFrame;
 
+    // Warm start from a filter snapshot
+    WarmStartState warmStartState;
+    int warmStartFrames; // Live frames left to check before the restored state is trusted
+    FilterSnapshotWriter snapshotWriter;
+
 	bool doInPaint;
+	InpaintMode inpaintMode;
+	PushPullInpainter pushPullInpainter;
+	OccluderDetector occluderDetector;
+	bool detectOccluders;
+	int numOccluderPixels;
+	int inpaintHoleLevel = 0;
+
+	// Temporal filter kernel
+	bool vectorizedFilter;
+	FrameFilterKernelType filterKernelType;
+	FrameFilterRowKernel filterRowKernel;
+
+	// Parallel filter chain
+	FrameFilterWorkerPool workerPool;
+	int numFilterThreads;
+	std::vector<float> inpaintSource; // Copy of the ROI holding the measured values during inpainting
+	float filterTime;
+	float filterTimeByThreads[FrameFilterWorkerPool::MAX_THREADS+1]; // Average filter chain duration (ms) indexed by number of threads
+	int speedupThreads; // Number of threads being timed by the speedup measurement (0 if not running)
+	int speedupFrames;
+	uint64_t speedupMicros;
+	float speedupResults[FrameFilterWorkerPool::MAX_THREADS+1];
+
+	// Temporal filter statistics of the last frame
+	int numUnstablePixels;
+	int numBigChangeResets;
+
+	// Runtime metrics (see Metrics.h)
+	MetricCounter& framesProcessedMetric;
+	MetricCounter& bigChangeResetsMetric;
+	MetricGauge& unstablePixelsMetric;
+	MetricGauge& inpaintedPixelsMetric;
+	MetricCounter& inpaintedLocalMetric;
+	MetricCounter& inpaintedGlobalMetric;
+	MetricHistogram& processTimeMetric;
+	MetricGauge& occluderPixelsMetric;
 
 	bool doFullFrameFiltering;
+
+	// Session recording and replay
+	SessionRecorder recorder;
+	std::atomic<bool> recording; // State of the recorder for the main thread
+	std::atomic<uint64_t> numRecordedFrames;
+	std::shared_ptr<FrameSource> replaySource;
     // Debug
 //    int blockX, blockY;
 };
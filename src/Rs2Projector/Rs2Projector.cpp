@@ -22,6 +22,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 ***********************************************************************/
 
 #include "Rs2Projector.h"
+#include "Profiler.h"
 #include <sstream>
 
 using namespace ofxCSG;
@@ -37,7 +38,12 @@ projRs2CalibrationUpdated (false),
 imageStabilized (false),
 waitingForFlattenSand (false),
 drawRs2View(false),
-drawRs2ColorView(true)
+drawRs2ColorView(true),
+metricsInterval(15),
+lastPacketSequence(0),
+framesReceivedMetric(MetricsRegistry::get().counter("magicsand_frames_received_total", "Frame packets taken by the main thread")),
+framesDroppedMetric(MetricsRegistry::get().counter("magicsand_frames_dropped_total", "Frame packets published by the grabber but replaced before the main thread took them")),
+uploadBytesMetric(MetricsRegistry::get().counter("magicsand_texture_upload_bytes_total", "Bytes uploaded to the depth texture"))
 {
 	doShowROIonProjector = false;
 	applicationState = APPLICATION_STATE_SETUP;
@@ -79,6 +85,8 @@ void Rs2Projector::setup(bool sdisplayGui)
     // Setup default base plane
 	basePlaneNormalBack = ofVec3f(0,0,1); // This is our default baseplane normal
 	basePlaneOffsetBack= ofVec3f(0,0,870); // This is our default baseplane offset
+	driftReferenceNormalBack = basePlaneNormalBack;
+	driftReferenceOffsetBack = basePlaneOffsetBack;
     basePlaneNormal = basePlaneNormalBack;
     basePlaneOffset = basePlaneOffsetBack;
     basePlaneEq=getPlaneEquation(basePlaneOffset,basePlaneNormal);
@@ -87,7 +95,21 @@ void Rs2Projector::setup(bool sdisplayGui)
     maxOffsetSafeRange = 50; // Range above the autocalib measured max offset
 
     // rs2grabber: start & default setup
-	rs2Opened = rs2grabber.setup();
+	// The frame source is read ahead of the other settings since the grabber is sized by it
+	frameSourceType = FRAMESOURCE_REALSENSE;
+	syntheticSize = ofVec2f(1280, 720);
+	syntheticFps = 90;
+	ofXml sourceXml;
+	if (sourceXml.load("settings/rs2ProjectorSettings.xml") && sourceXml.setTo("RS2SETTINGS"))
+	{
+		frameSourceType = static_cast<FrameSourceType>(sourceXml.getValue<int>("FrameSource", FRAMESOURCE_REALSENSE));
+		syntheticSize = sourceXml.getValue<ofVec2f>("SyntheticSize", syntheticSize);
+		syntheticFps = sourceXml.getValue<float>("SyntheticFps", syntheticFps);
+	}
+	if (frameSourceType == FRAMESOURCE_SYNTHETIC)
+		rs2Opened = rs2grabber.setup(std::make_shared<SandboxFrameSource>(syntheticSize.x, syntheticSize.y, syntheticFps));
+	else
+		rs2Opened = rs2grabber.setup(frameSourceType);
 	lastRs2OpenTry = ofGetElapsedTimef();
 	if (!rs2Opened)
 	{
@@ -96,7 +118,41 @@ void Rs2Projector::setup(bool sdisplayGui)
 	}
 
 	doInpainting = false;
+	inpaintMode = INPAINT_PUSH_PULL;
+	doTerrainDerivatives = true;
+	terrainDerivatives = nullptr;
+	elevationMap = nullptr;
+	elevationPyramid = nullptr;
+	elevationMapSequence = 0;
+	elevationBasePlaneEq = ofVec4f(0, 0, 0, 0);
+	partialTextureUpload = true;
+	detectOccluders = true;
+	hasOccluders = false;
+	latencyLog = true;
+	warmStart = true;
+	driftMonitoring = true;
+	driftCheckInterval = 10;
+	lastDriftCheck = 0;
+	driftTolerance = 2;
+	maxDriftCorrection = 20;
+	maxDriftRotation = 2;
+	minHighCalibPts = 3;
+	calibStopError = 2;
+	hasDrift = false;
+	cameraMoved = false;
+	snapshotInterval = 60;
+	lastSnapshotTime = 0;
+	latencyTracer.setup(600, 1);
+	setMetricsInterval(metricsInterval);
+	recordingSession = false;
+	replayMode = REPLAY_REALTIME;
 	doFullFrameFiltering = false;
+	vectorizedFilter = true;
+	numFilterThreads = rs2grabber.getNumFilterThreads();
+	planePool.setNumThreads(FrameFilterWorkerPool::getMaxThreads());
+	filterMode = FRAMEFILTER_MODE_SLOTS;
+	spatialFilterMode = SPATIALFILTER_RECURSIVE_GAUSSIAN;
+	spatialSigma = SPATIALFILTER_BINOMIAL_SIGMA;
 	spatialFiltering = true;
     followBigChanges = false;
     numAveragingSlots = 15;
@@ -110,6 +166,7 @@ void Rs2Projector::setup(bool sdisplayGui)
 
     // Initialize the fbos and images
     FilteredDepthImage.allocate(rs2Res.x, rs2Res.y);
+    dirtyTiles.setup(rs2Res.x, rs2Res.y);
     rs2ColorImage.allocate(rs2Res.x, rs2Res.y);
     thresholdedImage.allocate(rs2Res.x, rs2Res.y);
     
@@ -117,7 +174,7 @@ void Rs2Projector::setup(bool sdisplayGui)
 
 	// finish rs2grabber setup and start the grabber
     rs2grabber.setupFramefilter(gradFieldResolution, maxOffset, rs2ROI, spatialFiltering, followBigChanges, numAveragingSlots);
-    rs2WorldMatrix = rs2grabber.getWorldMatrix();
+    rs2WorldMatrix = rs2grabber.getCameraWorldMatrix();
     ofLogVerbose("Rs2Projector") << "Rs2Projector.setup(): rs2WorldMatrix: " << rs2WorldMatrix ;
     
     // Setup gradient field
@@ -154,17 +211,18 @@ void Rs2Projector::exit(ofEventArgs& e)
 			ofLogVerbose("Rs2Projector") << "exit(): Settings could not be saved ";
 		}
 	}
+
+	// The grabber writes the snapshot as its last action, before it releases the filter state and closes the camera
+	if (warmStart && applicationState == APPLICATION_STATE_RUNNING)
+		saveFilterSnapshot(false);
+	rs2grabber.waitForThread(true);
 }
 
 void Rs2Projector::setupGradientField(){
     gradFieldcols = rs2Res.x / gradFieldResolution;
     gradFieldrows = rs2Res.y / gradFieldResolution;
     
-    gradField = new ofVec2f[gradFieldcols*gradFieldrows];
-    ofVec2f* gfPtr=gradField;
-    for(unsigned int y=0;y<gradFieldrows;++y)
-        for(unsigned int x=0;x<gradFieldcols;++x,++gfPtr)
-            *gfPtr=ofVec2f(0);
+    gradField.assign(gradFieldcols*gradFieldrows, ofVec2f(0));
 }
 
 void Rs2Projector::setGradFieldResolution(int sgradFieldResolution){
@@ -179,9 +237,17 @@ void Rs2Projector::setGradFieldResolution(int sgradFieldResolution){
 // else it would be convenient just to call it in every update
 void Rs2Projector::updateStatusGUI()
 {
-	if (rs2Opened)
+	if (replayPlayer)
+	{
+		StatusGUI->getLabel("Rs2 Status")->setLabel("Replaying recorded session");
+		StatusGUI->getLabel("Rs2 Status")->setLabelColor(ofColor(255, 255, 0));
+	}
+	else if (rs2Opened)
 	{
-		StatusGUI->getLabel("Rs2 Status")->setLabel("Rs2 running");
+		if (frameSourceType == FRAMESOURCE_REALSENSE)
+			StatusGUI->getLabel("Rs2 Status")->setLabel("Rs2 running");
+		else
+			StatusGUI->getLabel("Rs2 Status")->setLabel(getFrameSourceTypeName(frameSourceType) + " frames running");
 		StatusGUI->getLabel("Rs2 Status")->setLabelColor(ofColor(0, 255, 0));
 	}
 	else
@@ -189,11 +255,12 @@ void Rs2Projector::updateStatusGUI()
 		StatusGUI->getLabel("Rs2 Status")->setLabel("Rs2 not found");
 		StatusGUI->getLabel("Rs2 Status")->setLabelColor(ofColor(255, 0, 0));
 	}
+    WarmStartState warmStartState = rs2grabber.getWarmStartState();
     if(imageStabilized){
-        StatusGUI->getLabel("Ready Calibration")->setLabel("ready calibration");
+        StatusGUI->getLabel("Ready Calibration")->setLabel(warmStartState == WARMSTART_RESTORED ? "ready calibration (warm start)" : "ready calibration");
         StatusGUI->getLabel("Ready Calibration")->setLabelColor(ofColor(0, 255, 0));
     }else{
-        StatusGUI->getLabel("Ready Calibration")->setLabel("not ready calibration");
+        StatusGUI->getLabel("Ready Calibration")->setLabel(warmStartState == WARMSTART_VALIDATING ? "not ready calibration (checking snapshot)" : "not ready calibration");
         StatusGUI->getLabel("Ready Calibration")->setLabelColor(ofColor(255, 0, 0));
     }
 	if (ROIcalibrated)
@@ -248,10 +315,89 @@ void Rs2Projector::updateStatusGUI()
 	gui->getToggle("Quick reaction")->setChecked(followBigChanges);
 	gui->getToggle("Inpaint outliers")->setChecked(doInpainting);
 	gui->getToggle("Full Frame Filtering")->setChecked(doFullFrameFiltering);
+	gui->getToggle("Vectorized filter")->setChecked(vectorizedFilter);
+	gui->getToggle("Terrain derivatives")->setChecked(doTerrainDerivatives);
+	gui->getToggle("Partial texture upload")->setChecked(partialTextureUpload);
+	gui->getToggle("Freeze under hands")->setChecked(detectOccluders);
+	// The grabber drops the recording if the file cannot be created or grown
+	if (recordingSession && !rs2grabber.isRecording())
+	{
+		ofLogWarning("Rs2Projector") << "updateStatusGUI(): Session recording stopped";
+		recordingSession = false;
+	}
+	gui->getToggle("Record session")->setChecked(recordingSession);
+	gui->getToggle("Latency log")->setChecked(latencyLog);
+	gui->getToggle("Warm start")->setChecked(warmStart);
+	gui->getToggle("Camera drift monitor")->setChecked(driftMonitoring);
+	gui->getSlider("Filter threads")->setValue(numFilterThreads);
+	gui->getSlider("Spatial sigma")->setValue(spatialSigma);
+
+	std::string FilterStatus = "Filter: " + ofToString(numFilterThreads) + " threads, " + ofToString(rs2grabber.getFilterTime(), 1) + " ms";
+	float speedup = rs2grabber.getFilterSpeedup();
+	if (speedup > 0)
+		FilterStatus += " (x" + ofToString(speedup, 2) + ")";
+	FilterStatus += ", unstable " + ofToString(rs2grabber.getNumUnstablePixels()) + " px";
+	if (detectOccluders)
+		FilterStatus += ", hands " + ofToString(rs2grabber.getNumOccluderPixels()) + " px";
+	FilterStatus += ", dirty tiles " + ofToString(rs2grabber.getNumDirtyTiles()) + "/" + ofToString(dirtyTiles.getCols() * dirtyTiles.getRows());
+	FilterStatus += ", upload " + ofToString(FilteredDepthImage.getLastUploadBytes() / 1024) + " kB";
+	StatusGUI->getLabel("Filter Status")->setLabel(FilterStatus);
+
+	std::string InpaintStatus = "Inpainting: off";
+	if (doInpainting)
+	{
+		InpaintStatus = "Inpainted: " + ofToString(rs2grabber.getNumInpaintedPixels()) + " px";
+		if (inpaintMode == INPAINT_PUSH_PULL)
+			InpaintStatus += ", hole level " + ofToString(rs2grabber.getInpaintHoleLevel());
+		else
+			InpaintStatus += ", " + ofToString(rs2grabber.getNumInpaintedFromROIAverage()) + " from ROI average";
+	}
+	StatusGUI->getLabel("Inpaint Status")->setLabel(InpaintStatus);
+
+	std::string SessionStatus = "Session: live";
+	if (replayPlayer)
+		SessionStatus = "Replay: frame " + ofToString(replayPlayer->getCurrentFrame() + 1) + "/" + ofToString(replayPlayer->getNumFrames());
+	if (recordingSession)
+		SessionStatus += ", recording " + ofToString(rs2grabber.getNumRecordedFrames()) + " frames";
+	StatusGUI->getLabel("Session Status")->setLabel(SessionStatus);
+
+	const LatencyPercentiles& total = latencyTracer.getPercentiles(0);
+	std::string LatencyStatus = "Latency: no frames";
+	if (total.count > 0)
+		LatencyStatus = "Latency: " + ofToString(total.p50, 1) + " / " + ofToString(total.p95, 1) + " / " + ofToString(total.p99, 1) + " ms (p50/p95/p99)";
+	StatusGUI->getLabel("Latency Status")->setLabel(LatencyStatus);
+	std::string LatencyStages = "p95:";
+	for (int s = 1; s < LatencyTracer::NUM_STAGES; s++)
+		LatencyStages += " " + LatencyTracer::getStageName(s) + " " + ofToString(latencyTracer.getPercentiles(s).p95, 1);
+	StatusGUI->getLabel("Latency Stages")->setLabel(LatencyStages);
+
+	if (!driftMonitoring)
+	{
+		StatusGUI->getLabel("Drift Status")->setLabel("Camera drift: not monitored");
+		StatusGUI->getLabel("Drift Status")->setLabelColor(ofColor(255, 255, 0));
+	}
+	else if (cameraMoved)
+	{
+		StatusGUI->getLabel("Drift Status")->setLabel("Camera moved: calibrate again");
+		StatusGUI->getLabel("Drift Status")->setLabelColor(ofColor(255, 0, 0));
+	}
+	else if (hasDrift)
+	{
+		StatusGUI->getLabel("Drift Status")->setLabel("Camera drift: " + ofToString(lastDrift.rotation, 2) + " deg, " + ofToString(lastDrift.elevationShift, 1) + " elevation");
+		StatusGUI->getLabel("Drift Status")->setLabelColor(ofColor(0, 255, 0));
+	}
+	else
+	{
+		StatusGUI->getLabel("Drift Status")->setLabel(driftMonitor.hasReference() ? "Camera drift: not measured yet" : "Camera drift: no reference");
+		StatusGUI->getLabel("Drift Status")->setLabelColor(ofColor(255, 255, 0));
+	}
 }
 
 void Rs2Projector::update()
 {
+    PROFILE_ZONE("Rs2Projector::update");
+    latencyTracer.update();
+    MetricsRegistry::get().update();
     updateStatusGUI();
     // Clear updated state variables
     basePlaneUpdated = false;
@@ -272,7 +418,7 @@ void Rs2Projector::update()
 			ofLogVerbose("Rs2Projector") << "Rs2Projector.update(): rs2ROI " << rs2ROI;
 
 			rs2grabber.setupFramefilter(gradFieldResolution, maxOffset, rs2ROI, spatialFiltering, followBigChanges, numAveragingSlots);
-			rs2WorldMatrix = rs2grabber.getWorldMatrix();
+			rs2WorldMatrix = rs2grabber.getCameraWorldMatrix();
 			ofLogVerbose("Rs2Projector") << "Rs2Projector.update(): rs2WorldMatrix: " << rs2WorldMatrix;
             
             
@@ -280,44 +426,101 @@ void Rs2Projector::update()
 		}
 	}
 
+	// Keep a recent filter snapshot in case the application does not exit cleanly
+	if (warmStart && applicationState == APPLICATION_STATE_RUNNING && snapshotInterval > 0 && TimeStamp - lastSnapshotTime > snapshotInterval)
+	{
+		lastSnapshotTime = TimeStamp;
+		saveFilterSnapshot(true);
+	}
+
 	if (displayGui)
 	{
 		gui->update();
 		StatusGUI->update();
 	}
 
-    // Get images from rs2 grabber
-    ofFloatPixels filteredframe;
-    if (rs2Opened && rs2grabber.filtered.tryReceive(filteredframe))
-	{
+    // Rays of the rs2 pixels, rebuilt when the camera changes
+    if (rs2Opened)
+        deprojection.setup(rs2WorldMatrix, rs2Res.x, rs2Res.y);
+
+    // The grabber measures the elevation of its pyramid with the current camera and base plane
+    if (rs2Opened && (basePlaneEq != elevationBasePlaneEq || rs2WorldMatrix != elevationWorldMatrix))
+    {
+        elevationBasePlaneEq = basePlaneEq;
+        elevationWorldMatrix = rs2WorldMatrix;
+        ofMatrix4x4 worldMatrix = rs2WorldMatrix;
+        ofVec4f planeEq = basePlaneEq;
+        rs2grabber.performInThread([worldMatrix, planeEq](Rs2Grabber & kg) {
+            kg.setElevationReference(worldMatrix, planeEq);
+        });
+    }
+
+    // Drift measured by the monitor thread on one of the previous frames
+    CameraDrift drift;
+    if (driftMonitor.getDrift(drift))
+        applyCameraDrift(drift);
+
+    // Get the latest frame packet from rs2 grabber. The packet stays ours until the next acquireLatest()
+    if (rs2Opened && rs2grabber.framePackets.acquireLatest())
+	{
+		PROFILE_ZONE("Rs2Projector frame packet");
+		const FramePacket& packet = rs2grabber.framePackets.getReadPacket();
+		frameLatency = packet.latency;
+		frameLatency.mark(LATENCY_RECEIVED);
+		framesReceivedMetric.add();
+		if (packet.sequence > lastPacketSequence + 1 && lastPacketSequence > 0)
+			framesDroppedMetric.add(packet.sequence - lastPacketSequence - 1);
+		lastPacketSequence = packet.sequence;
 		fpsRs2.newFrame();
 		fpsRs2Text->setText(ofToString(fpsRs2.getFps(), 2));
 
-		FilteredDepthImage.setFromPixels(filteredframe.getData(), rs2Res.x, rs2Res.y);
-        FilteredDepthImage.updateTexture();
+		FilteredDepthImage.setFromPixels(packet.depth.getData(), rs2Res.x, rs2Res.y);
+
+        // Tiles changed since the previous packet received
+        dirtyTiles = packet.dirtyTiles;
+        if (!partialTextureUpload)
+            FilteredDepthImage.invalidateTexture();
+        FilteredDepthImage.updateTextureTiles(dirtyTiles);
+        frameLatency.mark(LATENCY_UPLOADED);
+        uploadBytesMetric.add(FilteredDepthImage.getLastUploadBytes());
+        if (dirtyTiles.any())
+            ofNotifyEvent(sandChangedEvent, dirtyTiles, this);
         
-        // Get color image from rs2 grabber
-        ofPixels coloredframe;
-        if (rs2grabber.colored.tryReceive(coloredframe))
-		{
-            rs2ColorImage.setFromPixels(coloredframe);
-		
-			if (TemporalFilteringType == 0)
-				TemporalFrameFilter.NewFrame(rs2ColorImage.getPixels().getData(), rs2ColorImage.width, rs2ColorImage.height);
-			else if (TemporalFilteringType == 1)
-				TemporalFrameFilter.NewColFrame(rs2ColorImage.getPixels().getData(), rs2ColorImage.width, rs2ColorImage.height);
-		}
+        // Get color image
+        rs2ColorImage.setFromPixels(packet.color);
+		if (TemporalFilteringType == 0)
+			TemporalFrameFilter.NewFrame(rs2ColorImage.getPixels().getData(), rs2ColorImage.width, rs2ColorImage.height);
+		else if (TemporalFilteringType == 1)
+			TemporalFrameFilter.NewColFrame(rs2ColorImage.getPixels().getData(), rs2ColorImage.width, rs2ColorImage.height);
+
+        // Get gradient field, unless the packet still has the previous resolution
+        if (packet.gradientResolution == gradFieldResolution && packet.gradient.size() == gradField.size())
+            std::copy(packet.gradient.begin(), packet.gradient.end(), gradField.begin());
+        terrainDerivatives = packet.hasDerivatives ? &packet.derivatives : nullptr;
+
+        // Elevation map, unless it was measured with a previous camera or base plane
+        elevationMap = nullptr;
+        elevationPyramid = nullptr;
+        if (packet.hasElevation && packet.elevationWorldMatrix == rs2WorldMatrix)
+        {
+            elevationMap = &packet.elevation;
+            elevationPyramid = &packet.elevationPyramid;
+            elevationMapBasePlaneEq = packet.elevationBasePlaneEq;
+            elevationMapSequence = packet.sequence;
+        }
 
-        // Get gradient field from rs2 grabber
-        rs2grabber.gradient.tryReceive(gradField);
-        
-        // Update grabber stored frame number
-        rs2grabber.lock();
-        rs2grabber.decStoredframes();
-        rs2grabber.unlock();
+        // Get occluder mask
+        hasOccluders = packet.hasOccluders;
+        if (hasOccluders)
+            occluderMask = packet.occluders;
         
         // Is the depth image stabilized
-        imageStabilized = rs2grabber.isImageStabilized();
+        imageStabilized = packet.stabilized;
+
+        // Now and then a stable frame goes to the drift monitor, unless it is still busy with the previous one
+        if (driftMonitoring && applicationState == APPLICATION_STATE_RUNNING && imageStabilized && TimeStamp - lastDriftCheck > driftCheckInterval
+            && driftMonitor.submit(packet.depth.getData(), packet.sequence))
+            lastDriftCheck = TimeStamp;
         
 
         // Are we calibrating ?
@@ -806,6 +1009,9 @@ void Rs2Projector::updateProjRs2AutoCalibration()
 		currentCalibPts = 0;
         upframe = false;
         trials = 0;
+		pairsRs2.clear();
+		pairsProjector.clear();
+		kpt->resetPointPairs();
 		TemporalFrameCounter = 0;
 
 		ofPoint dispPt = ofPoint(projRes.x / 2, projRes.y / 2) + autoCalibPts[currentCalibPts]; //
@@ -842,6 +1048,7 @@ void Rs2Projector::updateProjRs2AutoCalibration()
             ofLogVerbose("Rs2Projector") << "autoCalib(): Calibrating" ;
             kpt->calibrate(pairsRs2, pairsProjector);
             rs2ProjMatrix = kpt->getProjectionMatrix();
+            ofLogVerbose("Rs2Projector") << "autoCalib(): " << kpt->getNumInliers() << " inliers out of " << pairsRs2.size() << " point pairs, RMS error of the inliers " << kpt->getReprojectionError();
 
 			double ReprojectionError = ComputeReprojectionError(DumpDebugFiles);
             errorcounts = ReprojectionError;
@@ -926,8 +1133,9 @@ double Rs2Projector::ComputeReprojectionError(bool WriteFile)
 
 			double D = sqrt((projectedPoint.x - projP.x) * (projectedPoint.x - projP.x) + (projectedPoint.y - projP.y) * (projectedPoint.y - projP.y));
 
+			bool inlier = i < kpt->getInliers().size() && kpt->getInliers()[i];
 			fost2 << wc.x << ", " << wc.y << ", " << wc.z << ", "
-				<< projP.x << ", " << projP.y << ", " << projectedPoint.x << ", " << projectedPoint.y << ", " << D << std::endl;
+				<< projP.x << ", " << projP.y << ", " << projectedPoint.x << ", " << projectedPoint.y << ", " << D << ", " << inlier << std::endl;
 		}
 	}
 
@@ -1013,8 +1221,18 @@ void Rs2Projector::CalibrateNextPoint()
 			{
 				trials = 0;
 				currentCalibPts++;
-				ofPoint dispPt = ofPoint(projRes.x / 2, projRes.y / 2) + autoCalibPts[currentCalibPts]; // Compute next chessboard position
-				drawChessboard(dispPt.x, dispPt.y, chessboardSize); // We can now draw the next chess board
+				// Stop when the calibration from the previous chessboards already predicted this one well
+				double predictionError = kpt->getPredictionError();
+				if (upframe && currentCalibPts >= 5 + minHighCalibPts && predictionError >= 0 && predictionError < calibStopError)
+				{
+					ofLogVerbose("Rs2Projector") << "autoCalib(): Calibration converged after " << currentCalibPts << " chessboards, prediction error " << predictionError;
+					currentCalibPts = 15;
+				}
+				if (currentCalibPts < 15)
+				{
+					ofPoint dispPt = ofPoint(projRes.x / 2, projRes.y / 2) + autoCalibPts[currentCalibPts]; // Compute next chessboard position
+					drawChessboard(dispPt.x, dispPt.y, chessboardSize); // We can now draw the next chess board
+				}
 			}
 			else
 			{
@@ -1102,22 +1320,15 @@ void Rs2Projector::updateBasePlane()
         ofLogVerbose("Rs2Projector") << "updateBasePlane(): smallROI is null, cannot compute base plane normal" ;
         return;
     }
-    ofVec4f pt;
-    ofVec3f* points;
-    points = new ofVec3f[sw*sh];
-    ofLogVerbose("Rs2Projector") << "updateBasePlane(): Computing points in smallROI : " << sw*sh ;
-    for (int x = 0; x<sw; x++){
-        for (int y = 0; y<sh; y ++){
-            points[x+y*sw] = rs2CoordToWorldCoord(x+sl, y+st);
-        }
-    }
-    ofLogVerbose("Rs2Projector") << "updateBasePlane(): Computing plane from points" ;
-    basePlaneEq = plane_from_points(points, sw*sh);
-	if (basePlaneEq.x == 0 && basePlaneEq.y == 0 && basePlaneEq.z == 0)
+    ofLogVerbose("Rs2Projector") << "updateBasePlane(): Fitting plane to smallROI : " << sw*sh ;
+    PlaneFit fit = planeEstimator.fit(FilteredDepthImage.getFloatPixelsRef().getData(), deprojection, sl, st, sl+sw, st+sh, planePool);
+	if (!fit.valid)
 	{
-		ofLogVerbose("Rs2Projector") << "updateBasePlane(): plane_from_points could not compute basePlane";
+		ofLogVerbose("Rs2Projector") << "updateBasePlane(): could not compute basePlane";
 		return;
 	}
+    ofLogVerbose("Rs2Projector") << "updateBasePlane(): inliers: " << fit.numInliers << " / " << fit.numPoints << " rms: " << fit.rmsResidual ;
+    basePlaneEq = fit.plane;
 
     basePlaneNormal = ofVec3f(basePlaneEq);
     basePlaneOffset = ofVec3f(0,0,-basePlaneEq.w);
@@ -1125,9 +1336,87 @@ void Rs2Projector::updateBasePlane()
     basePlaneOffsetBack = basePlaneOffset;
     basePlaneUpdated = true;
 	basePlaneComputed = true;
+
+	// The flattened sand is the reference of the camera drift monitor
+	driftMonitor.setReference(FilteredDepthImage.getFloatPixelsRef().getData(), rs2Res.x, rs2Res.y, rs2ROI, rs2WorldMatrix, basePlaneEq);
+	driftReferenceNormalBack = basePlaneNormalBack;
+	driftReferenceOffsetBack = basePlaneOffsetBack;
+	hasDrift = false;
+	cameraMoved = false;
 	updateStatusGUI();
 }
 
+// Small drifts move the base plane with the camera. Larger ones put the projector calibration in doubt as well, which
+// the depth frames cannot check, so they only flag the calibration as outdated. Only the camera motion (reference
+// plane to drifted plane) is corrected, the sea level adjustments of the sliders are applied on top of it again.
+void Rs2Projector::applyCameraDrift(const CameraDrift& drift)
+{
+	ofLogVerbose("Rs2Projector") << "applyCameraDrift(): frame " << drift.sequence << " rotation: " << drift.rotation << " translation: " << drift.translation
+		<< " elevation shift: " << drift.elevationShift << " inliers: " << drift.inlierRatio << " rms: " << drift.rmsResidual << " time: " << drift.alignTime << " ms";
+	if (!drift.valid)
+		return; // Too much sand moved since the reference to tell
+	hasDrift = true;
+	lastDrift = drift;
+	if (drift.elevationShift > maxDriftCorrection || drift.rotation > maxDriftRotation)
+	{
+		if (!cameraMoved)
+			ofLogWarning("Rs2Projector") << "applyCameraDrift(): The camera moved since the calibration (" << drift.rotation << " deg, "
+				<< drift.elevationShift << " elevation shift), the calibration should be done again";
+		cameraMoved = true;
+		return;
+	}
+	cameraMoved = false;
+	if (drift.elevationShift < driftTolerance)
+		return;
+
+	// Move the calibrated plane of the reference time as the camera moved the reference plane
+	ofVec3f referenceNormal(drift.referencePlaneEq);
+	ofVec3f driftNormal(drift.basePlaneEq);
+	ofVec3f normalBack = driftReferenceNormalBack;
+	ofVec3f axis = referenceNormal.getCrossed(driftNormal);
+	if (axis.length() > 0)
+		normalBack.rotate(referenceNormal.angle(driftNormal), axis);
+	ofVec3f offsetBack = driftReferenceOffsetBack;
+	if (normalBack.z != 0)
+		offsetBack.z -= (drift.basePlaneEq.w - drift.referencePlaneEq.w) / normalBack.z;
+	if (basePlaneShift(getPlaneEquation(offsetBack, normalBack), getPlaneEquation(basePlaneOffsetBack, basePlaneNormalBack)) < driftTolerance)
+		return; // Corrected already
+
+	ofLogNotice("Rs2Projector") << "applyCameraDrift(): Base plane corrected for a camera drift of " << drift.rotation << " deg, " << drift.translation;
+	basePlaneNormalBack = normalBack;
+	basePlaneOffsetBack = offsetBack;
+	applySeaLevelAdjustments();
+}
+
+// Base plane from the calibrated one and the "Tilt X", "Tilt Y" and "Vertical offset" sliders
+void Rs2Projector::applySeaLevelAdjustments()
+{
+	basePlaneNormal = basePlaneNormalBack.getRotated(gui->getSlider("Tilt X")->getValue(), ofVec3f(1,0,0));
+	basePlaneNormal.rotate(gui->getSlider("Tilt Y")->getValue(), ofVec3f(0,1,0));
+	basePlaneOffset = basePlaneOffsetBack;
+	basePlaneOffset.z += gui->getSlider("Vertical offset")->getValue();
+	basePlaneEq = getPlaneEquation(basePlaneOffset, basePlaneNormal);
+	basePlaneUpdated = true;
+}
+
+// Largest elevation fromPlaneEq gives to the points of another plane, at the corners of the ROI
+float Rs2Projector::basePlaneShift(const ofVec4f& planeEq, const ofVec4f& fromPlaneEq)
+{
+	float corners[4][2] = { { rs2ROI.getMinX(), rs2ROI.getMinY() }, { rs2ROI.getMaxX() - 1, rs2ROI.getMinY() },
+		{ rs2ROI.getMinX(), rs2ROI.getMaxY() - 1 }, { rs2ROI.getMaxX() - 1, rs2ROI.getMaxY() - 1 } };
+	float shift = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		ofVec3f ray = deprojection.deproject(corners[i][0], corners[i][1], 1);
+		float along = ofVec3f(planeEq).dot(ray);
+		if (along == 0)
+			continue;
+		ofVec3f point = ray * (-planeEq.w / along);
+		shift = max(shift, fabs(fromPlaneEq.x * point.x + fromPlaneEq.y * point.y + fromPlaneEq.z * point.z + fromPlaneEq.w));
+	}
+	return shift;
+}
+
 void Rs2Projector::updateMaxOffset(){
     ofRectangle smallROI = rs2ROI;
     smallROI.scaleFromCenter(0.75); // Reduce ROI to avoid problems with borders
@@ -1141,18 +1430,14 @@ void Rs2Projector::updateMaxOffset(){
         ofLogVerbose("Rs2Projector") << "updateMaxOffset(): smallROI is null, cannot compute base plane normal" ;
         return;
     }
-    ofVec4f pt;
-    ofVec3f* points;
-    points = new ofVec3f[sw*sh];
-    ofLogVerbose("Rs2Projector") << "updateMaxOffset(): Computing points in smallROI : " << sw*sh ;
-    for (int x = 0; x<sw; x++){
-        for (int y = 0; y<sh; y ++){
-            points[x+y*sw] = rs2CoordToWorldCoord(x+sl, y+st);//vertexCcvertexCc;
-        }
+    ofLogVerbose("Rs2Projector") << "updateMaxOffset(): Fitting plane to smallROI : " << sw*sh ;
+    PlaneFit fit = planeEstimator.fit(FilteredDepthImage.getFloatPixelsRef().getData(), deprojection, sl, st, sl+sw, st+sh, planePool);
+    if (!fit.valid) {
+        ofLogVerbose("Rs2Projector") << "updateMaxOffset(): could not compute max offset plane" ;
+        return;
     }
-    ofLogVerbose("Rs2Projector") << "updateMaxOffset(): Computing plane from points" ;
-    ofVec4f eqoff = plane_from_points(points, sw*sh);
-    maxOffset = -eqoff.w-maxOffsetSafeRange;
+    ofLogVerbose("Rs2Projector") << "updateMaxOffset(): inliers: " << fit.numInliers << " / " << fit.numPoints << " rms: " << fit.rmsResidual ;
+    maxOffset = -fit.plane.w-maxOffsetSafeRange;
     maxOffsetBack = maxOffset;
     // Update max Offset
     ofLogVerbose("Rs2Projector") << "updateMaxOffset(): maxOffset" << maxOffset ;
@@ -1171,12 +1456,17 @@ bool Rs2Projector::addPointPair() {
         if (worldPoint.z > 0)   nDepthPoints++;
     }
     if (nDepthPoints == (chessboardX-1)*(chessboardY-1)) {
+        vector<ofVec3f> newPairsRs2;
+        vector<ofVec2f> newPairsProjector;
         for (int i=0; i<cvPoints.size(); i++) {
             ofVec3f worldPoint = rs2CoordToWorldCoord(cvPoints[i].x, cvPoints[i].y);
-            pairsRs2.push_back(worldPoint);
-            pairsProjector.push_back(currentProjectorPoints[i]);
+            newPairsRs2.push_back(worldPoint);
+            newPairsProjector.push_back(currentProjectorPoints[i]);
         }
-        resultMessage = "addPointPair(): Added " + ofToString((chessboardX-1)*(chessboardY-1)) + " points pairs.";
+        pairsRs2.insert(pairsRs2.end(), newPairsRs2.begin(), newPairsRs2.end());
+        pairsProjector.insert(pairsProjector.end(), newPairsProjector.begin(), newPairsProjector.end());
+        kpt->addPointPairs(newPairsRs2, newPairsProjector);
+        resultMessage = "addPointPair(): Added " + ofToString((chessboardX-1)*(chessboardY-1)) + " points pairs, prediction error " + ofToString(kpt->getPredictionError()) + ".";
 		if (DumpDebugFiles)
 		{
 			savePointPair();
@@ -1200,6 +1490,13 @@ void Rs2Projector::askToFlattenSand(){
 
 void Rs2Projector::drawProjectorWindow(){
     fboProjWindow.draw(0,0);
+
+    // The frame has reached the projector (up to the buffer swap), it is recorded once
+    if (frameLatency.has(LATENCY_RECEIVED) && !frameLatency.has(LATENCY_PROJECTED))
+    {
+        frameLatency.mark(LATENCY_PROJECTED);
+        latencyTracer.record(frameLatency);
+    }
 }
 
 void Rs2Projector::drawMainWindow(float x, float y, float width, float height){
@@ -1309,12 +1606,7 @@ ofVec2f Rs2Projector::rs2CoordToProjCoord(float x, float y) // x, y in rs2 pixel
 
 ofVec2f Rs2Projector::rs2CoordToProjCoord(float x, float y, float z)
 {
-	ofVec4f kc = ofVec2f(x, y);
-	kc.z = z;
-	kc.w = 1;
-	ofVec4f wc = rs2WorldMatrix*kc*kc.z;
-
-	return worldCoordToProjCoord(wc);
+	return worldCoordToProjCoord(deprojection.deproject(x, y, z));
 }
 
 ofVec2f Rs2Projector::worldCoordToProjCoord(ofVec3f vin)
@@ -1355,13 +1647,13 @@ ofVec3f Rs2Projector::rs2CoordToWorldCoord(float x, float y) // x, y in rs2 pixe
 	if (x >= rs2Res.x)
 		x = rs2Res.x - 1;
 
-    ofVec4f kc = ofVec2f(x, y);
     int ind = static_cast<int>(y) * rs2Res.x + static_cast<int>(x);
-    kc.z = FilteredDepthImage.getFloatPixelsRef().getData()[ind];
+    return deprojection.deproject(x, y, FilteredDepthImage.getFloatPixelsRef().getData()[ind]);
+}
 
-    kc.w = 1;
-    ofVec4f wc = rs2WorldMatrix*kc*kc.z;
-    return ofVec3f(wc);
+void Rs2Projector::rs2CoordsToWorldCoords(const ofVec2f* coords, int count, ofVec3f* points)
+{
+    deprojection.deprojectPoints(FilteredDepthImage.getFloatPixelsRef().getData(), coords, count, points);
 }
 
 ofVec2f Rs2Projector::worldCoordTors2Coord(ofVec3f wc)
@@ -1373,14 +1665,19 @@ ofVec2f Rs2Projector::worldCoordTors2Coord(ofVec3f wc)
 
 ofVec3f Rs2Projector::Rawrs2CoordToWorldCoord(float x, float y) // x, y in rs2 pixel coord
 {
-    ofVec4f kc = ofVec3f(x, y, rs2grabber.getRawDepthAt(static_cast<int>(x), static_cast<int>(y)));
-    kc.w = 1;
-    ofVec4f wc = rs2WorldMatrix*kc*kc.z;
-    return ofVec3f(wc);
+    return deprojection.deproject(x, y, rs2grabber.getRawDepthAt(static_cast<int>(x), static_cast<int>(y)));
 }
 
 float Rs2Projector::elevationAtrs2Coord(float x, float y) // x, y in rs2 pixel coordinate
 {
+    // Elevation of the pixel holding the point from the map of the frame
+    const float* map = getElevationMap();
+    if (map)
+    {
+        int col = static_cast<int>(ofClamp(x, 0, rs2Res.x - 1));
+        int row = static_cast<int>(ofClamp(y, 0, rs2Res.y - 1));
+        return map[row * static_cast<int>(rs2Res.x) + col];
+    }
     ofVec4f wc = rs2CoordToWorldCoord(x, y);
     wc.w = 1;
     float elevation = -basePlaneEq.dot(wc);
@@ -1397,11 +1694,36 @@ float Rs2Projector::elevationTors2Depth(float elevation, float x, float y) // x,
 }
 
 ofVec2f Rs2Projector::gradientAtrs2Coord(float x, float y){
-    int ind = static_cast<int>(floor(x/gradFieldResolution)) + gradFieldcols*static_cast<int>(floor(y/gradFieldResolution));
+    int col = static_cast<int>(floor(x/gradFieldResolution));
+    int row = static_cast<int>(floor(y/gradFieldResolution));
+    if (col < 0 || col >= gradFieldcols || row < 0 || row >= gradFieldrows)
+        return ofVec2f(0);
+    int ind = col + gradFieldcols*row;
     fishInd = ind;
+    if (doTerrainDerivatives && terrainDerivatives)
+        return terrainDerivatives->sampleGradient(x, y);
     return gradField[ind];
 }
 
+TerrainSample Rs2Projector::terrainAtrs2Coord(float x, float y){
+    if (!doTerrainDerivatives || !terrainDerivatives)
+        return TerrainDerivatives().sample(x, y); // Flat surface
+    return terrainDerivatives->sample(x, y);
+}
+
+ElevationCell Rs2Projector::elevationCellAtrs2Coord(float x, float y, int reduction){
+    const ElevationPyramid* pyramid = getElevationPyramid();
+    if (pyramid)
+    {
+        ElevationCell cell = pyramid->getCell(ElevationPyramid::getLevelForReduction(reduction), x, y);
+        if (cell.count > 0)
+            return cell;
+    }
+    float elevation = elevationAtrs2Coord(x, y);
+    ElevationCell cell = { elevation, elevation, elevation, 1 };
+    return cell;
+}
+
 void Rs2Projector::setupGui(){
     // instantiate and position the gui //
     gui = new ofxDatGui( ofxDatGuiAnchor::TOP_RIGHT );
@@ -1417,8 +1739,23 @@ void Rs2Projector::setupGui(){
 	advancedFolder->addToggle("Dump Debug", DumpDebugFiles);
 	advancedFolder->addSlider("Ceiling", -300, 300, 0);
     advancedFolder->addToggle("Spatial filtering", spatialFiltering);
+	advancedFolder->addDropdown("Spatial filter", { "Binomial 20 passes", "Recursive Gaussian" })->setName("Spatial filter");
+	gui->getDropdown("Spatial filter")->select(spatialFilterMode);
+	advancedFolder->addSlider("Spatial sigma", 0.5, 10, spatialSigma)->setPrecision(2);
 	advancedFolder->addToggle("Inpaint outliers", doInpainting);
+	advancedFolder->addDropdown("Inpainting", { "Local average", "Push-pull" })->setName("Inpainting");
+	gui->getDropdown("Inpainting")->select(inpaintMode);
 	advancedFolder->addToggle("Full Frame Filtering", doFullFrameFiltering);
+	advancedFolder->addDropdown("Temporal filter", { "Float slots", "Compact ring", "Recursive estimate" })->setName("Temporal filter");
+	gui->getDropdown("Temporal filter")->select(filterMode);
+	advancedFolder->addToggle("Vectorized filter", vectorizedFilter);
+	advancedFolder->addToggle("Terrain derivatives", doTerrainDerivatives);
+	advancedFolder->addToggle("Partial texture upload", partialTextureUpload);
+	advancedFolder->addToggle("Freeze under hands", detectOccluders);
+	advancedFolder->addToggle("Latency log", latencyLog);
+	advancedFolder->addToggle("Warm start", warmStart);
+	advancedFolder->addSlider("Filter threads", 1, FrameFilterWorkerPool::getMaxThreads(), numFilterThreads)->setPrecision(0);
+	advancedFolder->addButton("Measure filter speedup");
 	advancedFolder->addToggle("Quick reaction", followBigChanges);
     advancedFolder->addSlider("Averaging", 1, 40, numAveragingSlots)->setPrecision(0);
 	advancedFolder->addSlider("Tilt X", -30, 30, 0);
@@ -1426,12 +1763,23 @@ void Rs2Projector::setupGui(){
 	advancedFolder->addSlider("Vertical offset", -100, 100, 0);
 	advancedFolder->addButton("Reset sea level");
 	advancedFolder->addBreak();
+
+	auto sessionFolder = gui->addFolder("Session", ofColor::darkOrange);
+	sessionFolder->addToggle("Record session", recordingSession);
+	sessionFolder->addButton("Replay session...");
+	sessionFolder->addDropdown("Replay mode", { "Real-time", "As fast as possible", "Frame step" })->setName("Replay mode");
+	gui->getDropdown("Replay mode")->select(replayMode);
+	sessionFolder->addButton("Step frame");
+	sessionFolder->addButton("Stop replay");
+	sessionFolder->addDropdown("Depth camera", { "RealSense", "Kinect", "Synthetic" })->setName("Depth camera");
+	gui->getDropdown("Depth camera")->select(frameSourceType);
 	
 	auto calibrationFolder = gui->addFolder("Calibration", ofColor::darkCyan);
 	calibrationFolder->addButton("Manually define sand region");
 	calibrationFolder->addButton("Automatically calibrate rs2 & projector");
 	calibrationFolder->addButton("Auto Adjust ROI");
 	calibrationFolder->addToggle("Show ROI on sand", doShowROIonProjector);
+	calibrationFolder->addToggle("Camera drift monitor", driftMonitoring);
     
     gui->addHeader(":: Settings ::", false);
     
@@ -1439,6 +1787,7 @@ void Rs2Projector::setupGui(){
     gui->onButtonEvent(this, &Rs2Projector::onButtonEvent);
     gui->onToggleEvent(this, &Rs2Projector::onToggleEvent);
     gui->onSliderEvent(this, &Rs2Projector::onSliderEvent);
+	gui->onDropdownEvent(this, &Rs2Projector::onDropdownEvent);
 
 	// disactivate autodraw
 	gui->setAutoDraw(false);
@@ -1454,6 +1803,12 @@ void Rs2Projector::setupGui(){
 	StatusGUI->addLabel("Calibration Step");
     StatusGUI->addLabel("Calibration Error Count");
 	StatusGUI->addLabel("Projector Status");
+	StatusGUI->addLabel("Filter Status");
+	StatusGUI->addLabel("Inpaint Status");
+	StatusGUI->addLabel("Session Status");
+	StatusGUI->addLabel("Latency Status");
+	StatusGUI->addLabel("Latency Stages");
+	StatusGUI->addLabel("Drift Status");
 	StatusGUI->addHeader(":: Status ::", false);
     StatusGUI->addBreak();
     StatusGUI->setAutoDraw(false);
@@ -1507,18 +1862,39 @@ void Rs2Projector::startApplication()
 		if (loadSettings())
 		{
 			ofLogVerbose("Rs2Projector") << "Rs2Projector.setup(): Settings loaded ";
+			if (driftMonitor.loadReference(ofToDataPath("settings/cameraReference.bin", true), rs2WorldMatrix, rs2Res.x, rs2Res.y))
+			{
+				ofLogVerbose("Rs2Projector") << "Rs2Projector.setup(): Camera drift reference loaded ";
+				driftReferenceNormalBack = basePlaneNormalBack;
+				driftReferenceOffsetBack = basePlaneOffsetBack;
+			}
 			setNewRs2ROI();
 			ROIcalibrated = true;
 			basePlaneComputed = true;
 			setFullFrameFiltering(doFullFrameFiltering);
 			setInPainting(doInpainting);
+			setInpaintMode(inpaintMode);
+			setTerrainDerivatives(doTerrainDerivatives);
+			setPartialTextureUpload(partialTextureUpload);
+			setDetectOccluders(detectOccluders);
+			setLatencyLog(latencyLog);
+			setMetricsInterval(metricsInterval);
 			setFollowBigChanges(followBigChanges);
 			setSpatialFiltering(spatialFiltering);
+			setSpatialFilterMode(spatialFilterMode);
+			setSpatialSigma(spatialSigma);
+			setVectorizedFilter(vectorizedFilter);
+			setNumFilterThreads(numFilterThreads);
+			setFilterMode(filterMode);
 
 			int nAvg = numAveragingSlots;
 			rs2grabber.performInThread([nAvg](Rs2Grabber & kg) {
 				kg.setAveragingSlotsNumber(nAvg); });
 
+			// Queued after the settings so the grabber buffers have their final layout
+			if (warmStart)
+				loadFilterSnapshot();
+
 			updateStatusGUI();
 		}
 		else 
@@ -1617,6 +1993,206 @@ void Rs2Projector::setSpatialFiltering(bool sspatialFiltering){
 	updateStatusGUI();
 }
 
+void Rs2Projector::setSpatialFilterMode(SpatialFilterMode mode)
+{
+	spatialFilterMode = mode;
+	rs2grabber.performInThread([mode](Rs2Grabber & kg) {
+		kg.setSpatialFilterMode(mode);
+	});
+	if (displayGui)
+		gui->getDropdown("Spatial filter")->select(spatialFilterMode);
+	updateStatusGUI();
+}
+
+void Rs2Projector::setSpatialSigma(float sigma)
+{
+	spatialSigma = sigma;
+	rs2grabber.performInThread([sigma](Rs2Grabber & kg) {
+		kg.setSpatialSigma(sigma);
+	});
+	updateStatusGUI();
+}
+
+void Rs2Projector::setInpaintMode(InpaintMode mode)
+{
+	inpaintMode = mode;
+	rs2grabber.performInThread([mode](Rs2Grabber & kg) {
+		kg.setInpaintMode(mode);
+	});
+	if (displayGui)
+		gui->getDropdown("Inpainting")->select(inpaintMode);
+	updateStatusGUI();
+}
+
+void Rs2Projector::setTerrainDerivatives(bool td)
+{
+	doTerrainDerivatives = td;
+	rs2grabber.performInThread([td](Rs2Grabber & kg) {
+		kg.setComputeDerivatives(td);
+	});
+	updateStatusGUI();
+}
+
+void Rs2Projector::setPartialTextureUpload(bool ptu)
+{
+	partialTextureUpload = ptu;
+	FilteredDepthImage.invalidateTexture();
+	updateStatusGUI();
+}
+
+void Rs2Projector::setDetectOccluders(bool doc)
+{
+	detectOccluders = doc;
+	rs2grabber.performInThread([doc](Rs2Grabber & kg) {
+		kg.setDetectOccluders(doc);
+	});
+	updateStatusGUI();
+}
+
+void Rs2Projector::setWarmStart(bool ws)
+{
+	warmStart = ws;
+	updateStatusGUI();
+}
+
+FilterSnapshotCalibration Rs2Projector::getSnapshotCalibration()
+{
+	return FilterSnapshotCalibration(rs2ROI, basePlaneNormalBack, basePlaneOffsetBack, maxOffsetBack, rs2ProjMatrix);
+}
+
+// The grabber copies the state between two frames. The periodic saves are written in the background so the
+// frames keep coming, the one on exit is written before the grabber releases the state.
+void Rs2Projector::saveFilterSnapshot(bool inBackground)
+{
+	std::string path = ofToDataPath("settings/filterSnapshot.bin", true);
+	FilterSnapshotCalibration calibration = getSnapshotCalibration();
+	rs2grabber.performInThread([path, calibration, inBackground](Rs2Grabber & kg) {
+		if (inBackground)
+			kg.saveSnapshotInBackground(path, calibration);
+		else
+			kg.saveSnapshot(path, calibration);
+	});
+}
+
+void Rs2Projector::loadFilterSnapshot()
+{
+	std::string path = ofToDataPath("settings/filterSnapshot.bin", true);
+	FilterSnapshotCalibration calibration = getSnapshotCalibration();
+	rs2grabber.performInThread([path, calibration](Rs2Grabber & kg) {
+		kg.loadSnapshot(path, calibration);
+	});
+}
+
+// Percentiles of the frame latencies are appended to data/logs/latency-<time>.csv every 10 seconds
+void Rs2Projector::setLatencyLog(bool log)
+{
+	latencyLog = log;
+	if (log == latencyTracer.isLogging())
+		return;
+	if (log)
+	{
+		ofDirectory::createDirectory("logs", true, true);
+		latencyTracer.setLogFile(ofToDataPath("logs/latency-" + ofGetTimestampString("%Y%m%d-%H%M%S") + ".csv", true), 10);
+	}
+	else
+		latencyTracer.setLogFile("", 10);
+	updateStatusGUI();
+}
+
+void Rs2Projector::setDriftMonitoring(bool dm)
+{
+	driftMonitoring = dm;
+	if (!driftMonitoring)
+	{
+		hasDrift = false;
+		cameraMoved = false;
+	}
+	updateStatusGUI();
+}
+
+void Rs2Projector::setMetricsInterval(float interval)
+{
+	metricsInterval = interval;
+	if (interval > 0)
+	{
+		ofDirectory::createDirectory("metrics", true, true);
+		MetricsRegistry::get().setOutput(ofToDataPath("metrics", true), interval);
+	}
+	else
+		MetricsRegistry::get().setOutput("", 0);
+}
+
+void Rs2Projector::setRecording(bool rec)
+{
+	recordingSession = rec;
+	if (rec)
+	{
+		ofDirectory::createDirectory("recordings", true, true);
+		std::string path = ofToDataPath("recordings/session-" + ofGetTimestampString("%Y%m%d-%H%M%S") + ".msrec", true);
+		rs2grabber.startRecording(path);
+	}
+	else
+		rs2grabber.stopRecording();
+	updateStatusGUI();
+}
+
+// Replace the rs2 frames by a recorded session. Works without a rs2 connected.
+bool Rs2Projector::startReplay(std::string path)
+{
+	auto player = std::make_shared<SessionPlayer>();
+	if (!player->open(path))
+		return false;
+	if (player->getWidth() != rs2Res.x || player->getHeight() != rs2Res.y)
+	{
+		ofLogError("Rs2Projector") << "startReplay(): " << path << " was recorded at " << player->getWidth() << " x " << player->getHeight()
+			<< ", expected " << rs2Res.x << " x " << rs2Res.y;
+		return false;
+	}
+	player->setMode(replayMode);
+	replayPlayer = player;
+	rs2grabber.performInThread([player](Rs2Grabber & kg) {
+		kg.setReplay(player);
+	});
+	rs2WorldMatrix = player->getWorldMatrix();
+	ofLogVerbose("Rs2Projector") << "startReplay(): rs2WorldMatrix: " << rs2WorldMatrix;
+	rs2Opened = true;
+	updateStatusGUI();
+	return true;
+}
+
+void Rs2Projector::stopReplay()
+{
+	if (!replayPlayer)
+		return;
+	replayPlayer.reset();
+	rs2grabber.performInThread([](Rs2Grabber & kg) {
+		kg.setReplay(nullptr);
+	});
+	rs2Opened = rs2grabber.isRs2Opened();
+	if (rs2Opened)
+		rs2WorldMatrix = rs2grabber.getCameraWorldMatrix();
+	updateStatusGUI();
+}
+
+// The grabber keeps its source, the new one is saved with the settings and used at the next start
+void Rs2Projector::setFrameSourceType(FrameSourceType type)
+{
+	frameSourceType = type;
+	ofLogNotice("Rs2Projector") << "setFrameSourceType(): " << getFrameSourceTypeName(type) << " will be used after a restart";
+	if (displayGui)
+		gui->getDropdown("Depth camera")->select(frameSourceType);
+}
+
+void Rs2Projector::setReplayMode(ReplayMode mode)
+{
+	replayMode = mode;
+	if (replayPlayer)
+		replayPlayer->setMode(mode);
+	if (displayGui)
+		gui->getDropdown("Replay mode")->select(replayMode);
+	updateStatusGUI();
+}
+
 void Rs2Projector::setInPainting(bool inp) {
 	doInpainting = inp;
 	rs2grabber.performInThread([inp](Rs2Grabber & kg) {
@@ -1636,6 +2212,35 @@ void Rs2Projector::setFullFrameFiltering(bool ff)
 	updateStatusGUI();
 }
 
+void Rs2Projector::setVectorizedFilter(bool vf)
+{
+	vectorizedFilter = vf;
+	rs2grabber.performInThread([vf](Rs2Grabber & kg) {
+		kg.setVectorizedFilter(vf);
+	});
+	updateStatusGUI();
+}
+
+void Rs2Projector::setNumFilterThreads(int n)
+{
+	numFilterThreads = n;
+	rs2grabber.performInThread([n](Rs2Grabber & kg) {
+		kg.setNumFilterThreads(n);
+	});
+	updateStatusGUI();
+}
+
+void Rs2Projector::setFilterMode(FrameFilterMode mode)
+{
+	filterMode = mode;
+	rs2grabber.performInThread([mode](Rs2Grabber & kg) {
+		kg.setFilterMode(mode);
+	});
+	if (displayGui)
+		gui->getDropdown("Temporal filter")->select(filterMode); // Not refreshed in updateStatusGUI since it would close the open list
+	updateStatusGUI();
+}
+
 void Rs2Projector::setFollowBigChanges(bool sfollowBigChanges){
     followBigChanges = sfollowBigChanges;
     rs2grabber.performInThread([sfollowBigChanges](Rs2Grabber & kg) {
@@ -1671,6 +2276,27 @@ void Rs2Projector::onButtonEvent(ofxDatGuiButtonEvent e){
 	{
 		updateROIFromCalibration();
 	}
+	else if (e.target->is("Measure filter speedup"))
+	{
+		rs2grabber.performInThread([](Rs2Grabber & kg) {
+			kg.startSpeedupMeasurement();
+		});
+	}
+	else if (e.target->is("Replay session..."))
+	{
+		ofFileDialogResult result = ofSystemLoadDialog("Select a recorded session");
+		if (result.bSuccess)
+			startReplay(result.getPath());
+	}
+	else if (e.target->is("Step frame"))
+	{
+		if (replayPlayer)
+			replayPlayer->step();
+	}
+	else if (e.target->is("Stop replay"))
+	{
+		stopReplay();
+	}
 }
 
 void Rs2Projector::StartManualROIDefinition()
@@ -1720,6 +2346,30 @@ void Rs2Projector::onToggleEvent(ofxDatGuiToggleEvent e){
 	else if (e.target->is("Full Frame Filtering")) {
 		setFullFrameFiltering(e.checked);
 	}
+	else if (e.target->is("Vectorized filter")) {
+		setVectorizedFilter(e.checked);
+	}
+	else if (e.target->is("Terrain derivatives")) {
+		setTerrainDerivatives(e.checked);
+	}
+	else if (e.target->is("Partial texture upload")) {
+		setPartialTextureUpload(e.checked);
+	}
+	else if (e.target->is("Freeze under hands")) {
+		setDetectOccluders(e.checked);
+	}
+	else if (e.target->is("Record session")) {
+		setRecording(e.checked);
+	}
+	else if (e.target->is("Latency log")) {
+		setLatencyLog(e.checked);
+	}
+	else if (e.target->is("Warm start")) {
+		setWarmStart(e.checked);
+	}
+	else if (e.target->is("Camera drift monitor")) {
+		setDriftMonitoring(e.checked);
+	}
 	else if (e.target->is("Draw rs2 depth view")){
         drawRs2View = e.checked;
 		if (drawRs2View)
@@ -1762,6 +2412,10 @@ void Rs2Projector::onSliderEvent(ofxDatGuiSliderEvent e){
         rs2grabber.performInThread([this](Rs2Grabber & kg) {
             kg.setMaxOffset(this->maxOffset);
         });
+    } else if(e.target->is("Spatial sigma")){
+        setSpatialSigma(e.value);
+    } else if(e.target->is("Filter threads")){
+        setNumFilterThreads(e.value);
     } else if(e.target->is("Averaging")){
         numAveragingSlots = e.value;
         rs2grabber.performInThread([e](Rs2Grabber & kg) {
@@ -1770,6 +2424,24 @@ void Rs2Projector::onSliderEvent(ofxDatGuiSliderEvent e){
     }
 }
 
+void Rs2Projector::onDropdownEvent(ofxDatGuiDropdownEvent e){
+	if (e.target->is("Temporal filter")) {
+		setFilterMode(static_cast<FrameFilterMode>(e.child));
+	}
+	else if (e.target->is("Spatial filter")) {
+		setSpatialFilterMode(static_cast<SpatialFilterMode>(e.child));
+	}
+	else if (e.target->is("Inpainting")) {
+		setInpaintMode(static_cast<InpaintMode>(e.child));
+	}
+	else if (e.target->is("Replay mode")) {
+		setReplayMode(static_cast<ReplayMode>(e.child));
+	}
+	else if (e.target->is("Depth camera")) {
+		setFrameSourceType(static_cast<FrameSourceType>(e.child));
+	}
+}
+
 void Rs2Projector::onConfirmModalEvent(ofxModalEvent e)
 {
     if (e.type == ofxModalEvent::SHOWN)
@@ -1847,6 +2519,8 @@ void Rs2Projector::saveCalibrationAndSettings()
 		if (saveSettings())
 		{
 			ofLogVerbose("Rs2Projector") << "update(): initialisation: Settings saved ";
+			if (driftMonitor.saveReference(ofToDataPath("settings/cameraReference.bin", true)))
+				ofLogVerbose("Rs2Projector") << "update(): initialisation: Camera drift reference saved ";
 		}
 		else {
 			ofLogVerbose("Rs2Projector") << "update(): initialisation: Settings could not be saved ";
@@ -1873,7 +2547,21 @@ bool Rs2Projector::loadSettings(){
     followBigChanges = xml.getValue<bool>("followBigChanges");
     numAveragingSlots = xml.getValue<int>("numAveragingSlots");
 	doInpainting = xml.getValue<bool>("OutlierInpainting", false);
+	inpaintMode = static_cast<InpaintMode>(xml.getValue<int>("InpaintMode", INPAINT_PUSH_PULL));
+	doTerrainDerivatives = xml.getValue<bool>("TerrainDerivatives", true);
+	partialTextureUpload = xml.getValue<bool>("PartialTextureUpload", true);
+	detectOccluders = xml.getValue<bool>("OccluderDetection", true);
+	latencyLog = xml.getValue<bool>("LatencyLog", true);
+	warmStart = xml.getValue<bool>("WarmStart", true);
+	driftMonitoring = xml.getValue<bool>("DriftMonitor", true);
+	snapshotInterval = xml.getValue<float>("SnapshotInterval", 60);
+	metricsInterval = xml.getValue<float>("MetricsInterval", 15);
 	doFullFrameFiltering = xml.getValue<bool>("FullFrameFiltering", false);
+	vectorizedFilter = xml.getValue<bool>("VectorizedFilter", true);
+	numFilterThreads = xml.getValue<int>("NumFilterThreads", numFilterThreads);
+	filterMode = static_cast<FrameFilterMode>(xml.getValue<int>("TemporalFilterMode", FRAMEFILTER_MODE_SLOTS));
+	spatialFilterMode = static_cast<SpatialFilterMode>(xml.getValue<int>("SpatialFilterMode", SPATIALFILTER_RECURSIVE_GAUSSIAN));
+	spatialSigma = xml.getValue<float>("SpatialSigma", SPATIALFILTER_BINOMIAL_SIGMA);
     return true;
 }
 
@@ -1893,7 +2581,24 @@ bool Rs2Projector::saveSettings()
     xml.addValue("followBigChanges", followBigChanges);
     xml.addValue("numAveragingSlots", numAveragingSlots);
 	xml.addValue("OutlierInpainting", doInpainting);
+	xml.addValue("InpaintMode", static_cast<int>(inpaintMode));
+	xml.addValue("TerrainDerivatives", doTerrainDerivatives);
+	xml.addValue("PartialTextureUpload", partialTextureUpload);
+	xml.addValue("OccluderDetection", detectOccluders);
+	xml.addValue("LatencyLog", latencyLog);
+	xml.addValue("WarmStart", warmStart);
+	xml.addValue("DriftMonitor", driftMonitoring);
+	xml.addValue("SnapshotInterval", snapshotInterval);
+	xml.addValue("MetricsInterval", metricsInterval);
 	xml.addValue("FullFrameFiltering", doFullFrameFiltering);
+	xml.addValue("VectorizedFilter", vectorizedFilter);
+	xml.addValue("NumFilterThreads", numFilterThreads);
+	xml.addValue("TemporalFilterMode", static_cast<int>(filterMode));
+	xml.addValue("SpatialFilterMode", static_cast<int>(spatialFilterMode));
+	xml.addValue("SpatialSigma", spatialSigma);
+	xml.addValue("FrameSource", static_cast<int>(frameSourceType));
+	xml.addValue("SyntheticSize", syntheticSize);
+	xml.addValue("SyntheticFps", syntheticFps);
 	xml.setToParent();
     return xml.save(settingsFile);
 }
@@ -2030,21 +2735,21 @@ bool Rs2Projector::getBinaryLandImage(ofxCvGrayscaleImage& BinImg)
 	BinImg.allocate(rs2Res.x, rs2Res.y);
 	unsigned char *binData = BinImg.getPixels().getData();
 
-	for (int y = 0; y < rs2Res.y; y++)
+	// Elevation map of the frame, measured here if the grabber has not sent one for the current base plane
+	const float* elevation = getElevationMap();
+	std::vector<float> measured;
+	if (!elevation)
 	{
-		for (int x = 0; x < rs2Res.x; x++)
-		{
-			int IDX = y * rs2Res.x + x;
-			double val = imgData[IDX];
-
-			float H = elevationAtrs2Coord(x, y);
-
-			unsigned char BinOut = 255 * (H > 0);
-
-			binData[IDX] = BinOut;
-		}
+		measured.resize(rs2Res.x * rs2Res.y);
+		for (int y = 0; y < rs2Res.y; y++)
+			deprojection.elevationRow(imgData, y, 0, rs2Res.x, basePlaneEq, measured.data());
+		elevation = measured.data();
 	}
 
+	int size = static_cast<int>(rs2Res.x * rs2Res.y);
+	for (int IDX = 0; IDX < size; IDX++)
+		binData[IDX] = 255 * (elevation[IDX] > 0);
+
 	return true;
 }
 
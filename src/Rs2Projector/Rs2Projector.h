@@ -29,6 +29,11 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #include "ofxOpenCv.h"
 #include "ofxCv.h"
 #include "Rs2Grabber.h"
+#include "DeprojectionTable.h"
+#include "PlaneEstimator.h"
+#include "CameraDriftMonitor.h"
+#include "DepthFloatImage.h"
+#include "SandboxFrameSource.h"
 #include "ofxModal.h"
 
 #include "Rs2ProjectorCalibration.h"
@@ -66,9 +71,31 @@ public:
 	ofVec3f rs2CoordToWorldCoord(float x, float y);
 	ofVec2f worldCoordTors2Coord(ofVec3f wc);
 	ofVec3f Rawrs2CoordToWorldCoord(float x, float y);
+	// rs2CoordToWorldCoord() of a list of points
+	void rs2CoordsToWorldCoords(const ofVec2f* coords, int count, ofVec3f* points);
+	const DeprojectionTable& getDeprojectionTable(){
+		return deprojection;
+	}
     float elevationAtrs2Coord(float x, float y);
     float elevationTors2Depth(float elevation, float x, float y);
     ofVec2f gradientAtrs2Coord(float x, float y);
+	// Bilinearly interpolated gradient, normal, slope and curvature of the sand surface (flat outside the rs2 frame)
+	TerrainSample terrainAtrs2Coord(float x, float y);
+	// Minimum, maximum and mean elevation of the pyramid cell (at least reduction rs2 pixels wide) holding the point.
+	// Falls back to the elevation of the pixel until the grabber sends the pyramid.
+	ElevationCell elevationCellAtrs2Coord(float x, float y, int reduction);
+	// Elevation map (rs2 frame size) and pyramid of the last frame received. nullptr until the grabber measured a frame
+	// with the current camera and base plane.
+	const float* getElevationMap(){
+		return hasElevationMap() ? elevationMap->getData() : nullptr;
+	}
+	const ElevationPyramid* getElevationPyramid(){
+		return hasElevationMap() ? elevationPyramid : nullptr;
+	}
+	// Sequence number of the frame the elevation map was measured on
+	uint64_t getElevationMapSequence(){
+		return elevationMapSequence;
+	}
 
 	// Try to start the application - assumes calibration has been done before
 	void startApplication();
@@ -82,6 +109,24 @@ public:
 	void setSpatialFiltering(bool sspatialFiltering);
 	void setInPainting(bool inp);
 	void setFullFrameFiltering(bool ff);	
+	void setVectorizedFilter(bool vf);
+	void setNumFilterThreads(int n);
+	void setFilterMode(FrameFilterMode mode);
+	void setSpatialFilterMode(SpatialFilterMode mode);
+	void setSpatialSigma(float sigma);
+	void setInpaintMode(InpaintMode mode);
+	void setTerrainDerivatives(bool td);
+	void setPartialTextureUpload(bool ptu);
+	void setDetectOccluders(bool doc);
+	void setRecording(bool rec);
+	bool startReplay(std::string path);
+	void stopReplay();
+	void setReplayMode(ReplayMode mode);
+	void setFrameSourceType(FrameSourceType type);
+	void setLatencyLog(bool log);
+	void setWarmStart(bool ws);
+	void setMetricsInterval(float interval);
+	void setDriftMonitoring(bool dm);
 	
 	void setFollowBigChanges(bool sfollowBigChanges);
 	void StartManualROIDefinition();
@@ -94,6 +139,7 @@ public:
 
 	void onToggleEvent(ofxDatGuiToggleEvent e);
     void onSliderEvent(ofxDatGuiSliderEvent e);
+	void onDropdownEvent(ofxDatGuiDropdownEvent e);
     void onConfirmModalEvent(ofxModalEvent e);
     void onCalibModalEvent(ofxModalEvent e);
 
@@ -122,6 +168,24 @@ public:
     ofTexture & getTexture(){
         return FilteredDepthImage.getTexture();
     }
+    // Tiles of the depth frame (rs2 coordinates) that changed with the last frame received
+    const DirtyTiles & getDirtyTiles(){
+        return dirtyTiles;
+    }
+    // Hands and objects held above the sand in the last frame received (rs2 coordinates, 255 for an occluder)
+    const ofPixels & getOccluderMask(){
+        return occluderMask;
+    }
+    bool hasOccluderMask(){
+        return hasOccluders;
+    }
+    // Time stamp a checkpoint of the frame being displayed (once per frame, the first call counts)
+    void markLatency(LatencyCheckpoint checkpoint){
+        if (frameLatency.has(LATENCY_RECEIVED) && !frameLatency.has(checkpoint))
+            frameLatency.mark(checkpoint);
+    }
+    // Notified with the changed tiles each time a frame moving part of the sand is received
+    ofEvent<const DirtyTiles> sandChangedEvent;
     ofRectangle getRs2ROI(){
         return rs2ROI;
     }
@@ -238,6 +302,12 @@ private:
     bool addPointPair();
     void updateMaxOffset();
     void updateBasePlane();
+    void applyCameraDrift(const CameraDrift& drift);
+    float basePlaneShift(const ofVec4f& planeEq, const ofVec4f& fromPlaneEq);
+    void applySeaLevelAdjustments();
+    bool hasElevationMap(){
+        return elevationMap && elevationMapBasePlaneEq == basePlaneEq;
+    }
     void askToFlattenSand();
 
     void drawChessboard(int x, int y, int chessboardSize);
@@ -246,6 +316,11 @@ private:
     void saveCalibrationAndSettings();
     bool loadSettings();
     bool saveSettings();
+
+    // Filter state snapshot (settings/filterSnapshot.bin) restored when the application starts
+    FilterSnapshotCalibration getSnapshotCalibration();
+    void saveFilterSnapshot(bool inBackground);
+    void loadFilterSnapshot();
     
 	void ProcessChessBoardInput(ofxCvGrayscaleImage& image);
 	void CheckAndNormalizeRs2ROI();
@@ -280,12 +355,46 @@ private:
     bool                        followBigChanges;
     int                         numAveragingSlots;
 	bool                        doInpainting;
+	InpaintMode                 inpaintMode;
+	bool                        doTerrainDerivatives;
+	bool                        partialTextureUpload;
+	bool                        detectOccluders;
+	bool                        recordingSession;
+	ReplayMode                  replayMode;
+	std::shared_ptr<SessionPlayer> replayPlayer; // Session replayed instead of the rs2 frames, if any
+	FrameSourceType             frameSourceType; // Camera (or synthetic frames) the grabber was set up with
+	ofVec2f                     syntheticSize; // Resolution and frame rate of the sandbox simulation
+	float                       syntheticFps;
 	bool                        doFullFrameFiltering;
+	bool                        vectorizedFilter;
+	int                         numFilterThreads;
+	FrameFilterMode             filterMode;
+	SpatialFilterMode           spatialFilterMode;
+	float                       spatialSigma;
+	LatencyTracer               latencyTracer;
+	LatencyStamps               frameLatency; // Stamps of the last frame received, until it is projected
+	bool                        latencyLog;
+	bool                        warmStart;
+	float                       snapshotInterval; // Seconds between two filter snapshots while running (0 = only on exit)
+	float                       lastSnapshotTime;
 
     //rs2 buffer
-    ofxCvFloatImage             FilteredDepthImage;
+    DepthFloatImage             FilteredDepthImage;
     ofxCvColorImage             rs2ColorImage;
-    ofVec2f*                    gradField;
+    std::vector<ofVec2f>        gradField;
+    const TerrainDerivatives*   terrainDerivatives; // Derivatives of the packet being read, nullptr if not computed
+    const ofFloatPixels*        elevationMap; // Elevation map and pyramid of the packet being read, nullptr if not computed
+    const ElevationPyramid*     elevationPyramid;
+    ofVec4f                     elevationMapBasePlaneEq; // Base plane the elevation map was measured with
+    uint64_t                    elevationMapSequence;
+    ofMatrix4x4                 elevationWorldMatrix; // Camera and base plane last sent to the grabber for the pyramid
+    DeprojectionTable           deprojection; // Rays of rs2WorldMatrix, used by all the rs2 to world conversions
+    PlaneEstimator              planeEstimator; // Base plane and max offset fits
+    FrameFilterWorkerPool       planePool;
+    ofVec4f                     elevationBasePlaneEq;
+    DirtyTiles                  dirtyTiles;
+    ofPixels                    occluderMask;
+    bool                        hasOccluders;
 	ofFpsCounter                fpsRs2;
 	ofxDatGuiTextInput*         fpsRs2Text;
 
@@ -338,12 +447,27 @@ private:
     float maxOffset;
     float maxOffsetSafeRange;
     float maxOffsetBack;
+
+    // Camera drift from the frame the base plane was computed on, measured in the background while running
+    CameraDriftMonitor driftMonitor;
+    ofVec3f driftReferenceNormalBack, driftReferenceOffsetBack; // Calibrated base plane when the reference was taken
+    bool driftMonitoring;
+    float driftCheckInterval; // Seconds between two frames sent to the monitor
+    float lastDriftCheck;
+    float driftTolerance; // Base plane elevation shifts (world units) below this are left alone
+    float maxDriftCorrection; // Largest elevation shift corrected in place, beyond it the calibration must be done again
+    float maxDriftRotation; // Degrees
+    bool hasDrift;
+    CameraDrift lastDrift;
+    bool cameraMoved;
     
     // Autocalib points
     ofPoint* autoCalibPts; // Center of autocalib chess boards
     int currentCalibPts;
     int trials;
     bool upframe;
+    int minHighCalibPts; // High chessboards acquired before the calibration may stop early
+    float calibStopError; // Prediction error (projector pixels) of the last chessboard stopping the calibration
 
 	// Temporal frame filter for cleaning the colour image used for calibration. It should probably be moved to the grabber class/thread
 	CTemporalFrameFilter TemporalFrameFilter;
@@ -372,6 +496,13 @@ private:
 	std::string GetTimeAndDateString();
 	bool savePointPair();
 	void SaveFilteredDepthImageDebug();
+
+	// Runtime metrics (see Metrics.h), written to data/metrics every metricsInterval seconds (0 = off)
+	float metricsInterval;
+	uint64_t lastPacketSequence;
+	MetricCounter& framesReceivedMetric;
+	MetricCounter& framesDroppedMetric;
+	MetricCounter& uploadBytesMetric;
 };
 
 
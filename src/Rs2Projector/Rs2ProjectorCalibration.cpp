@@ -26,55 +26,331 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "Rs2ProjectorCalibration.h"
 
+namespace
+{
+    const int minimalSetSize = 6; // Pairs giving at least the 11 equations of the DLT
+    
+    // The two equations of the DLT given by a pair
+    void dltRows(const ofVec3f& w, const ofVec2f& p, double r0[11], double r1[11]) {
+        double row0[11] = {w.x, w.y, w.z, 1, 0, 0, 0, 0, -w.x * p.x, -w.y * p.x, -w.z * p.x};
+        double row1[11] = {0, 0, 0, 0, w.x, w.y, w.z, 1, -w.x * p.y, -w.y * p.y, -w.z * p.y};
+        memcpy(r0, row0, sizeof(row0));
+        memcpy(r1, row1, sizeof(row1));
+    }
+    
+    bool isFinite(const dlib::matrix<double, 11, 1>& c) {
+        for (int k = 0; k < 11; k++)
+            if (!std::isfinite(c(k, 0)))
+                return false;
+        return true;
+    }
+}
+
 ofxRs2ProjectorToolkit::ofxRs2ProjectorToolkit(ofVec2f sprojRes, ofVec2f srs2Res) {
 	projRes = sprojRes;
 	rs2Res = srs2Res;
     calibrated = false;
+    x = 0;
+    inlierThreshold = 10;
+    ransacIterations = 300;
+    resetPointPairs();
 }
 
 void ofxRs2ProjectorToolkit::calibrate(vector<ofVec3f> pairsRs2,
                                           vector<ofVec2f> pairsProjector) {
-    int nPairs = pairsRs2.size();
+    resetPointPairs();
+    addPointPairs(pairsRs2, pairsProjector);
+    int nPairs = rs2Points.size();
+    
+    // RANSAC: the least squares DLT of all the pairs competes with the DLT of random minimal sets
+    vector<int> best;
+    if (nPairs >= 2 * minimalSetSize) {
+        vector<int> sample(minimalSetSize);
+        vector<int> candidates;
+        std::uniform_int_distribution<int> pick(0, nPairs - 1);
+        random.seed(5489u);
+        for (int it = 0; it <= ransacIterations; it++) {
+            Coefficients hypothesis;
+            if (it == 0) {
+                if (!hasIncremental)
+                    continue;
+                hypothesis = incremental;
+            } else {
+                for (int k = 0; k < minimalSetSize; k++) {
+                    int i;
+                    do {
+                        i = pick(random);
+                    } while (std::find(sample.begin(), sample.begin() + k, i) != sample.begin() + k);
+                    sample[k] = i;
+                }
+                if (!solveDLT(sample, hypothesis))
+                    continue;
+            }
+            candidates.clear();
+            for (int i = 0; i < nPairs; i++)
+                if (reprojectionError(hypothesis, i) < inlierThreshold)
+                    candidates.push_back(i);
+            if (candidates.size() > best.size())
+                best.swap(candidates);
+        }
+    }
+    if (best.size() < minimalSetSize) {
+        best.resize(nPairs);
+        for (int i = 0; i < nPairs; i++)
+            best[i] = i;
+    }
+    
+    Coefficients coefficients;
+    if (!solveDLT(best, coefficients)) {
+        ofLogError("ofxRs2ProjectorToolkit") << "calibrate(): Not enough point pairs (" << nPairs << ") to calibrate";
+        return;
+    }
+    refine(best, coefficients);
+    
+    // The refined calibration may take back pairs RANSAC left out with a rough one
+    vector<int> refined;
+    for (int i = 0; i < nPairs; i++)
+        if (reprojectionError(coefficients, i) < inlierThreshold)
+            refined.push_back(i);
+    if (refined.size() >= minimalSetSize && refined != best)
+        refine(refined, coefficients);
+    
+    setCoefficients(coefficients);
+    updateResiduals(true);
+    cout << "x: "<< x << endl;
+    ofLogVerbose("ofxRs2ProjectorToolkit") << "calibrate(): " << getNumInliers() << " inliers out of " << nPairs
+        << " pairs, reprojection error " << getReprojectionError();
+    calibrated = true;
+}
+
+void ofxRs2ProjectorToolkit::resetPointPairs() {
+    rs2Points.clear();
+    projectorPoints.clear();
+    accumulated.clear();
+    numAccumulated = 0;
+    AtA = 0;
+    Aty = 0;
+    hasIncremental = false;
+    predictionError = -1;
+}
+
+void ofxRs2ProjectorToolkit::addPointPairs(const vector<ofVec3f>& pairsRs2, const vector<ofVec2f>& pairsProjector) {
+    int first = rs2Points.size();
+    int nPairs = min(pairsRs2.size(), pairsProjector.size());
+    rs2Points.insert(rs2Points.end(), pairsRs2.begin(), pairsRs2.begin() + nPairs);
+    projectorPoints.insert(projectorPoints.end(), pairsProjector.begin(), pairsProjector.begin() + nPairs);
+    accumulated.resize(rs2Points.size(), false);
+    
+    // How well the pairs before the batch predicted it. The median leaves out a bad corner of the batch.
+    predictionError = -1;
+    if (hasIncremental && nPairs > 0) {
+        vector<double> errors(nPairs);
+        for (int i = 0; i < nPairs; i++)
+            errors[i] = reprojectionError(incremental, first + i);
+        std::nth_element(errors.begin(), errors.begin() + nPairs / 2, errors.end());
+        predictionError = errors[nPairs / 2];
+    }
+    
+    for (int i = first; i < first + nPairs; i++)
+        accumulate(i, true);
+    hasIncremental = solveNormalEquations(incremental);
+    
+    // The pairs much worse than the median with the new calibration are taken back out of the normal equations (and
+    // the ones left out put back if they fit again), so a bad corner does not stay in for good
+    int nTotal = rs2Points.size();
+    vector<double> errors(nTotal);
+    for (int pass = 0; pass < 2 && hasIncremental; pass++) {
+        for (int i = 0; i < nTotal; i++)
+            errors[i] = reprojectionError(incremental, i);
+        vector<double> sorted = errors;
+        std::nth_element(sorted.begin(), sorted.begin() + nTotal / 2, sorted.end());
+        double gate = max(inlierThreshold, 3 * sorted[nTotal / 2]);
+        bool changed = false;
+        for (int i = 0; i < nTotal; i++) {
+            if (accumulated[i] != (errors[i] <= gate)) {
+                accumulate(i, !accumulated[i]);
+                changed = true;
+            }
+        }
+        if (!changed)
+            break;
+        hasIncremental = solveNormalEquations(incremental);
+    }
+}
+
+// Add the equations of a pair to the normal equations, or remove them
+void ofxRs2ProjectorToolkit::accumulate(int i, bool add) {
+    double r[2][11];
+    dltRows(rs2Points[i], projectorPoints[i], r[0], r[1]);
+    double target[2] = {projectorPoints[i].x, projectorPoints[i].y};
+    double sign = add ? 1 : -1;
+    for (int k = 0; k < 2; k++) {
+        for (int a = 0; a < 11; a++) {
+            for (int b = 0; b < 11; b++)
+                AtA(a, b) += sign * r[k][a] * r[k][b];
+            Aty(a, 0) += sign * r[k][a] * target[k];
+        }
+    }
+    accumulated[i] = add;
+    numAccumulated += add ? 1 : -1;
+}
+
+int ofxRs2ProjectorToolkit::getNumInliers() {
+    return std::count(inliers.begin(), inliers.end(), true);
+}
+
+double ofxRs2ProjectorToolkit::getReprojectionError() {
+    double sum = 0;
+    int n = 0;
+    for (size_t i = 0; i < residuals.size(); i++) {
+        if (!inliers[i])
+            continue;
+        sum += residuals[i] * residuals[i];
+        n++;
+    }
+    return n > 0 ? sqrt(sum / n) : 0;
+}
+
+// Least squares DLT of some of the pairs
+bool ofxRs2ProjectorToolkit::solveDLT(const vector<int>& indices, Coefficients& coefficients) {
+    int nPairs = indices.size();
+    if (nPairs < minimalSetSize)
+        return false;
+    dlib::matrix<double, 0, 11> A;
+    dlib::matrix<double, 0, 1> y;
     A.set_size(nPairs*2, 11);
     y.set_size(nPairs*2, 1);
-    
+    double r[2][11];
     for (int i=0; i<nPairs; i++) {
-        A(2*i, 0) = pairsRs2[i].x;
-        A(2*i, 1) = pairsRs2[i].y;
-        A(2*i, 2) = pairsRs2[i].z;
-        A(2*i, 3) = 1;
-        A(2*i, 4) = 0;
-        A(2*i, 5) = 0;
-        A(2*i, 6) = 0;
-        A(2*i, 7) = 0;
-        A(2*i, 8) = -pairsRs2[i].x * pairsProjector[i].x;
-        A(2*i, 9) = -pairsRs2[i].y * pairsProjector[i].x;
-        A(2*i, 10) = -pairsRs2[i].z * pairsProjector[i].x;
-        
-        A(2*i+1, 0) = 0;
-        A(2*i+1, 1) = 0;
-        A(2*i+1, 2) = 0;
-        A(2*i+1, 3) = 0;
-        A(2*i+1, 4) = pairsRs2[i].x;
-        A(2*i+1, 5) = pairsRs2[i].y;
-        A(2*i+1, 6) = pairsRs2[i].z;
-        A(2*i+1, 7) = 1;
-        A(2*i+1, 8) = -pairsRs2[i].x * pairsProjector[i].y;
-        A(2*i+1, 9) = -pairsRs2[i].y * pairsProjector[i].y;
-        A(2*i+1, 10) = -pairsRs2[i].z * pairsProjector[i].y;
-        
-        y(2*i, 0) = pairsProjector[i].x;
-        y(2*i+1, 0) = pairsProjector[i].y;
+        const ofVec3f& w = rs2Points[indices[i]];
+        const ofVec2f& p = projectorPoints[indices[i]];
+        dltRows(w, p, r[0], r[1]);
+        for (int k = 0; k < 11; k++) {
+            A(2*i, k) = r[0][k];
+            A(2*i+1, k) = r[1][k];
+        }
+        y(2*i, 0) = p.x;
+        y(2*i+1, 0) = p.y;
     }
     
     dlib::qr_decomposition<dlib::matrix<double, 0, 11> > qrd(A);
-    x = qrd.solve(y);
-    cout << "x: "<< x << endl;
+    coefficients = qrd.solve(y);
+    return isFinite(coefficients);
+}
+
+// DLT of all the pairs added, from the accumulated normal equations. The unknowns are scaled to a unit diagonal since
+// the world coordinates and their products with the projector coordinates are orders of magnitude apart.
+bool ofxRs2ProjectorToolkit::solveNormalEquations(Coefficients& coefficients) {
+    if (numAccumulated < minimalSetSize)
+        return false;
+    dlib::matrix<double, 11, 1> scale;
+    for (int a = 0; a < 11; a++) {
+        if (AtA(a, a) <= 0)
+            return false;
+        scale(a, 0) = 1 / sqrt(AtA(a, a));
+    }
+    dlib::matrix<double, 11, 11> normal;
+    dlib::matrix<double, 11, 1> rhs;
+    for (int a = 0; a < 11; a++) {
+        for (int b = 0; b < 11; b++)
+            normal(a, b) = AtA(a, b) * scale(a, 0) * scale(b, 0);
+        normal(a, a) += 1e-12; // Keeps the system solvable while all the pairs are still on one plane
+        rhs(a, 0) = Aty(a, 0) * scale(a, 0);
+    }
+    dlib::qr_decomposition<dlib::matrix<double, 11, 11> > qrd(normal);
+    coefficients = qrd.solve(rhs);
+    for (int a = 0; a < 11; a++)
+        coefficients(a, 0) *= scale(a, 0);
+    return isFinite(coefficients);
+}
+
+// Levenberg-Marquardt on the reprojection errors of some of the pairs
+void ofxRs2ProjectorToolkit::refine(const vector<int>& indices, Coefficients& coefficients) {
+    auto cost = [&](const Coefficients& c) {
+        double sum = 0;
+        for (size_t i = 0; i < indices.size(); i++) {
+            double e = reprojectionError(c, indices[i]);
+            sum += e * e;
+        }
+        return sum;
+    };
+    
+    double current = cost(coefficients);
+    double lambda = 1e-3;
+    for (int it = 0; it < 50; it++) {
+        dlib::matrix<double, 11, 11> JtJ;
+        dlib::matrix<double, 11, 1> Jtr;
+        JtJ = 0;
+        Jtr = 0;
+        for (size_t n = 0; n < indices.size(); n++) {
+            const ofVec3f& w = rs2Points[indices[n]];
+            const ofVec2f& p = projectorPoints[indices[n]];
+            const Coefficients& c = coefficients;
+            double den = c(8, 0) * w.x + c(9, 0) * w.y + c(10, 0) * w.z + 1;
+            double u = (c(0, 0) * w.x + c(1, 0) * w.y + c(2, 0) * w.z + c(3, 0)) / den;
+            double v = (c(4, 0) * w.x + c(5, 0) * w.y + c(6, 0) * w.z + c(7, 0)) / den;
+            double ju[11] = {w.x / den, w.y / den, w.z / den, 1 / den, 0, 0, 0, 0, -u * w.x / den, -u * w.y / den, -u * w.z / den};
+            double jv[11] = {0, 0, 0, 0, w.x / den, w.y / den, w.z / den, 1 / den, -v * w.x / den, -v * w.y / den, -v * w.z / den};
+            double ru = u - p.x;
+            double rv = v - p.y;
+            for (int a = 0; a < 11; a++) {
+                for (int b = 0; b < 11; b++)
+                    JtJ(a, b) += ju[a] * ju[b] + jv[a] * jv[b];
+                Jtr(a, 0) += ju[a] * ru + jv[a] * rv;
+            }
+        }
+        
+        bool improved = false;
+        double previous = current;
+        for (int attempt = 0; attempt < 10 && !improved; attempt++) {
+            dlib::matrix<double, 11, 11> H = JtJ;
+            for (int a = 0; a < 11; a++)
+                H(a, a) += lambda * JtJ(a, a);
+            dlib::qr_decomposition<dlib::matrix<double, 11, 11> > qrd(H);
+            Coefficients trial = coefficients - qrd.solve(Jtr);
+            double trialCost = isFinite(trial) ? cost(trial) : current;
+            if (trialCost < current) {
+                coefficients = trial;
+                current = trialCost;
+                lambda = max(lambda / 10, 1e-12);
+                improved = true;
+            } else {
+                lambda *= 10;
+            }
+        }
+        if (!improved || previous - current < 1e-10 * previous)
+            break;
+    }
+}
+
+double ofxRs2ProjectorToolkit::reprojectionError(const Coefficients& c, int i) {
+    const ofVec3f& w = rs2Points[i];
+    const ofVec2f& p = projectorPoints[i];
+    double den = c(8, 0) * w.x + c(9, 0) * w.y + c(10, 0) * w.z + 1;
+    if (fabs(den) < 1e-12)
+        return 1e12;
+    double du = (c(0, 0) * w.x + c(1, 0) * w.y + c(2, 0) * w.z + c(3, 0)) / den - p.x;
+    double dv = (c(4, 0) * w.x + c(5, 0) * w.y + c(6, 0) * w.z + c(7, 0)) / den - p.y;
+    return sqrt(du * du + dv * dv);
+}
+
+void ofxRs2ProjectorToolkit::setCoefficients(const Coefficients& coefficients) {
+    x = coefficients;
     projMatrice = ofMatrix4x4(x(0,0), x(1,0), x(2,0), x(3,0),
                               x(4,0), x(5,0), x(6,0), x(7,0),
                               x(8,0), x(9,0), x(10,0), 1,
                               0, 0, 0, 1);
-    calibrated = true;
+}
+
+// Residuals of the pairs with the current calibration, and optionally the inliers
+void ofxRs2ProjectorToolkit::updateResiduals(bool selectInliers) {
+    residuals.resize(rs2Points.size());
+    inliers.resize(rs2Points.size(), true);
+    for (size_t i = 0; i < rs2Points.size(); i++) {
+        residuals[i] = reprojectionError(x, i);
+        if (selectInliers)
+            inliers[i] = residuals[i] < inlierThreshold;
+    }
 }
 
 ofMatrix4x4 ofxRs2ProjectorToolkit::getProjectionMatrix() {
@@ -92,7 +368,7 @@ ofVec2f ofxRs2ProjectorToolkit::getProjectedPoint(ofVec3f worldPoint) {
 vector<double> ofxRs2ProjectorToolkit::getCalibration()
 {
     vector<double> coefficients;
-    for (int i=0; i<15; i++) {
+    for (int i=0; i<11; i++) {
         coefficients.push_back(x(i, 0));
     }
     return coefficients;
@@ -108,7 +384,7 @@ bool ofxRs2ProjectorToolkit::loadCalibration(string path){
 	if (sprojRes!=projRes || srs2Res!=rs2Res)
 		return false;
     xml.setTo("//CALIBRATION/COEFFICIENTS");
-    for (int i=0; i<15; i++) {
+    for (int i=0; i<11; i++) {
         x(i, 0) = xml.getValue<float>("COEFF"+ofToString(i));
     }
     projMatrice = ofMatrix4x4(x(0,0), x(1,0), x(2,0), x(3,0),
@@ -130,7 +406,7 @@ bool ofxRs2ProjectorToolkit::saveCalibration(string path){
 	xml.setTo("//CALIBRATION");
 	xml.addChild("COEFFICIENTS");
 	xml.setTo("COEFFICIENTS");
-	for (int i=0; i<15; i++) {
+	for (int i=0; i<11; i++) {
         ofXml coeff;
         coeff.addValue("COEFF"+ofToString(i), x(i, 0));
         xml.addXml(coeff);
@@ -28,6 +28,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #define __Magic_Sand__Calibration__
 
 #include <iostream>
+#include <random>
 #include "ofMain.h"
 #include "libs/dlib/matrix.h"
 #include "libs/dlib/matrix/matrix_qr.h"
@@ -38,9 +39,27 @@ class ofxRs2ProjectorToolkit
 public:
     ofxRs2ProjectorToolkit(ofVec2f projRes, ofVec2f rs2Res);
     
+    // Robust calibration from all the pairs: the DLT of random minimal sets (RANSAC) selects the inliers, the DLT of
+    // the inliers is then refined by Levenberg-Marquardt on their reprojection error
     void calibrate(vector<ofVec3f> pairsRs2,
                    vector<ofVec2f> pairsProjector);
     
+    // Incremental calibration while the pairs are acquired: each batch updates the normal equations of the DLT
+    // (recursive least squares in information form) and a calibration is solved from them. It only serves to follow
+    // the convergence and as first RANSAC hypothesis of calibrate(), the projection matrix is left untouched.
+    void resetPointPairs();
+    void addPointPairs(const vector<ofVec3f>& pairsRs2, const vector<ofVec2f>& pairsProjector);
+    // Median reprojection error (projector pixels) of the last batch with the calibration from the pairs before it,
+    // -1 when there was no calibration yet. Small values mean new pairs no longer change the calibration much.
+    double getPredictionError() {return predictionError;}
+    
+    // Reprojection error (projector pixels) of each pair with the current calibration, and the pairs kept by RANSAC
+    const vector<double>& getResiduals() {return residuals;}
+    const vector<bool>& getInliers() {return inliers;}
+    int getNumInliers();
+    // RMS reprojection error of the inliers
+    double getReprojectionError();
+    
     ofVec2f getProjectedPoint(ofVec3f worldPoint);
     ofMatrix4x4 getProjectionMatrix();
     
@@ -52,13 +71,39 @@ public:
     bool isCalibrated() {return calibrated;}
     
 private:
+    typedef dlib::matrix<double, 11, 1> Coefficients;
+    
+    bool solveDLT(const vector<int>& indices, Coefficients& coefficients);
+    bool solveNormalEquations(Coefficients& coefficients);
+    void accumulate(int i, bool add);
+    void refine(const vector<int>& indices, Coefficients& coefficients);
+    double reprojectionError(const Coefficients& coefficients, int i);
+    void setCoefficients(const Coefficients& coefficients);
+    void updateResiduals(bool selectInliers);
     
-    dlib::matrix<double, 0, 11> A;
-    dlib::matrix<double, 0, 1> y;
     dlib::matrix<double, 11, 1> x;
     
     ofMatrix4x4 projMatrice;
     
+    // Pairs the calibration was computed from
+    vector<ofVec3f> rs2Points;
+    vector<ofVec2f> projectorPoints;
+    vector<double> residuals;
+    vector<bool> inliers;
+    
+    // Normal equations of the DLT of the pairs added so far, less the ones not fitting
+    vector<bool> accumulated;
+    int numAccumulated;
+    dlib::matrix<double, 11, 11> AtA;
+    dlib::matrix<double, 11, 1> Aty;
+    Coefficients incremental;
+    bool hasIncremental;
+    double predictionError;
+    
+    double inlierThreshold; // Reprojection error of an inlier, projector pixels
+    int ransacIterations;
+    std::mt19937 random;
+    
     bool calibrated;
 	ofVec2f projRes;
 	ofVec2f rs2Res;
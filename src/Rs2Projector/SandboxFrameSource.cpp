@@ -0,0 +1,358 @@
+/***********************************************************************
+SandboxFrameSource - Synthetic sandbox depth frames: noise terrain on a
+tilted base plane, seen through a RealSense-like noise model, with
+scripted hands and digging. Reproducible for a given seed.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "SandboxFrameSource.h"
+#include <cfloat>
+
+// Integer hash used for the noise lattice and to seed the random numbers (no dependency on ofRandom's state)
+static uint32_t hashInts(uint32_t a, uint32_t b, uint32_t c)
+{
+	uint32_t h = a * 0x9E3779B1u ^ b * 0x85EBCA77u ^ c * 0xC2B2AE3Du;
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+	h *= 0x297A2D39u;
+	h ^= h >> 15;
+	return h;
+}
+
+static inline uint64_t xorshift(uint64_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static inline uint64_t seedState(uint32_t a, uint32_t b, uint32_t c)
+{
+	return (static_cast<uint64_t>(hashInts(a, b, c)) << 32 | hashInts(c, b, a)) | 1;
+}
+
+static inline float uniform(uint64_t& state)
+{
+	return (xorshift(state) >> 40) * (1.0f / 16777216.0f);
+}
+
+// Approximately normal value from 32 random bits: sum of the four bytes, centered and scaled to unit variance
+static inline float gaussian(uint32_t bits)
+{
+	int sum = (bits & 0xFF) + ((bits >> 8) & 0xFF) + ((bits >> 16) & 0xFF) + (bits >> 24);
+	return (sum - 510) * (1.0f / 147.8f);
+}
+
+static float valueNoise(float x, float y, uint32_t seed)
+{
+	int ix = static_cast<int>(floorf(x));
+	int iy = static_cast<int>(floorf(y));
+	float fx = x - ix;
+	float fy = y - iy;
+	fx = fx * fx * (3 - 2 * fx);
+	fy = fy * fy * (3 - 2 * fy);
+	float v00 = hashInts(ix, iy, seed) * (1.0f / 4294967296.0f);
+	float v10 = hashInts(ix + 1, iy, seed) * (1.0f / 4294967296.0f);
+	float v01 = hashInts(ix, iy + 1, seed) * (1.0f / 4294967296.0f);
+	float v11 = hashInts(ix + 1, iy + 1, seed) * (1.0f / 4294967296.0f);
+	return ofLerp(ofLerp(v00, v10, fx), ofLerp(v01, v11, fx), fy);
+}
+
+SandboxFrameSource::SandboxFrameSource(int swidth, int sheight, float sfps, SandboxSimulationSettings ssettings)
+:SyntheticFrameSource(swidth, sheight, sfps),
+settings(ssettings),
+cycle(-1),
+cycleDigApplied(false),
+rngState(1)
+{
+	focal = 0.5f * width / tanf(ofDegToRad(0.5f * horizontalFov));
+	terrain.resize(width*height);
+	planeDepth.resize(width*height);
+	surface.resize(width*height);
+	scene.resize(width*height);
+	sandColor.allocate(width, height, 3);
+	generateTerrain();
+}
+
+bool SandboxFrameSource::open()
+{
+	SyntheticFrameSource::open();
+	generateTerrain();
+	customApplied.assign(customEvents.size(), false);
+	cycle = -1;
+	cycleDigApplied = false;
+	return true;
+}
+
+void SandboxFrameSource::addEvent(const SandboxEvent& event)
+{
+	customEvents.push_back(event);
+	customApplied.push_back(false);
+}
+
+void SandboxFrameSource::clearEvents()
+{
+	customEvents.clear();
+	customApplied.clear();
+}
+
+float SandboxFrameSource::getSimulationTime() const
+{
+	return frameNumber / (fps > 0 ? fps : 30.0f);
+}
+
+// Fractal noise hills stretched to 0..hillHeight, in normalized coordinates so the terrain does not depend on the resolution
+void SandboxFrameSource::generateTerrain()
+{
+	float minElevation = FLT_MAX;
+	float maxElevation = -FLT_MAX;
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			float u = settings.hillScale * x / width;
+			float v = settings.hillScale * y / width;
+			float amplitude = 1;
+			float frequency = 1;
+			float elevation = 0;
+			for (int o = 0; o < settings.octaves; o++)
+			{
+				elevation += amplitude * valueNoise(u * frequency, v * frequency, settings.seed + o);
+				amplitude *= settings.persistence;
+				frequency *= 2;
+			}
+			terrain[y*width + x] = elevation;
+			minElevation = std::min(minElevation, elevation);
+			maxElevation = std::max(maxElevation, elevation);
+		}
+	}
+	float scale = maxElevation > minElevation ? settings.hillHeight / (maxElevation - minElevation) : 0;
+	for (auto& t : terrain)
+		t = (t - minElevation) * scale;
+
+	// Depth of the tilted plane z = distance + tan(tiltX) * X + tan(tiltY) * Y along the pixel rays
+	float tanX = tanf(ofDegToRad(settings.tiltX));
+	float tanY = tanf(ofDegToRad(settings.tiltY));
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			float dx = (x - 0.5f * width) / focal;
+			float dy = (y - 0.5f * height) / focal;
+			planeDepth[y*width + x] = settings.distance / (1 - tanX * dx - tanY * dy);
+		}
+	}
+	updateSurface(0, 0, width, height);
+}
+
+void SandboxFrameSource::updateSurface(int x0, int y0, int x1, int y1)
+{
+	for (int y = y0; y < y1; y++)
+		for (int x = x0; x < x1; x++)
+		{
+			int idx = y*width + x;
+			surface[idx] = planeDepth[idx] - terrain[idx];
+			// Sand shaded by the elevation
+			float shade = std::min(1.0f, 0.6f + 0.4f * terrain[idx] / std::max(1.0f, settings.hillHeight));
+			unsigned char* c = sandColor.getData() + 3 * idx;
+			c[0] = static_cast<unsigned char>(194 * shade);
+			c[1] = static_cast<unsigned char>(178 * shade);
+			c[2] = static_cast<unsigned char>(128 * shade);
+		}
+}
+
+// Gather the events running at time and apply the digs that started
+void SandboxFrameSource::collectEvents(float time, std::vector<const SandboxEvent*>& active)
+{
+	active.clear();
+	for (size_t i = 0; i < customEvents.size(); i++)
+	{
+		const SandboxEvent& event = customEvents[i];
+		if (event.type == SANDBOX_EVENT_DIG && time >= event.start && !customApplied[i])
+		{
+			applyDig(event);
+			customApplied[i] = true;
+		}
+		if (time >= event.start && time < event.start + event.duration)
+			active.push_back(&event);
+	}
+
+	if (!settings.scriptedEvents || settings.eventPeriod <= 0)
+		return;
+
+	int64_t k = static_cast<int64_t>(floorf(time / settings.eventPeriod));
+	if (k != cycle)
+	{
+		// Events of a cycle only depend on the seed and the cycle index
+		cycle = k;
+		cycleDigApplied = false;
+		uint64_t state = seedState(settings.seed, static_cast<uint32_t>(k), 0x5A4D);
+		float period = settings.eventPeriod;
+		float cycleStart = k * period;
+		cycleEvents.clear();
+
+		SandboxEvent sweep;
+		sweep.type = SANDBOX_EVENT_HAND_SWEEP;
+		sweep.start = cycleStart + 0.1f * period;
+		sweep.duration = 0.3f * period;
+		sweep.from.x = ofLerp(0.05f, 0.3f, uniform(state));
+		sweep.from.y = ofLerp(0.3f, 0.7f, uniform(state));
+		sweep.to.x = ofLerp(0.7f, 0.95f, uniform(state));
+		sweep.to.y = ofLerp(0.3f, 0.7f, uniform(state));
+		if (uniform(state) < 0.5f)
+			std::swap(sweep.from, sweep.to);
+		sweep.radius = 0.05f;
+		sweep.amount = 0;
+		cycleEvents.push_back(sweep);
+
+		// Holes and piles alternate so the terrain stays in range on long runs
+		SandboxEvent dig;
+		dig.type = SANDBOX_EVENT_DIG;
+		dig.start = cycleStart + 0.6f * period;
+		dig.duration = 0.15f * period;
+		dig.from.x = ofLerp(0.2f, 0.8f, uniform(state));
+		dig.from.y = ofLerp(0.2f, 0.8f, uniform(state));
+		dig.to = dig.from;
+		dig.radius = ofLerp(0.04f, 0.08f, uniform(state));
+		dig.amount = (k % 2 == 0) ? 0.5f * settings.hillHeight : -0.5f * settings.hillHeight;
+		cycleEvents.push_back(dig);
+	}
+
+	for (const auto& event : cycleEvents)
+	{
+		if (event.type == SANDBOX_EVENT_DIG && time >= event.start && !cycleDigApplied)
+		{
+			applyDig(event);
+			cycleDigApplied = true;
+		}
+		if (time >= event.start && time < event.start + event.duration)
+			active.push_back(&event);
+	}
+}
+
+// Gaussian hole with a rim of the removed sand (or a pile for a negative amount), the sand stays above the bottom of the box
+void SandboxFrameSource::applyDig(const SandboxEvent& event)
+{
+	float cx = event.from.x * width;
+	float cy = event.from.y * height;
+	float radius = std::max(1.0f, event.radius * width);
+	int x0 = std::max(0, static_cast<int>(cx - 2 * radius));
+	int x1 = std::min(width, static_cast<int>(cx + 2 * radius) + 1);
+	int y0 = std::max(0, static_cast<int>(cy - 2 * radius));
+	int y1 = std::min(height, static_cast<int>(cy + 2 * radius) + 1);
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			float d = sqrtf((x - cx)*(x - cx) + (y - cy)*(y - cy)) / radius;
+			float rim = (d - 1.1f) / 0.3f;
+			float delta = -event.amount * expf(-2 * d * d) + 0.35f * event.amount * expf(-rim * rim);
+			float& t = terrain[y*width + x];
+			t = std::max(0.0f, t + delta);
+		}
+	}
+	updateSurface(x0, y0, x1, y1);
+}
+
+// A rounded hand at position with the arm reaching in from the bottom edge of the image (the side of the user)
+void SandboxFrameSource::drawHand(ofVec2f position, float radius)
+{
+	ofVec2f hand(position.x * width, position.y * height);
+	ofVec2f entry(hand.x, 1.15f * height);
+	float handRadius = std::max(1.0f, radius * width);
+	float armRadius = 0.55f * handRadius;
+	float mmPerPixel = settings.distance / focal;
+	unsigned char* colorData = color.getData();
+
+	int x0 = std::max(0, static_cast<int>(hand.x - handRadius));
+	int x1 = std::min(width, static_cast<int>(hand.x + handRadius) + 1);
+	int y0 = std::max(0, static_cast<int>(hand.y - handRadius));
+	int y1 = height;
+	ofVec2f axis = entry - hand;
+	float axisLength2 = axis.lengthSquared();
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			ofVec2f p(x, y);
+			// Along the arm, the arm rises toward the edge of the box
+			float t = ofClamp((p - hand).dot(axis) / axisLength2, 0, 1);
+			float d = p.distance(hand + axis * t);
+			float r = t * t * axisLength2 < handRadius * handRadius ? handRadius : armRadius;
+			if (d >= r)
+				continue;
+			int idx = y*width + x;
+			float elevation = settings.handHeight + 150 * t;
+			float bulge = 0.4f * r * mmPerPixel * sqrtf(1 - (d / r) * (d / r));
+			scene[idx] = std::min(scene[idx], planeDepth[idx] - elevation - bulge);
+			colorData[3 * idx] = 224;
+			colorData[3 * idx + 1] = 172;
+			colorData[3 * idx + 2] = 105;
+		}
+	}
+}
+
+// RealSense-like measures: depth-proportional noise, missing pixels, and flying pixels mixing the two sides of the edges
+void SandboxFrameSource::applySensorNoise()
+{
+	uint16_t* depthPtr = depth.getData();
+	uint32_t dropoutThreshold = static_cast<uint32_t>(ofClamp(settings.dropoutRate, 0, 1) * 4294967295.0);
+	for (int y = 0; y < height; y++)
+	{
+		const float* row = &scene[y*width];
+		const float* nextRow = y + 1 < height ? row + width : row;
+		for (int x = 0; x < width; x++)
+		{
+			// One random number for the dropout test (low bits) and the jitter (high bits)
+			uint64_t bits = xorshift(rngState);
+			if (static_cast<uint32_t>(bits) < dropoutThreshold)
+			{
+				*depthPtr++ = 0;
+				continue;
+			}
+			float z = row[x];
+			float right = x + 1 < width ? row[x + 1] : z;
+			float below = nextRow[x];
+			float neighbour = fabsf(right - z) > fabsf(below - z) ? right : below;
+			if (fabsf(neighbour - z) > settings.edgeThreshold && uniform(rngState) < settings.flyingPixelRate)
+				z += (neighbour - z) * uniform(rngState);
+			z += gaussian(static_cast<uint32_t>(bits >> 32)) * settings.jitter * z;
+			*depthPtr++ = static_cast<uint16_t>(std::min(std::max(z + 0.5f, 0.0f), 65535.0f));
+		}
+	}
+}
+
+void SandboxFrameSource::generateFrame()
+{
+	float time = getSimulationTime();
+	collectEvents(time, activeEvents);
+
+	// Hands are drawn over the sand in the depth and the color
+	scene = surface;
+	memcpy(color.getData(), sandColor.getData(), width*height*3);
+	for (auto event : activeEvents)
+	{
+		float progress = event->duration > 0 ? (time - event->start) / event->duration : 0;
+		drawHand(event->from.getInterpolated(event->to, progress), event->radius);
+	}
+
+	rngState = seedState(settings.seed, static_cast<uint32_t>(frameNumber), 0x1F3D);
+	applySensorNoise();
+}
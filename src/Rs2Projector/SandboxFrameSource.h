@@ -0,0 +1,119 @@
+/***********************************************************************
+SandboxFrameSource - Synthetic sandbox depth frames: noise terrain on a
+tilted base plane, seen through a RealSense-like noise model, with
+scripted hands and digging. Reproducible for a given seed.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include "FrameSource.h"
+
+struct SandboxSimulationSettings
+{
+	unsigned int seed = 1;
+
+	// Box geometry
+	float distance = 1000; // Distance (mm) from the sensor to the base plane along the optical axis
+	float tiltX = 2; // Base plane tilt (degrees) along the image x axis
+	float tiltY = -1; // and along the image y axis
+
+	// Terrain: fractal value noise
+	float hillHeight = 150; // Elevation (mm) of the highest hills
+	float hillScale = 3; // Number of large hills across the box
+	int octaves = 5;
+	float persistence = 0.5f; // Amplitude ratio of successive octaves
+
+	// Sensor noise
+	float jitter = 0.002f; // Standard deviation of the depth noise, relative to the depth
+	float dropoutRate = 0.01f; // Fraction of pixels without measure (0)
+	float edgeThreshold = 30; // Depth step (mm) between neighbours over which the pixels are on an edge
+	float flyingPixelRate = 0.5f; // Probability for an edge pixel to get a depth between the two sides
+
+	// Scripted events: every eventPeriod seconds a hand sweeps across the box, then digs a hole or piles sand
+	bool scriptedEvents = true;
+	float eventPeriod = 10;
+	float handHeight = 250; // Height (mm) of the hands above the base plane
+};
+
+enum SandboxEventType
+{
+	SANDBOX_EVENT_HAND_SWEEP, // A hand moves from 'from' to 'to'
+	SANDBOX_EVENT_DIG // A hand at 'from' digs a hole of 'amount' mm (negative amount piles sand) at the start of the event
+};
+
+struct SandboxEvent
+{
+	SandboxEventType type;
+	float start; // Seconds from the opening of the source
+	float duration;
+	ofVec2f from, to; // Normalized image coordinates
+	float radius; // Normalized to the image width
+	float amount;
+};
+
+class SandboxFrameSource : public SyntheticFrameSource
+{
+public:
+	SandboxFrameSource(int width = 1280, int height = 720, float fps = 90, SandboxSimulationSettings settings = SandboxSimulationSettings());
+
+	// Terrain and scripts restart from the seed
+	bool open() override;
+
+	std::string getName() const override{
+		return "Sandbox simulation";
+	}
+
+	const SandboxSimulationSettings& getSettings() const{
+		return settings;
+	}
+
+	// Events played in addition to the periodic ones
+	void addEvent(const SandboxEvent& event);
+	void clearEvents();
+
+	// Simulated time of the current frame in seconds (frame number / fps, independent of the wall clock)
+	float getSimulationTime() const;
+
+protected:
+	void generateFrame() override;
+
+private:
+	void generateTerrain();
+	void updateSurface(int x0, int y0, int x1, int y1); // Exclusive max
+	void collectEvents(float time, std::vector<const SandboxEvent*>& active);
+	void applyDig(const SandboxEvent& event);
+	void drawHand(ofVec2f position, float radius);
+	void applySensorNoise();
+
+	SandboxSimulationSettings settings;
+	std::vector<SandboxEvent> customEvents;
+	std::vector<bool> customApplied; // Dig of the custom event done
+	std::vector<SandboxEvent> cycleEvents; // Periodic events of the current cycle
+	int64_t cycle; // Index of the period cycleEvents belong to
+	bool cycleDigApplied;
+	std::vector<const SandboxEvent*> activeEvents;
+
+	std::vector<float> terrain; // Elevation (mm) above the base plane
+	std::vector<float> planeDepth; // Depth of the base plane
+	std::vector<float> surface; // Depth of the sand surface
+	std::vector<float> scene; // Surface with the hands of the current frame
+	ofPixels sandColor; // Color of the sand surface
+	float focal; // In pixels
+	uint64_t rngState;
+};
@@ -0,0 +1,483 @@
+/***********************************************************************
+SessionRecording - Records the raw depth and color frames of the rs2 into
+a memory-mapped session file and plays them back in place of the camera.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "SessionRecording.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char sessionMagic[8] = { 'M', 'S', 'A', 'N', 'D', 'R', 'E', 'C' };
+static const uint32_t sessionVersion = 1;
+static const size_t sessionHeaderBytes = 256;
+static const size_t frameDepthOffset = 64;
+static const uint64_t initialCapacity = 64;
+
+static_assert(sizeof(SessionFileHeader) <= sessionHeaderBytes, "Session header does not fit");
+
+//--------------------------------------------------------------
+MappedFile::MappedFile()
+:
+#ifdef _WIN32
+file(INVALID_HANDLE_VALUE),
+mapping(nullptr),
+#else
+fd(-1),
+#endif
+ptr(nullptr),
+length(0),
+writable(false)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef _WIN32
+bool MappedFile::map()
+{
+	DWORD protect = writable ? PAGE_READWRITE : PAGE_READONLY;
+	uint64_t size = length;
+	// A writable mapping larger than the file extends the file
+	mapping = CreateFileMappingA(file, nullptr, protect, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size & 0xffffffff), nullptr);
+	if (mapping == nullptr)
+		return false;
+	ptr = static_cast<unsigned char*>(MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, length));
+	if (ptr == nullptr)
+	{
+		CloseHandle(mapping);
+		mapping = nullptr;
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::unmap()
+{
+	if (ptr != nullptr)
+		UnmapViewOfFile(ptr);
+	if (mapping != nullptr)
+		CloseHandle(mapping);
+	ptr = nullptr;
+	mapping = nullptr;
+}
+
+bool MappedFile::openRead(const std::string& path)
+{
+	close();
+	writable = false;
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	length = static_cast<size_t>(fileSize.QuadPart);
+	if (!map())
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool MappedFile::create(const std::string& path, size_t size)
+{
+	close();
+	writable = true;
+	file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	length = size;
+	if (!map())
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool MappedFile::resize(size_t size)
+{
+	if (!writable || file == INVALID_HANDLE_VALUE)
+		return false;
+	unmap();
+	length = size;
+	return map();
+}
+
+bool MappedFile::flush()
+{
+	if (!writable || ptr == nullptr)
+		return false;
+	return FlushViewOfFile(ptr, length) && FlushFileBuffers(file);
+}
+
+void MappedFile::close(size_t finalSize)
+{
+	unmap();
+	if (file != INVALID_HANDLE_VALUE)
+	{
+		if (writable)
+		{
+			LARGE_INTEGER end;
+			end.QuadPart = static_cast<LONGLONG>(finalSize);
+			SetFilePointerEx(file, end, nullptr, FILE_BEGIN);
+			SetEndOfFile(file);
+		}
+		CloseHandle(file);
+	}
+	file = INVALID_HANDLE_VALUE;
+	length = 0;
+	writable = false;
+}
+
+void MappedFile::close()
+{
+	close(length);
+}
+#else
+bool MappedFile::map()
+{
+	int protect = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+	void* p = mmap(nullptr, length, protect, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return false;
+	ptr = static_cast<unsigned char*>(p);
+	return true;
+}
+
+void MappedFile::unmap()
+{
+	if (ptr != nullptr)
+		munmap(ptr, length);
+	ptr = nullptr;
+}
+
+bool MappedFile::openRead(const std::string& path)
+{
+	close();
+	writable = false;
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close();
+		return false;
+	}
+	length = static_cast<size_t>(st.st_size);
+	if (!map())
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool MappedFile::create(const std::string& path, size_t size)
+{
+	close();
+	writable = true;
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	length = size;
+	if (ftruncate(fd, static_cast<off_t>(size)) != 0 || !map())
+	{
+		close(0);
+		return false;
+	}
+	return true;
+}
+
+bool MappedFile::resize(size_t size)
+{
+	if (!writable || fd < 0)
+		return false;
+	unmap();
+	length = size;
+	if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+		return false;
+	return map();
+}
+
+bool MappedFile::flush()
+{
+	if (!writable || ptr == nullptr)
+		return false;
+	return msync(ptr, length, MS_SYNC) == 0 && fsync(fd) == 0;
+}
+
+void MappedFile::close(size_t finalSize)
+{
+	unmap();
+	if (fd >= 0)
+	{
+		if (writable && ftruncate(fd, static_cast<off_t>(finalSize)) != 0)
+			ofLogError("MappedFile") << "close(): Could not truncate the file to " << finalSize << " bytes";
+		::close(fd);
+	}
+	fd = -1;
+	length = 0;
+	writable = false;
+}
+
+void MappedFile::close()
+{
+	close(length);
+}
+#endif
+
+//--------------------------------------------------------------
+SessionRecorder::SessionRecorder()
+:width(0),
+height(0),
+frameBytes(0),
+numFrames(0),
+capacity(0)
+{
+}
+
+SessionRecorder::~SessionRecorder()
+{
+	close();
+}
+
+bool SessionRecorder::open(const std::string& spath, int swidth, int sheight, const ofMatrix4x4& worldMatrix)
+{
+	close();
+	path = spath;
+	width = swidth;
+	height = sheight;
+	frameBytes = (frameDepthOffset + width * height * (sizeof(uint16_t) + 3) + 63) / 64 * 64;
+	numFrames = 0;
+	capacity = initialCapacity;
+	if (!file.create(path, sessionHeaderBytes + capacity * frameBytes))
+	{
+		ofLogError("SessionRecorder") << "open(): Could not create " << path;
+		return false;
+	}
+
+	SessionFileHeader* h = header();
+	memset(h, 0, sessionHeaderBytes);
+	memcpy(h->magic, sessionMagic, sizeof(sessionMagic));
+	h->version = sessionVersion;
+	h->width = width;
+	h->height = height;
+	h->colorChannels = 3;
+	h->numFrames = 0;
+	h->frameBytes = frameBytes;
+	memcpy(h->worldMatrix, worldMatrix.getPtr(), sizeof(h->worldMatrix));
+	ofLogNotice("SessionRecorder") << "open(): Recording " << width << " x " << height << " frames to " << path;
+	return true;
+}
+
+bool SessionRecorder::addFrame(const uint16_t* depth, const unsigned char* color, uint64_t timestamp)
+{
+	if (!isOpen())
+		return false;
+
+	// Grow the file by doubling so the mapping rarely moves
+	if (numFrames == capacity)
+	{
+		capacity *= 2;
+		if (!file.resize(sessionHeaderBytes + capacity * frameBytes))
+		{
+			ofLogError("SessionRecorder") << "addFrame(): Could not grow " << path << ", recording stopped";
+			close();
+			return false;
+		}
+	}
+
+	unsigned char* record = file.data() + sessionHeaderBytes + numFrames * frameBytes;
+	memcpy(record, &timestamp, sizeof(timestamp));
+	memcpy(record + frameDepthOffset, depth, width * height * sizeof(uint16_t));
+	memcpy(record + frameDepthOffset + width * height * sizeof(uint16_t), color, width * height * 3);
+
+	// The count is updated after the frame so the file is readable at any time
+	numFrames++;
+	header()->numFrames = numFrames;
+	return true;
+}
+
+void SessionRecorder::close()
+{
+	if (!isOpen())
+		return;
+	file.close(sessionHeaderBytes + numFrames * frameBytes);
+	ofLogNotice("SessionRecorder") << "close(): " << numFrames << " frames recorded to " << path;
+}
+
+//--------------------------------------------------------------
+SessionPlayer::SessionPlayer()
+:mode(REPLAY_REALTIME),
+stepRequests(0),
+currentFrame(0),
+nextFrame(0),
+clockStarted(false),
+lastMode(REPLAY_REALTIME),
+playStart(0)
+{
+}
+
+bool SessionPlayer::open(const std::string& path)
+{
+	close();
+	if (!file.openRead(path))
+	{
+		ofLogError("SessionPlayer") << "open(): Could not open " << path;
+		return false;
+	}
+
+	const SessionFileHeader* h = header();
+	bool valid = file.size() >= sessionHeaderBytes
+		&& memcmp(h->magic, sessionMagic, sizeof(sessionMagic)) == 0
+		&& h->version == sessionVersion
+		&& h->colorChannels == 3
+		&& h->width > 0 && h->height > 0
+		&& h->numFrames > 0
+		&& h->frameBytes >= frameDepthOffset + static_cast<uint64_t>(h->width) * h->height * (sizeof(uint16_t) + 3)
+		&& file.size() >= sessionHeaderBytes + h->numFrames * h->frameBytes;
+	if (!valid)
+	{
+		ofLogError("SessionPlayer") << "open(): " << path << " is not a valid session recording";
+		close();
+		return false;
+	}
+
+	nextFrame = 0;
+	currentFrame = 0;
+	clockStarted = false;
+	ofLogNotice("SessionPlayer") << "open(): " << h->numFrames << " frames of " << h->width << " x " << h->height << " from " << path;
+	return true;
+}
+
+void SessionPlayer::close()
+{
+	file.close();
+}
+
+int SessionPlayer::getWidth() const
+{
+	return isOpen() ? header()->width : 0;
+}
+
+int SessionPlayer::getHeight() const
+{
+	return isOpen() ? header()->height : 0;
+}
+
+uint64_t SessionPlayer::getNumFrames() const
+{
+	return isOpen() ? header()->numFrames : 0;
+}
+
+ofMatrix4x4 SessionPlayer::getWorldMatrix() const
+{
+	if (!isOpen())
+		return ofMatrix4x4();
+	return ofMatrix4x4(header()->worldMatrix);
+}
+
+void SessionPlayer::setMode(ReplayMode smode)
+{
+	mode = smode;
+	stepRequests = 0;
+}
+
+const unsigned char* SessionPlayer::frameRecord(uint64_t index) const
+{
+	return file.data() + sessionHeaderBytes + index * header()->frameBytes;
+}
+
+uint64_t SessionPlayer::frameTimestamp(uint64_t index) const
+{
+	uint64_t timestamp;
+	memcpy(&timestamp, frameRecord(index), sizeof(timestamp));
+	return timestamp;
+}
+
+bool SessionPlayer::update(ofShortPixels& depth, ofPixels& color, uint64_t& timestamp)
+{
+	if (!isOpen())
+		return false;
+
+	int currentMode = mode;
+	if (currentMode != lastMode)
+	{
+		clockStarted = false;
+		lastMode = currentMode;
+	}
+
+	if (currentMode == REPLAY_STEP)
+	{
+		if (stepRequests <= 0)
+			return false;
+		stepRequests--;
+	}
+	else if (currentMode == REPLAY_REALTIME)
+	{
+		// The clock is anchored on the frame to play so playback resumes where it was
+		uint64_t now = ofGetElapsedTimeMicros();
+		uint64_t offset = frameTimestamp(nextFrame) - frameTimestamp(0);
+		if (!clockStarted)
+		{
+			playStart = now - offset;
+			clockStarted = true;
+		}
+		if (now - playStart < offset)
+			return false;
+	}
+
+	const SessionFileHeader* h = header();
+	size_t w = h->width; // Checked positive by open()
+	size_t hgt = h->height;
+	if (depth.getWidth() != w || depth.getHeight() != hgt || depth.getNumChannels() != 1)
+		depth.allocate(w, hgt, 1);
+	if (color.getWidth() != w || color.getHeight() != hgt || color.getNumChannels() != 3)
+		color.allocate(w, hgt, 3);
+
+	const unsigned char* record = frameRecord(nextFrame);
+	memcpy(&timestamp, record, sizeof(timestamp));
+	memcpy(depth.getData(), record + frameDepthOffset, w * hgt * sizeof(uint16_t));
+	memcpy(color.getData(), record + frameDepthOffset + w * hgt * sizeof(uint16_t), w * hgt * 3);
+
+	currentFrame = nextFrame;
+	if (++nextFrame == h->numFrames)
+	{
+		// Loop, the real-time clock restarts with the first frame
+		nextFrame = 0;
+		clockStarted = false;
+	}
+	return true;
+}
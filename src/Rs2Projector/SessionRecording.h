@@ -0,0 +1,189 @@
+/***********************************************************************
+SessionRecording - Records the raw depth and color frames of the rs2 into
+a memory-mapped session file and plays them back in place of the camera.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include "ofMain.h"
+
+// A file mapped in memory, read-only or growable read-write
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool openRead(const std::string& path);
+	bool create(const std::string& path, size_t size);
+
+	// Change the size of a file opened with create(), the mapping may move
+	bool resize(size_t size);
+
+	// Write the mapped data of a file opened with create() through to the disk
+	bool flush();
+
+	// Unmap and close, a file opened with create() is truncated to finalSize
+	void close(size_t finalSize);
+	void close();
+
+	bool isOpen() const{
+		return ptr != nullptr;
+	}
+
+	unsigned char* data(){
+		return ptr;
+	}
+
+	const unsigned char* data() const{
+		return ptr;
+	}
+
+	size_t size() const{
+		return length;
+	}
+
+private:
+	bool map();
+	void unmap();
+
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int fd;
+#endif
+	unsigned char* ptr;
+	size_t length;
+	bool writable;
+};
+
+// Session file layout: a 256 byte header followed by fixed size frame records. Each record holds the capture
+// timestamp (uint64, microseconds) at offset 0, the raw Z16 depth frame at offset 64 and the RGB frame after it.
+struct SessionFileHeader
+{
+	char magic[8]; // "MSANDREC"
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t colorChannels;
+	uint64_t numFrames;
+	uint64_t frameBytes; // Size of a frame record, a multiple of 64
+	float worldMatrix[16]; // Rs2Grabber::getWorldMatrix() of the recorded camera
+};
+
+class SessionRecorder
+{
+public:
+	SessionRecorder();
+	~SessionRecorder();
+
+	bool open(const std::string& path, int width, int height, const ofMatrix4x4& worldMatrix);
+
+	// Append one frame. depth holds width x height raw values, color width x height RGB pixels.
+	bool addFrame(const uint16_t* depth, const unsigned char* color, uint64_t timestamp);
+
+	void close();
+
+	bool isOpen() const{
+		return file.isOpen();
+	}
+
+	uint64_t getNumFrames() const{
+		return numFrames;
+	}
+
+	const std::string& getPath() const{
+		return path;
+	}
+
+private:
+	SessionFileHeader* header(){
+		return reinterpret_cast<SessionFileHeader*>(file.data());
+	}
+
+	MappedFile file;
+	std::string path;
+	int width, height;
+	uint64_t frameBytes;
+	uint64_t numFrames;
+	uint64_t capacity; // Number of frame records the file can hold before it has to grow
+};
+
+enum ReplayMode
+{
+	REPLAY_REALTIME, // Frames are delivered at the pace they were recorded
+	REPLAY_FAST, // Every call delivers the next frame
+	REPLAY_STEP // A frame is delivered for each call to step()
+};
+
+class SessionPlayer
+{
+public:
+	SessionPlayer();
+
+	bool open(const std::string& path);
+	void close();
+
+	bool isOpen() const{
+		return file.isOpen();
+	}
+
+	int getWidth() const;
+	int getHeight() const;
+	uint64_t getNumFrames() const;
+	ofMatrix4x4 getWorldMatrix() const;
+
+	// Mode and steps can be changed from any thread
+	void setMode(ReplayMode mode);
+
+	ReplayMode getMode() const{
+		return static_cast<ReplayMode>(mode.load());
+	}
+
+	void step(){
+		stepRequests++;
+	}
+
+	// Index of the frame delivered last
+	uint64_t getCurrentFrame() const{
+		return currentFrame.load();
+	}
+
+	// Copy the next frame if it is due (depending on the mode). The recording loops at its end.
+	bool update(ofShortPixels& depth, ofPixels& color, uint64_t& timestamp);
+
+private:
+	const SessionFileHeader* header() const{
+		return reinterpret_cast<const SessionFileHeader*>(file.data());
+	}
+
+	const unsigned char* frameRecord(uint64_t index) const;
+	uint64_t frameTimestamp(uint64_t index) const;
+
+	MappedFile file;
+	std::atomic<int> mode;
+	std::atomic<int> stepRequests;
+	std::atomic<uint64_t> currentFrame;
+	uint64_t nextFrame;
+	bool clockStarted; // Real-time mode: playStart is anchored
+	int lastMode;
+	uint64_t playStart; // Real-time mode: ofGetElapsedTimeMicros() matching the first frame of the recording
+};
@@ -0,0 +1,112 @@
+/***********************************************************************
+SpatialFilterKernels - Recursive Gaussian (Young - van Vliet) smoothing
+of the filtered depth frame. The cost per pixel does not depend on sigma.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "SpatialFilterKernels.h"
+#include <algorithm>
+#include <cmath>
+
+// SSE2 is part of the x86-64 baseline, no runtime dispatch needed
+#if defined(__x86_64__) || defined(_M_X64)
+#define SPATIALFILTER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+RecursiveGaussianCoefficients computeRecursiveGaussian(float sigma)
+{
+	double s = std::max(0.5, static_cast<double>(sigma));
+	double q;
+	if (s >= 2.5)
+		q = 0.98711 * s - 0.96330;
+	else
+		q = 3.97156 - 4.14554 * std::sqrt(1.0 - 0.26891 * s);
+
+	double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+	double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+	double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+	double b3 = 0.422205 * q * q * q;
+
+	RecursiveGaussianCoefficients c;
+	c.a1 = static_cast<float>(b1 / b0);
+	c.a2 = static_cast<float>(b2 / b0);
+	c.a3 = static_cast<float>(b3 / b0);
+	c.B = 1.0f - (c.a1 + c.a2 + c.a3); // Unit gain, so a constant input is left unchanged
+	return c;
+}
+
+// out = B*x + a1*p1 + a2*p2 + a3*p3 for numCols values (out may be x)
+static void recursionRow(const RecursiveGaussianCoefficients& c, const float* x, const float* p1, const float* p2, const float* p3, float* out, int numCols)
+{
+	int i = 0;
+#ifdef SPATIALFILTER_SSE2
+	const __m128 B = _mm_set1_ps(c.B);
+	const __m128 a1 = _mm_set1_ps(c.a1);
+	const __m128 a2 = _mm_set1_ps(c.a2);
+	const __m128 a3 = _mm_set1_ps(c.a3);
+	for (; i + 4 <= numCols; i += 4)
+	{
+		__m128 v = _mm_mul_ps(B, _mm_loadu_ps(x + i));
+		v = _mm_add_ps(v, _mm_mul_ps(a1, _mm_loadu_ps(p1 + i)));
+		v = _mm_add_ps(v, _mm_mul_ps(a2, _mm_loadu_ps(p2 + i)));
+		v = _mm_add_ps(v, _mm_mul_ps(a3, _mm_loadu_ps(p3 + i)));
+		_mm_storeu_ps(out + i, v);
+	}
+#endif
+	for (; i < numCols; i++)
+		out[i] = c.B * x[i] + c.a1 * p1[i] + c.a2 * p2[i] + c.a3 * p3[i];
+}
+
+void recursiveGaussianColumns(const RecursiveGaussianCoefficients& c, float* data, int stride, int numRows, int numCols)
+{
+	if (numRows < 2 || numCols < 1)
+		return;
+
+	// Rows outside the block are clamped to the border rows. With unit gain the first forward output equals
+	// the first input and the first backward output equals the last forward output, so the clamped rows
+	// already hold the steady state values of a constant signal extended beyond the border.
+	auto row = [data, stride, numRows](int y) {
+		return data + std::min(std::max(y, 0), numRows - 1) * stride;
+	};
+
+	// Causal pass, top to bottom
+	for (int y = 1; y < numRows; y++)
+		recursionRow(c, row(y), row(y - 1), row(y - 2), row(y - 3), row(y), numCols);
+
+	// Anti-causal pass, bottom to top
+	for (int y = numRows - 2; y >= 0; y--)
+		recursionRow(c, row(y), row(y + 1), row(y + 2), row(y + 3), row(y), numCols);
+}
+
+void transposeBlock(const float* src, int srcStride, float* dst, int dstStride, int numRows, int numCols)
+{
+	// Tiles of 16 x 16 values keep both the source and the destination in cache
+	const int tile = 16;
+	for (int y0 = 0; y0 < numRows; y0 += tile)
+	{
+		int y1 = std::min(y0 + tile, numRows);
+		for (int x0 = 0; x0 < numCols; x0 += tile)
+		{
+			int x1 = std::min(x0 + tile, numCols);
+			for (int y = y0; y < y1; y++)
+				for (int x = x0; x < x1; x++)
+					dst[x * dstStride + y] = src[y * srcStride + x];
+		}
+	}
+}
@@ -0,0 +1,48 @@
+/***********************************************************************
+SpatialFilterKernels - Recursive Gaussian (Young - van Vliet) smoothing
+of the filtered depth frame. The cost per pixel does not depend on sigma.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+enum SpatialFilterMode
+{
+	SPATIALFILTER_BINOMIAL, // 20 passes of a [1 2 1]/4 kernel along columns and rows
+	SPATIALFILTER_RECURSIVE_GAUSSIAN // Recursive Gaussian, constant cost per pixel
+};
+
+// Sigma of the 20 pass binomial filter (each pass adds a variance of 1/2)
+const float SPATIALFILTER_BINOMIAL_SIGMA = 3.16227766f;
+
+// Third order recursion y[n] = B*x[n] + a1*y[n-1] + a2*y[n-2] + a3*y[n-3], run forward then backward
+struct RecursiveGaussianCoefficients
+{
+	float B, a1, a2, a3;
+};
+
+// Young & van Vliet 1995, valid for sigma >= 0.5
+RecursiveGaussianCoefficients computeRecursiveGaussian(float sigma);
+
+// Smooth numCols neighbouring columns of numRows rows (rows are stride floats apart) along y, in place.
+// Values beyond the first and last rows are taken equal to the border values.
+// All columns of a row are updated together, so the work is vectorized across columns.
+void recursiveGaussianColumns(const RecursiveGaussianCoefficients& c, float* data, int stride, int numRows, int numCols);
+
+// dst(x, y) = src(y, x) for a block of numRows x numCols values of src
+void transposeBlock(const float* src, int srcStride, float* dst, int dstStride, int numRows, int numCols);
@@ -0,0 +1,213 @@
+/***********************************************************************
+TerrainDerivatives - Full resolution derivatives of the sand surface
+(gradient, normal, slope and curvature) computed in one pass over the
+filtered depth frame, with bilinear sampling.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "TerrainDerivatives.h"
+
+// SSE2 is part of the x86-64 baseline, no runtime dispatch needed
+#if defined(__x86_64__) || defined(_M_X64)
+#define TERRAINDERIVATIVES_SSE2 1
+#include <emmintrin.h>
+#endif
+
+TerrainDerivatives::TerrainDerivatives()
+:width(0),
+height(0),
+minX(0),
+minY(0),
+maxX(0),
+maxY(0)
+{
+}
+
+void TerrainDerivatives::allocate(int swidth, int sheight)
+{
+	width = swidth;
+	height = sheight;
+	planes.assign(NUM_CHANNELS * width * height, 0.0f);
+	setFlat(0, height, 0, width);
+	minX = minY = maxX = maxY = 0;
+}
+
+void TerrainDerivatives::setFlat(int firstRow, int lastRow, int firstCol, int lastCol)
+{
+	float* normalZ = planes.data() + NORMAL_Z * width * height;
+	for (int c = 0; c < NUM_CHANNELS; c++)
+	{
+		float* plane = planes.data() + c * width * height;
+		float value = (plane == normalZ) ? 1.0f : 0.0f;
+		for (int y = firstRow; y < lastRow; y++)
+			std::fill(plane + y * width + firstCol, plane + y * width + lastCol, value);
+	}
+}
+
+// One pixel with explicit neighbour columns (used at the ROI borders)
+static inline void derivativesAt(const float* up, const float* mid, const float* down, int xl, int x, int xr,
+	float& gx, float& gy, float& nx, float& ny, float& nz, float& slope, float& curvature)
+{
+	// Sobel on the depth, the elevation is -depth
+	gx = ((up[xl] + 2.0f * mid[xl] + down[xl]) - (up[xr] + 2.0f * mid[xr] + down[xr])) * 0.125f;
+	gy = ((up[xl] + 2.0f * up[x] + up[xr]) - (down[xl] + 2.0f * down[x] + down[xr])) * 0.125f;
+	curvature = 4.0f * mid[x] - (mid[xl] + mid[xr] + up[x] + down[x]);
+	float sq = gx * gx + gy * gy;
+	slope = std::sqrt(sq);
+	float invNorm = 1.0f / std::sqrt(sq + 1.0f);
+	nx = -gx * invNorm;
+	ny = -gy * invNorm;
+	nz = invNorm;
+}
+
+void TerrainDerivatives::computeRow(const float* up, const float* mid, const float* down, int y)
+{
+	int plane = width * height;
+	float* gxPtr = planes.data() + GRADIENT_X * plane + y * width;
+	float* gyPtr = planes.data() + GRADIENT_Y * plane + y * width;
+	float* nxPtr = planes.data() + NORMAL_X * plane + y * width;
+	float* nyPtr = planes.data() + NORMAL_Y * plane + y * width;
+	float* nzPtr = planes.data() + NORMAL_Z * plane + y * width;
+	float* slopePtr = planes.data() + SLOPE * plane + y * width;
+	float* curvPtr = planes.data() + CURVATURE * plane + y * width;
+
+	// ROI borders: clamp the neighbour columns
+	int borders[2] = { minX, maxX - 1 };
+	for (int b = 0; b < 2; b++)
+	{
+		int x = borders[b];
+		int xl = max(minX, x - 1);
+		int xr = min(maxX - 1, x + 1);
+		derivativesAt(up, mid, down, xl, x, xr, gxPtr[x], gyPtr[x], nxPtr[x], nyPtr[x], nzPtr[x], slopePtr[x], curvPtr[x]);
+	}
+
+	int x = minX + 1;
+#ifdef TERRAINDERIVATIVES_SSE2
+	const __m128 two = _mm_set1_ps(2.0f);
+	const __m128 four = _mm_set1_ps(4.0f);
+	const __m128 eighth = _mm_set1_ps(0.125f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	for (; x + 4 <= maxX - 1; x += 4)
+	{
+		__m128 ul = _mm_loadu_ps(up + x - 1), uc = _mm_loadu_ps(up + x), ur = _mm_loadu_ps(up + x + 1);
+		__m128 ml = _mm_loadu_ps(mid + x - 1), mc = _mm_loadu_ps(mid + x), mr = _mm_loadu_ps(mid + x + 1);
+		__m128 dl = _mm_loadu_ps(down + x - 1), dc = _mm_loadu_ps(down + x), dr = _mm_loadu_ps(down + x + 1);
+
+		__m128 left = _mm_add_ps(_mm_add_ps(ul, _mm_mul_ps(two, ml)), dl);
+		__m128 right = _mm_add_ps(_mm_add_ps(ur, _mm_mul_ps(two, mr)), dr);
+		__m128 top = _mm_add_ps(_mm_add_ps(ul, _mm_mul_ps(two, uc)), ur);
+		__m128 bottom = _mm_add_ps(_mm_add_ps(dl, _mm_mul_ps(two, dc)), dr);
+		__m128 gx = _mm_mul_ps(_mm_sub_ps(left, right), eighth);
+		__m128 gy = _mm_mul_ps(_mm_sub_ps(top, bottom), eighth);
+		__m128 curvature = _mm_sub_ps(_mm_mul_ps(four, mc), _mm_add_ps(_mm_add_ps(ml, mr), _mm_add_ps(uc, dc)));
+
+		__m128 sq = _mm_add_ps(_mm_mul_ps(gx, gx), _mm_mul_ps(gy, gy));
+		__m128 invNorm = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(sq, one)));
+
+		_mm_storeu_ps(gxPtr + x, gx);
+		_mm_storeu_ps(gyPtr + x, gy);
+		_mm_storeu_ps(nxPtr + x, _mm_mul_ps(_mm_xor_ps(gx, signMask), invNorm));
+		_mm_storeu_ps(nyPtr + x, _mm_mul_ps(_mm_xor_ps(gy, signMask), invNorm));
+		_mm_storeu_ps(nzPtr + x, invNorm);
+		_mm_storeu_ps(slopePtr + x, _mm_sqrt_ps(sq));
+		_mm_storeu_ps(curvPtr + x, curvature);
+	}
+#endif
+	for (; x < maxX - 1; x++)
+		derivativesAt(up, mid, down, x - 1, x, x + 1, gxPtr[x], gyPtr[x], nxPtr[x], nyPtr[x], nzPtr[x], slopePtr[x], curvPtr[x]);
+}
+
+void TerrainDerivatives::compute(const float* depth, int swidth, int sheight, int sminX, int sminY, int smaxX, int smaxY, FrameFilterWorkerPool& pool)
+{
+	if (swidth != width || sheight != height || (int)planes.size() != NUM_CHANNELS * swidth * sheight)
+		allocate(swidth, sheight);
+
+	// Pixels that left the ROI go back to a flat surface
+	if (sminX != minX || sminY != minY || smaxX != maxX || smaxY != maxY)
+		setFlat(0, height, 0, width);
+	minX = sminX;
+	minY = sminY;
+	maxX = smaxX;
+	maxY = smaxY;
+	if (maxX - minX < 2 || maxY - minY < 2)
+		return;
+
+	// Rows only read the depth frame so they are split between the threads
+	pool.run(minY, maxY, [this, depth](int firstRow, int lastRow, int) {
+		for (int y = firstRow; y < lastRow; y++)
+		{
+			const float* up = depth + max(minY, y - 1) * width;
+			const float* mid = depth + y * width;
+			const float* down = depth + min(maxY - 1, y + 1) * width;
+			computeRow(up, mid, down, y);
+		}
+	});
+}
+
+bool TerrainDerivatives::bilinearWeights(float x, float y, int& idx, int& dx, int& dy, float& tx, float& ty) const
+{
+	if (!isAllocated() || !(x >= 0 && y >= 0 && x <= width - 1 && y <= height - 1))
+		return false;
+	int x0 = static_cast<int>(x);
+	int y0 = static_cast<int>(y);
+	idx = y0 * width + x0;
+	dx = (x0 < width - 1) ? 1 : 0;
+	dy = (y0 < height - 1) ? width : 0;
+	tx = x - x0;
+	ty = y - y0;
+	return true;
+}
+
+float TerrainDerivatives::bilinear(Channel channel, int idx, int dx, int dy, float tx, float ty) const
+{
+	const float* p = getChannel(channel) + idx;
+	float top = p[0] + tx * (p[dx] - p[0]);
+	float bottom = p[dy] + tx * (p[dy + dx] - p[dy]);
+	return top + ty * (bottom - top);
+}
+
+TerrainSample TerrainDerivatives::sample(float x, float y) const
+{
+	TerrainSample s;
+	int idx, dx, dy;
+	float tx, ty;
+	if (!bilinearWeights(x, y, idx, dx, dy, tx, ty))
+	{
+		s.gradient = ofVec2f(0);
+		s.normal = ofVec3f(0, 0, 1);
+		s.slope = 0;
+		s.curvature = 0;
+		return s;
+	}
+	s.gradient = ofVec2f(bilinear(GRADIENT_X, idx, dx, dy, tx, ty), bilinear(GRADIENT_Y, idx, dx, dy, tx, ty));
+	s.normal = ofVec3f(bilinear(NORMAL_X, idx, dx, dy, tx, ty), bilinear(NORMAL_Y, idx, dx, dy, tx, ty), bilinear(NORMAL_Z, idx, dx, dy, tx, ty));
+	s.normal.normalize();
+	s.slope = bilinear(SLOPE, idx, dx, dy, tx, ty);
+	s.curvature = bilinear(CURVATURE, idx, dx, dy, tx, ty);
+	return s;
+}
+
+ofVec2f TerrainDerivatives::sampleGradient(float x, float y) const
+{
+	int idx, dx, dy;
+	float tx, ty;
+	if (!bilinearWeights(x, y, idx, dx, dy, tx, ty))
+		return ofVec2f(0);
+	return ofVec2f(bilinear(GRADIENT_X, idx, dx, dy, tx, ty), bilinear(GRADIENT_Y, idx, dx, dy, tx, ty));
+}
@@ -0,0 +1,89 @@
+/***********************************************************************
+TerrainDerivatives - Full resolution derivatives of the sand surface
+(gradient, normal, slope and curvature) computed in one pass over the
+filtered depth frame, with bilinear sampling.
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+
+#include "ofMain.h"
+#include "FrameFilterWorkerPool.h"
+
+// Derivatives at one point of the sand surface. The surface is the elevation -depth, in depth units (mm) over rs2 pixels
+struct TerrainSample
+{
+	ofVec2f gradient; // Sobel gradient of the elevation, points uphill (same convention as the Rs2Grabber gradient field)
+	ofVec3f normal; // Unit normal of the elevation surface
+	float slope; // Length of the gradient
+	float curvature; // Laplacian of the elevation: positive in pits, negative on ridges
+};
+
+class TerrainDerivatives
+{
+public:
+	enum Channel
+	{
+		GRADIENT_X,
+		GRADIENT_Y,
+		NORMAL_X,
+		NORMAL_Y,
+		NORMAL_Z,
+		SLOPE,
+		CURVATURE,
+		NUM_CHANNELS
+	};
+
+	TerrainDerivatives();
+
+	// Compute all channels inside the ROI [minX, maxX) x [minY, maxY) of a depth frame. Neighbours outside
+	// the ROI are clamped to the ROI border, pixels outside the ROI get a flat surface.
+	void compute(const float* depth, int width, int height, int minX, int minY, int maxX, int maxY, FrameFilterWorkerPool& pool);
+
+	bool isAllocated() const{
+		return width > 0 && height > 0 && !planes.empty();
+	}
+
+	int getWidth() const{
+		return width;
+	}
+
+	int getHeight() const{
+		return height;
+	}
+
+	// Plane of one channel, width x height values
+	const float* getChannel(Channel channel) const{
+		return planes.data() + channel * width * height;
+	}
+
+	// Bilinear interpolation at rs2 coordinates. Points outside the frame return a flat surface.
+	TerrainSample sample(float x, float y) const;
+	ofVec2f sampleGradient(float x, float y) const;
+
+private:
+	void allocate(int width, int height);
+	void setFlat(int firstRow, int lastRow, int firstCol, int lastCol);
+	void computeRow(const float* up, const float* mid, const float* down, int y);
+	bool bilinearWeights(float x, float y, int& idx, int& dx, int& dy, float& tx, float& ty) const;
+	float bilinear(Channel channel, int idx, int dx, int dy, float tx, float ty) const;
+
+	int width, height;
+	int minX, minY, maxX, maxY; // ROI of the last computation
+	std::vector<float> planes; // NUM_CHANNELS planes of width x height values
+};
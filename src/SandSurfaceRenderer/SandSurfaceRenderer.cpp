@@ -24,6 +24,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 ***********************************************************************/
 
 #include "SandSurfaceRenderer.h"
+#include "../Rs2Projector/Profiler.h"
 
 using namespace ofxCSG;
 
@@ -206,6 +207,7 @@ void SandSurfaceRenderer::setupMesh(){
 }
 
 void SandSurfaceRenderer::update(){
+    PROFILE_ZONE("SandSurfaceRenderer::update");
     // Update Renderer state if needed
     //if (rs2Projector->isROIUpdated() || rs2Projector->getRs2ROI() != rs2ROI)
 	if (rs2Projector->getRs2ROI() != rs2ROI)
@@ -250,6 +252,7 @@ void SandSurfaceRenderer::drawProjectorWindow(){
 }
 
 void SandSurfaceRenderer::drawSandbox() {
+    PROFILE_ZONE("drawSandbox");
     fboProjWindow.begin();
     ofBackground(0);
     rs2Projector->bind();
@@ -267,10 +270,12 @@ void SandSurfaceRenderer::drawSandbox() {
     heightMapShader.end();
     rs2Projector->unbind();
     fboProjWindow.end();
+    rs2Projector->markLatency(LATENCY_RENDERED);
 }
 
 void SandSurfaceRenderer::prepareContourLinesFbo()
 {
+    PROFILE_ZONE("prepareContourLinesFbo");
     contourLineFramebufferObject.begin();
     ofClear(255,255,255, 0);
     rs2Projector->bind();
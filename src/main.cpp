@@ -22,6 +22,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ofMain.h"
 #include "ofApp.h"
+#include "Rs2Projector/FilterBenchmark.h"
+#include "Rs2Projector/OccluderDetectorTest.h"
+#include "Rs2Projector/Profiler.h"
 
 const std::string MagicSandVersion = "1.5.4.2";
 
@@ -63,7 +66,19 @@ bool setWindowDimensions(ofGLFWWindowSettings& settings, int windowsNum) {
 }
 
 //========================================================================
-int main() {
+int main(int argc, char* argv[]) {
+	// Filter benchmarks and occluder checks on synthetic frames, without windows or camera
+	// Profiling capture of the first frames: --profile <frames>
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::string(argv[i]) == "--benchmark")
+			return runFilterBenchmarks();
+		if (std::string(argv[i]) == "--test-occluders")
+			return runOccluderDetectorTest();
+		if (std::string(argv[i]) == "--profile" && i + 1 < argc)
+			Profiler::startCapture(std::max(1, atoi(argv[++i])));
+	}
+
 	ofGLFWWindowSettings settings;
     settings.width = 1600; // Default settings
     settings.height = 800;
@@ -20,6 +20,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 ***********************************************************************/
 
 #include "ofApp.h"
+#include "Rs2Projector/Profiler.h"
 
 void ofApp::setup() {
 	// OF basics
@@ -31,6 +32,7 @@ void ofApp::setup() {
 	ofSetLogLevel("ofFbo", OF_LOG_ERROR);
 	ofSetLogLevel("ofShader", OF_LOG_ERROR);
 	ofSetLogLevel("ofxKinect", OF_LOG_WARNING);
+	Profiler::setThreadName("Main");
 
 	// Setup rs2Projector
 	rs2Projector = std::make_shared<Rs2Projector>(projWindow);
@@ -60,6 +62,7 @@ void ofApp::setup() {
 
 
 void ofApp::update() {
+	Profiler::newFrame();
     // Call rs2Projector->update() first during the update function()
 	rs2Projector->update();
    	sandSurfaceRenderer->update();
@@ -94,6 +97,7 @@ void ofApp::draw()
 
 void ofApp::drawProjWindow(ofEventArgs &args) 
 {
+	PROFILE_ZONE("ofApp::drawProjWindow");
 	if (rs2Projector->GetApplicationState() == Rs2Projector::APPLICATION_STATE_RUNNING)
 	{
 		sandSurfaceRenderer->drawProjectorWindow();
@@ -199,6 +203,11 @@ void ofApp::keyPressed(int key)
 		mapGameController.setDebug(rs2Projector->getDumpDebugFiles());
 		mapGameController.DebugTestMe();
 	}
+	else if (key == 'p')
+	{
+		// Start or stop a profiling capture, the trace is saved in data/profiles
+		Profiler::toggleCapture();
+	}
 }
 
 void ofApp::keyReleased(int key) {